@@ -5,66 +5,39 @@
 #include <stdint.h>
 #include <string.h>
 #include <time.h>
+#include <sys/mman.h>
 #include "Raycaster.h"
-#include "v3math.h"
-
-typedef struct Object {
-  // kind 0 default, 1 camera, 2 sphere, 3 plane
-  int kind;
-  float diffuse[3];
-  float specular[3];
-  float position[3];
-  float reflectivity;
-  float ns;
-
-  union {
-    // different structs for different objects, like sphere/plane/camera/etc
-
-    // struct for camera
-    struct {
-      // camera is assumed to be at position [0, 0, 0]
-      float width;
-      float height;
-    };
-
-    // struct for sphere
-    struct {
-      float radius;
-    };
-
-    // struct for plane
-    struct {
-      float normal[3];
-    };
-  };
-} Object;
-
-typedef struct Light {
-  // kind 0 default, 1 point light, 2 spot light
-  int kind;
-  float position[3];
-  float color[3];
-  float theta;
-  float spotlightDotProd;
-
-  // point light
-  float radial_a0;
-  float radial_a1;
-  float radial_a2;
-
-  // spot light
-  float angular_a0;
-  float direction[3];
-} Light;
-
-void displayTime(clock_t time) {
-  double total = ((double) time) / CLOCKS_PER_SEC;
+#include "bscene.h"
+#include "bvh.h"
+#include "parser.h"
+#include "threadpool.h"
+#include "vec3.h"
+#include "wavefront.h"
+
+// roulette draws are numbered from here, apart from the anti-aliasing jitter
+#define ROULETTE_DRAWS 1024
+
+double wallSeconds(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+void displayTime(double wall, clock_t cpu, int threads) {
+  double total = wall;
 
   int milliseconds = (int) (-1 * (((int) total) - total) * 1000);
   int minutes = (int) (total / 60);
   int seconds = ((int) total) % 60;
 
   printf("The raytracer took %d minutes, %d seconds, and %d milliseconds to execute\n", minutes, seconds, milliseconds);
+
+  // cpu time summed over all threads vs wall time shows how well the tiles spread out
+  double cpuSeconds = ((double) cpu) / CLOCKS_PER_SEC;
+  double speedup = wall > 0 ? cpuSeconds / wall : 0;
+  printf("Wall %.3f s, CPU %.3f s on %d threads: %.2fx speedup, %.0f%% parallel efficiency\n",
+         wall, cpuSeconds, threads, speedup, 100 * speedup / threads);
 }
 
 // return smaller positive t value or negative if neither intersections are positive
@@ -73,13 +46,9 @@ float sphere_intersect(float *Rd, float *pos, float *R0, float radius) {
   // compute A, B, and C
   // since the Rd is normalized, A = 1
   float A = 1.0;
-  float B = 2 * ((Rd[0] * (R0[0] - pos[0])) + 
-                 (Rd[1] * (R0[1] - pos[1])) + 
-                 (Rd[2] * (R0[2] - pos[2])));
-  float C = (((R0[0] - pos[0]) * (R0[0] - pos[0])) + 
-             ((R0[1] - pos[1]) * (R0[1] - pos[1])) + 
-             ((R0[2] - pos[2]) * (R0[2] - pos[2])) - 
-             (radius * radius));
+  vec3 fromCenter = vec3_load(R0) - vec3_load(pos);
+  float B = 2 * vec3_dot(vec3_load(Rd), fromCenter);
+  float C = vec3_dot(fromCenter, fromCenter) - (radius * radius);
 
   float discrim = (B * B) - (4 * C);
 
@@ -112,14 +81,11 @@ float plane_intersect(float *planePosition, float *planeNormal,
     float V0;
     float distance;
 
-    float origin[3] = {0, 0, 0};
-
-    distance = sqrtf(((planePosition[0]-origin[0]) * (planePosition[0]-origin[0])) +
-                     ((planePosition[1]-origin[1]) * (planePosition[1]-origin[1])) +
-                     ((planePosition[2]-origin[2]) * (planePosition[2]-origin[2])));
+    vec3 normal = vec3_load(planeNormal);
+    distance = vec3_length(vec3_load(planePosition));
 
-    V0 = -(v3_dot_product(planeNormal, R0) + distance);
-    Vd = v3_dot_product(planeNormal, Rd);
+    V0 = -(vec3_dot(normal, vec3_load(R0)) + distance);
+    Vd = vec3_dot(normal, vec3_load(Rd));
 
     //ray is parallel to plane there for no intersection
     if(Vd == 0)
@@ -133,46 +99,449 @@ float plane_intersect(float *planePosition, float *planeNormal,
     return t_value;
 }
 
-// returns closest t val and reassigns closest object index
-float shoot(int *closestObjIndex, Object *objects, float *Rd, float *R0, int skipObjIndex) {
-  // create min
-  float minIntersect = 10000000;
-  int minIndex = -1;
+// the sphere boxes are padded for rays starting inside the scene's extent. the
+// discriminant error grows with the square of the distance to a sphere, so a
+// ray starting further out, from a far away point on a plane or a camera
+// moved out of the scene, gets the boxes
+// grown by enough to cover it. 0 for every other ray, which keeps their
+// traversal exactly as before
+float origin_margin(Scene *scene, float *R0) {
+  if (fabsf(R0[0]) <= scene->extent && fabsf(R0[1]) <= scene->extent && fabsf(R0[2]) <= scene->extent) {
+    return 0;
+  }
 
-  for (int index = 0; index < 128; index += 1) {
-    // skip over current object
-    if (index == skipObjIndex) {
-      continue;
+  return 1e-3f * (vec3_length(vec3_load(R0)) + 2 * scene->extent);
+}
+
+// how far outside a sphere sphere_intersect can report a grazing hit, for
+// spheres with radii from minRadius to maxRadius at most sqrt(distanceSq)
+// from the ray's origin. sphere_box pads by the same bound with the largest
+// distance in the scene, the instance boxes get it for each ray, since crowds
+// of small spheres would otherwise overlap each other's boxes
+static float graze_margin(float distanceSq, float minRadius, float maxRadius, float extent) {
+  return 1e-5f * maxRadius + 4e-7f * distanceSq / fmaxf(minRadius, 1e-3f * extent + 1e-6f);
+}
+
+// squared distance from R0 to the farthest point of a box
+static float farthest_sq(float *boxMin, float *boxMax, float *R0) {
+  float distanceSq = 0;
+  for (int axis = 0; axis < 3; axis += 1) {
+    float across = fmaxf(fabsf(boxMin[axis] - R0[axis]), fabsf(boxMax[axis] - R0[axis]));
+    distanceSq += across * across;
+  }
+  return distanceSq;
+}
+
+// an instance's box, its prototype's bounds moved into place and grown by
+// the rounding of doing that
+static void instance_box(Instance *instance, Prototype *proto, float *boxMin, float *boxMax) {
+  float reach = 0;
+  for (int axis = 0; axis < 3; axis += 1) {
+    reach = fmaxf(reach, fabsf(instance->position[axis]) +
+                         instance->scale * fmaxf(fabsf(proto->min[axis]), fabsf(proto->max[axis])));
+  }
+  for (int axis = 0; axis < 3; axis += 1) {
+    boxMin[axis] = instance->position[axis] + instance->scale * proto->min[axis] - 1e-6f * reach;
+    boxMax[axis] = instance->position[axis] + instance->scale * proto->max[axis] + 1e-6f * reach;
+  }
+}
+
+// world center and radius of a prototype sphere placed by an instance. the
+// tracing and scene_object both get them from here, so they agree to the bit
+static inline void instance_sphere(Instance *instance, PrototypeSphere *sphere, float *center, float *radius) {
+  center[0] = instance->position[0] + instance->scale * sphere->position[0];
+  center[1] = instance->position[1] + instance->scale * sphere->position[1];
+  center[2] = instance->position[2] + instance->scale * sphere->position[2];
+  *radius = instance->scale * sphere->radius;
+}
+
+// a mesh vertex where it is traced, a quantized one put back together from
+// its steps
+static inline void mesh_vertex(Scene *scene, Mesh *mesh, int vertexI, float *vertex) {
+  if (mesh->quantized) {
+    uint16_t *steps = scene->quantizedVertices[vertexI];
+    for (int axis = 0; axis < 3; axis += 1) {
+      vertex[axis] = mesh->origin[axis] + mesh->step[axis] * steps[axis];
     }
+  }
+  else {
+    memcpy(vertex, scene->vertices[vertexI], sizeof(float[3]));
+  }
+}
 
-    // determine kind of object and break if 0 (default)
-    Object *currentObj = &objects[index];
+static inline void triangle_corners(Scene *scene, Mesh *mesh, int triangleI, float *a, float *b, float *c) {
+  int *corners = scene->triangles[triangleI];
+  mesh_vertex(scene, mesh, corners[0], a);
+  mesh_vertex(scene, mesh, corners[1], b);
+  mesh_vertex(scene, mesh, corners[2], c);
+}
 
-    if (currentObj->kind == 0) {
-      break;
+// the mesh triangle triangleI belongs to
+static Mesh *triangle_mesh(Scene *scene, int triangleI) {
+  int low = 0;
+  int high = scene->meshCount - 1;
+  while (low < high) {
+    int middle = (low + high + 1) / 2;
+    if (scene->meshes[middle].firstTriangle <= triangleI) {
+      low = middle;
     }
+    else {
+      high = middle - 1;
+    }
+  }
+  return &scene->meshes[low];
+}
+
+// t value of a ray against one triangle, negative if it misses
+static float mesh_triangle_intersect(Scene *scene, int triangleI, float *Rd, float *R0) {
+  float a[3], b[3], c[3];
+  TriangleRay ray;
+  triangle_corners(scene, triangle_mesh(scene, triangleI), triangleI, a, b, c);
+  triangle_ray_init(&ray, Rd, R0);
+  return triangle_intersect(&ray, a, b, c);
+}
+
+Object *scene_object(Scene *scene, int objIndex, Object *scratch) {
+  if (objIndex < scene->objectCount) {
+    return &scene->objects[objIndex];
+  }
 
-    // get t value
-    float tVal = -1;
-    
-    if (currentObj->kind == 2) {
-      // sphere
-      tVal = sphere_intersect(Rd, currentObj->position, R0, currentObj->radius);
+  // triangles are flat, shaded with the normal their winding gives
+  if (objIndex >= scene->triangleBase) {
+    int triangleI = objIndex - scene->triangleBase;
+    Mesh *mesh = triangle_mesh(scene, triangleI);
+    float a[3], b[3], c[3];
+    triangle_corners(scene, mesh, triangleI, a, b, c);
+
+    memset(scratch, 0, sizeof(Object));
+    scratch->kind = 4;
+    memcpy(scratch->diffuse, mesh->material.diffuse, sizeof(float[3]));
+    memcpy(scratch->specular, mesh->material.specular, sizeof(float[3]));
+    scratch->reflectivity = mesh->material.reflectivity;
+    scratch->ns = mesh->material.ns;
+    memcpy(scratch->position, a, sizeof(float[3]));
+    vec3 normal = vec3_cross(vec3_from_points(vec3_load(a), vec3_load(b)), vec3_from_points(vec3_load(a), vec3_load(c)));
+    vec3_store(scratch->normal, vec3_normalize(normal));
+    return scratch;
+  }
+
+  int instanceI = (objIndex - scene->objectCount) / scene->instanceStride;
+  Instance *instance = &scene->instances[instanceI];
+  Prototype *proto = &scene->prototypes[instance->prototype];
+  PrototypeSphere *sphere = &scene->prototypeSpheres[proto->first + (objIndex - scene->objectCount) % scene->instanceStride];
+  Material *material = &scene->materials[sphere->material];
+
+  memset(scratch, 0, sizeof(Object));
+  scratch->kind = 2;
+  memcpy(scratch->diffuse, material->diffuse, sizeof(float[3]));
+  memcpy(scratch->specular, material->specular, sizeof(float[3]));
+  scratch->reflectivity = material->reflectivity;
+  scratch->ns = material->ns;
+  instance_sphere(instance, sphere, scratch->position, &scratch->radius);
+  return scratch;
+}
+
+// a ray query through one of the scene's bvhs, for the callbacks of
+// bvh_walk. boxes are tested with boxR0, boxInvRd and margin, which in a
+// prototype's bvh are the ray moved into its coordinates, and primitives
+// with Rd and R0
+typedef struct RayQuery {
+  Scene *scene;
+  float *Rd;
+  float *R0;
+  float *boxR0;
+  float *boxInvRd;
+  float margin;
+  int skipObjIndex;
+  float *minIntersect;
+  int *minIndex;
+  // the walk ends at the first hit when set. startIndex is minIndex before it
+  bool anyHit;
+  int startIndex;
+  RayStats *stats;
+  // the instance or mesh whose bvh is walked
+  int instanceI;
+  Mesh *mesh;
+  TriangleRay *triangleRay;
+} RayQuery;
+
+static void ray_query_init(RayQuery *ray, Scene *scene, float *Rd, float *R0, float *invRd, int skipObjIndex,
+                           float *minIntersect, int *minIndex, bool anyHit, RayStats *stats) {
+  ray->scene = scene;
+  ray->Rd = Rd;
+  ray->R0 = R0;
+  ray->boxR0 = R0;
+  ray->boxInvRd = invRd;
+  ray->margin = 0;
+  ray->skipObjIndex = skipObjIndex;
+  ray->minIntersect = minIntersect;
+  ray->minIndex = minIndex;
+  ray->anyHit = anyHit;
+  ray->startIndex = *minIndex;
+  ray->stats = stats;
+  ray->instanceI = -1;
+  ray->mesh = NULL;
+  ray->triangleRay = NULL;
+}
+
+// bvh_walk callback, whether the ray enters the node's box grown by the
+// query's margin before the closest hit so far
+static int ray_enters(void *query, BVHNode *node, float *entryT) {
+  RayQuery *ray = (RayQuery *) query;
+  STAT_ADD(ray->stats, nodeTests, 1);
+  return bvh_ray_box(node, ray->boxR0, ray->boxInvRd, *ray->minIntersect, ray->margin, entryT);
+}
+
+// bvh_walk callback for the leaves of the scene's sphere bvh, which are
+// ranges of the sphere arrays
+static int sphere_leaf(void *query, BVHNode *node) {
+  RayQuery *ray = (RayQuery *) query;
+  nearest_sphere(&ray->scene->spheres, node->first, node->count, ray->Rd, ray->R0, ray->skipObjIndex,
+                 ray->minIntersect, ray->minIndex);
+  STAT_ADD(ray->stats, sphereTests, node->count);
+  return ray->anyHit && *ray->minIndex != ray->startIndex;
+}
+
+// most prototype spheres tested in one kernel call
+#define INSTANCE_BATCH 8
+
+// tests the ray against the prototype spheres listed in prims, placed by
+// instance instanceI. the spheres are moved into place and tested in world
+// space by the kernels, so the hits are the ones the same spheres written
+// out as objects would give
+static void nearest_instance_spheres(Scene *scene, int instanceI, int *prims, int count, float *Rd, float *R0,
+                                     int skipObjIndex, float *minIntersect, int *minIndex, RayStats *stats) {
+  Instance *instance = &scene->instances[instanceI];
+  int firstIndex = scene->objectCount + instanceI * scene->instanceStride - scene->prototypes[instance->prototype].first;
+  float cx[INSTANCE_BATCH + KERNEL_PADDING];
+  float cy[INSTANCE_BATCH + KERNEL_PADDING];
+  float cz[INSTANCE_BATCH + KERNEL_PADDING];
+  float r2[INSTANCE_BATCH + KERNEL_PADDING];
+  int objIndex[INSTANCE_BATCH + KERNEL_PADDING];
+  SphereArrays batch = {cx, cy, cz, r2, objIndex, 0};
+
+  for (int start = 0; start < count; start += INSTANCE_BATCH) {
+    int batchCount = count - start < INSTANCE_BATCH ? count - start : INSTANCE_BATCH;
+    for (int slot = 0; slot < batchCount; slot += 1) {
+      int sphereI = prims[start + slot];
+      float center[3];
+      float radius;
+      instance_sphere(instance, &scene->prototypeSpheres[sphereI], center, &radius);
+      cx[slot] = center[0];
+      cy[slot] = center[1];
+      cz[slot] = center[2];
+      r2[slot] = radius * radius;
+      objIndex[slot] = firstIndex + sphereI;
+    }
+    // the vector kernels read whole registers past the end
+    for (int slot = batchCount; slot < batchCount + KERNEL_PADDING; slot += 1) {
+      cx[slot] = cy[slot] = cz[slot] = r2[slot] = 0;
+      objIndex[slot] = -1;
+    }
+
+    nearest_sphere(&batch, 0, batchCount, Rd, R0, skipObjIndex, minIntersect, minIndex);
+    STAT_ADD(stats, sphereTests, batchCount);
+  }
+}
+
+// bvh_walk callback for the leaves of a prototype's bvh, tested as the
+// spheres of the query's instance
+static int prototype_leaf(void *query, BVHNode *node) {
+  RayQuery *ray = (RayQuery *) query;
+  nearest_instance_spheres(ray->scene, ray->instanceI, &ray->scene->prototypeBvh.primIndices[node->first], node->count,
+                           ray->Rd, ray->R0, ray->skipObjIndex, ray->minIntersect, ray->minIndex, ray->stats);
+  return ray->anyHit && *ray->minIndex != ray->startIndex;
+}
+
+// walks one instance's prototype bvh with the ray moved into the prototype's
+// coordinates, where t values stay the same. returns true once it has a hit
+// when the query wants any hit. margin is the instance box's
+static bool nearest_in_prototype(RayQuery *ray, int instanceI, float margin) {
+  Scene *scene = ray->scene;
+  Instance *instance = &scene->instances[instanceI];
+  Prototype *proto = &scene->prototypes[instance->prototype];
+  BVH *bvh = &scene->prototypeBvh;
+
+  // a prototype that fits in one leaf has nothing to cull past the instance box
+  BVHNode *root = &bvh->nodes[proto->root];
+  if (root->count > 0) {
+    nearest_instance_spheres(scene, instanceI, &bvh->primIndices[root->first], root->count, ray->Rd, ray->R0,
+                             ray->skipObjIndex, ray->minIntersect, ray->minIndex, ray->stats);
+    return ray->anyHit && *ray->minIndex != ray->startIndex;
+  }
+
+  float localR0[3];
+  float localInvRd[3];
+  float roundoff = 0;
+  for (int axis = 0; axis < 3; axis += 1) {
+    localR0[axis] = (ray->R0[axis] - instance->position[axis]) / instance->scale;
+    localInvRd[axis] = ray->boxInvRd[axis] * instance->scale;
+    roundoff = fmaxf(roundoff, fabsf(ray->R0[axis]) + fabsf(instance->position[axis]));
+  }
+
+  RayQuery local = *ray;
+  local.boxR0 = localR0;
+  local.boxInvRd = localInvRd;
+  local.margin = (margin + 1e-6f * roundoff) / instance->scale;
+  local.instanceI = instanceI;
+  return bvh_walk(bvh, proto->root, NULL, ray_enters, prototype_leaf, &local);
+}
+
+// bvh_walk callback for the instance bvh. boxes are grown by how far a hit
+// can be outside them for a ray from as far away as their farthest point
+static int instance_node_enters(void *query, BVHNode *node, float *entryT) {
+  RayQuery *ray = (RayQuery *) query;
+  Scene *scene = ray->scene;
+  float margin = graze_margin(farthest_sq(node->min, node->max, ray->R0), scene->instanceMinRadius,
+                              scene->instanceMaxRadius, scene->extent);
+  STAT_ADD(ray->stats, nodeTests, 1);
+  return bvh_ray_box(node, ray->R0, ray->boxInvRd, *ray->minIntersect, margin, entryT);
+}
+
+// bvh_walk callback for the instance bvh's leaves, each instance is culled
+// by its own box before its prototype is walked
+static int instance_leaf(void *query, BVHNode *node) {
+  RayQuery *ray = (RayQuery *) query;
+  Scene *scene = ray->scene;
+
+  for (int slot = node->first; slot < node->first + node->count; slot += 1) {
+    int instanceI = scene->instanceBvh.primIndices[slot];
+    Instance *instance = &scene->instances[instanceI];
+    Prototype *proto = &scene->prototypes[instance->prototype];
+
+    float boxMin[3], boxMax[3];
+    float entryT;
+    instance_box(instance, proto, boxMin, boxMax);
+    BVHNode box = {{boxMin[0], boxMin[1], boxMin[2]}, {boxMax[0], boxMax[1], boxMax[2]}, 0, 0};
+    float instanceMargin = graze_margin(farthest_sq(boxMin, boxMax, ray->R0), instance->scale * proto->minRadius,
+                                        instance->scale * proto->maxRadius, scene->extent);
+    STAT_ADD(ray->stats, nodeTests, 1);
+    if (!bvh_ray_box(&box, ray->R0, ray->boxInvRd, *ray->minIntersect, instanceMargin, &entryT)) {
+      continue;
     }
-    else if (currentObj->kind == 3) {
-      // plane
-      tVal = plane_intersect(currentObj->position, currentObj->normal, R0, Rd);
+    if (nearest_in_prototype(ray, instanceI, instanceMargin)) {
+      return 1;
     }
+  }
+  return 0;
+}
 
-    // check that t is positive
-    if (tVal > 0 && tVal < minIntersect) {
-      minIntersect = tVal;
-      minIndex = index;
+void nearest_instance(Scene *scene, float *Rd, float *R0, int skipObjIndex, float *minIntersect, int *minIndex,
+                      bool anyHit, RayStats *stats) {
+  if (scene->instanceBvh.nodeCount == 0) {
+    return;
+  }
+
+  float invRd[3] = {1.0f / Rd[0], 1.0f / Rd[1], 1.0f / Rd[2]};
+  RayQuery ray;
+  ray_query_init(&ray, scene, Rd, R0, invRd, skipObjIndex, minIntersect, minIndex, anyHit, stats);
+  bvh_walk(&scene->instanceBvh, 0, minIntersect, instance_node_enters, instance_leaf, &ray);
+}
+
+// tests the ray against triangles [first, first + count), gathering their
+// corners from the shared vertices for the kernels
+static void nearest_mesh_triangles(Scene *scene, Mesh *mesh, int first, int count, TriangleRay *ray, int skipObjIndex,
+                                   float *minIntersect, int *minIndex, RayStats *stats) {
+  TriangleBatch batch;
+
+  for (int start = first; start < first + count; start += TRIANGLE_BATCH) {
+    batch.count = first + count - start < TRIANGLE_BATCH ? first + count - start : TRIANGLE_BATCH;
+    for (int slot = 0; slot < batch.count; slot += 1) {
+      float a[3], b[3], c[3];
+      triangle_corners(scene, mesh, start + slot, a, b, c);
+      batch.ax[slot] = a[0];
+      batch.ay[slot] = a[1];
+      batch.az[slot] = a[2];
+      batch.bx[slot] = b[0];
+      batch.by[slot] = b[1];
+      batch.bz[slot] = b[2];
+      batch.cx[slot] = c[0];
+      batch.cy[slot] = c[1];
+      batch.cz[slot] = c[2];
+      batch.objIndex[slot] = scene->triangleBase + start + slot;
     }
+    // the vector kernels read the whole batch
+    for (int slot = batch.count; slot < TRIANGLE_BATCH; slot += 1) {
+      batch.ax[slot] = batch.ay[slot] = batch.az[slot] = 0;
+      batch.bx[slot] = batch.by[slot] = batch.bz[slot] = 0;
+      batch.cx[slot] = batch.cy[slot] = batch.cz[slot] = 0;
+      batch.objIndex[slot] = -1;
+    }
+
+    nearest_triangle(&batch, ray, skipObjIndex, minIntersect, minIndex);
+    STAT_ADD(stats, triangleTests, batch.count);
   }
+}
+
+// bvh_walk callback for the leaves of a mesh's bvh, which are ranges of its
+// triangles
+static int mesh_leaf(void *query, BVHNode *node) {
+  RayQuery *ray = (RayQuery *) query;
+  nearest_mesh_triangles(ray->scene, ray->mesh, node->first, node->count, ray->triangleRay, ray->skipObjIndex,
+                         ray->minIntersect, ray->minIndex, ray->stats);
+  return ray->anyHit && *ray->minIndex != ray->startIndex;
+}
+
+void nearest_mesh(Scene *scene, float *Rd, float *R0, int skipObjIndex, float *minIntersect, int *minIndex,
+                  bool anyHit, RayStats *stats) {
+  if (scene->meshCount == 0) {
+    return;
+  }
+
+  TriangleRay triangleRay;
+  triangle_ray_init(&triangleRay, Rd, R0);
+  float invRd[3] = {1.0f / Rd[0], 1.0f / Rd[1], 1.0f / Rd[2]};
+  float originReach = fmaxf(fabsf(R0[0]), fmaxf(fabsf(R0[1]), fabsf(R0[2])));
+  RayQuery ray;
+  ray_query_init(&ray, scene, Rd, R0, invRd, skipObjIndex, minIntersect, minIndex, anyHit, stats);
+  ray.triangleRay = &triangleRay;
+
+  for (int meshI = 0; meshI < scene->meshCount; meshI += 1) {
+    Mesh *mesh = &scene->meshes[meshI];
+
+    // the triangle test is exact about which triangles a ray goes through,
+    // the boxes only have to cover the slab test's rounding, a few ulps of
+    // the coordinates involved
+    float meshReach = 0;
+    for (int axis = 0; axis < 3; axis += 1) {
+      meshReach = fmaxf(meshReach, fmaxf(fabsf(mesh->min[axis]), fabsf(mesh->max[axis])));
+    }
+    ray.margin = 1e-6f * (originReach + meshReach);
+    ray.mesh = mesh;
+
+    if (bvh_walk(&scene->meshBvh, mesh->root, minIntersect, ray_enters, mesh_leaf, &ray)) {
+      return;
+    }
+  }
+}
+
+// returns closest t val and reassigns closest object index
+// the kernels break ties on equal t by the lower object index, so the result
+// is the same as scanning the objects in order
+float shoot(int *closestObjIndex, Scene *scene, float *Rd, float *R0, int skipObjIndex, RayStats *stats) {
+  // create min
+  float minIntersect = 10000000;
+  int minIndex = -1;
+
+  // planes are unbounded, so they are always tested
+  nearest_plane(&scene->planes, 0, scene->planes.count, Rd, R0, skipObjIndex, &minIntersect, &minIndex);
+  STAT_ADD(stats, planeTests, scene->planes.count);
+
+  // walk the sphere bvh front to back, skipping boxes that start past the closest hit
+  if (scene->bvh.nodeCount > 0) {
+    float invRd[3] = {1.0f / Rd[0], 1.0f / Rd[1], 1.0f / Rd[2]};
+    RayQuery ray;
+    ray_query_init(&ray, scene, Rd, R0, invRd, skipObjIndex, &minIntersect, &minIndex, false, stats);
+    ray.margin = origin_margin(scene, R0);
+    bvh_walk(&scene->bvh, 0, &minIntersect, ray_enters, sphere_leaf, &ray);
+  }
+
+  nearest_instance(scene, Rd, R0, skipObjIndex, &minIntersect, &minIndex, false, stats);
+  nearest_mesh(scene, Rd, R0, skipObjIndex, &minIntersect, &minIndex, false, stats);
 
   // get color of min if there is a min
   if (minIndex >= 0) {
+    STAT_ADD(stats, hits, 1);
     *closestObjIndex = minIndex;
     return minIntersect;
   }
@@ -181,521 +550,1045 @@ float shoot(int *closestObjIndex, Object *objects, float *Rd, float *R0, int ski
   return -1;
 }
 
-// puts the final color after calculations into illuminate
-void illuminate(float *finalColor, Object *objects, Light *lights, int currObjIndex, float *point, float *rayInit, int *reflectLimit) {
-  // printf("%d [%f %f %f] [%f %f %f] %d\n", currObjIndex, point[0], point[1], point[2], rayInit[0], rayInit[1], rayInit[2], *reflectLimit);
-  if (*reflectLimit <= 0) {
-    return;
+// t value of a ray against a single object, negative if it misses
+float object_intersect(Object *obj, float *Rd, float *R0) {
+  if (obj->kind == 2) {
+    return sphere_intersect(Rd, obj->position, R0, obj->radius);
   }
-  *reflectLimit -= 1;
+  if (obj->kind == 3) {
+    return plane_intersect(obj->position, obj->normal, R0, Rd);
+  }
+  return -1;
+}
 
-  float lightsColor[3] = {0, 0, 0};
+// shadow ray query, true if any object other than skipObjIndex is hit closer
+// than maxDist. gives the same answer as comparing shoot()'s closest hit
+// against maxDist, but returns at the first blocker it finds. lastOccluder
+// remembers the blocker and is tried first next time, since neighboring
+// shading points are usually shadowed by the same object
+bool occluded(Scene *scene, float *Rd, float *R0, float maxDist, int skipObjIndex, int *lastOccluder, RayStats *stats) {
+  // shoot() never reports hits past this
+  float limit = maxDist < 10000000 ? maxDist : 10000000;
+
+  if (*lastOccluder >= 0 && *lastOccluder != skipObjIndex) {
+    float tVal;
+    if (*lastOccluder >= scene->triangleBase) {
+      tVal = mesh_triangle_intersect(scene, *lastOccluder - scene->triangleBase, Rd, R0);
+      STAT_ADD(stats, triangleTests, 1);
+    }
+    else {
+      Object scratch;
+      Object *blocker = scene_object(scene, *lastOccluder, &scratch);
+      tVal = object_intersect(blocker, Rd, R0);
+      if (blocker->kind == 2) {
+        STAT_ADD(stats, sphereTests, 1);
+      }
+      else {
+        STAT_ADD(stats, planeTests, 1);
+      }
+    }
+    if (tVal > 0 && tVal < limit) {
+      STAT_ADD(stats, shadowBlocked, 1);
+      return true;
+    }
+  }
 
-  for (int lightI = 0; lightI < 128; lightI += 1) {
-    Light *currentLight = &lights[lightI];
+  // the kernels only take hits strictly closer than the starting t
+  float tVal = limit;
+  int hitIndex = -1;
 
-    if (currentLight->kind == 0) {
-      break;
-    }
+  nearest_plane(&scene->planes, 0, scene->planes.count, Rd, R0, skipObjIndex, &tVal, &hitIndex);
+  STAT_ADD(stats, planeTests, scene->planes.count);
+  if (hitIndex >= 0) {
+    STAT_ADD(stats, shadowBlocked, 1);
+    *lastOccluder = hitIndex;
+    return true;
+  }
 
-    float minIntersect = 10000000;
-    float minIndex = -1;
+  nearest_instance(scene, Rd, R0, skipObjIndex, &tVal, &hitIndex, true, stats);
+  if (hitIndex >= 0) {
+    STAT_ADD(stats, shadowBlocked, 1);
+    *lastOccluder = hitIndex;
+    return true;
+  }
 
-    // calculate vector and Rd from point to light
-    float pToL[3];
-    float Rd[3];
-    v3_from_points(pToL, point, currentLight->position);
-    // calculate distance then normalize L
-    float dist = v3_length(pToL);
-    v3_normalize(Rd, pToL);
-    v3_normalize(pToL, pToL);
+  nearest_mesh(scene, Rd, R0, skipObjIndex, &tVal, &hitIndex, true, stats);
+  if (hitIndex >= 0) {
+    STAT_ADD(stats, shadowBlocked, 1);
+    *lastOccluder = hitIndex;
+    return true;
+  }
 
-    int closestObjIndex = -1;
-    float tVal = shoot(&closestObjIndex, objects, Rd, point, currObjIndex);
+  if (scene->bvh.nodeCount == 0) {
+    return false;
+  }
 
-    if (tVal >= 0 && tVal < dist) {
-      // There was a valid intersection between point and light, skip over calculations for light
-      continue;
-    }
+  // any hit will do, so there is no need to visit children in order. until
+  // there is one tVal stays at limit for the box tests
+  float invRd[3] = {1.0f / Rd[0], 1.0f / Rd[1], 1.0f / Rd[2]};
+  RayQuery ray;
+  ray_query_init(&ray, scene, Rd, R0, invRd, skipObjIndex, &tVal, &hitIndex, true, stats);
+  ray.margin = origin_margin(scene, R0);
+  if (bvh_walk(&scene->bvh, 0, NULL, ray_enters, sphere_leaf, &ray)) {
+    STAT_ADD(stats, shadowBlocked, 1);
+    *lastOccluder = hitIndex;
+    return true;
+  }
 
-    Object *currObj = &objects[currObjIndex];
+  return false;
+}
 
-    // get surface normal
-    float surfaceNorm[3];
-    if (currObj->kind == 3) {
-      v3_copy(surfaceNorm, currObj->normal);
-    }
-    else if (currObj->kind == 2)
-    {
-      v3_from_points(surfaceNorm, currObj->position, point);
-      v3_normalize(surfaceNorm, surfaceNorm);
+// outward normal of a sphere, plane or triangle at a point on it
+vec3 surface_normal(Object *obj, vec3 point) {
+  if (obj->kind == 3 || obj->kind == 4) {
+    return vec3_load(obj->normal);
+  }
+  return vec3_normalize(vec3_from_points(vec3_load(obj->position), point));
+}
+
+static int compare_ints(const void *a, const void *b) {
+  int left = *(const int *) a;
+  int right = *(const int *) b;
+  return (left > right) - (left < right);
+}
+
+// the lights whose influence reaches a point, gathered from the light bvh
+typedef struct LightQuery {
+  Scene *scene;
+  vec3 point;
+  int *lights;
+  int count;
+} LightQuery;
+
+// bvh_walk callback, whether the point is inside the node's box
+static int point_inside(void *query, BVHNode *node, float *entryT) {
+  LightQuery *lightQuery = (LightQuery *) query;
+  *entryT = 0;
+
+  bool inside = true;
+  for (int axis = 0; axis < 3; axis += 1) {
+    inside = inside && lightQuery->point[axis] >= node->min[axis] && lightQuery->point[axis] <= node->max[axis];
+  }
+  return inside;
+}
+
+// bvh_walk callback, adds the lights of the leaf whose sphere of influence
+// holds the point
+static int light_leaf(void *query, BVHNode *node) {
+  LightQuery *lightQuery = (LightQuery *) query;
+  Scene *scene = lightQuery->scene;
+
+  for (int slot = node->first; slot < node->first + node->count; slot += 1) {
+    int lightI = scene->lightBvh.primIndices[slot];
+    vec3 toLight = vec3_from_points(lightQuery->point, vec3_load(scene->lights[lightI].position));
+    float radius = scene->lightRadius[lightI];
+    if (vec3_dot(toLight, toLight) <= radius * radius) {
+      lightQuery->lights[lightQuery->count] = lightI;
+      lightQuery->count += 1;
     }
+  }
+  return 0;
+}
 
-    // radial attenuation
-    float radAttn = 1 / (currentLight->radial_a0 + (currentLight->radial_a1 * dist) + (currentLight->radial_a2 * dist * dist));
+// writes the indices of the lights whose influence reaches point to lights,
+// in increasing order so their colors add up in the same order as with every
+// light. returns how many there are
+int lights_near(Scene *scene, vec3 point, int *lights) {
+  if (scene->lightRadius == NULL) {
+    for (int lightI = 0; lightI < scene->lightCount; lightI += 1) {
+      lights[lightI] = lightI;
+    }
+    return scene->lightCount;
+  }
 
-    // angular attn
-    float V0[3];
-    v3_copy(V0, pToL);
-    v3_scale(V0, -1);
-    float angAttn = 1;
-    if (currentLight->kind == 2) {
-      // Vl is spot light direction
-      float angAttnDot = v3_dot_product(V0, currentLight->direction);
+  LightQuery query = {scene, point, lights, 0};
+  if (scene->lightBvh.nodeCount > 0) {
+    bvh_walk(&scene->lightBvh, 0, NULL, point_inside, light_leaf, &query);
+  }
+  int count = query.count;
 
-      // check that vl is in the cone (angle < theta, dot > acos(theta))
-      if (angAttnDot > currentLight->spotlightDotProd) {
-        angAttn = powf(angAttnDot, currentLight->angular_a0);
-      }
-      else {
-        angAttn = 0;
+  if (count > 16) {
+    qsort(lights, count, sizeof(int), compare_ints);
+  }
+  else {
+    for (int index = 1; index < count; index += 1) {
+      int lightI = lights[index];
+      int pos = index;
+      for (; pos > 0 && lights[pos - 1] > lightI; pos -= 1) {
+        lights[pos] = lights[pos - 1];
       }
+      lights[pos] = lightI;
     }
+  }
 
-    // calculate diffuse component:
-    // color += diffuse * attenuation (radial and angular)
-    float diffuse[3] = {0, 0, 0};
-    float dotProd = v3_dot_product(surfaceNorm, pToL);
-    // if n dot l < 0 then diffuse is zero
-    if (dotProd > 0) {
-      // (n * L) (c_l) (c_m)
-      diffuse[0] = dotProd * currentLight->color[0] * currObj->diffuse[0] * angAttn * radAttn;
-      diffuse[1] = dotProd * currentLight->color[1] * currObj->diffuse[1] * angAttn * radAttn;
-      diffuse[2] = dotProd * currentLight->color[2] * currObj->diffuse[2] * angAttn * radAttn;
-    }
-
-    // calculate specular component:
-    // color += specular * attenuation (radial and angular)
-    float specular[3] = {0, 0, 0};
-    float R[3];
-    // uL is the negative of normalized L
-    float uL[3];
-    v3_copy(uL, pToL);
-    v3_scale(uL, -1);
-    v3_reflect(R, uL, surfaceNorm);
-    float viewVec[3];
-    // float cam[3] = {0, 0, 0}
-    v3_from_points(viewVec, point, rayInit);
-    v3_normalize(viewVec, viewVec);
-    // v3_normalize(R, R);
-    float viewDotProd = v3_dot_product(R, viewVec);
-    if (dotProd > 0 && viewDotProd > 0) {
-      float shiny = powf(viewDotProd, currObj->ns);
-      specular[0] = shiny * currentLight->color[0] * currObj->specular[0] * angAttn * radAttn;
-      specular[1] = shiny * currentLight->color[1] * currObj->specular[1] * angAttn * radAttn;
-      specular[2] = shiny * currentLight->color[2] * currObj->specular[2] * angAttn * radAttn;
-    }
-
-    v3_add(lightsColor, lightsColor, diffuse);
-    v3_add(lightsColor, lightsColor, specular);
+  // merge in the lights that reach everywhere, from the back so nothing is
+  // overwritten before it moves
+  int nearI = count - 1;
+  int globalI = scene->globalLightCount - 1;
+  for (int out = count + scene->globalLightCount - 1; globalI >= 0; out -= 1) {
+    if (nearI >= 0 && lights[nearI] > scene->globalLights[globalI]) {
+      lights[out] = lights[nearI];
+      nearI -= 1;
+    }
+    else {
+      lights[out] = scene->globalLights[globalI];
+      globalI -= 1;
+    }
   }
 
-  // add ambient light to color
-  float ambient[3] = {0.01, 0.01, 0.01};
-  v3_add(finalColor, finalColor, ambient);
+  return count + scene->globalLightCount;
+}
 
-  Object *surfaceObj = &objects[currObjIndex];
+// whether a light can add anything at a point: the light has to be on the
+// outside of the surface, and inside a spot light's cone. add_light_color
+// adds exactly nothing otherwise, so these skip the shadow ray and change
+// nothing in the image. pToL is the normalized direction to the light
+bool light_reaches(Light *light, vec3 surfaceNorm, vec3 pToL) {
+  if (!(vec3_dot(surfaceNorm, pToL) > 0)) {
+    return false;
+  }
 
-  float reflectAmount = 1 - surfaceObj->reflectivity;
-  v3_scale(lightsColor, reflectAmount);
-  v3_add(finalColor, lightsColor, finalColor);
+  if (light->kind == 2) {
+    if (!(vec3_dot(pToL * -1, vec3_load(light->direction)) > light->spotlightDotProd)) {
+      return false;
+    }
+  }
 
-  // if there is no reflectivity, no reason to continue calculations
-  if (surfaceObj->reflectivity == 0) {
-    if (finalColor[0] > 1) {
-      finalColor[0] = 1;
+  return true;
+}
+
+// normalized direction and distance from a shading point to a light. the
+// direction is both the shadow ray and the L of the shading
+vec3 light_direction(float *dist, Light *light, vec3 point) {
+  vec3 pToL = vec3_from_points(point, vec3_load(light->position));
+  // calculate distance then normalize L
+  *dist = vec3_length(pToL);
+  return pToL / *dist;
+}
+
+// one unshadowed light's diffuse and specular color at point added to lightsColor
+vec3 add_light_color(vec3 lightsColor, Scene *scene, int currObjIndex, Light *currentLight, vec3 point, vec3 rayInit, vec3 pToL, float dist) {
+  Object scratch;
+  Object *currObj = scene_object(scene, currObjIndex, &scratch);
+
+  // get surface normal
+  vec3 surfaceNorm = surface_normal(currObj, point);
+
+  // radial attenuation
+  float radAttn = 1 / (currentLight->radial_a0 + (currentLight->radial_a1 * dist) + (currentLight->radial_a2 * dist * dist));
+
+  // angular attn
+  // uL is the negative of normalized L
+  vec3 uL = pToL * -1;
+  float angAttn = 1;
+  if (currentLight->kind == 2) {
+    // Vl is spot light direction
+    float angAttnDot = vec3_dot(uL, vec3_load(currentLight->direction));
+
+    // check that vl is in the cone (angle < theta, dot > acos(theta))
+    if (angAttnDot > currentLight->spotlightDotProd) {
+      angAttn = powf(angAttnDot, currentLight->angular_a0);
     }
-    if (finalColor[1] > 1) {
-      finalColor[1] = 1;
+    else {
+      angAttn = 0;
     }
-    if (finalColor[2] > 1) {
-      finalColor[2] = 1;
+  }
+  vec3 lightColor = vec3_load(currentLight->color);
+
+  // calculate diffuse component:
+  // color += diffuse * attenuation (radial and angular)
+  vec3 diffuse = vec3_make(0, 0, 0);
+  float dotProd = vec3_dot(surfaceNorm, pToL);
+  // if n dot l < 0 then diffuse is zero
+  if (dotProd > 0) {
+    // (n * L) (c_l) (c_m)
+    diffuse = dotProd * lightColor * vec3_load(currObj->diffuse) * angAttn * radAttn;
+  }
+
+  // calculate specular component:
+  // color += specular * attenuation (radial and angular)
+  vec3 specular = vec3_make(0, 0, 0);
+  vec3 R = vec3_reflect(uL, surfaceNorm);
+  vec3 viewVec = vec3_normalize(vec3_from_points(point, rayInit));
+  float viewDotProd = vec3_dot(R, viewVec);
+  if (dotProd > 0 && viewDotProd > 0) {
+    float shiny = powf(viewDotProd, currObj->ns);
+    specular = shiny * lightColor * vec3_load(currObj->specular) * angAttn * radAttn;
+  }
+
+  return lightsColor + diffuse + specular;
+}
+
+// mirror direction of the ray that came from rayInit and hit surfaceObj at point
+vec3 reflect_direction(Object *surfaceObj, vec3 point, vec3 rayInit) {
+  vec3 ray = vec3_normalize(vec3_from_points(rayInit, point));
+
+  return vec3_reflect(ray, surface_normal(surfaceObj, point));
+}
+
+vec3 clamp_color(vec3 color) {
+  for (int channel = 0; channel < 3; channel += 1) {
+    if (color[channel] > 1) {
+      color[channel] = 1;
     }
+  }
+  return color;
+}
 
-    return;
+// random number hashed from a seed, like a pixel, and the number of the draw,
+// so the image doesn't depend on which thread traces what. returns 0 to 1
+double hashed_random(unsigned int seed, unsigned int draw) {
+  unsigned int hash = seed * 0x9e3779b9u ^ (draw + 0x7f4a7c15u) * 0x85ebca6bu;
+  hash ^= hash >> 16;
+  hash *= 0x7feb352du;
+  hash ^= hash >> 15;
+  hash *= 0x846ca68bu;
+  hash ^= hash >> 16;
+
+  return (hash >> 8) / 16777216.0;
+}
+
+// weight a bounce's reflection is added with, its reflectivity unless the
+// path plays russian roulette. throughput is the product of the path's
+// reflectivities up to this bounce. below ctx->roulette the reflection
+// survives with a chance of throughput / roulette and is weighted up by as
+// much, so on average it adds what it would have. 0 when it doesn't survive
+float reflection_weight(TraceContext *ctx, float reflectivity, float throughput, unsigned int seed, int level) {
+  if (ctx->roulette <= 0 || throughput >= ctx->roulette) {
+    return reflectivity;
   }
 
-  // calculate new vector - reflection ray from first ray off object with intersection
-  // shoot new ray and illuminate
-  // get surface normal
-  float reflectSurfaceNorm[3];
-  if (surfaceObj->kind == 3) {
-    v3_copy(reflectSurfaceNorm, surfaceObj->normal);
+  float survival = throughput / ctx->roulette;
+  if (hashed_random(seed, ROULETTE_DRAWS + level) >= survival) {
+    return 0;
+  }
+  return reflectivity / survival;
+}
+
+// whether the reflection at level can still change the pixel. base and weight
+// hold the bounces of the path up to level. a reflection's color is between
+// 0 and 1, and each bounce's color is clamp(reflection * weight + base),
+// which never goes down when the reflection goes up, with float rounding too.
+// so the pixel is somewhere between what it is with a black and with a white
+// reflection, and when those agree nothing further down the path matters
+bool reflection_matters(TraceContext *ctx, vec3 *base, float *weight, int level) {
+  if (!ctx->cutoff) {
+    return true;
+  }
+
+  vec3 low = vec3_make(0, 0, 0);
+  vec3 high = vec3_make(1, 1, 1);
+  for (int bounce = level; bounce >= 0; bounce -= 1) {
+    low = clamp_color(low * weight[bounce] + base[bounce]);
+    high = clamp_color(high * weight[bounce] + base[bounce]);
   }
-  else if (surfaceObj->kind == 2)
-  {
-    v3_from_points(reflectSurfaceNorm, surfaceObj->position, point);
-    v3_normalize(reflectSurfaceNorm, reflectSurfaceNorm);
+
+  bool same = true;
+  for (int channel = 0; channel < 3; channel += 1) {
+    if (ctx->quantizedCutoff && low[channel] >= 0) {
+      same = same && (uint8_t) (low[channel] * 255) == (uint8_t) (high[channel] * 255);
+    }
+    else {
+      same = same && low[channel] == high[channel];
+    }
   }
+  return !same;
+}
 
-  float ray[3];
-  v3_from_points(ray, rayInit, point);
-  v3_normalize(ray, ray);
+// light the point currObjIndex was hit at gets from the lights that reach it
+static vec3 lights_color(Scene *scene, TraceContext *ctx, int currObjIndex, vec3 point, vec3 rayInit) {
+  vec3 lightsColor = vec3_make(0, 0, 0);
+  float R0[3];
+  vec3_store(R0, point);
 
-  float reflectedRay[3];
-  v3_reflect(reflectedRay, ray, reflectSurfaceNorm);
+  // only lights that can reach the point get a shadow ray
+  Object scratch;
+  vec3 surfaceNorm = surface_normal(scene_object(scene, currObjIndex, &scratch), point);
+  int nearCount = lights_near(scene, point, ctx->nearLights);
+  STAT_ADD(&ctx->stats, lightsCulled, scene->lightCount - nearCount);
 
-  int newClosestObjIndex = -1;
-  float tVal = shoot(&newClosestObjIndex, objects, reflectedRay, point, currObjIndex);
+  for (int nearI = 0; nearI < nearCount; nearI += 1) {
+    int lightI = ctx->nearLights[nearI];
+    Light *currentLight = &scene->lights[lightI];
 
-  if (tVal > 0) {
-    float reflectColor[3] = {0, 0, 0};
+    // calculate vector and Rd from point to light
+    float dist;
+    vec3 pToL = light_direction(&dist, currentLight, point);
+    if (!light_reaches(currentLight, surfaceNorm, pToL)) {
+      STAT_ADD(&ctx->stats, lightsCulled, 1);
+      continue;
+    }
 
-    float intersectPoint[3];
-    v3_copy(intersectPoint, reflectedRay);
-    v3_scale(intersectPoint, tVal); 
-    v3_add(intersectPoint, intersectPoint, point);
-    // printf("%d %d [%f %f %f] [%f %f %f] [%f %f %f]\n", currObjIndex, newClosestObjIndex, intersectPoint[0], intersectPoint[1], intersectPoint[2], reflectedRay[0], reflectedRay[1], reflectedRay[2], point[0], point[1], point[2]);
-    illuminate(reflectColor, objects, lights, newClosestObjIndex, intersectPoint, point, reflectLimit);
+    float Rd[3];
+    vec3_store(Rd, pToL);
+    STAT_ADD(&ctx->stats, shadowRays, 1);
+    if (occluded(scene, Rd, R0, dist, currObjIndex, &ctx->lastOccluder[lightI], &ctx->stats)) {
+      // There was a valid intersection between point and light, skip over calculations for light
+      continue;
+    }
+
+    lightsColor = add_light_color(lightsColor, scene, currObjIndex, currentLight, point, rayInit, pToL, dist);
+  }
+
+  return lightsColor;
+}
 
-    v3_scale(reflectColor, surfaceObj->reflectivity);
-    v3_add(finalColor, reflectColor, finalColor);
+// color of the point currObjIndex was hit at by a ray from rayInit, the
+// level-th surface of its path, with its reflections
+vec3 illuminate(Scene *scene, TraceContext *ctx, int currObjIndex, vec3 point, vec3 rayInit, int level) {
+  ctx->pathDepth = level + 1;
+  if (ctx->pathHits != NULL) {
+    vec3_store(ctx->pathHits[level].point, point);
+    ctx->pathHits[level].objIndex = currObjIndex;
   }
+  vec3 lightsColor = lights_color(scene, ctx, currObjIndex, point, rayInit);
+
+  // add ambient light to color
+  vec3 finalColor = vec3_make(0.01, 0.01, 0.01);
 
-  if (finalColor[0] > 1) {
-    finalColor[0] = 1;
+  Object scratch;
+  Object *surfaceObj = scene_object(scene, currObjIndex, &scratch);
+
+  float reflectAmount = 1 - surfaceObj->reflectivity;
+  finalColor = lightsColor * reflectAmount + finalColor;
+
+  // if there is no reflectivity, no reason to continue calculations. nor
+  // when the path can't go on, or nothing it finds can show in the pixel,
+  // which is the same as a reflection that misses
+  if (surfaceObj->reflectivity == 0 || level + 1 >= ctx->maxDepth) {
+    return clamp_color(finalColor);
   }
-  if (finalColor[1] > 1) {
-    finalColor[1] = 1;
+  ctx->pathThroughput[level] = (level > 0 ? ctx->pathThroughput[level - 1] : 1) * surfaceObj->reflectivity;
+  float weight = reflection_weight(ctx, surfaceObj->reflectivity, ctx->pathThroughput[level], ctx->pathSeed, level);
+  ctx->pathBase[level] = finalColor;
+  ctx->pathWeight[level] = weight;
+  if (weight == 0 || !reflection_matters(ctx, ctx->pathBase, ctx->pathWeight, level)) {
+    return clamp_color(finalColor);
   }
-  if (finalColor[2] > 1) {
-    finalColor[2] = 1;
+
+  // calculate new vector - reflection ray from first ray off object with intersection
+  // shoot new ray and illuminate
+  vec3 reflectedRay = reflect_direction(surfaceObj, point, rayInit);
+  float Rd[3];
+  float R0[3];
+  vec3_store(Rd, reflectedRay);
+  vec3_store(R0, point);
+
+  int newClosestObjIndex = -1;
+  STAT_ADD(&ctx->stats, reflectionRays, 1);
+  float tVal = shoot(&newClosestObjIndex, scene, Rd, R0, currObjIndex, &ctx->stats);
+
+  if (tVal > 0) {
+    vec3 intersectPoint = reflectedRay * tVal + point;
+    vec3 reflectColor = illuminate(scene, ctx, newClosestObjIndex, intersectPoint, point, level + 1);
+
+    finalColor = reflectColor * weight + finalColor;
   }
 
-  // printf("%f %f %f\n", finalColor[0], finalColor[1], finalColor[2]);
+  return clamp_color(finalColor);
 }
 
 // checks if the ray hit an object
 // runs through whole list of objects checking for intersections
 // returns color of closest object or black background
-void intersect(float *finalColor, Object *objects, Light *lights, float *Rd, float *R0, float *cam, int *reflectLimit) {
+vec3 intersect(Scene *scene, TraceContext *ctx, float *Rd, float *R0, float *cam) {
   int closestObjIndex = -1;
-  float tVal = shoot(&closestObjIndex, objects, Rd, R0, -1);
+  float tVal = shoot(&closestObjIndex, scene, Rd, R0, -1, &ctx->stats);
 
+  return shade_primary(scene, ctx, Rd, tVal, closestObjIndex, cam);
+}
+
+// colors a primary ray from the result of shooting it. ctx->pathSeed has to
+// be set for the path, and ctx->pathDepth tells how many surfaces it was shaded through
+vec3 shade_primary(Scene *scene, TraceContext *ctx, float *Rd, float tVal, int closestObjIndex, float *cam) {
+  ctx->pathDepth = 0;
   // get color of min if there is a min
   if (tVal >= 0) {
     // There was a valid intersection, closest object is at minIndex
-    // Object intersectObj = objects[minIndex];
-    float intersectPoint[3];
-    v3_copy(intersectPoint, Rd);
-    v3_scale(intersectPoint, tVal); 
-    illuminate(finalColor, objects, lights, closestObjIndex, intersectPoint, cam, reflectLimit);
+    vec3 camPoint = vec3_load(cam);
+    vec3 intersectPoint = vec3_load(Rd) * tVal + camPoint;
+    return illuminate(scene, ctx, closestObjIndex, intersectPoint, camPoint, 0);
   }
-  else {
-    finalColor[0] = 0;
-    finalColor[1] = 0;
-    finalColor[2] = 0;
-  }
-}
-
-void read_objects(char *fileName, Object *objects, Light *lights) {
-  // will eventually do the better version with dynamic array
-
-  // Safe object storing/reading in place
-  // Open file and loop through it storing values
-  FILE *fh = fopen(fileName, "r");
-
-  // while not end of file, scan in all info.
-  int objIndex = 0;
-  int lightIndex = 0;
-  while (!feof(fh)) {
-    char objCase[100];
-    fscanf(fh, "%s", objCase);
-
-    // Check if light first
-    if (strcmp(objCase, "light,") == 0) {
-      // One light per line
-      Light light;
-
-      // Set defaults
-      light.kind = 0;
-      light.position[0] = 0;
-      light.position[1] = 0;
-      light.position[2] = 0;
-      light.color[0] = 0;
-      light.color[1] = 0;
-      light.color[2] = 0;
-      light.theta = 0;
-      // point light defaults
-      light.radial_a0 = 0;
-      light.radial_a1 = 0;
-      light.radial_a2 = 0;
-      // spot light defaults
-      light.angular_a0 = 0;
-      light.direction[0] = 0;
-      light.direction[1] = 0;
-      light.direction[2] = 0;
-
-      char check = fgetc(fh);
-      ungetc(check, fh);
-
-      // assign the rest of the values into the light as they are seen on the row
-      while (check != '\n' && check != EOF) {
-        fscanf(fh, "%s", objCase);
-        char v1[100], v2[100], v3[100];
-
-        if (strcmp(objCase, "color:") == 0) {
-          // need to have this longer 3 part parse because fscanf only grabs first value
-          // before the space and reads it improperly
-          fscanf(fh, "%s %s %s", &v1, &v2, &v3);
-          sscanf(v1, "[%f,", &light.color[0]);
-          sscanf(v2, "%f,", &light.color[1]);
-          sscanf(v3, "%f],", &light.color[2]);
-        }
-        else if (strcmp(objCase, "position:") == 0) {
-          fscanf(fh, "%s %s %s", &v1, &v2, &v3);
-          sscanf(v1, "[%f,", &light.position[0]);
-          sscanf(v2, "%f,", &light.position[1]);
-          sscanf(v3, "%f],", &light.position[2]);
-        }
-        else if (strcmp(objCase, "direction:") == 0) {
-          fscanf(fh, "%s %s %s", &v1, &v2, &v3);
-          sscanf(v1, "[%f,", &light.direction[0]);
-          sscanf(v2, "%f,", &light.direction[1]);
-          sscanf(v3, "%f],", &light.direction[2]);
-
-          // normalize direction vector
-          v3_normalize(light.direction, light.direction);
-        }
-        else if (strcmp(objCase, "radial-a0:") == 0) {
-          fscanf(fh, "%f", &light.radial_a0);
-        }
-        else if (strcmp(objCase, "radial-a1:") == 0) {
-          fscanf(fh, "%f", &light.radial_a1);
-        }
-        else if (strcmp(objCase, "radial-a2:") == 0) {
-          fscanf(fh, "%f", &light.radial_a2);
-        }
-        else if (strcmp(objCase, "theta:") == 0) {
-          fscanf(fh, "%f", &light.theta);
-
-          // calculate acos for future use
-          float PI = 3.14159265359;
-          light.spotlightDotProd = acosf((light.theta * PI) / 180);
-        }
-        else if (strcmp(objCase, "angular-a0:") == 0) {
-          fscanf(fh, "%f", &light.angular_a0);
-        }
-
-        check = fgetc(fh);
-      }
+  return vec3_make(0, 0, 0);
+}
 
-      // assign kind based on theta
-      if (light.theta == 0) {
-        light.kind = 1;
-      }
-      else {
-        light.kind = 2;
-      }
+// colors a path from the surfaces a g-buffer recorded for it, the way
+// illuminate would with the scene's lights. each recorded surface but the last
+// is where the previous one's reflection hit, so no rays but shadow rays are
+// traced. ctx->pathSeed has to be set like when the path was recorded
+vec3 shade_recorded(Scene *scene, TraceContext *ctx, GBufferHit *hits, int depth, float *cam) {
+  ctx->pathDepth = 0;
+  vec3 rayInit = vec3_load(cam);
+  int last = depth - 1;
+
+  for (int level = 0; level < depth; level += 1) {
+    ctx->pathDepth = level + 1;
+    vec3 point = vec3_load(hits[level].point);
+    Object scratch;
+    Object *surfaceObj = scene_object(scene, hits[level].objIndex, &scratch);
+
+    vec3 lightsColor = lights_color(scene, ctx, hits[level].objIndex, point, rayInit);
+    float reflectAmount = 1 - surfaceObj->reflectivity;
+    ctx->pathBase[level] = lightsColor * reflectAmount + vec3_make(0.01, 0.01, 0.01);
+    if (level == last) {
+      break;
+    }
 
-      // assign light then increment index
-      lights[lightIndex] = light;
-      lightIndex += 1;
+    // lights can't change whether the recorded reflection is traced, only
+    // whether it still matters
+    ctx->pathThroughput[level] = (level > 0 ? ctx->pathThroughput[level - 1] : 1) * surfaceObj->reflectivity;
+    ctx->pathWeight[level] = reflection_weight(ctx, surfaceObj->reflectivity, ctx->pathThroughput[level],
+                                               ctx->pathSeed, level);
+    if (!reflection_matters(ctx, ctx->pathBase, ctx->pathWeight, level)) {
+      last = level;
+      break;
     }
+    rayInit = point;
+  }
 
-    // It's an object not a light
-    else {
-      // only one object per line
-      Object obj;
-
-      // defaults of 0
-      obj.kind = 0;
-      obj.diffuse[0] = 0;
-      obj.diffuse[1] = 0;
-      obj.diffuse[2] = 0;
-      obj.specular[0] = 0;
-      obj.specular[1] = 0;
-      obj.specular[2] = 0;
-      obj.position[0] = 0;
-      obj.position[1] = 0;
-      obj.position[2] = 0;
-      obj.reflectivity - 0;
-      obj.ns = 20;
-
-      // check the case (camera, sphere, plane)
-      // assign defaults in case of missing params
-      if (strcmp(objCase, "camera,") == 0) {
-        obj.kind = 1;
-
-        obj.width = 0;
-        obj.height = 0;
-      }
-      else if (strcmp(objCase, "sphere,") == 0) {
-        obj.kind = 2;
-        
-        obj.radius = 0;
-      }
-      else if (strcmp(objCase, "plane,") == 0) {
-        obj.kind = 3;
-        
-        obj.normal[0] = 0;
-        obj.normal[1] = 0;
-        obj.normal[2] = 0;
-      }
+  vec3 color = vec3_make(0, 0, 0);
+  for (int level = last; level >= 0; level -= 1) {
+    vec3 finalColor = ctx->pathBase[level];
+    if (level < last) {
+      finalColor = color * ctx->pathWeight[level] + finalColor;
+    }
+    color = clamp_color(finalColor);
+  }
+  return color;
+}
 
-      char check = fgetc(fh);
-      ungetc(check, fh);
-
-      // assign the rest of the values into the object as they are seen on the row
-      while (check != '\n' && check != EOF) {
-        fscanf(fh, "%s", objCase);
-        char v1[100], v2[100], v3[100];
-
-        if (strcmp(objCase, "diffuse_color:") == 0) {
-          // need to have this longer 3 part parse because fscanf only grabs first value
-          // before the space and reads it improperly
-          fscanf(fh, "%s %s %s", &v1, &v2, &v3);
-          sscanf(v1, "[%f,", &obj.diffuse[0]);
-          sscanf(v2, "%f,", &obj.diffuse[1]);
-          sscanf(v3, "%f],", &obj.diffuse[2]);
-        }
-        if (strcmp(objCase, "specular_color:") == 0) {
-          // need to have this longer 3 part parse because fscanf only grabs first value
-          // before the space and reads it improperly
-          fscanf(fh, "%s %s %s", &v1, &v2, &v3);
-          sscanf(v1, "[%f,", &obj.specular[0]);
-          sscanf(v2, "%f,", &obj.specular[1]);
-          sscanf(v3, "%f],", &obj.specular[2]);
-        }
-        else if (strcmp(objCase, "position:") == 0) {
-          fscanf(fh, "%s %s %s", &v1, &v2, &v3);
-          sscanf(v1, "[%f,", &obj.position[0]);
-          sscanf(v2, "%f,", &obj.position[1]);
-          sscanf(v3, "%f],", &obj.position[2]);
-        }
-        else if (strcmp(objCase, "normal:") == 0) {
-          fscanf(fh, "%s %s %s", &v1, &v2, &v3);
-          sscanf(v1, "[%f,", &obj.normal[0]);
-          sscanf(v2, "%f,", &obj.normal[1]);
-          sscanf(v3, "%f],", &obj.normal[2]);
-
-          // normalize normal vector
-          v3_normalize(obj.normal, obj.normal);
-        }
-        else if (strcmp(objCase, "width:") == 0) {
-          fscanf(fh, "%f", &obj.width);
-        }
-        else if (strcmp(objCase, "height:") == 0) {
-          fscanf(fh, "%f", &obj.height);
-        }
-        else if (strcmp(objCase, "radius:") == 0) {
-          fscanf(fh, "%f", &obj.radius);
-        }
-        else if (strcmp(objCase, "reflectivity:") == 0) {
-          fscanf(fh, "%f", &obj.reflectivity);
-        }
-        else if (strcmp(objCase, "ns:") == 0) {
-          fscanf(fh, "%f", &obj.ns);
-        }
-
-        check = fgetc(fh);
+// everything rays can reach, including the camera at the origin
+static float scene_extent(Scene *scene) {
+  float extent = 0;
+  for (int lightI = 0; lightI < scene->lightCount; lightI += 1) {
+    for (int axis = 0; axis < 3; axis += 1) {
+      extent = fmaxf(extent, fabsf(scene->lights[lightI].position[axis]));
+    }
+  }
+
+  for (int index = 0; index < scene->objectCount; index += 1) {
+    Object *obj = &scene->objects[index];
+    if (obj->kind == 2) {
+      for (int axis = 0; axis < 3; axis += 1) {
+        extent = fmaxf(extent, fabsf(obj->position[axis]) + fabsf(obj->radius));
       }
+    }
+  }
 
-      // assign object then increment index
-      objects[objIndex] = obj;
-      objIndex += 1;
+  for (int instanceI = 0; instanceI < scene->instanceCount; instanceI += 1) {
+    Instance *instance = &scene->instances[instanceI];
+    Prototype *proto = &scene->prototypes[instance->prototype];
+    for (int axis = 0; axis < 3; axis += 1) {
+      extent = fmaxf(extent, fabsf(instance->position[axis]) +
+                             instance->scale * fmaxf(fabsf(proto->min[axis]), fabsf(proto->max[axis])));
     }
   }
 
-  // Set all leftover space to default objects
-  while (objIndex < 128) {
-    Object defaultObj;
-    defaultObj.kind = 0;
+  for (int meshI = 0; meshI < scene->meshCount; meshI += 1) {
+    Mesh *mesh = &scene->meshes[meshI];
+    for (int axis = 0; axis < 3; axis += 1) {
+      extent = fmaxf(extent, fmaxf(fabsf(mesh->min[axis]), fabsf(mesh->max[axis])));
+    }
+  }
 
-    objects[objIndex] = defaultObj;
+  return extent;
+}
 
-    objIndex += 1;
+// sphere_intersect can report a grazing hit slightly outside the true sphere
+// due to cancellation in the discriminant, roughly by eps * |R0 - pos|^2 / radius.
+// boxes are padded by that much so the bvh never culls a sphere the plain
+// scan would have hit, keeping the images identical
+static void sphere_box(Object *obj, float extent, float *boxMin, float *boxMax) {
+  float farthest = 12 * extent * extent;
+  float radius = fabsf(obj->radius);
+  float pad = 1e-5f * radius + 4e-7f * farthest / fmaxf(radius, 1e-3f * extent + 1e-6f);
+
+  for (int axis = 0; axis < 3; axis += 1) {
+    boxMin[axis] = obj->position[axis] - radius - pad;
+    boxMax[axis] = obj->position[axis] + radius + pad;
   }
-  // Same for lights
-  while (lightIndex < 128) {
-    Light defaultLight;
-    defaultLight.kind = 0;
+}
 
-    lights[lightIndex] = defaultLight;
+// same distance term plane_intersect computes per ray
+static float plane_distance(Object *obj) {
+  return sqrtf((obj->position[0] * obj->position[0]) +
+               (obj->position[1] * obj->position[1]) +
+               (obj->position[2] * obj->position[2]));
+}
+
+// distance past which a light's brightest color channel times its radial
+// attenuation is below cutoff, INFINITY when the attenuation never gets there
+static float light_radius(Light *light, float cutoff) {
+  float brightest = fmaxf(fabsf(light->color[0]), fmaxf(fabsf(light->color[1]), fabsf(light->color[2])));
+  float a0 = light->radial_a0;
+  float a1 = light->radial_a1;
+  float a2 = light->radial_a2;
 
-    lightIndex += 1;
+  if (a0 < 0 || a1 < 0 || a2 < 0 || (a1 == 0 && a2 == 0)) {
+    return INFINITY;
   }
 
-  fclose(fh);
+  // a0 + a1 * d + a2 * d^2 = brightest / cutoff
+  float rest = brightest / cutoff - a0;
+  if (rest <= 0) {
+    return 0;
+  }
+  if (a2 == 0) {
+    return rest / a1;
+  }
+  return (sqrtf(a1 * a1 + 4 * a2 * rest) - a1) / (2 * a2);
 }
 
-void write_P6 (char *filename, int width, int height, uint8_t *image) {
-  FILE *fh = fopen(filename,"wb");
-  fprintf(fh,"P6 %d %d 255\n", width, height);
-  fwrite(image, sizeof(uint8_t), width*height*3, fh);
-  fclose(fh);
+static void free_light_bounds(Scene *scene) {
+  free(scene->lightRadius);
+  free(scene->globalLights);
+  bvh_free(&scene->lightBvh);
+  scene->lightRadius = NULL;
+  scene->globalLights = NULL;
+  scene->globalLightCount = 0;
 }
 
-void generate_image(int pixelWidth, int pixelHeight, char *fileName, char *outputFile) {
-  // time measurement
-  clock_t time = clock();
+void cull_lights(Scene *scene, float cutoff) {
+  free_light_bounds(scene);
+  scene->lightCutoff = cutoff;
+  if (cutoff <= 0) {
+    return;
+  }
+
+  int lightCount = scene->lightCount;
+  scene->lightRadius = (float *) malloc((lightCount + 1) * sizeof(float));
+  scene->globalLights = (int *) malloc((lightCount + 1) * sizeof(int));
+  int *boundedLights = (int *) malloc((lightCount + 1) * sizeof(int));
+  float (*boxMin)[3] = (float (*)[3]) malloc((lightCount + 1) * sizeof(float[3]));
+  float (*boxMax)[3] = (float (*)[3]) malloc((lightCount + 1) * sizeof(float[3]));
+  int boundedCount = 0;
+
+  for (int lightI = 0; lightI < lightCount; lightI += 1) {
+    Light *light = &scene->lights[lightI];
+    float radius = light_radius(light, cutoff);
+    scene->lightRadius[lightI] = radius;
+
+    if (isinf(radius)) {
+      scene->globalLights[scene->globalLightCount] = lightI;
+      scene->globalLightCount += 1;
+      continue;
+    }
+    for (int axis = 0; axis < 3; axis += 1) {
+      boxMin[boundedCount][axis] = light->position[axis] - radius;
+      boxMax[boundedCount][axis] = light->position[axis] + radius;
+    }
+    boundedLights[boundedCount] = lightI;
+    boundedCount += 1;
+  }
+
+  bvh_build(&scene->lightBvh, boxMin, boxMax, boundedCount, 1);
+  for (int slot = 0; slot < boundedCount; slot += 1) {
+    scene->lightBvh.primIndices[slot] = boundedLights[scene->lightBvh.primIndices[slot]];
+  }
 
-  // create p6 output file
-  uint8_t *rgbFile = (uint8_t *) malloc(pixelWidth * pixelHeight * 3 * sizeof(uint8_t));
+  free(boxMax);
+  free(boxMin);
+  free(boundedLights);
+}
 
-  // Read in the scene
-  Object objects[128];
-  Light lights[128];
+// instance leaves hold about ten instances, which keeps the tree of a crowd
+// of millions to a fraction of the instances' own memory. the box tests of a
+// leaf cost little next to the spheres behind them
+#define INSTANCE_LEAF_WIDTH 16
+
+// gives every prototype its bounds and a bvh over its spheres in its own
+// coordinates. the trees go one after another into prototypeBvh, with their
+// node and leaf indices pointing into it
+static void build_prototypes(Scene *scene) {
+  int sphereCount = scene->prototypeSphereCount;
+  BVH *all = &scene->prototypeBvh;
+  scene->prototypes = (Prototype *) malloc((scene->prototypeCount + 1) * sizeof(Prototype));
+  all->nodes = (BVHNode *) malloc((2 * sphereCount + 1) * sizeof(BVHNode));
+  all->nodeCount = 0;
+  all->primIndices = (int *) malloc((sphereCount + 1) * sizeof(int));
+  all->primCount = sphereCount;
+  float (*boxMin)[3] = (float (*)[3]) malloc((sphereCount + 1) * sizeof(float[3]));
+  float (*boxMax)[3] = (float (*)[3]) malloc((sphereCount + 1) * sizeof(float[3]));
+
+  int first = 0;
+  for (int prototypeI = 0; prototypeI < scene->prototypeCount; prototypeI += 1) {
+    Prototype *proto = &scene->prototypes[prototypeI];
+    proto->first = first;
+    proto->count = 0;
+    proto->minRadius = INFINITY;
+    proto->maxRadius = 0;
+    while (first + proto->count < sphereCount && scene->prototypeSpheres[first + proto->count].prototype == prototypeI) {
+      proto->count += 1;
+    }
 
-  read_objects(fileName, objects, lights);
+    for (int axis = 0; axis < 3; axis += 1) {
+      proto->min[axis] = INFINITY;
+      proto->max[axis] = -INFINITY;
+    }
+    for (int sphereI = first; sphereI < first + proto->count; sphereI += 1) {
+      PrototypeSphere *sphere = &scene->prototypeSpheres[sphereI];
+      float radius = fabsf(sphere->radius);
+      proto->minRadius = fminf(proto->minRadius, radius);
+      proto->maxRadius = fmaxf(proto->maxRadius, radius);
+      for (int axis = 0; axis < 3; axis += 1) {
+        boxMin[sphereI][axis] = sphere->position[axis] - radius;
+        boxMax[sphereI][axis] = sphere->position[axis] + radius;
+        proto->min[axis] = fminf(proto->min[axis], boxMin[sphereI][axis]);
+        proto->max[axis] = fmaxf(proto->max[axis], boxMax[sphereI][axis]);
+      }
+    }
 
-  // find width, height, and position from camera
-  // default values of 1 if no camera provided
-  float width = 1;
-  float height = 1;
-  float camPosition[3];
-  for (int index = 0; index < 128; index += 1) {
-    if (objects[index].kind == 1) {
-      width = objects[index].width;
-      height = objects[index].height;
-      camPosition[0] = objects[index].position[0];
-      camPosition[1] = objects[index].position[1];
-      camPosition[2] = objects[index].position[2];
+    BVH tree;
+    bvh_build(&tree, boxMin + first, boxMax + first, proto->count, kernel_width());
+    proto->root = all->nodeCount;
+    for (int nodeI = 0; nodeI < tree.nodeCount; nodeI += 1) {
+      BVHNode *node = &all->nodes[proto->root + nodeI];
+      *node = tree.nodes[nodeI];
+      node->first += node->count > 0 ? first : proto->root;
     }
+    for (int slot = 0; slot < proto->count; slot += 1) {
+      all->primIndices[first + slot] = first + tree.primIndices[slot];
+    }
+    all->nodeCount += tree.nodeCount;
+    bvh_free(&tree);
+
+    first += proto->count;
   }
 
-  // shoot ray through each pixel
-  // for each ray, go through list of objects and check for intersections
-  // smallest intersection (where t > 0) gets the color
+  free(boxMax);
+  free(boxMin);
+}
 
-  float pixel_height = height / pixelHeight;
-  float pixel_width = width / pixelWidth;
-  float pixelPoint[3];
-  float Rd[3];
+// the top level of the instance tree, a bvh over the instances' boxes
+static void build_instances(Scene *scene) {
+  int instanceCount = scene->instanceCount;
+  float (*boxMin)[3] = (float (*)[3]) malloc(((size_t) instanceCount + 1) * sizeof(float[3]));
+  float (*boxMax)[3] = (float (*)[3]) malloc(((size_t) instanceCount + 1) * sizeof(float[3]));
+
+  scene->instanceMinRadius = INFINITY;
+  scene->instanceMaxRadius = 0;
+  for (int instanceI = 0; instanceI < instanceCount; instanceI += 1) {
+    Instance *instance = &scene->instances[instanceI];
+    Prototype *proto = &scene->prototypes[instance->prototype];
+    instance_box(instance, proto, boxMin[instanceI], boxMax[instanceI]);
+    scene->instanceMinRadius = fminf(scene->instanceMinRadius, instance->scale * proto->minRadius);
+    scene->instanceMaxRadius = fmaxf(scene->instanceMaxRadius, instance->scale * proto->maxRadius);
+  }
 
-  int rgbIndex = 0;
-  for (int row = 0; row < pixelHeight; row += 1) {
-    pixelPoint[1] = (camPosition[1] + height) / 2 - pixel_height * (row + 0.5);
-    for (int col = 0; col < pixelWidth; col += 1) {
-      pixelPoint[0] = (camPosition[0] - width) / 2 + pixel_width * (col + 0.5);
-      pixelPoint[2] = -1;
+  if (instanceCount > 0) {
+    bvh_build(&scene->instanceBvh, boxMin, boxMax, instanceCount, INSTANCE_LEAF_WIDTH);
+    // room was made for the most nodes a tree can have, which is a lot for millions of instances
+    scene->instanceBvh.nodes = (BVHNode *) realloc(scene->instanceBvh.nodes,
+                                                   scene->instanceBvh.nodeCount * sizeof(BVHNode));
+  }
 
-      v3_normalize(Rd, pixelPoint);
+  free(boxMax);
+  free(boxMin);
+}
 
-      // get ray and check intersections to get color
-      float currColor[3] = {0, 0, 0};
+// mesh leaves hold as many triangles as one kernel call tests, whichever
+// kernels are in use, so the triangle numbering is the same for all of them
+#define MESH_LEAF_WIDTH TRIANGLE_BATCH
+
+// a bvh over each mesh's triangles. the trees go one after another into
+// meshBvh, and each mesh's triangles are put in leaf order so a leaf is a
+// range of them, which needs no index list
+static void build_meshes(Scene *scene) {
+  int triangleCount = scene->triangleCount;
+  BVH *all = &scene->meshBvh;
+  all->nodes = (BVHNode *) malloc((2 * (size_t) triangleCount + 1) * sizeof(BVHNode));
+  all->nodeCount = 0;
+  all->primIndices = NULL;
+  all->primCount = 0;
+  float (*boxMin)[3] = (float (*)[3]) malloc(((size_t) triangleCount + 1) * sizeof(float[3]));
+  float (*boxMax)[3] = (float (*)[3]) malloc(((size_t) triangleCount + 1) * sizeof(float[3]));
+  int (*ordered)[3] = (int (*)[3]) malloc(((size_t) triangleCount + 1) * sizeof(int[3]));
+
+  for (int meshI = 0; meshI < scene->meshCount; meshI += 1) {
+    Mesh *mesh = &scene->meshes[meshI];
+    int first = mesh->firstTriangle;
+
+    for (int triangleI = first; triangleI < first + mesh->triangleCount; triangleI += 1) {
+      float a[3], b[3], c[3];
+      triangle_corners(scene, mesh, triangleI, a, b, c);
+      for (int axis = 0; axis < 3; axis += 1) {
+        boxMin[triangleI][axis] = fminf(a[axis], fminf(b[axis], c[axis]));
+        boxMax[triangleI][axis] = fmaxf(a[axis], fmaxf(b[axis], c[axis]));
+      }
+    }
 
-      // get_Rd(ray, height, width, pixelHeight, pixelWidth, col, row);
+    BVH tree;
+    bvh_build(&tree, boxMin + first, boxMax + first, mesh->triangleCount, MESH_LEAF_WIDTH);
+    mesh->root = all->nodeCount;
+    for (int nodeI = 0; nodeI < tree.nodeCount; nodeI += 1) {
+      BVHNode *node = &all->nodes[mesh->root + nodeI];
+      *node = tree.nodes[nodeI];
+      node->first += node->count > 0 ? first : mesh->root;
+    }
+    for (int slot = 0; slot < mesh->triangleCount; slot += 1) {
+      memcpy(ordered[first + slot], scene->triangles[first + tree.primIndices[slot]], sizeof(int[3]));
+    }
+    all->nodeCount += tree.nodeCount;
+    bvh_free(&tree);
+  }
 
-      int reflectLimit = 5;
+  memcpy(scene->triangles, ordered, (size_t) triangleCount * sizeof(int[3]));
+  all->nodes = (BVHNode *) realloc(all->nodes, ((size_t) all->nodeCount + 1) * sizeof(BVHNode));
 
-      intersect(currColor, objects, lights, Rd, camPosition, camPosition, &reflectLimit);
-      
-      // add color to uint8_t data thing (uint8_t)
-      rgbFile[rgbIndex + 0] = (uint8_t)(currColor[0] * 255);
-      rgbFile[rgbIndex + 1] = (uint8_t)(currColor[1] * 255);
-      rgbFile[rgbIndex + 2] = (uint8_t)(currColor[2] * 255);
+  free(ordered);
+  free(boxMax);
+  free(boxMin);
+}
 
-      rgbIndex += 3;
+// the sphere bvh and the intersection arrays of the scene's own objects
+static void build_objects(Scene *scene) {
+  int sphereCount = 0;
+  int planeCount = 0;
+  int *sphereIndices = (int *) malloc((scene->objectCount + 1) * sizeof(int));
+  int *planeIndices = (int *) malloc((scene->objectCount + 1) * sizeof(int));
+
+  for (int index = 0; index < scene->objectCount; index += 1) {
+    Object *obj = &scene->objects[index];
+    if (obj->kind == 2) {
+      sphereIndices[sphereCount] = index;
+      sphereCount += 1;
+    }
+    else if (obj->kind == 3) {
+      planeIndices[planeCount] = index;
+      planeCount += 1;
     }
   }
 
-  // turn uint8_t data into image
-  write_P6(outputFile, pixelWidth, pixelHeight, rgbFile);
+  float extent = scene_extent(scene);
+  float (*boxMin)[3] = (float (*)[3]) malloc((sphereCount + 1) * sizeof(float[3]));
+  float (*boxMax)[3] = (float (*)[3]) malloc((sphereCount + 1) * sizeof(float[3]));
+  for (int sphereI = 0; sphereI < sphereCount; sphereI += 1) {
+    sphere_box(&scene->objects[sphereIndices[sphereI]], extent, boxMin[sphereI], boxMax[sphereI]);
+  }
+
+  scene->extent = extent;
+  bvh_build(&scene->bvh, boxMin, boxMax, sphereCount, kernel_width());
+
+  // lay the spheres out in leaf order so every leaf is one contiguous range
+  sphere_arrays_alloc(&scene->spheres, sphereCount);
+  for (int slot = 0; slot < sphereCount; slot += 1) {
+    int index = sphereIndices[scene->bvh.primIndices[slot]];
+    Object *obj = &scene->objects[index];
+
+    scene->bvh.primIndices[slot] = index;
+    scene->spheres.cx[slot] = obj->position[0];
+    scene->spheres.cy[slot] = obj->position[1];
+    scene->spheres.cz[slot] = obj->position[2];
+    scene->spheres.r2[slot] = obj->radius * obj->radius;
+    scene->spheres.objIndex[slot] = index;
+  }
+
+  plane_arrays_alloc(&scene->planes, planeCount);
+  for (int slot = 0; slot < planeCount; slot += 1) {
+    Object *obj = &scene->objects[planeIndices[slot]];
+
+    scene->planes.nx[slot] = obj->normal[0];
+    scene->planes.ny[slot] = obj->normal[1];
+    scene->planes.nz[slot] = obj->normal[2];
+    scene->planes.d[slot] = plane_distance(obj);
+    scene->planes.objIndex[slot] = planeIndices[slot];
+  }
+
+  free(boxMax);
+  free(boxMin);
+  free(planeIndices);
+  free(sphereIndices);
+}
+
+// sets up the acceleration structures, call once after read_objects
+void build_scene(Scene *scene) {
+  build_meshes(scene);
+  build_prototypes(scene);
+  build_instances(scene);
+  build_objects(scene);
+}
+
+void refit_scene(Scene *scene) {
+  float extent = scene_extent(scene);
+  int sphereCount = scene->spheres.count;
+  float (*boxMin)[3] = (float (*)[3]) malloc((sphereCount + 1) * sizeof(float[3]));
+  float (*boxMax)[3] = (float (*)[3]) malloc((sphereCount + 1) * sizeof(float[3]));
+
+  for (int slot = 0; slot < sphereCount; slot += 1) {
+    Object *obj = &scene->objects[scene->spheres.objIndex[slot]];
+
+    scene->spheres.cx[slot] = obj->position[0];
+    scene->spheres.cy[slot] = obj->position[1];
+    scene->spheres.cz[slot] = obj->position[2];
+    sphere_box(obj, extent, boxMin[slot], boxMax[slot]);
+  }
+
+  for (int slot = 0; slot < scene->planes.count; slot += 1) {
+    scene->planes.d[slot] = plane_distance(&scene->objects[scene->planes.objIndex[slot]]);
+  }
+
+  scene->extent = extent;
+  bvh_refit(&scene->bvh, boxMin, boxMax);
+  if (scene->lightCutoff > 0) {
+    cull_lights(scene, scene->lightCutoff);
+  }
+
+  free(boxMax);
+  free(boxMin);
+}
+
+void rebuild_scene(Scene *scene) {
+  // a compiled scene's arrays live in its mapping, so the objects and lights
+  // are copied out before the mapping goes
+  if (scene->mapping != NULL) {
+    Object *objects = (Object *) malloc((scene->objectCount + 1) * sizeof(Object));
+    Light *lights = (Light *) malloc((scene->lightCount + 1) * sizeof(Light));
+    Material *materials = (Material *) malloc((scene->materialCount + 1) * sizeof(Material));
+    PrototypeSphere *prototypeSpheres = (PrototypeSphere *) malloc((scene->prototypeSphereCount + 1) * sizeof(PrototypeSphere));
+    Instance *instances = (Instance *) malloc(((size_t) scene->instanceCount + 1) * sizeof(Instance));
+    Mesh *meshes = (Mesh *) malloc((scene->meshCount + 1) * sizeof(Mesh));
+    float (*vertices)[3] = (float (*)[3]) malloc(((size_t) scene->vertexCount + 1) * sizeof(float[3]));
+    uint16_t (*quantizedVertices)[3] = (uint16_t (*)[3]) malloc(((size_t) scene->quantizedVertexCount + 1) *
+                                                                sizeof(uint16_t[3]));
+    int (*triangles)[3] = (int (*)[3]) malloc(((size_t) scene->triangleCount + 1) * sizeof(int[3]));
+    BVHNode *meshNodes = (BVHNode *) malloc(((size_t) scene->meshBvh.nodeCount + 1) * sizeof(BVHNode));
+    memcpy(objects, scene->objects, scene->objectCount * sizeof(Object));
+    memcpy(lights, scene->lights, scene->lightCount * sizeof(Light));
+    memcpy(materials, scene->materials, scene->materialCount * sizeof(Material));
+    memcpy(prototypeSpheres, scene->prototypeSpheres, scene->prototypeSphereCount * sizeof(PrototypeSphere));
+    memcpy(instances, scene->instances, (size_t) scene->instanceCount * sizeof(Instance));
+    memcpy(meshes, scene->meshes, scene->meshCount * sizeof(Mesh));
+    memcpy(vertices, scene->vertices, (size_t) scene->vertexCount * sizeof(float[3]));
+    memcpy(quantizedVertices, scene->quantizedVertices, (size_t) scene->quantizedVertexCount * sizeof(uint16_t[3]));
+    memcpy(triangles, scene->triangles, (size_t) scene->triangleCount * sizeof(int[3]));
+    memcpy(meshNodes, scene->meshBvh.nodes, (size_t) scene->meshBvh.nodeCount * sizeof(BVHNode));
+    munmap(scene->mapping, scene->mappingSize);
+
+    scene->objects = objects;
+    scene->objectCapacity = scene->objectCount;
+    scene->lights = lights;
+    scene->materials = materials;
+    scene->prototypeSpheres = prototypeSpheres;
+    scene->instances = instances;
+    scene->meshes = meshes;
+    scene->vertices = vertices;
+    scene->quantizedVertices = quantizedVertices;
+    scene->triangles = triangles;
+    scene->meshBvh.nodes = meshNodes;
+    scene->meshBvh.primIndices = NULL;
+    scene->mapping = NULL;
+    scene->mappingSize = 0;
+    // the meshes' triangles are already in leaf order, building their trees
+    // again would number them differently
+    build_prototypes(scene);
+    build_instances(scene);
+    build_objects(scene);
+  }
+  else {
+    // instances and meshes don't move, so only the objects' bvh is built again
+    bvh_free(&scene->bvh);
+    sphere_arrays_free(&scene->spheres);
+    plane_arrays_free(&scene->planes);
+    build_objects(scene);
+  }
+
+  if (scene->lightCutoff > 0) {
+    cull_lights(scene, scene->lightCutoff);
+  }
+}
+
+void free_scene(Scene *scene) {
+  free_light_bounds(scene);
+  if (scene->mapping != NULL) {
+    munmap(scene->mapping, scene->mappingSize);
+    return;
+  }
+
+  bvh_free(&scene->bvh);
+  sphere_arrays_free(&scene->spheres);
+  plane_arrays_free(&scene->planes);
+  bvh_free(&scene->instanceBvh);
+  bvh_free(&scene->prototypeBvh);
+  bvh_free(&scene->meshBvh);
+  free(scene->triangles);
+  free(scene->quantizedVertices);
+  free(scene->vertices);
+  free(scene->meshes);
+  free(scene->instances);
+  free(scene->prototypes);
+  free(scene->prototypeSpheres);
+  free(scene->materials);
+  free(scene->lights);
+  free(scene->objects);
+}
+
+int load_scene(char *fileName, Scene *scene, ThreadPool *pool, PhaseTimes *phases, char *error, int errorSize) {
+  double start = wallSeconds();
+  phases->build = 0;
+
+  if (is_bscene(fileName)) {
+    int result = load_bscene(fileName, scene, error, errorSize);
+    phases->parse = wallSeconds() - start;
+    return result;
+  }
+
+  if (read_objects(fileName, scene, pool, error, errorSize) < 0) {
+    return -1;
+  }
+  phases->parse = wallSeconds() - start;
+
+  start = wallSeconds();
+  build_scene(scene);
+  phases->build = wallSeconds() - start;
 
-  free(rgbFile);
+  return 0;
+}
+
+void compile_scene(char *fileName, char *outputFile, RenderOptions *options) {
+  double wallStart = wallSeconds();
+  ThreadPool *pool = pool_create(options->threads);
+  Scene scene;
+  char error[256];
+
+  // leaves are sized for the kernels this machine would pick, any kernel
+  // still traces them correctly
+  kernels_init(options->simd);
+  if (read_objects(fileName, &scene, pool, error, sizeof(error)) < 0) {
+    printf("Error: %s\n", error);
+    exit(1);
+  }
+  build_scene(&scene);
+  pool_destroy(pool);
+
+  if (write_bscene(&scene, outputFile, error, sizeof(error)) < 0) {
+    printf("Error: %s\n", error);
+    exit(1);
+  }
+
+  printf("Compiled %d objects, %d instances, %d triangles, %d lights and %d bvh nodes in %.3f s\n",
+         scene.objectCount, scene.instanceCount, scene.triangleCount, scene.lightCount,
+         scene.bvh.nodeCount + scene.prototypeBvh.nodeCount + scene.instanceBvh.nodeCount + scene.meshBvh.nodeCount,
+         wallSeconds() - wallStart);
+  free_scene(&scene);
+}
+
+void init_context(TraceContext *ctx, Scene *scene) {
+  ctx->lastOccluder = (int *) malloc((scene->lightCount + 1) * sizeof(int));
+  for (int lightI = 0; lightI < scene->lightCount; lightI += 1) {
+    ctx->lastOccluder[lightI] = -1;
+  }
+  ctx->nearLights = (int *) malloc((scene->lightCount + 1) * sizeof(int));
+  ctx->wavefront = NULL;
+  memset(&ctx->stats, 0, sizeof(RayStats));
+  ctx->maxDepth = DEFAULT_MAX_DEPTH;
+  ctx->cutoff = false;
+  ctx->quantizedCutoff = false;
+  ctx->roulette = 0;
+  ctx->pathHits = NULL;
+}
 
-  // final time measurement
-  time = clock() - time;
-  displayTime(time);
+void free_context(TraceContext *ctx) {
+  free(ctx->lastOccluder);
+  free(ctx->nearLights);
+  wavefront_free(ctx->wavefront);
 }
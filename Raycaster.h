@@ -1 +1,386 @@
-void generate_image(int pixelWidth, int pixelHeight, char *fileName, char *outputFile);
\ No newline at end of file
+#ifndef RAYCASTER_H
+#define RAYCASTER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <time.h>
+#include "bvh.h"
+#include "kernels.h"
+#include "stats.h"
+#include "threadpool.h"
+#include "vec3.h"
+
+typedef struct Object {
+  // kind 0 default, 1 camera, 2 sphere, 3 plane, 4 triangle of a mesh
+  int kind;
+  float diffuse[3];
+  float specular[3];
+  float position[3];
+  float reflectivity;
+  float ns;
+
+  union {
+    // different structs for different objects, like sphere/plane/camera/etc
+
+    // struct for camera
+    struct {
+      // the camera looks down -z from its position, [0, 0, 0] by default
+      float width;
+      float height;
+    };
+
+    // struct for sphere
+    struct {
+      float radius;
+    };
+
+    // struct for plane, and for a triangle as scene_object gives it
+    struct {
+      float normal[3];
+    };
+  };
+} Object;
+
+typedef struct Light {
+  // kind 0 default, 1 point light, 2 spot light
+  int kind;
+  float position[3];
+  float color[3];
+  float theta;
+  float spotlightDotProd;
+
+  // point light
+  float radial_a0;
+  float radial_a1;
+  float radial_a2;
+
+  // spot light
+  float angular_a0;
+  float direction[3];
+} Light;
+
+// a material shared by the spheres of prototypes
+typedef struct Material {
+  float diffuse[3];
+  float specular[3];
+  float reflectivity;
+  float ns;
+} Material;
+
+// one sphere of a prototype, in the prototype's own coordinates
+typedef struct PrototypeSphere {
+  float position[3];
+  float radius;
+  int material;
+  int prototype;
+} PrototypeSphere;
+
+// a group of spheres placed many times by instances. its spheres are
+// prototypeSpheres[first .. first + count), and its bvh is the subtree of the
+// scene's prototypeBvh starting at node root, with boxes in its own coordinates
+typedef struct Prototype {
+  int first;
+  int count;
+  int root;
+  // bounds of the spheres and their smallest and largest radius
+  float min[3];
+  float max[3];
+  float minRadius;
+  float maxRadius;
+} Prototype;
+
+// a prototype moved to position and scaled, all an instance stores. a point p
+// of the prototype is at position + scale * p
+typedef struct Instance {
+  float position[3];
+  float scale;
+  int prototype;
+} Instance;
+
+// a triangle mesh read from an obj file, already moved into place. its
+// triangles are triangles[firstTriangle .. firstTriangle + triangleCount),
+// three indices each into the vertex buffer the mesh uses, and its bvh is
+// the subtree of the scene's meshBvh starting at node root, whose leaves are
+// ranges of the triangles
+typedef struct Mesh {
+  Material material;
+  int firstTriangle;
+  int triangleCount;
+  int root;
+  // quantized meshes keep their vertices in quantizedVertices, as 16 bit
+  // steps of step from origin, the rest in vertices
+  int quantized;
+  float origin[3];
+  float step[3];
+  // bounds of the vertices as they are traced
+  float min[3];
+  float max[3];
+} Mesh;
+
+typedef struct Scene {
+  // everything in the scene file except lights and instancing
+  Object *objects;
+  int objectCount;
+  int objectCapacity;
+
+  Light *lights;
+  int lightCount;
+
+  // spheres live in the bvh, whose leaves are ranges of the sphere arrays
+  // (stored in leaf order). planes are unbounded and always get tested
+  BVH bvh;
+  SphereArrays spheres;
+  PlaneArrays planes;
+  // half size of the cube around the origin holding the camera, every sphere
+  // and every light. the bvh padding covers rays starting inside it
+  float extent;
+
+  // instanced spheres. shoot reports sphere k of instance i as object
+  // objectCount + i * instanceStride + k, instanceStride being the size of the
+  // largest prototype, and scene_object puts it together. the instances are
+  // in instanceBvh, and each prototype's spheres in its part of prototypeBvh,
+  // whose leaves hold prototypeSpheres indices
+  Material *materials;
+  int materialCount;
+  PrototypeSphere *prototypeSpheres;
+  int prototypeSphereCount;
+  Prototype *prototypes;
+  int prototypeCount;
+  Instance *instances;
+  int instanceCount;
+  int instanceStride;
+  BVH prototypeBvh;
+  BVH instanceBvh;
+  // smallest and largest radius of any instance sphere, for padding the
+  // instance bvh's boxes
+  float instanceMinRadius;
+  float instanceMaxRadius;
+
+  // triangle meshes. shoot reports triangle j as object triangleBase + j,
+  // numbered after the instance spheres. triangles sharing a vertex share
+  // its entry in vertices or quantizedVertices
+  Mesh *meshes;
+  int meshCount;
+  float (*vertices)[3];
+  int vertexCount;
+  uint16_t (*quantizedVertices)[3];
+  int quantizedVertexCount;
+  int (*triangles)[3];
+  int triangleCount;
+  int triangleBase;
+  BVH meshBvh;
+
+  // light culling by distance, set up by cull_lights. lightRadius is NULL
+  // when there is no cutoff, otherwise it holds how far each light reaches.
+  // lights that reach everywhere are listed in globalLights and the rest are
+  // in lightBvh, whose leaves hold light indices
+  float lightCutoff;
+  float *lightRadius;
+  int *globalLights;
+  int globalLightCount;
+  BVH lightBvh;
+
+  // compiled scenes point every array above into this mapping instead of
+  // owning them, NULL for scenes built from text
+  void *mapping;
+  size_t mappingSize;
+} Scene;
+
+// a position of the camera, an object or a light at one frame of an animation
+typedef struct Keyframe {
+  // 0 camera, 1 object, 2 light
+  int target;
+  // objects and lights are numbered from 0 in scene file order, the camera
+  // line counting as an object
+  int index;
+  int frame;
+  float position[3];
+} Keyframe;
+
+typedef struct Animation {
+  // sorted by target, index and frame
+  Keyframe *keys;
+  int keyCount;
+  // one past the last keyed frame
+  int frameCount;
+} Animation;
+
+// a surface a path went through, as a g-buffer records it
+typedef struct GBufferHit {
+  float point[3];
+  int objIndex;
+} GBufferHit;
+
+// most surfaces a path can be shaded through, the limit of --max-depth, and
+// how many it is by default
+#define MAX_DEPTH 32
+#define DEFAULT_MAX_DEPTH 5
+
+// per thread state handed down the shading path
+typedef struct TraceContext {
+  // how paths end. they are shaded through at most maxDepth surfaces, and stop
+  // early when cutoff is set and the rest of the path can't change the
+  // pixel: its float color, or just its 8 bit value when quantizedCutoff is
+  // set. below a throughput of roulette, reflections are traced with a chance
+  // proportional to it and weighted up to make up for it. 0 turns that off
+  int maxDepth;
+  bool cutoff;
+  bool quantizedCutoff;
+  float roulette;
+
+  // the path being shaded by illuminate: each bounce's color before its
+  // reflection is added, the weight the reflection is added with, and the
+  // product of the reflectivities so far. pathSeed picks the roulette draws,
+  // and pathDepth counts the surfaces shaded
+  vec3 pathBase[MAX_DEPTH];
+  float pathWeight[MAX_DEPTH];
+  float pathThroughput[MAX_DEPTH];
+  unsigned int pathSeed;
+  int pathDepth;
+  // when set, illuminate records each surface of the path here
+  GBufferHit *pathHits;
+
+  // object that last blocked each light's shadow ray, -1 for none
+  int *lastOccluder;
+  // scratch for the lights near a shading point
+  int *nearLights;
+  // queues for the wavefront engine, allocated on first use
+  struct Wavefront *wavefront;
+
+  RayStats stats;
+  // contexts sit next to each other, keep each worker's counters off its neighbors' cache lines
+  char pad[64];
+} TraceContext;
+
+typedef struct RenderOptions {
+  // worker threads used for tracing, including the main thread
+  int threads;
+  // intersection kernels, "auto", "scalar", "sse" or "avx2"
+  char *simd;
+  // primary rays are traced in packetSize x packetSize blocks, 0 to trace them one by one
+  int packetSize;
+  // adaptive anti-aliasing, off when aaThreshold is 0. pixels differing from a
+  // neighbor by more than aaThreshold in any channel get aaGrid x aaGrid extra
+  // samples, as long as the image averages at most aaBudget samples per pixel
+  float aaThreshold;
+  int aaGrid;
+  float aaBudget;
+  // shade with the wavefront engine instead of recursing per pixel
+  int wavefront;
+  // json counters and phase timings are written here when set
+  char *statsFile;
+  // image of the intersection work per pixel, written when set
+  char *heatmapFile;
+  // sequences: frames to render, 0 for up to the last keyframe, and whether
+  // to rebuild the bvh every frame instead of refitting it
+  int frames;
+  int rebuild;
+  // lights are dropped where their color times their radial attenuation is
+  // below this, 0 keeps every light everywhere
+  float lightCutoff;
+  // bytes the image buffer may use, 0 to keep the whole image in memory.
+  // otherwise the image renders in bands that are written out as they finish
+  long memBudget;
+  // x0, y0, x1, y1: only the pixels x0 <= x < x1, y0 <= y < y1 of the frame
+  // are rendered, into a tile file. all 0 renders the whole frame
+  int region[4];
+  // surfaces a path is shaded through at most, and the throughput below which
+  // paths play russian roulette, 0 for never
+  int maxDepth;
+  float roulette;
+  // a render records its paths' surfaces into gbufferFile when set. with
+  // relightFile set it shades the surfaces recorded there instead of tracing
+  char *gbufferFile;
+  char *relightFile;
+  // with updateScene set, only the pixels that edits since updateScene can
+  // reach are rendered, the rest are copied from updateImage, which was
+  // rendered from it with the same options
+  char *updateScene;
+  char *updateImage;
+  // milliseconds from the start the render may take, 0 for no limit. with a
+  // limit pixels are traced coarse to fine, and the ones left when it runs
+  // out are filled in from the traced ones, "bilinear" or "nearest"
+  int deadlineMs;
+  char *fill;
+} RenderOptions;
+
+// gives every light an influence radius from its attenuation and the cutoff,
+// and indexes the lights by it. a cutoff of 0 turns distance culling off.
+// call again after lights move
+void cull_lights(Scene *scene, float cutoff);
+
+// seconds on a monotonic clock, for timing phases
+double wallSeconds(void);
+// prints the wall and cpu time of a render, and how well the threads were used
+void displayTime(double wall, clock_t cpu, int threads);
+
+void build_scene(Scene *scene);
+void free_scene(Scene *scene);
+
+// updates the intersection arrays and bvh boxes after objects or lights moved,
+// keeping the tree built for where they were
+void refit_scene(Scene *scene);
+// builds the bvh again from scratch, for when refitting has made it slow
+void rebuild_scene(Scene *scene);
+
+// reads a text or compiled scene (told apart by the file's magic) and gets it
+// ready to trace, timing the parse and build into phases. returns 0 on
+// success, or -1 with a message written to error
+int load_scene(char *fileName, Scene *scene, ThreadPool *pool, PhaseTimes *phases, char *error, int errorSize);
+
+// converts a text scene into a compiled one with its bvh already built
+void compile_scene(char *fileName, char *outputFile, RenderOptions *options);
+
+// tracing and shading steps, shared by the recursive and wavefront engines
+float origin_margin(Scene *scene, float *R0);
+// replaces minIntersect / minIndex with a closer instance sphere hit, the way
+// the kernels do. with anyHit it returns at the first hit it finds
+void nearest_instance(Scene *scene, float *Rd, float *R0, int skipObjIndex, float *minIntersect, int *minIndex,
+                      bool anyHit, RayStats *stats);
+// the same for triangles of meshes
+void nearest_mesh(Scene *scene, float *Rd, float *R0, int skipObjIndex, float *minIntersect, int *minIndex,
+                  bool anyHit, RayStats *stats);
+float shoot(int *closestObjIndex, Scene *scene, float *Rd, float *R0, int skipObjIndex, RayStats *stats);
+bool occluded(Scene *scene, float *Rd, float *R0, float maxDist, int skipObjIndex, int *lastOccluder, RayStats *stats);
+// the object shoot reported as objIndex. an instance sphere or a triangle
+// (kind 4, with its normal in normal) is put together in scratch, any other
+// object is the scene's own
+Object *scene_object(Scene *scene, int objIndex, Object *scratch);
+vec3 surface_normal(Object *obj, vec3 point);
+int lights_near(Scene *scene, vec3 point, int *lights);
+bool light_reaches(Light *light, vec3 surfaceNorm, vec3 pToL);
+vec3 light_direction(float *dist, Light *light, vec3 point);
+vec3 add_light_color(vec3 lightsColor, Scene *scene, int currObjIndex, Light *currentLight, vec3 point, vec3 rayInit, vec3 pToL, float dist);
+vec3 reflect_direction(Object *surfaceObj, vec3 point, vec3 rayInit);
+vec3 clamp_color(vec3 color);
+float reflection_weight(TraceContext *ctx, float reflectivity, float throughput, unsigned int seed, int level);
+bool reflection_matters(TraceContext *ctx, vec3 *base, float *weight, int level);
+// random number hashed from a seed, like a pixel, and the number of the draw.
+// returns 0 to 1
+double hashed_random(unsigned int seed, unsigned int draw);
+// colors of a primary ray, traced from R0 or from the result of shooting it.
+// ctx->pathSeed has to be set for the path
+vec3 intersect(Scene *scene, TraceContext *ctx, float *Rd, float *R0, float *cam);
+vec3 shade_primary(Scene *scene, TraceContext *ctx, float *Rd, float tVal, int closestObjIndex, float *cam);
+// colors a path from the surfaces a g-buffer recorded for it, shooting only shadow rays
+vec3 shade_recorded(Scene *scene, TraceContext *ctx, GBufferHit *hits, int depth, float *cam);
+
+void init_context(TraceContext *ctx, Scene *scene);
+void free_context(TraceContext *ctx);
+
+void generate_image(int pixelWidth, int pixelHeight, char *fileName, char *outputFile, RenderOptions *options);
+
+// fills rowCosts with the relative cost of rendering each row of a
+// pixelWidth x pixelHeight image of the scene, from the intersection work of
+// a low resolution preview
+void estimate_row_costs(int pixelWidth, int pixelHeight, char *fileName, RenderOptions *options, double *rowCosts);
+
+// renders one image of an already loaded scene on pool, for the render daemon.
+// camPosition moves the camera when it isn't NULL. the image is written to
+// outputFile, or when that is NULL handed back in *pixels as width x height
+// rgb bytes for the caller to free. returns 0 on success, or -1 with a
+// message in error
+int render_request(Scene *scene, ThreadPool *pool, int pixelWidth, int pixelHeight, float *camPosition,
+                   char *outputFile, uint8_t **pixels, RenderOptions *options, char *error, int errorSize);
+
+#endif
@@ -0,0 +1,336 @@
+// benchmark harness. renders a fixed matrix of generated scenes with the
+// raytrace binary, reports wall time, ray throughput by ray type and peak
+// memory as JSON, and compares the wall times against a stored baseline
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+typedef struct BenchCase {
+  const char *name;
+  int spheres;
+  int planes;
+  int pointLights;
+  int spotLights;
+  float reflective;
+  int width;
+  int height;
+} BenchCase;
+
+// changing this table makes old baselines meaningless, add cases instead
+static const BenchCase benchCases[] = {
+  {"spheres-small", 64, 2, 2, 0, 0.25f, 640, 480},
+  {"spheres-large", 20000, 2, 2, 0, 0.25f, 640, 480},
+  {"many-lights", 200, 2, 24, 8, 0.25f, 320, 240},
+  {"mirrors", 500, 5, 2, 1, 0.9f, 320, 240},
+  {"wide", 2000, 2, 4, 2, 0.25f, 1280, 720},
+};
+#define BENCH_CASE_COUNT ((int) (sizeof(benchCases) / sizeof(benchCases[0])))
+
+typedef struct BenchResult {
+  double wallSeconds;
+  long primaryRays;
+  long shadowRays;
+  long reflectionRays;
+  long peakKilobytes;
+} BenchResult;
+
+double wallSeconds(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// runs a program to completion, collecting its stdout into output. returns
+// the exit status, and the child's peak resident size through peakKilobytes
+int run_program(char **args, char *output, int outputSize, long *peakKilobytes) {
+  int pipeFds[2];
+  if (pipe(pipeFds) < 0) {
+    printf("Error: cannot create a pipe.\n");
+    exit(1);
+  }
+
+  pid_t child = fork();
+  if (child < 0) {
+    printf("Error: cannot start %s.\n", args[0]);
+    exit(1);
+  }
+  if (child == 0) {
+    dup2(pipeFds[1], STDOUT_FILENO);
+    close(pipeFds[0]);
+    close(pipeFds[1]);
+    execv(args[0], args);
+    fprintf(stderr, "Error: cannot run %s: %s\n", args[0], strerror(errno));
+    _exit(127);
+  }
+
+  close(pipeFds[1]);
+  int used = 0;
+  int got;
+  while ((got = read(pipeFds[0], output + used, outputSize - 1 - used)) > 0) {
+    used += got;
+    if (used == outputSize - 1) {
+      // keep draining so the child never blocks on a full pipe
+      char discard[4096];
+      while (read(pipeFds[0], discard, sizeof(discard)) > 0) {
+      }
+      break;
+    }
+  }
+  output[used] = '\0';
+  close(pipeFds[0]);
+
+  int status;
+  struct rusage usage;
+  wait4(child, &status, 0, &usage);
+  // ru_maxrss is in kilobytes on linux
+  *peakKilobytes = usage.ru_maxrss;
+
+  return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+void generate_case(const BenchCase *benchCase, char *scenegenPath, char *sceneFile) {
+  char spheres[16], planes[16], pointLights[16], spotLights[16], reflective[16];
+  snprintf(spheres, sizeof(spheres), "%d", benchCase->spheres);
+  snprintf(planes, sizeof(planes), "%d", benchCase->planes);
+  snprintf(pointLights, sizeof(pointLights), "%d", benchCase->pointLights);
+  snprintf(spotLights, sizeof(spotLights), "%d", benchCase->spotLights);
+  snprintf(reflective, sizeof(reflective), "%.2f", benchCase->reflective);
+
+  char *args[] = {scenegenPath, "--spheres", spheres, "--planes", planes, "--point-lights", pointLights,
+                  "--spot-lights", spotLights, "--reflective", reflective, sceneFile, NULL};
+  char output[1024];
+  long peakKilobytes;
+  if (run_program(args, output, sizeof(output), &peakKilobytes) != 0) {
+    printf("Error: generating %s failed: %s\n", sceneFile, output);
+    exit(1);
+  }
+}
+
+// best of runs renders, peak memory is the largest seen
+void run_case(const BenchCase *benchCase, char *raytracePath, char *sceneFile, char *threads, int runs, BenchResult *result) {
+  char width[16], height[16];
+  snprintf(width, sizeof(width), "%d", benchCase->width);
+  snprintf(height, sizeof(height), "%d", benchCase->height);
+  char *args[] = {raytracePath, "--threads", threads, width, height, sceneFile, "/dev/null", NULL};
+
+  result->wallSeconds = -1;
+  result->peakKilobytes = 0;
+  for (int run = 0; run < runs; run += 1) {
+    char output[8192];
+    long peakKilobytes;
+    double start = wallSeconds();
+    int status = run_program(args, output, sizeof(output), &peakKilobytes);
+    double elapsed = wallSeconds() - start;
+
+    char *rays = strstr(output, "Rays: ");
+    if (status != 0 || rays == NULL ||
+        sscanf(rays, "Rays: %ld primary, %ld shadow, %ld reflection", &result->primaryRays,
+               &result->shadowRays, &result->reflectionRays) != 3) {
+      printf("Error: rendering %s failed:\n%s\n", benchCase->name, output);
+      exit(1);
+    }
+
+    if (result->wallSeconds < 0 || elapsed < result->wallSeconds) {
+      result->wallSeconds = elapsed;
+    }
+    if (peakKilobytes > result->peakKilobytes) {
+      result->peakKilobytes = peakKilobytes;
+    }
+  }
+}
+
+void write_json(FILE *fh, BenchResult *results, char *threads, int runs) {
+  fprintf(fh, "{\n  \"version\": 1,\n  \"threads\": %s,\n  \"runs\": %d,\n  \"cases\": [\n", threads, runs);
+
+  for (int caseI = 0; caseI < BENCH_CASE_COUNT; caseI += 1) {
+    const BenchCase *benchCase = &benchCases[caseI];
+    BenchResult *result = &results[caseI];
+    double wall = result->wallSeconds;
+    long totalRays = result->primaryRays + result->shadowRays + result->reflectionRays;
+
+    fprintf(fh, "    {\"name\": \"%s\", \"spheres\": %d, \"planes\": %d, \"point_lights\": %d, \"spot_lights\": %d, "
+                "\"reflective\": %.2f, \"width\": %d, \"height\": %d,\n",
+            benchCase->name, benchCase->spheres, benchCase->planes, benchCase->pointLights, benchCase->spotLights,
+            benchCase->reflective, benchCase->width, benchCase->height);
+    fprintf(fh, "     \"wall_seconds\": %.4f, \"primary_rays\": %ld, \"shadow_rays\": %ld, \"reflection_rays\": %ld,\n",
+            wall, result->primaryRays, result->shadowRays, result->reflectionRays);
+    fprintf(fh, "     \"primary_mrays_per_s\": %.3f, \"shadow_mrays_per_s\": %.3f, \"reflection_mrays_per_s\": %.3f, "
+                "\"total_mrays_per_s\": %.3f, \"peak_rss_kb\": %ld}%s\n",
+            result->primaryRays / wall / 1e6, result->shadowRays / wall / 1e6, result->reflectionRays / wall / 1e6,
+            totalRays / wall / 1e6, result->peakKilobytes, caseI + 1 < BENCH_CASE_COUNT ? "," : "");
+  }
+
+  fprintf(fh, "  ]\n}\n");
+}
+
+// finds a number field of the named case in a file written by write_json
+int baseline_value(char *json, const char *caseName, const char *field, double *value) {
+  char pattern[128];
+  snprintf(pattern, sizeof(pattern), "\"name\": \"%s\"", caseName);
+  char *entry = strstr(json, pattern);
+  if (entry == NULL) {
+    return -1;
+  }
+
+  char *entryEnd = strchr(entry, '}');
+  snprintf(pattern, sizeof(pattern), "\"%s\": ", field);
+  char *found = strstr(entry, pattern);
+  if (found == NULL || (entryEnd != NULL && found > entryEnd)) {
+    return -1;
+  }
+  *value = atof(found + strlen(pattern));
+
+  return 0;
+}
+
+// prints the change from the baseline per case, returns how many cases got
+// slower than the tolerance allows
+int compare_baseline(char *baselineFile, BenchResult *results, double tolerance) {
+  FILE *fh = fopen(baselineFile, "r");
+  if (fh == NULL) {
+    fprintf(stderr, "No baseline at %s, run make bench-baseline to record one\n", baselineFile);
+    return 0;
+  }
+  fseek(fh, 0, SEEK_END);
+  long size = ftell(fh);
+  fseek(fh, 0, SEEK_SET);
+  char *json = (char *) malloc(size + 1);
+  size = fread(json, 1, size, fh);
+  json[size] = '\0';
+  fclose(fh);
+
+  int regressions = 0;
+  fprintf(stderr, "\n%-16s %10s %10s %9s\n", "case", "baseline", "now", "change");
+  for (int caseI = 0; caseI < BENCH_CASE_COUNT; caseI += 1) {
+    const char *name = benchCases[caseI].name;
+    double baseWall;
+    if (baseline_value(json, name, "wall_seconds", &baseWall) < 0 || baseWall <= 0) {
+      fprintf(stderr, "%-16s %10s %9.4fs %9s\n", name, "-", results[caseI].wallSeconds, "new");
+      continue;
+    }
+
+    double change = (results[caseI].wallSeconds - baseWall) / baseWall;
+    bool slower = change > tolerance;
+    regressions += slower;
+    fprintf(stderr, "%-16s %9.4fs %9.4fs %+8.1f%%%s\n", name, baseWall, results[caseI].wallSeconds, change * 100,
+            slower ? "  REGRESSION" : "");
+
+    // the same scene should always trace the same rays
+    double baseRays[3];
+    if (baseline_value(json, name, "primary_rays", &baseRays[0]) == 0 &&
+        baseline_value(json, name, "shadow_rays", &baseRays[1]) == 0 &&
+        baseline_value(json, name, "reflection_rays", &baseRays[2]) == 0 &&
+        ((long) baseRays[0] != results[caseI].primaryRays || (long) baseRays[1] != results[caseI].shadowRays ||
+         (long) baseRays[2] != results[caseI].reflectionRays)) {
+      fprintf(stderr, "%-16s ray counts differ from the baseline, the rendering itself changed\n", "");
+    }
+  }
+  free(json);
+
+  return regressions;
+}
+
+void usage(void) {
+  printf("Usage: bench [--raytrace PATH] [--scenegen PATH] [--scenes DIR] [--threads N] [--runs N]\n"
+         "             [--out results.json] [--baseline baseline.json] [--tolerance PERCENT]\n");
+}
+
+int main(int argc, char **argv) {
+  char *raytracePath = "./raytrace";
+  char *scenegenPath = "./bench/scenegen";
+  char *sceneDir = "bench/scenes";
+  // same default as raytrace, one thread per cpu
+  char threadCount[16];
+  snprintf(threadCount, sizeof(threadCount), "%ld", sysconf(_SC_NPROCESSORS_ONLN));
+  char *threads = threadCount;
+  char *outputFile = NULL;
+  char *baselineFile = NULL;
+  int runs = 3;
+  double tolerance = 0.10;
+
+  for (int index = 1; index < argc; index += 1) {
+    if (index + 1 >= argc) {
+      printf("Error: %s needs a value.\n", argv[index]);
+      usage();
+      exit(1);
+    }
+
+    if (strcmp(argv[index], "--raytrace") == 0) {
+      raytracePath = argv[index + 1];
+    }
+    else if (strcmp(argv[index], "--scenegen") == 0) {
+      scenegenPath = argv[index + 1];
+    }
+    else if (strcmp(argv[index], "--scenes") == 0) {
+      sceneDir = argv[index + 1];
+    }
+    else if (strcmp(argv[index], "--threads") == 0) {
+      threads = argv[index + 1];
+    }
+    else if (strcmp(argv[index], "--runs") == 0) {
+      runs = atoi(argv[index + 1]);
+    }
+    else if (strcmp(argv[index], "--out") == 0) {
+      outputFile = argv[index + 1];
+    }
+    else if (strcmp(argv[index], "--baseline") == 0) {
+      baselineFile = argv[index + 1];
+    }
+    else if (strcmp(argv[index], "--tolerance") == 0) {
+      tolerance = atof(argv[index + 1]) / 100;
+    }
+    else {
+      printf("Error: unknown option %s.\n", argv[index]);
+      usage();
+      exit(1);
+    }
+    index += 1;
+  }
+
+  if (runs < 1 || atoi(threads) < 1) {
+    printf("Error: --runs and --threads need positive numbers.\n");
+    exit(1);
+  }
+  mkdir(sceneDir, 0755);
+
+  BenchResult results[BENCH_CASE_COUNT];
+  for (int caseI = 0; caseI < BENCH_CASE_COUNT; caseI += 1) {
+    char sceneFile[1024];
+    snprintf(sceneFile, sizeof(sceneFile), "%s/%s.scene", sceneDir, benchCases[caseI].name);
+
+    generate_case(&benchCases[caseI], scenegenPath, sceneFile);
+    run_case(&benchCases[caseI], raytracePath, sceneFile, threads, runs, &results[caseI]);
+
+    long totalRays = results[caseI].primaryRays + results[caseI].shadowRays + results[caseI].reflectionRays;
+    fprintf(stderr, "%-16s %8.4f s %8.2f Mrays/s %8ld KB peak\n", benchCases[caseI].name, results[caseI].wallSeconds,
+            totalRays / results[caseI].wallSeconds / 1e6, results[caseI].peakKilobytes);
+  }
+
+  if (outputFile != NULL) {
+    FILE *fh = fopen(outputFile, "w");
+    if (fh == NULL) {
+      printf("Error: cannot create %s.\n", outputFile);
+      exit(1);
+    }
+    write_json(fh, results, threads, runs);
+    fclose(fh);
+  }
+  else {
+    write_json(stdout, results, threads, runs);
+  }
+
+  if (baselineFile != NULL && compare_baseline(baselineFile, results, tolerance) > 0) {
+    fprintf(stderr, "Slower than the baseline by more than %.0f%%\n", tolerance * 100);
+    return 1;
+  }
+
+  return 0;
+}
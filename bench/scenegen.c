@@ -0,0 +1,187 @@
+// procedural scene generator for the benchmarks. the same arguments always
+// produce the same file, the random numbers don't come from the C library
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct SceneParams {
+  int spheres;
+  int planes;
+  int pointLights;
+  int spotLights;
+  // fraction of spheres and planes that reflect
+  float reflective;
+  uint64_t seed;
+} SceneParams;
+
+static uint64_t rngState;
+
+// xorshift64*, returns 0 to 1
+static double random_unit(void) {
+  rngState ^= rngState >> 12;
+  rngState ^= rngState << 25;
+  rngState ^= rngState >> 27;
+
+  return ((rngState * 0x2545f4914f6cdd1dull) >> 11) / 9007199254740992.0;
+}
+
+static double random_range(double low, double high) {
+  return low + (high - low) * random_unit();
+}
+
+static float random_reflectivity(SceneParams *params) {
+  return random_unit() < params->reflective ? random_range(0.2, 0.9) : 0;
+}
+
+void generate_scene(FILE *fh, SceneParams *params) {
+  rngState = params->seed * 0x9e3779b97f4a7c15ull + 1;
+
+  fprintf(fh, "camera, width: 1.6, height: 1.2\n");
+
+  // spheres fill a box in front of the camera, getting smaller as there are
+  // more of them so the box doesn't turn into a solid wall
+  double scale = params->spheres > 500 ? cbrt(500.0 / params->spheres) : 1;
+  for (int sphereI = 0; sphereI < params->spheres; sphereI += 1) {
+    double radius = random_range(0.1, 1.2) * scale;
+    float reflectivity = random_reflectivity(params);
+    double red = random_unit();
+    double green = random_unit();
+    double blue = random_unit();
+    double x = random_range(-10, 10);
+    double y = random_range(-6, 6);
+    double z = random_range(-40, -5);
+
+    fprintf(fh, "sphere, radius: %.4f, reflectivity: %.2f, diffuse_color: [%.2f, %.2f, %.2f], "
+                "specular_color: [1, 1, 1], position: [%.3f, %.3f, %.3f]\n",
+            radius, reflectivity, red, green, blue, x, y, z);
+  }
+
+  // floor, back wall, ceiling and side walls first, then tilted planes
+  static const float roomNormals[5][3] = {{0, 1, 0}, {0, 0, 1}, {0, -1, 0}, {1, 0, 0}, {-1, 0, 0}};
+  static const float roomPositions[5][3] = {{0, -7, 0}, {0, 0, -45}, {0, 7, 0}, {-12, 0, 0}, {12, 0, 0}};
+  for (int planeI = 0; planeI < params->planes; planeI += 1) {
+    float normal[3];
+    float position[3];
+
+    if (planeI < 5) {
+      memcpy(normal, roomNormals[planeI], sizeof(normal));
+      memcpy(position, roomPositions[planeI], sizeof(position));
+    }
+    else {
+      double angle = random_range(0, 2 * M_PI);
+      double tilt = random_range(0.2, 1);
+      double length = sqrt(tilt * tilt + 1);
+      normal[0] = cos(angle) / length;
+      normal[1] = tilt / length;
+      normal[2] = sin(angle) / length;
+      position[0] = 0;
+      position[1] = random_range(-9, -7);
+      position[2] = 0;
+    }
+
+    fprintf(fh, "plane, normal: [%.4f, %.4f, %.4f], reflectivity: %.2f, diffuse_color: [%.2f, %.2f, %.2f], "
+                "position: [%.2f, %.2f, %.2f]\n",
+            normal[0], normal[1], normal[2], random_reflectivity(params),
+            random_range(0.3, 1), random_range(0.3, 1), random_range(0.3, 1),
+            position[0], position[1], position[2]);
+  }
+
+  // keep the total light about the same however many lights there are
+  int lightCount = params->pointLights + params->spotLights;
+  double brightness = lightCount > 4 ? 4.0 / lightCount : 1;
+  for (int lightI = 0; lightI < lightCount; lightI += 1) {
+    double x = random_range(-8, 8);
+    double y = random_range(0, 6);
+    double z = random_range(-30, -5);
+
+    if (lightI < params->pointLights) {
+      fprintf(fh, "light, color: [%.3f, %.3f, %.3f], theta: 0, radial-a2: 0.0125, radial-a1: 0.125, radial-a0: 0.25, "
+                  "position: [%.2f, %.2f, %.2f]\n",
+              brightness, brightness, brightness, x, y, z);
+    }
+    else {
+      // spot lights aim at the middle of the sphere box
+      fprintf(fh, "light, color: [%.3f, %.3f, %.3f], theta: %.1f, angular-a0: 2, radial-a2: 0.0125, radial-a1: 0.125, "
+                  "radial-a0: 0.25, position: [%.2f, %.2f, %.2f], direction: [%.3f, %.3f, %.3f]\n",
+              brightness, brightness, brightness, random_range(35, 55), x, y, z, -x, -y, -22.5 - z);
+    }
+  }
+}
+
+void usage(void) {
+  printf("Usage: scenegen [--spheres N] [--planes N] [--point-lights N] [--spot-lights N]\n"
+         "                [--reflective FRACTION] [--seed N] output.scene\n");
+}
+
+int main(int argc, char **argv) {
+  SceneParams params = {100, 2, 2, 0, 0.25f, 1};
+  char *outputFile = NULL;
+
+  for (int index = 1; index < argc; index += 1) {
+    int *count = NULL;
+    if (strcmp(argv[index], "--spheres") == 0) {
+      count = &params.spheres;
+    }
+    else if (strcmp(argv[index], "--planes") == 0) {
+      count = &params.planes;
+    }
+    else if (strcmp(argv[index], "--point-lights") == 0) {
+      count = &params.pointLights;
+    }
+    else if (strcmp(argv[index], "--spot-lights") == 0) {
+      count = &params.spotLights;
+    }
+    else if (strcmp(argv[index], "--reflective") == 0) {
+      if (index + 1 >= argc || atof(argv[index + 1]) < 0 || atof(argv[index + 1]) > 1) {
+        printf("Error: --reflective needs a fraction from 0 to 1.\n");
+        exit(1);
+      }
+      params.reflective = atof(argv[index + 1]);
+      index += 1;
+      continue;
+    }
+    else if (strcmp(argv[index], "--seed") == 0) {
+      if (index + 1 >= argc) {
+        printf("Error: --seed needs a number.\n");
+        exit(1);
+      }
+      params.seed = strtoull(argv[index + 1], NULL, 10);
+      index += 1;
+      continue;
+    }
+    else if (outputFile == NULL) {
+      outputFile = argv[index];
+      continue;
+    }
+    else {
+      printf("Error: too many arguments.\n");
+      usage();
+      exit(1);
+    }
+
+    if (index + 1 >= argc || atoi(argv[index + 1]) < 0) {
+      printf("Error: %s needs a count of 0 or more.\n", argv[index]);
+      exit(1);
+    }
+    *count = atoi(argv[index + 1]);
+    index += 1;
+  }
+
+  if (outputFile == NULL) {
+    printf("Error: no output file given.\n");
+    usage();
+    exit(1);
+  }
+
+  FILE *fh = fopen(outputFile, "w");
+  if (fh == NULL) {
+    printf("Error: cannot create %s.\n", outputFile);
+    exit(1);
+  }
+  generate_scene(fh, &params);
+  fclose(fh);
+
+  return 0;
+}
@@ -0,0 +1,208 @@
+// micro benchmark of the shading math, the inline vec3 library against the
+// float[3] functions it replaced. both run the vector steps of one light's
+// shading over the same random inputs, and the results have to match bit for
+// bit. the old functions are kept here as they were, out of line like they
+// were in their own file
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../vec3.h"
+
+#define POINTS 4096
+
+__attribute__((noinline)) void v3_from_points(float *dst, float *a, float *b) {
+  dst[0] = b[0] - a[0];
+  dst[1] = b[1] - a[1];
+  dst[2] = b[2] - a[2];
+}
+
+__attribute__((noinline)) void v3_add(float *dst, float *a, float *b) {
+  dst[0] = a[0] + b[0];
+  dst[1] = a[1] + b[1];
+  dst[2] = a[2] + b[2];
+}
+
+__attribute__((noinline)) float v3_dot_product(float *a, float *b) {
+  return (a[0] * b[0]) + (a[1] * b[1]) + (a[2] * b[2]);
+}
+
+__attribute__((noinline)) void v3_scale(float *dst, float s) {
+  dst[0] = dst[0] * s;
+  dst[1] = dst[1] * s;
+  dst[2] = dst[2] * s;
+}
+
+__attribute__((noinline)) void v3_reflect(float *dst, float *v, float *n) {
+  v3_scale(n, (-2 * (v3_dot_product(n, v))));
+  v3_add(dst, v, n);
+}
+
+__attribute__((noinline)) float v3_length(float *a) {
+  double result = (a[0] * a[0]) + (a[1] * a[1]) + (a[2] * a[2]);
+  return (float) sqrt(result);
+}
+
+__attribute__((noinline)) void v3_normalize(float *dst, float *a) {
+  float denominator = v3_length(a);
+  dst[0] = a[0] / denominator;
+  dst[1] = a[1] / denominator;
+  dst[2] = a[2] / denominator;
+}
+
+__attribute__((noinline)) void v3_copy(float *dst, float *a) {
+  dst[0] = a[0];
+  dst[1] = a[1];
+  dst[2] = a[2];
+}
+
+typedef struct Inputs {
+  float point[POINTS][3];
+  float light[POINTS][3];
+  float normal[POINTS][3];
+  float eye[POINTS][3];
+} Inputs;
+
+static uint64_t rngState = 0x9e3779b97f4a7c15ull;
+
+// xorshift64*, returns -1 to 1
+static float random_signed(void) {
+  rngState ^= rngState >> 12;
+  rngState ^= rngState << 25;
+  rngState ^= rngState >> 27;
+
+  return (float) (((rngState * 0x2545f4914f6cdd1dull) >> 11) / 4503599627370496.0 - 1);
+}
+
+static double seconds_now(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+// direction to the light, n dot l and r dot v, the way shading used to do them
+static void shade_old(Inputs *in, float (*out)[3]) {
+  for (int index = 0; index < POINTS; index += 1) {
+    float pToL[3];
+    float Rd[3];
+    v3_from_points(pToL, in->point[index], in->light[index]);
+    float dist = v3_length(pToL);
+    v3_normalize(Rd, pToL);
+    v3_normalize(pToL, pToL);
+
+    float surfaceNorm[3];
+    v3_copy(surfaceNorm, in->normal[index]);
+    float dotProd = v3_dot_product(surfaceNorm, pToL);
+
+    float uL[3];
+    float R[3];
+    v3_copy(uL, pToL);
+    v3_scale(uL, -1);
+    v3_reflect(R, uL, surfaceNorm);
+    float viewVec[3];
+    v3_from_points(viewVec, in->point[index], in->eye[index]);
+    v3_normalize(viewVec, viewVec);
+
+    out[index][0] = dotProd + Rd[0];
+    out[index][1] = v3_dot_product(R, viewVec);
+    out[index][2] = dist;
+  }
+}
+
+static void shade_new(Inputs *in, float (*out)[3]) {
+  for (int index = 0; index < POINTS; index += 1) {
+    vec3 point = vec3_load(in->point[index]);
+    vec3 pToL = vec3_from_points(point, vec3_load(in->light[index]));
+    float dist = vec3_length(pToL);
+    pToL = pToL / dist;
+
+    vec3 surfaceNorm = vec3_load(in->normal[index]);
+    float dotProd = vec3_dot(surfaceNorm, pToL);
+
+    vec3 R = vec3_reflect(pToL * -1, surfaceNorm);
+    vec3 viewVec = vec3_normalize(vec3_from_points(point, vec3_load(in->eye[index])));
+
+    out[index][0] = dotProd + pToL[0];
+    out[index][1] = vec3_dot(R, viewVec);
+    out[index][2] = dist;
+  }
+}
+
+// best of several runs, in nanoseconds per point
+static double time_shading(void (*shade)(Inputs *, float (*)[3]), Inputs *in, float (*out)[3], int repeats) {
+  double best = INFINITY;
+
+  for (int run = 0; run < 5; run += 1) {
+    double start = seconds_now();
+    for (int repeat = 0; repeat < repeats; repeat += 1) {
+      shade(in, out);
+    }
+    double elapsed = seconds_now() - start;
+    best = elapsed < best ? elapsed : best;
+  }
+
+  return best * 1e9 / ((double) repeats * POINTS);
+}
+
+int main(int argc, char **argv) {
+  int repeats = argc > 1 ? atoi(argv[1]) : 500;
+  if (repeats < 1) {
+    printf("Usage: vecbench [repeats]\n");
+    return 1;
+  }
+
+  Inputs *in = (Inputs *) malloc(sizeof(Inputs));
+  for (int index = 0; index < POINTS; index += 1) {
+    for (int axis = 0; axis < 3; axis += 1) {
+      in->point[index][axis] = random_signed() * 10;
+      in->light[index][axis] = random_signed() * 20;
+      in->normal[index][axis] = random_signed();
+      in->eye[index][axis] = random_signed() * 5;
+    }
+    vec3_store(in->normal[index], vec3_normalize(vec3_load(in->normal[index])));
+  }
+
+  float (*oldOut)[3] = (float (*)[3]) malloc(POINTS * sizeof(float[3]));
+  float (*newOut)[3] = (float (*)[3]) malloc(POINTS * sizeof(float[3]));
+  double oldTime = time_shading(shade_old, in, oldOut, repeats);
+  double newTime = time_shading(shade_new, in, newOut, repeats);
+  bool same = memcmp(oldOut, newOut, POINTS * sizeof(float[3])) == 0;
+
+  printf("float[3] functions  %6.2f ns per shading point\n", oldTime);
+  printf("inline vec3         %6.2f ns per shading point, %.2fx faster, results %s\n", newTime,
+         oldTime / newTime, same ? "identical" : "DIFFERENT");
+
+  // the approximate normalize, against the exact one
+  double exactStart = seconds_now();
+  for (int repeat = 0; repeat < repeats; repeat += 1) {
+    for (int index = 0; index < POINTS; index += 1) {
+      vec3_store(newOut[index], vec3_normalize(vec3_load(in->light[index])));
+    }
+  }
+  double exactTime = (seconds_now() - exactStart) * 1e9 / ((double) repeats * POINTS);
+
+  double fastStart = seconds_now();
+  for (int repeat = 0; repeat < repeats; repeat += 1) {
+    for (int index = 0; index < POINTS; index += 1) {
+      vec3_store(oldOut[index], vec3_normalize_fast(vec3_load(in->light[index])));
+    }
+  }
+  double fastTime = (seconds_now() - fastStart) * 1e9 / ((double) repeats * POINTS);
+
+  float worst = 0;
+  for (int index = 0; index < POINTS; index += 1) {
+    vec3 exact = vec3_normalize(vec3_load(in->light[index]));
+    vec3 error = vec3_normalize_fast(vec3_load(in->light[index])) - exact;
+    worst = fmaxf(worst, vec3_length(error));
+  }
+
+  printf("normalize           %6.2f ns exact, %.2f ns fast, fast is off by up to %.2g\n", exactTime, fastTime, worst);
+
+  free(in);
+  free(oldOut);
+  free(newOut);
+  return same ? 0 : 1;
+}
@@ -0,0 +1,447 @@
+#include <fcntl.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "bscene.h"
+
+static const char bsceneMagic[8] = {'R', 'T', 'S', 'C', 'E', 'N', 'E', '\0'};
+
+enum {
+  SECTION_OBJECTS,
+  SECTION_LIGHTS,
+  SECTION_BVH_NODES,
+  SECTION_BVH_PRIMS,
+  SECTION_SPHERE_CX,
+  SECTION_SPHERE_CY,
+  SECTION_SPHERE_CZ,
+  SECTION_SPHERE_R2,
+  SECTION_SPHERE_INDEX,
+  SECTION_PLANE_NX,
+  SECTION_PLANE_NY,
+  SECTION_PLANE_NZ,
+  SECTION_PLANE_D,
+  SECTION_PLANE_INDEX,
+  SECTION_MATERIALS,
+  SECTION_PROTOTYPE_SPHERES,
+  SECTION_PROTOTYPES,
+  SECTION_PROTOTYPE_NODES,
+  SECTION_PROTOTYPE_PRIMS,
+  SECTION_INSTANCES,
+  SECTION_INSTANCE_NODES,
+  SECTION_INSTANCE_PRIMS,
+  SECTION_MESHES,
+  SECTION_VERTICES,
+  SECTION_QUANTIZED_VERTICES,
+  SECTION_TRIANGLES,
+  SECTION_MESH_NODES,
+  SECTION_COUNT
+};
+
+typedef struct Section {
+  uint64_t offset;
+  uint64_t size;
+  // elements, not counting the kernel padding stored after them
+  uint64_t count;
+} Section;
+
+typedef struct BSceneHeader {
+  char magic[8];
+  uint32_t version;
+  // catches files written on a machine with the other byte order
+  uint32_t byteOrder;
+  // struct sizes the file was written with
+  uint32_t objectSize;
+  uint32_t lightSize;
+  uint32_t nodeSize;
+  uint32_t instanceSize;
+  uint32_t prototypeSize;
+  uint32_t meshSize;
+  uint32_t kernelPadding;
+  // Scene.extent, which the bvh padding was computed for
+  float extent;
+  // the instance numbering and the radii the instance boxes are padded for
+  int32_t instanceStride;
+  float instanceMinRadius;
+  float instanceMaxRadius;
+  // the first triangle's object number
+  int32_t triangleBase;
+  Section sections[SECTION_COUNT];
+} BSceneHeader;
+
+static uint64_t align_up(uint64_t value) {
+  return (value + BSCENE_ALIGN - 1) & ~(uint64_t) (BSCENE_ALIGN - 1);
+}
+
+int is_bscene(char *fileName) {
+  char magic[8];
+  FILE *fh = fopen(fileName, "rb");
+
+  if (fh == NULL) {
+    return 0;
+  }
+  int isCompiled = fread(magic, 1, sizeof(magic), fh) == sizeof(magic) && memcmp(magic, bsceneMagic, sizeof(magic)) == 0;
+  fclose(fh);
+
+  return isCompiled;
+}
+
+int write_bscene(Scene *scene, char *fileName, char *error, int errorSize) {
+  BSceneHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, bsceneMagic, sizeof(bsceneMagic));
+  header.version = BSCENE_VERSION;
+  header.byteOrder = 0x01020304;
+  header.objectSize = sizeof(Object);
+  header.lightSize = sizeof(Light);
+  header.nodeSize = sizeof(BVHNode);
+  header.instanceSize = sizeof(Instance);
+  header.prototypeSize = sizeof(Prototype);
+  header.meshSize = sizeof(Mesh);
+  header.kernelPadding = KERNEL_PADDING;
+  header.extent = scene->extent;
+  header.instanceStride = scene->instanceStride;
+  header.instanceMinRadius = scene->instanceMinRadius;
+  header.instanceMaxRadius = scene->instanceMaxRadius;
+  header.triangleBase = scene->triangleBase;
+
+  int sphereCount = scene->spheres.count + KERNEL_PADDING;
+  int planeCount = scene->planes.count + KERNEL_PADDING;
+  const void *data[SECTION_COUNT] = {
+    scene->objects, scene->lights, scene->bvh.nodes, scene->bvh.primIndices,
+    scene->spheres.cx, scene->spheres.cy, scene->spheres.cz, scene->spheres.r2, scene->spheres.objIndex,
+    scene->planes.nx, scene->planes.ny, scene->planes.nz, scene->planes.d, scene->planes.objIndex,
+    scene->materials, scene->prototypeSpheres, scene->prototypes, scene->prototypeBvh.nodes, scene->prototypeBvh.primIndices,
+    scene->instances, scene->instanceBvh.nodes, scene->instanceBvh.primIndices,
+    scene->meshes, scene->vertices, scene->quantizedVertices, scene->triangles, scene->meshBvh.nodes
+  };
+  uint64_t counts[SECTION_COUNT] = {
+    scene->objectCount, scene->lightCount, scene->bvh.nodeCount, scene->bvh.primCount,
+    scene->spheres.count, scene->spheres.count, scene->spheres.count, scene->spheres.count, scene->spheres.count,
+    scene->planes.count, scene->planes.count, scene->planes.count, scene->planes.count, scene->planes.count,
+    scene->materialCount, scene->prototypeSphereCount, scene->prototypeCount, scene->prototypeBvh.nodeCount,
+    scene->prototypeBvh.primCount, scene->instanceCount, scene->instanceBvh.nodeCount, scene->instanceBvh.primCount,
+    scene->meshCount, scene->vertexCount, scene->quantizedVertexCount, scene->triangleCount, scene->meshBvh.nodeCount
+  };
+  uint64_t sizes[SECTION_COUNT] = {
+    scene->objectCount * sizeof(Object), scene->lightCount * sizeof(Light),
+    scene->bvh.nodeCount * sizeof(BVHNode), scene->bvh.primCount * sizeof(int),
+    sphereCount * sizeof(float), sphereCount * sizeof(float), sphereCount * sizeof(float), sphereCount * sizeof(float), sphereCount * sizeof(int),
+    planeCount * sizeof(float), planeCount * sizeof(float), planeCount * sizeof(float), planeCount * sizeof(float), planeCount * sizeof(int),
+    scene->materialCount * sizeof(Material), scene->prototypeSphereCount * sizeof(PrototypeSphere),
+    scene->prototypeCount * sizeof(Prototype), scene->prototypeBvh.nodeCount * sizeof(BVHNode),
+    scene->prototypeBvh.primCount * sizeof(int), scene->instanceCount * sizeof(Instance),
+    scene->instanceBvh.nodeCount * sizeof(BVHNode), scene->instanceBvh.primCount * sizeof(int),
+    scene->meshCount * sizeof(Mesh), scene->vertexCount * sizeof(float[3]),
+    scene->quantizedVertexCount * sizeof(uint16_t[3]), scene->triangleCount * sizeof(int[3]),
+    scene->meshBvh.nodeCount * sizeof(BVHNode)
+  };
+
+  uint64_t offset = align_up(sizeof(header));
+  for (int section = 0; section < SECTION_COUNT; section += 1) {
+    header.sections[section].offset = offset;
+    header.sections[section].size = sizes[section];
+    header.sections[section].count = counts[section];
+    offset = align_up(offset + sizes[section]);
+  }
+
+  FILE *fh = fopen(fileName, "wb");
+  if (fh == NULL) {
+    snprintf(error, errorSize, "%s: cannot create the compiled scene", fileName);
+    return -1;
+  }
+
+  static const char zeros[BSCENE_ALIGN] = {0};
+  uint64_t written = 0;
+  int ok = fwrite(&header, sizeof(header), 1, fh) == 1;
+  written += sizeof(header);
+  for (int section = 0; section < SECTION_COUNT && ok; section += 1) {
+    ok = fwrite(zeros, 1, header.sections[section].offset - written, fh) == header.sections[section].offset - written;
+    ok = ok && (sizes[section] == 0 || fwrite(data[section], sizes[section], 1, fh) == 1);
+    written = header.sections[section].offset + sizes[section];
+  }
+  ok = fclose(fh) == 0 && ok;
+
+  if (!ok) {
+    snprintf(error, errorSize, "%s: failed writing the compiled scene", fileName);
+    return -1;
+  }
+  return 0;
+}
+
+// bytes of one element of each section
+static const uint64_t elementSizes[SECTION_COUNT] = {
+  sizeof(Object), sizeof(Light), sizeof(BVHNode), sizeof(int),
+  sizeof(float), sizeof(float), sizeof(float), sizeof(float), sizeof(int),
+  sizeof(float), sizeof(float), sizeof(float), sizeof(float), sizeof(int),
+  sizeof(Material), sizeof(PrototypeSphere), sizeof(Prototype), sizeof(BVHNode), sizeof(int),
+  sizeof(Instance), sizeof(BVHNode), sizeof(int),
+  sizeof(Mesh), sizeof(float[3]), sizeof(uint16_t[3]), sizeof(int[3]), sizeof(BVHNode)
+};
+
+// whether the section is a kernel array, stored with KERNEL_PADDING elements
+// after its count
+static bool section_padded(int section) {
+  return section >= SECTION_SPHERE_CX && section <= SECTION_PLANE_INDEX;
+}
+
+// whether every index in indices[0 .. count) is in [first, last)
+static bool indices_within(int *indices, long count, long first, long last) {
+  for (long index = 0; index < count; index += 1) {
+    if (indices[index] < first || indices[index] >= last) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// whether the tree starting at root only leads to nodes of the array, with
+// leaves inside [leafFirst, leafLast) and no deeper than the traversal stack
+// holds. children come after their parent, so the walk can't loop
+static bool tree_valid(BVH *bvh, int root, long leafFirst, long leafLast) {
+  if (root < 0 || root >= bvh->nodeCount) {
+    return false;
+  }
+
+  int stack[BVH_STACK_SIZE];
+  int stackSize = 1;
+  long visits = 0;
+  stack[0] = root;
+  while (stackSize > 0) {
+    stackSize -= 1;
+    int nodeIndex = stack[stackSize];
+    BVHNode *node = &bvh->nodes[nodeIndex];
+    visits += 1;
+    if (visits > bvh->nodeCount || node->count < 0) {
+      return false;
+    }
+
+    if (node->count > 0) {
+      if (node->first < leafFirst || (long) node->first + node->count > leafLast) {
+        return false;
+      }
+      continue;
+    }
+
+    if (node->first <= nodeIndex + 1 || node->first >= bvh->nodeCount || stackSize + 2 > BVH_STACK_SIZE) {
+      return false;
+    }
+    stack[stackSize] = node->first;
+    stack[stackSize + 1] = nodeIndex + 1;
+    stackSize += 2;
+  }
+  return true;
+}
+
+// checks that every index in the mapped scene points into the section it
+// belongs to, so a corrupt file is rejected instead of read out of bounds.
+// returns what is wrong, or NULL
+static const char *scene_problem(Scene *scene) {
+  long objectCount = scene->objectCount;
+
+  if (scene->bvh.primCount != scene->spheres.count ||
+      (scene->bvh.nodeCount > 0 && !tree_valid(&scene->bvh, 0, 0, scene->spheres.count)) ||
+      !indices_within(scene->bvh.primIndices, scene->bvh.primCount, 0, objectCount) ||
+      !indices_within(scene->spheres.objIndex, scene->spheres.count, 0, objectCount) ||
+      !indices_within(scene->planes.objIndex, scene->planes.count, 0, objectCount)) {
+    return "compiled scene has a sphere or plane that isn't one of its objects";
+  }
+  for (int slot = 0; slot < scene->spheres.count; slot += 1) {
+    if (scene->objects[scene->spheres.objIndex[slot]].kind != 2) {
+      return "compiled scene has a sphere that isn't one of its objects";
+    }
+  }
+  for (int slot = 0; slot < scene->planes.count; slot += 1) {
+    if (scene->objects[scene->planes.objIndex[slot]].kind != 3) {
+      return "compiled scene has a plane that isn't one of its objects";
+    }
+  }
+
+  for (int sphereI = 0; sphereI < scene->prototypeSphereCount; sphereI += 1) {
+    PrototypeSphere *sphere = &scene->prototypeSpheres[sphereI];
+    if (sphere->material < 0 || sphere->material >= scene->materialCount || sphere->prototype < 0 ||
+        sphere->prototype >= scene->prototypeCount) {
+      return "compiled scene has a prototype sphere with a missing material or prototype";
+    }
+  }
+  for (int prototypeI = 0; prototypeI < scene->prototypeCount; prototypeI += 1) {
+    Prototype *proto = &scene->prototypes[prototypeI];
+    long last = (long) proto->first + proto->count;
+    if (proto->first < 0 || proto->count < 0 || last > scene->prototypeSphereCount ||
+        proto->count > scene->instanceStride || scene->prototypeBvh.primCount != scene->prototypeSphereCount ||
+        (proto->count > 0 && !tree_valid(&scene->prototypeBvh, proto->root, proto->first, last)) ||
+        !indices_within(scene->prototypeBvh.primIndices + proto->first, proto->count, proto->first, last)) {
+      return "compiled scene has a prototype outside its spheres or bvh";
+    }
+  }
+  for (int instanceI = 0; instanceI < scene->instanceCount; instanceI += 1) {
+    if (scene->instances[instanceI].prototype < 0 || scene->instances[instanceI].prototype >= scene->prototypeCount) {
+      return "compiled scene has an instance of a missing prototype";
+    }
+  }
+  if (scene->instanceBvh.primCount != scene->instanceCount ||
+      (scene->instanceBvh.nodeCount > 0 && !tree_valid(&scene->instanceBvh, 0, 0, scene->instanceCount)) ||
+      !indices_within(scene->instanceBvh.primIndices, scene->instanceBvh.primCount, 0, scene->instanceCount)) {
+    return "compiled scene has an instance bvh outside its instances";
+  }
+
+  // object numbers go objects, then instance spheres, then triangles
+  if (scene->instanceStride < 0 || scene->triangleBase < objectCount + (long) scene->instanceCount * scene->instanceStride ||
+      (long) scene->triangleBase + scene->triangleCount > INT_MAX) {
+    return "compiled scene has overlapping object numbers";
+  }
+  for (int meshI = 0; meshI < scene->meshCount; meshI += 1) {
+    Mesh *mesh = &scene->meshes[meshI];
+    long last = (long) mesh->firstTriangle + mesh->triangleCount;
+    if (mesh->firstTriangle < 0 || mesh->triangleCount < 0 || last > scene->triangleCount ||
+        (mesh->triangleCount > 0 && !tree_valid(&scene->meshBvh, mesh->root, mesh->firstTriangle, last)) ||
+        !indices_within(scene->triangles[mesh->firstTriangle], 3 * (long) mesh->triangleCount, 0,
+                        mesh->quantized ? scene->quantizedVertexCount : scene->vertexCount)) {
+      return "compiled scene has a mesh outside its triangles, vertices or bvh";
+    }
+  }
+
+  return NULL;
+}
+
+int load_bscene(char *fileName, Scene *scene, char *error, int errorSize) {
+  memset(scene, 0, sizeof(Scene));
+
+  int fd = open(fileName, O_RDONLY);
+  if (fd < 0) {
+    snprintf(error, errorSize, "%s: cannot open the compiled scene", fileName);
+    return -1;
+  }
+
+  struct stat info;
+  if (fstat(fd, &info) < 0) {
+    close(fd);
+    snprintf(error, errorSize, "%s: cannot read the compiled scene", fileName);
+    return -1;
+  }
+  size_t size = (size_t) info.st_size;
+  if (size < sizeof(BSceneHeader)) {
+    close(fd);
+    snprintf(error, errorSize, "%s: compiled scene is truncated", fileName);
+    return -1;
+  }
+
+  // private writable mapping, pages are shared with the page cache until
+  // something writes to them
+  char *base = (char *) mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED) {
+    snprintf(error, errorSize, "%s: cannot map the compiled scene", fileName);
+    return -1;
+  }
+
+  BSceneHeader *header = (BSceneHeader *) base;
+  const char *problem = NULL;
+  if (memcmp(header->magic, bsceneMagic, sizeof(bsceneMagic)) != 0) {
+    problem = "not a compiled scene";
+  }
+  else if (header->version != BSCENE_VERSION) {
+    problem = "compiled scene version is not supported, recompile it";
+  }
+  else if (header->byteOrder != 0x01020304 || header->objectSize != sizeof(Object) || header->lightSize != sizeof(Light) ||
+           header->nodeSize != sizeof(BVHNode) || header->instanceSize != sizeof(Instance) ||
+           header->prototypeSize != sizeof(Prototype) || header->meshSize != sizeof(Mesh) || header->kernelPadding != KERNEL_PADDING) {
+    problem = "compiled scene was written by a different build, recompile it";
+  }
+  for (int section = 0; section < SECTION_COUNT && problem == NULL; section += 1) {
+    Section *entry = &header->sections[section];
+    uint64_t count = entry->count + (section_padded(section) ? KERNEL_PADDING : 0);
+    if (entry->offset % BSCENE_ALIGN != 0 || entry->offset > size || entry->size > size - entry->offset ||
+        entry->count > INT_MAX || count * elementSizes[section] > entry->size) {
+      problem = "compiled scene is truncated";
+    }
+  }
+  if (problem != NULL) {
+    munmap(base, size);
+    snprintf(error, errorSize, "%s: %s", fileName, problem);
+    return -1;
+  }
+
+  Section *sections = header->sections;
+  scene->objects = (Object *) (base + sections[SECTION_OBJECTS].offset);
+  scene->objectCount = (int) sections[SECTION_OBJECTS].count;
+  scene->objectCapacity = scene->objectCount;
+  scene->lights = (Light *) (base + sections[SECTION_LIGHTS].offset);
+  scene->lightCount = (int) sections[SECTION_LIGHTS].count;
+
+  scene->extent = header->extent;
+  scene->bvh.nodes = (BVHNode *) (base + sections[SECTION_BVH_NODES].offset);
+  scene->bvh.nodeCount = (int) sections[SECTION_BVH_NODES].count;
+  scene->bvh.primIndices = (int *) (base + sections[SECTION_BVH_PRIMS].offset);
+  scene->bvh.primCount = (int) sections[SECTION_BVH_PRIMS].count;
+
+  scene->spheres.cx = (float *) (base + sections[SECTION_SPHERE_CX].offset);
+  scene->spheres.cy = (float *) (base + sections[SECTION_SPHERE_CY].offset);
+  scene->spheres.cz = (float *) (base + sections[SECTION_SPHERE_CZ].offset);
+  scene->spheres.r2 = (float *) (base + sections[SECTION_SPHERE_R2].offset);
+  scene->spheres.objIndex = (int *) (base + sections[SECTION_SPHERE_INDEX].offset);
+  scene->spheres.count = (int) sections[SECTION_SPHERE_CX].count;
+
+  scene->planes.nx = (float *) (base + sections[SECTION_PLANE_NX].offset);
+  scene->planes.ny = (float *) (base + sections[SECTION_PLANE_NY].offset);
+  scene->planes.nz = (float *) (base + sections[SECTION_PLANE_NZ].offset);
+  scene->planes.d = (float *) (base + sections[SECTION_PLANE_D].offset);
+  scene->planes.objIndex = (int *) (base + sections[SECTION_PLANE_INDEX].offset);
+  scene->planes.count = (int) sections[SECTION_PLANE_NX].count;
+
+  scene->materials = (Material *) (base + sections[SECTION_MATERIALS].offset);
+  scene->materialCount = (int) sections[SECTION_MATERIALS].count;
+  scene->prototypeSpheres = (PrototypeSphere *) (base + sections[SECTION_PROTOTYPE_SPHERES].offset);
+  scene->prototypeSphereCount = (int) sections[SECTION_PROTOTYPE_SPHERES].count;
+  scene->prototypes = (Prototype *) (base + sections[SECTION_PROTOTYPES].offset);
+  scene->prototypeCount = (int) sections[SECTION_PROTOTYPES].count;
+  scene->prototypeBvh.nodes = (BVHNode *) (base + sections[SECTION_PROTOTYPE_NODES].offset);
+  scene->prototypeBvh.nodeCount = (int) sections[SECTION_PROTOTYPE_NODES].count;
+  scene->prototypeBvh.primIndices = (int *) (base + sections[SECTION_PROTOTYPE_PRIMS].offset);
+  scene->prototypeBvh.primCount = (int) sections[SECTION_PROTOTYPE_PRIMS].count;
+  scene->instances = (Instance *) (base + sections[SECTION_INSTANCES].offset);
+  scene->instanceCount = (int) sections[SECTION_INSTANCES].count;
+  scene->instanceBvh.nodes = (BVHNode *) (base + sections[SECTION_INSTANCE_NODES].offset);
+  scene->instanceBvh.nodeCount = (int) sections[SECTION_INSTANCE_NODES].count;
+  scene->instanceBvh.primIndices = (int *) (base + sections[SECTION_INSTANCE_PRIMS].offset);
+  scene->instanceBvh.primCount = (int) sections[SECTION_INSTANCE_PRIMS].count;
+  scene->instanceStride = header->instanceStride;
+  scene->instanceMinRadius = header->instanceMinRadius;
+  scene->instanceMaxRadius = header->instanceMaxRadius;
+  scene->meshes = (Mesh *) (base + sections[SECTION_MESHES].offset);
+  scene->meshCount = (int) sections[SECTION_MESHES].count;
+  scene->vertices = (float (*)[3]) (base + sections[SECTION_VERTICES].offset);
+  scene->vertexCount = (int) sections[SECTION_VERTICES].count;
+  scene->quantizedVertices = (uint16_t (*)[3]) (base + sections[SECTION_QUANTIZED_VERTICES].offset);
+  scene->quantizedVertexCount = (int) sections[SECTION_QUANTIZED_VERTICES].count;
+  scene->triangles = (int (*)[3]) (base + sections[SECTION_TRIANGLES].offset);
+  scene->triangleCount = (int) sections[SECTION_TRIANGLES].count;
+  scene->triangleBase = header->triangleBase;
+  scene->meshBvh.nodes = (BVHNode *) (base + sections[SECTION_MESH_NODES].offset);
+  scene->meshBvh.nodeCount = (int) sections[SECTION_MESH_NODES].count;
+
+  scene->mapping = base;
+  scene->mappingSize = size;
+
+  // the kernel arrays of one kind all hold the same number of elements
+  for (int section = SECTION_SPHERE_CY; section <= SECTION_SPHERE_INDEX && problem == NULL; section += 1) {
+    problem = sections[section].count != sections[SECTION_SPHERE_CX].count ? "compiled scene is corrupt" : NULL;
+  }
+  for (int section = SECTION_PLANE_NY; section <= SECTION_PLANE_INDEX && problem == NULL; section += 1) {
+    problem = sections[section].count != sections[SECTION_PLANE_NX].count ? "compiled scene is corrupt" : NULL;
+  }
+  problem = problem == NULL ? scene_problem(scene) : problem;
+  if (problem != NULL) {
+    munmap(base, size);
+    memset(scene, 0, sizeof(Scene));
+    snprintf(error, errorSize, "%s: %s", fileName, problem);
+    return -1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,24 @@
+#ifndef BSCENE_H
+#define BSCENE_H
+
+#include "Raycaster.h"
+
+// compiled scene files (.bscene). the object, light, instancing, mesh, bvh
+// and kernel arrays are written exactly as they sit in memory, each section
+// aligned to BSCENE_ALIGN, so loading is one mmap plus pointing the scene at
+// the sections. the header records the layout it was written with and files from
+// a different build or machine are rejected instead of misread
+
+#define BSCENE_VERSION 4
+#define BSCENE_ALIGN 64
+
+// true if the file starts with the compiled scene magic
+int is_bscene(char *fileName);
+
+// writes a scene that has been through build_scene
+int write_bscene(Scene *scene, char *fileName, char *error, int errorSize);
+
+// maps a compiled scene, the scene owns the mapping until free_scene
+int load_bscene(char *fileName, Scene *scene, char *error, int errorSize);
+
+#endif
@@ -0,0 +1,358 @@
+#include <math.h>
+#include <stdlib.h>
+#include "bvh.h"
+
+#define BVH_BINS 12
+#define BVH_MAX_LEAF 4
+// past this depth splits are forced to halve the list, which keeps the tree
+// shallow enough for the fixed traversal stack in BVH_STACK_SIZE
+#define BVH_SAH_DEPTH 48
+
+// relative costs of visiting a node and testing one primitive
+#define BVH_TRAVERSE_COST 1.0f
+#define BVH_INTERSECT_COST 1.5f
+
+typedef struct BuildState {
+  int leafWidth;
+  int maxLeaf;
+  float (*boxMin)[3];
+  float (*boxMax)[3];
+  float (*centroid)[3];
+  int *primIndices;
+  BVHNode *nodes;
+  int nodeCount;
+} BuildState;
+
+typedef struct Bin {
+  float min[3];
+  float max[3];
+  int count;
+} Bin;
+
+static void box_reset(float *min, float *max) {
+  for (int axis = 0; axis < 3; axis += 1) {
+    min[axis] = INFINITY;
+    max[axis] = -INFINITY;
+  }
+}
+
+static void box_grow(float *min, float *max, float *otherMin, float *otherMax) {
+  for (int axis = 0; axis < 3; axis += 1) {
+    min[axis] = otherMin[axis] < min[axis] ? otherMin[axis] : min[axis];
+    max[axis] = otherMax[axis] > max[axis] ? otherMax[axis] : max[axis];
+  }
+}
+
+static float box_area(float *min, float *max) {
+  float dx = max[0] - min[0];
+  float dy = max[1] - min[1];
+  float dz = max[2] - min[2];
+
+  if (dx < 0 || dy < 0 || dz < 0) {
+    return 0;
+  }
+  return 2 * (dx * dy + dy * dz + dz * dx);
+}
+
+// leafWidth primitives are tested in one go, so a few primitives cost as
+// much as a full leaf
+static int kernel_calls(BuildState *state, int count) {
+  return (count + state->leafWidth - 1) / state->leafWidth;
+}
+
+// builds the subtree for primIndices[first .. first + count) and returns its node
+static int build_node(BuildState *state, int first, int count, int depth) {
+  int nodeIndex = state->nodeCount;
+  state->nodeCount += 1;
+  BVHNode *node = &state->nodes[nodeIndex];
+
+  box_reset(node->min, node->max);
+  float centMin[3], centMax[3];
+  box_reset(centMin, centMax);
+  for (int index = first; index < first + count; index += 1) {
+    int prim = state->primIndices[index];
+    box_grow(node->min, node->max, state->boxMin[prim], state->boxMax[prim]);
+    box_grow(centMin, centMax, state->centroid[prim], state->centroid[prim]);
+  }
+
+  node->first = first;
+  node->count = count;
+  if (count <= 1) {
+    return nodeIndex;
+  }
+
+  // find the cheapest binned split over all three axes
+  float bestCost = INFINITY;
+  int bestAxis = -1;
+  int bestSplit = 0;
+
+  for (int axis = 0; axis < 3 && depth < BVH_SAH_DEPTH; axis += 1) {
+    float extent = centMax[axis] - centMin[axis];
+    if (extent <= 0) {
+      continue;
+    }
+
+    Bin bins[BVH_BINS];
+    for (int bin = 0; bin < BVH_BINS; bin += 1) {
+      box_reset(bins[bin].min, bins[bin].max);
+      bins[bin].count = 0;
+    }
+
+    float scale = BVH_BINS / extent;
+    for (int index = first; index < first + count; index += 1) {
+      int prim = state->primIndices[index];
+      int bin = (int) ((state->centroid[prim][axis] - centMin[axis]) * scale);
+      bin = bin < BVH_BINS ? bin : BVH_BINS - 1;
+      bins[bin].count += 1;
+      box_grow(bins[bin].min, bins[bin].max, state->boxMin[prim], state->boxMax[prim]);
+    }
+
+    // sweep from the right to get the area and count of every right side
+    float rightArea[BVH_BINS];
+    int rightCount[BVH_BINS];
+    float min[3], max[3];
+    box_reset(min, max);
+    int running = 0;
+    for (int bin = BVH_BINS - 1; bin > 0; bin -= 1) {
+      box_grow(min, max, bins[bin].min, bins[bin].max);
+      running += bins[bin].count;
+      rightArea[bin] = box_area(min, max);
+      rightCount[bin] = running;
+    }
+
+    box_reset(min, max);
+    running = 0;
+    for (int bin = 0; bin < BVH_BINS - 1; bin += 1) {
+      box_grow(min, max, bins[bin].min, bins[bin].max);
+      running += bins[bin].count;
+      if (running == 0 || rightCount[bin + 1] == 0) {
+        continue;
+      }
+
+      // a child costs as much as the kernel calls its leaves need
+      float cost = box_area(min, max) * kernel_calls(state, running) +
+                   rightArea[bin + 1] * kernel_calls(state, rightCount[bin + 1]);
+      if (cost < bestCost) {
+        bestCost = cost;
+        bestAxis = axis;
+        bestSplit = bin + 1;
+      }
+    }
+  }
+
+  float parentArea = box_area(node->min, node->max);
+  float leafCost = BVH_INTERSECT_COST * kernel_calls(state, count);
+  float splitCost = parentArea > 0 ? BVH_TRAVERSE_COST + BVH_INTERSECT_COST * bestCost / parentArea : INFINITY;
+
+  int mid;
+  if (bestAxis >= 0 && (splitCost < leafCost || count > state->maxLeaf)) {
+    // partition around the chosen bin boundary
+    float scale = BVH_BINS / (centMax[bestAxis] - centMin[bestAxis]);
+    int left = first;
+    int right = first + count - 1;
+    while (left <= right) {
+      int prim = state->primIndices[left];
+      int bin = (int) ((state->centroid[prim][bestAxis] - centMin[bestAxis]) * scale);
+      bin = bin < BVH_BINS ? bin : BVH_BINS - 1;
+      if (bin < bestSplit) {
+        left += 1;
+      }
+      else {
+        state->primIndices[left] = state->primIndices[right];
+        state->primIndices[right] = prim;
+        right -= 1;
+      }
+    }
+    mid = left;
+  }
+  else if (count > state->maxLeaf) {
+    // all centroids coincide (or the tree got too deep), split the list in
+    // half so leaves stay small
+    mid = first + count / 2;
+  }
+  else {
+    return nodeIndex;
+  }
+
+  node->count = 0;
+  build_node(state, first, mid - first, depth + 1);
+  // the node array does not move during the build so node is still valid
+  node->first = build_node(state, mid, first + count - mid, depth + 1);
+
+  return nodeIndex;
+}
+
+void bvh_build(BVH *bvh, float (*boxMin)[3], float (*boxMax)[3], int count, int leafWidth) {
+  BuildState state;
+  state.leafWidth = leafWidth > 0 ? leafWidth : 1;
+  state.maxLeaf = state.leafWidth > BVH_MAX_LEAF ? state.leafWidth : BVH_MAX_LEAF;
+  state.boxMin = boxMin;
+  state.boxMax = boxMax;
+  state.centroid = (float (*)[3]) malloc((count > 0 ? count : 1) * sizeof(float[3]));
+  state.primIndices = (int *) malloc((count > 0 ? count : 1) * sizeof(int));
+  // a binary tree with count leaves never needs more than 2 * count - 1 nodes
+  state.nodes = (BVHNode *) malloc((count > 0 ? 2 * count : 1) * sizeof(BVHNode));
+  state.nodeCount = 0;
+
+  for (int prim = 0; prim < count; prim += 1) {
+    state.primIndices[prim] = prim;
+    for (int axis = 0; axis < 3; axis += 1) {
+      state.centroid[prim][axis] = 0.5f * (boxMin[prim][axis] + boxMax[prim][axis]);
+    }
+  }
+
+  if (count > 0) {
+    build_node(&state, 0, count, 0);
+  }
+
+  free(state.centroid);
+
+  bvh->nodes = state.nodes;
+  bvh->nodeCount = state.nodeCount;
+  bvh->primIndices = state.primIndices;
+  bvh->primCount = count;
+}
+
+void bvh_refit(BVH *bvh, float (*slotMin)[3], float (*slotMax)[3]) {
+  // children always come after their parent, so walking backwards visits
+  // both children before the node itself
+  for (int nodeIndex = bvh->nodeCount - 1; nodeIndex >= 0; nodeIndex -= 1) {
+    BVHNode *node = &bvh->nodes[nodeIndex];
+
+    box_reset(node->min, node->max);
+    if (node->count > 0) {
+      for (int slot = node->first; slot < node->first + node->count; slot += 1) {
+        box_grow(node->min, node->max, slotMin[slot], slotMax[slot]);
+      }
+    }
+    else {
+      BVHNode *left = &bvh->nodes[nodeIndex + 1];
+      BVHNode *right = &bvh->nodes[node->first];
+      box_grow(node->min, node->max, left->min, left->max);
+      box_grow(node->min, node->max, right->min, right->max);
+    }
+  }
+}
+
+float bvh_cost(BVH *bvh) {
+  if (bvh->nodeCount == 0) {
+    return 0;
+  }
+
+  float rootArea = box_area(bvh->nodes[0].min, bvh->nodes[0].max);
+  float cost = 0;
+  for (int nodeIndex = 0; nodeIndex < bvh->nodeCount; nodeIndex += 1) {
+    BVHNode *node = &bvh->nodes[nodeIndex];
+    float area = box_area(node->min, node->max);
+    cost += node->count > 0 ? area * node->count * BVH_INTERSECT_COST : area * BVH_TRAVERSE_COST;
+  }
+
+  return rootArea > 0 ? cost / rootArea : 0;
+}
+
+void bvh_free(BVH *bvh) {
+  free(bvh->nodes);
+  free(bvh->primIndices);
+  bvh->nodes = NULL;
+  bvh->primIndices = NULL;
+  bvh->nodeCount = 0;
+  bvh->primCount = 0;
+}
+
+int bvh_ray_box(BVHNode *node, float *R0, float *invRd, float maxT, float margin, float *entryT) {
+  float tNear = 0;
+  float tFar = maxT;
+
+  for (int axis = 0; axis < 3; axis += 1) {
+    float t0 = (node->min[axis] - margin - R0[axis]) * invRd[axis];
+    float t1 = (node->max[axis] + margin - R0[axis]) * invRd[axis];
+
+    // fminf/fmaxf drop the NaN from 0 * inf when the origin sits on a slab
+    tNear = fmaxf(tNear, fminf(t0, t1));
+    tFar = fminf(tFar, fmaxf(t0, t1));
+  }
+
+  *entryT = tNear;
+  return tNear <= tFar;
+}
+
+int bvh_walk(BVH *bvh, int root, float *maxT, BVHEnter enter, BVHLeaf leaf, void *query) {
+  int stack[BVH_STACK_SIZE];
+  float stackT[BVH_STACK_SIZE];
+  int stackSize = 0;
+  float entryT;
+
+  if (maxT == NULL) {
+    stack[0] = root;
+    stackSize = 1;
+    while (stackSize > 0) {
+      stackSize -= 1;
+      int nodeIndex = stack[stackSize];
+      BVHNode *node = &bvh->nodes[nodeIndex];
+      if (!enter(query, node, &entryT)) {
+        continue;
+      }
+
+      if (node->count > 0) {
+        if (leaf(query, node)) {
+          return 1;
+        }
+        continue;
+      }
+
+      stack[stackSize] = node->first;
+      stack[stackSize + 1] = nodeIndex + 1;
+      stackSize += 2;
+    }
+    return 0;
+  }
+
+  if (enter(query, &bvh->nodes[root], &entryT)) {
+    stack[0] = root;
+    stackT[0] = entryT;
+    stackSize = 1;
+  }
+
+  while (stackSize > 0) {
+    stackSize -= 1;
+    if (stackT[stackSize] > *maxT) {
+      continue;
+    }
+    BVHNode *node = &bvh->nodes[stack[stackSize]];
+
+    if (node->count > 0) {
+      if (leaf(query, node)) {
+        return 1;
+      }
+      continue;
+    }
+
+    int left = stack[stackSize] + 1;
+    int right = node->first;
+    float leftT, rightT;
+    int hitLeft = enter(query, &bvh->nodes[left], &leftT);
+    int hitRight = enter(query, &bvh->nodes[right], &rightT);
+
+    // push the farther child first so the nearer one is visited next
+    if (hitLeft && hitRight && leftT < rightT) {
+      stack[stackSize] = right;
+      stackT[stackSize] = rightT;
+      stack[stackSize + 1] = left;
+      stackT[stackSize + 1] = leftT;
+      stackSize += 2;
+    }
+    else {
+      if (hitLeft) {
+        stack[stackSize] = left;
+        stackT[stackSize] = leftT;
+        stackSize += 1;
+      }
+      if (hitRight) {
+        stack[stackSize] = right;
+        stackT[stackSize] = rightT;
+        stackSize += 1;
+      }
+    }
+  }
+  return 0;
+}
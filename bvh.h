@@ -0,0 +1,58 @@
+#ifndef BVH_H
+#define BVH_H
+
+// bounding volume hierarchy over a set of axis aligned boxes, built with the
+// surface area heuristic. the tree only knows about boxes, callers map the
+// leaf primitive indices back to whatever the boxes came from
+
+// deep enough for any tree bvh_build produces
+#define BVH_STACK_SIZE 128
+
+typedef struct BVHNode {
+  float min[3];
+  float max[3];
+  // leaf: primIndices[first .. first + count)
+  // interior: count is 0, left child is the next node, right child is first
+  int first;
+  int count;
+} BVHNode;
+
+typedef struct BVH {
+  BVHNode *nodes;
+  int nodeCount;
+  int *primIndices;
+  int primCount;
+} BVH;
+
+// leafWidth is how many primitives the caller tests in one go, leaves of up
+// to that many primitives cost the same as a leaf with one
+void bvh_build(BVH *bvh, float (*boxMin)[3], float (*boxMax)[3], int count, int leafWidth);
+void bvh_free(BVH *bvh);
+
+// recomputes every box from moved primitives, keeping the tree as it is.
+// slotMin and slotMax are in leaf order: slot i is the box of the primitive
+// at primIndices[i]
+void bvh_refit(BVH *bvh, float (*slotMin)[3], float (*slotMax)[3]);
+
+// surface area heuristic cost of traversing the tree, relative to its root.
+// a refitted tree gets more expensive as primitives move away from where the
+// tree was built for them
+float bvh_cost(BVH *bvh);
+
+// slab test, returns 1 and the entry distance if the ray hits the box grown by
+// margin on every side before maxT. invRd is 1 / Rd per component
+int bvh_ray_box(BVHNode *node, float *R0, float *invRd, float maxT, float margin, float *entryT);
+
+// a query walking the tree: enter says whether the walk goes into a node,
+// with the distance along the ray it is entered at for ray queries, and leaf
+// handles a leaf's primitives, returning 1 to end the walk
+typedef int (*BVHEnter)(void *query, BVHNode *node, float *entryT);
+typedef int (*BVHLeaf)(void *query, BVHNode *node);
+
+// walks the subtree at root. with maxT, the closest hit so far, nodes are
+// visited front to back and skipped once they start past it. without, any
+// order does, like for any hit and point queries, and nodes are visited in
+// tree order. returns 1 if a leaf ended the walk
+int bvh_walk(BVH *bvh, int root, float *maxT, BVHEnter enter, BVHLeaf leaf, void *query);
+
+#endif
@@ -0,0 +1,473 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "distribute.h"
+#include "imagewriter.h"
+
+// rows merged at once, the merge buffer holds two of these
+#define MERGE_BAND_ROWS 64
+// bands per worker process, so the faster workers pick up more of them
+#define BANDS_PER_PROCESS 4
+// tries per band before the render gives up
+#define BAND_ATTEMPTS 3
+
+typedef struct Tile {
+  char *fileName;
+  int frameWidth;
+  int frameHeight;
+  int x;
+  int y;
+  int width;
+  int height;
+  // where the pixels start in the file
+  long dataOffset;
+} Tile;
+
+typedef struct Band {
+  int firstRow;
+  int lastRow;
+  double cost;
+  int attempts;
+  pid_t pid;
+  double started;
+  double seconds;
+  char tileFile[PATH_MAX];
+  char logFile[PATH_MAX];
+} Band;
+
+// reads the header imagewriter's tile format starts with, and checks the file
+// holds all of the pixels it promises
+static int read_tile_header(Tile *tile, char *error, int errorSize) {
+  FILE *fh = fopen(tile->fileName, "rb");
+  if (fh == NULL) {
+    snprintf(error, errorSize, "cannot open %s", tile->fileName);
+    return -1;
+  }
+
+  int headerLength = 0;
+  int fields = fscanf(fh, "P6 # raytrace tile %d %d %d %d %d %d 255%n", &tile->frameWidth, &tile->frameHeight,
+                      &tile->x, &tile->y, &tile->width, &tile->height, &headerLength);
+  bool valid = fields == 6 && headerLength > 0 && fgetc(fh) == '\n' && tile->width > 0 && tile->height > 0 &&
+               tile->x >= 0 && tile->y >= 0 && tile->x + tile->width <= tile->frameWidth &&
+               tile->y + tile->height <= tile->frameHeight;
+  tile->dataOffset = headerLength + 1;
+  long expected = tile->dataOffset + (long) tile->width * tile->height * 3;
+  bool complete = valid && fseek(fh, 0, SEEK_END) == 0 && ftell(fh) == expected;
+  fclose(fh);
+
+  if (!valid) {
+    snprintf(error, errorSize, "%s is not a tile, render one with --region", tile->fileName);
+    return -1;
+  }
+  if (!complete) {
+    snprintf(error, errorSize, "%s is incomplete", tile->fileName);
+    return -1;
+  }
+  return 0;
+}
+
+static int compare_tiles(const void *a, const void *b) {
+  const Tile *left = (const Tile *) a;
+  const Tile *right = (const Tile *) b;
+
+  if (left->x != right->x) {
+    return (left->x > right->x) - (left->x < right->x);
+  }
+  return (left->y > right->y) - (left->y < right->y);
+}
+
+// every pixel has to be in exactly one tile. tiles are sorted by x, so on each
+// row the tiles crossing it have to follow one another without gaps
+static int check_coverage(Tile *tiles, int tileCount, char *error, int errorSize) {
+  int frameWidth = tiles[0].frameWidth;
+
+  for (int row = 0; row < tiles[0].frameHeight; row += 1) {
+    int nextX = 0;
+    for (int tileI = 0; tileI < tileCount; tileI += 1) {
+      Tile *tile = &tiles[tileI];
+      if (row < tile->y || row >= tile->y + tile->height) {
+        continue;
+      }
+      if (tile->x > nextX) {
+        break;
+      }
+      if (tile->x < nextX) {
+        snprintf(error, errorSize, "pixel %d,%d is in more than one tile, %s overlaps another", tile->x, row,
+                 tile->fileName);
+        return -1;
+      }
+      nextX = tile->x + tile->width;
+    }
+    if (nextX < frameWidth) {
+      snprintf(error, errorSize, "pixel %d,%d of the %dx%d frame is in none of the tiles", nextX, row, frameWidth,
+               tiles[0].frameHeight);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+// copies rows [firstRow, lastRow) of the tile that are in it into the ring buffer
+static int read_tile_rows(Tile *tile, int firstRow, int lastRow, uint8_t *image, int bufferRows,
+                          char *error, int errorSize) {
+  firstRow = firstRow > tile->y ? firstRow : tile->y;
+  lastRow = lastRow < tile->y + tile->height ? lastRow : tile->y + tile->height;
+  if (firstRow >= lastRow) {
+    return 0;
+  }
+
+  FILE *fh = fopen(tile->fileName, "rb");
+  bool read = fh != NULL && fseek(fh, tile->dataOffset + (long) (firstRow - tile->y) * tile->width * 3, SEEK_SET) == 0;
+  for (int row = firstRow; row < lastRow && read; row += 1) {
+    uint8_t *dst = image + ((long) (row % bufferRows) * tile->frameWidth + tile->x) * 3;
+    read = fread(dst, 3, tile->width, fh) == (size_t) tile->width;
+  }
+  if (fh != NULL) {
+    fclose(fh);
+  }
+
+  if (!read) {
+    snprintf(error, errorSize, "cannot read %s", tile->fileName);
+    return -1;
+  }
+  return 0;
+}
+
+int merge_tiles(char *outputFile, char **tileFiles, int tileCount, char *error, int errorSize) {
+  Tile *tiles = (Tile *) calloc(tileCount + 1, sizeof(Tile));
+  for (int tileI = 0; tileI < tileCount; tileI += 1) {
+    tiles[tileI].fileName = tileFiles[tileI];
+    if (read_tile_header(&tiles[tileI], error, errorSize) < 0) {
+      free(tiles);
+      return -1;
+    }
+    if (tiles[tileI].frameWidth != tiles[0].frameWidth || tiles[tileI].frameHeight != tiles[0].frameHeight) {
+      snprintf(error, errorSize, "%s is from a %dx%d frame, %s from a %dx%d one", tileFiles[tileI],
+               tiles[tileI].frameWidth, tiles[tileI].frameHeight, tileFiles[0], tiles[0].frameWidth,
+               tiles[0].frameHeight);
+      free(tiles);
+      return -1;
+    }
+  }
+
+  qsort(tiles, tileCount, sizeof(Tile), compare_tiles);
+  if (check_coverage(tiles, tileCount, error, errorSize) < 0) {
+    free(tiles);
+    return -1;
+  }
+
+  // a band is read while the writer encodes the one before it
+  int frameWidth = tiles[0].frameWidth;
+  int frameHeight = tiles[0].frameHeight;
+  int bufferRows = frameHeight < 2 * MERGE_BAND_ROWS ? frameHeight : 2 * MERGE_BAND_ROWS;
+  uint8_t *image = (uint8_t *) malloc((long) frameWidth * bufferRows * 3);
+  ImageWriter *writer = writer_open(outputFile, frameWidth, frameHeight, image, bufferRows, error, errorSize);
+  if (writer == NULL) {
+    free(image);
+    free(tiles);
+    return -1;
+  }
+
+  int result = 0;
+  for (int firstRow = 0; firstRow < frameHeight; firstRow += MERGE_BAND_ROWS) {
+    int lastRow = firstRow + MERGE_BAND_ROWS < frameHeight ? firstRow + MERGE_BAND_ROWS : frameHeight;
+    writer_wait(writer, firstRow - MERGE_BAND_ROWS);
+    for (int tileI = 0; tileI < tileCount && result == 0; tileI += 1) {
+      result = read_tile_rows(&tiles[tileI], firstRow, lastRow, image, bufferRows, error, errorSize);
+    }
+    // rows are handed over even after a failure, the writer has to finish
+    writer_rows_done(writer, firstRow, lastRow - firstRow);
+  }
+
+  WriterResult written;
+  char closeError[256];
+  if (writer_close(writer, &written, closeError, sizeof(closeError)) < 0 && result == 0) {
+    snprintf(error, errorSize, "%s", closeError);
+    result = -1;
+  }
+  if (result < 0) {
+    remove(outputFile);
+  }
+
+  free(image);
+  free(tiles);
+  return result;
+}
+
+// cuts the rows into bandCount bands, each ending about where the running
+// cost passes its share of the total. every band gets at least one row
+static void cut_bands(Band *bands, int bandCount, double *rowCosts, int pixelHeight) {
+  double total = 0;
+  for (int row = 0; row < pixelHeight; row += 1) {
+    total += rowCosts[row];
+  }
+
+  double sum = 0;
+  int row = 0;
+  for (int bandI = 0; bandI < bandCount; bandI += 1) {
+    Band *band = &bands[bandI];
+    double target = total * (bandI + 1) / bandCount;
+    int maxRow = pixelHeight - (bandCount - bandI - 1);
+    bool last = bandI == bandCount - 1;
+
+    band->firstRow = row;
+    band->cost = 0;
+    do {
+      sum += rowCosts[row];
+      band->cost += rowCosts[row];
+      row += 1;
+    } while (row < maxRow && (last || sum + rowCosts[row] / 2 < target));
+    band->lastRow = row;
+  }
+}
+
+static void start_band(Band *band, char *program, int pixelWidth, int pixelHeight, char *fileName,
+                       RenderOptions *options, int threads) {
+  char threadArg[16];
+  char packetArg[16];
+  char cutoffArg[32];
+  char budgetArg[32];
+  char regionArg[64];
+  char depthArg[16];
+  char rouletteArg[32];
+  char widthArg[16];
+  char heightArg[16];
+  snprintf(threadArg, sizeof(threadArg), "%d", threads);
+  snprintf(packetArg, sizeof(packetArg), "%d", options->packetSize);
+  snprintf(cutoffArg, sizeof(cutoffArg), "%.9g", options->lightCutoff);
+  snprintf(budgetArg, sizeof(budgetArg), "%.6f", options->memBudget / 1e6);
+  snprintf(regionArg, sizeof(regionArg), "0,%d,%d,%d", band->firstRow, pixelWidth, band->lastRow);
+  snprintf(depthArg, sizeof(depthArg), "%d", options->maxDepth);
+  snprintf(rouletteArg, sizeof(rouletteArg), "%.9g", options->roulette);
+  snprintf(widthArg, sizeof(widthArg), "%d", pixelWidth);
+  snprintf(heightArg, sizeof(heightArg), "%d", pixelHeight);
+
+  char *args[28];
+  int argCount = 0;
+  args[argCount++] = program;
+  args[argCount++] = "--threads";
+  args[argCount++] = threadArg;
+  args[argCount++] = "--simd";
+  args[argCount++] = options->simd;
+  args[argCount++] = "--packet";
+  args[argCount++] = packetArg;
+  args[argCount++] = "--light-cutoff";
+  args[argCount++] = cutoffArg;
+  args[argCount++] = "--max-depth";
+  args[argCount++] = depthArg;
+  args[argCount++] = "--roulette";
+  args[argCount++] = rouletteArg;
+  if (options->wavefront) {
+    args[argCount++] = "--wavefront";
+  }
+  if (options->memBudget > 0) {
+    args[argCount++] = "--mem-budget";
+    args[argCount++] = budgetArg;
+  }
+  args[argCount++] = "--region";
+  args[argCount++] = regionArg;
+  args[argCount++] = widthArg;
+  args[argCount++] = heightArg;
+  args[argCount++] = fileName;
+  args[argCount++] = band->tileFile;
+  args[argCount] = NULL;
+
+  band->attempts += 1;
+  band->started = wallSeconds();
+  fflush(stdout);
+  band->pid = fork();
+  if (band->pid < 0) {
+    printf("Error: cannot start a worker process.\n");
+    exit(1);
+  }
+  if (band->pid == 0) {
+    // the worker's own report goes to its log
+    int log = open(band->logFile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (log >= 0) {
+      dup2(log, STDOUT_FILENO);
+      dup2(log, STDERR_FILENO);
+      close(log);
+    }
+    execv(program, args);
+    printf("Error: cannot run %s.\n", program);
+    _exit(127);
+  }
+}
+
+// last line of a worker's log, which says what went wrong when it failed
+static void last_log_line(char *logFile, char *line, int lineSize) {
+  snprintf(line, lineSize, "no output");
+  FILE *fh = fopen(logFile, "r");
+  if (fh == NULL) {
+    return;
+  }
+
+  char buffer[512];
+  while (fgets(buffer, sizeof(buffer), fh) != NULL) {
+    buffer[strcspn(buffer, "\n")] = '\0';
+    if (buffer[0] != '\0') {
+      snprintf(line, lineSize, "%s", buffer);
+    }
+  }
+  fclose(fh);
+}
+
+static void describe_status(int status, char *text, int textSize) {
+  if (WIFSIGNALED(status)) {
+    snprintf(text, textSize, "killed by signal %d", WTERMSIG(status));
+  }
+  else {
+    snprintf(text, textSize, "exit status %d", WEXITSTATUS(status));
+  }
+}
+
+void render_distributed(int pixelWidth, int pixelHeight, char *fileName, char *outputFile, RenderOptions *options,
+                        int processes, char *argv0) {
+  double wallStart = wallSeconds();
+
+  // the workers are this same executable
+  char program[PATH_MAX];
+  ssize_t length = readlink("/proc/self/exe", program, sizeof(program) - 1);
+  if (length > 0) {
+    program[length] = '\0';
+  }
+  else {
+    snprintf(program, sizeof(program), "%s", argv0);
+  }
+
+  double *rowCosts = (double *) malloc(pixelHeight * sizeof(double));
+  estimate_row_costs(pixelWidth, pixelHeight, fileName, options, rowCosts);
+  double estimateSeconds = wallSeconds() - wallStart;
+
+  int bandCount = processes * BANDS_PER_PROCESS < pixelHeight ? processes * BANDS_PER_PROCESS : pixelHeight;
+  Band *bands = (Band *) calloc(bandCount, sizeof(Band));
+  cut_bands(bands, bandCount, rowCosts, pixelHeight);
+  free(rowCosts);
+
+  char tileDir[PATH_MAX];
+  snprintf(tileDir, sizeof(tileDir), "%s.tiles.XXXXXX", outputFile);
+  if (mkdtemp(tileDir) == NULL) {
+    printf("Error: cannot create a directory for the tiles next to %s.\n", outputFile);
+    exit(1);
+  }
+  for (int bandI = 0; bandI < bandCount; bandI += 1) {
+    int tileLength = snprintf(bands[bandI].tileFile, PATH_MAX, "%s/band%04d.ppm", tileDir, bandI);
+    int logLength = snprintf(bands[bandI].logFile, PATH_MAX, "%s/band%04d.log", tileDir, bandI);
+    if (tileLength >= PATH_MAX || logLength >= PATH_MAX) {
+      printf("Error: the tile directory %s is too long a path.\n", tileDir);
+      rmdir(tileDir);
+      exit(1);
+    }
+  }
+
+  // the most expensive bands go first so none of them is left for the end.
+  // failed bands go to the back of the queue
+  int *queue = (int *) malloc(bandCount * BAND_ATTEMPTS * sizeof(int));
+  for (int bandI = 0; bandI < bandCount; bandI += 1) {
+    int pos = bandI;
+    for (; pos > 0 && bands[queue[pos - 1]].cost < bands[bandI].cost; pos -= 1) {
+      queue[pos] = queue[pos - 1];
+    }
+    queue[pos] = bandI;
+  }
+
+  int threads = options->threads / processes > 1 ? options->threads / processes : 1;
+  int queued = bandCount;
+  int next = 0;
+  int running = 0;
+  int retries = 0;
+  while (next < queued || running > 0) {
+    while (running < processes && next < queued) {
+      start_band(&bands[queue[next]], program, pixelWidth, pixelHeight, fileName, options, threads);
+      next += 1;
+      running += 1;
+    }
+
+    int status;
+    pid_t pid = waitpid(-1, &status, 0);
+    if (pid < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      printf("Error: lost track of the worker processes.\n");
+      exit(1);
+    }
+
+    int bandI = 0;
+    while (bandI < bandCount && bands[bandI].pid != pid) {
+      bandI += 1;
+    }
+    if (bandI == bandCount) {
+      continue;
+    }
+    Band *band = &bands[bandI];
+    band->pid = 0;
+    running -= 1;
+
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+      band->seconds = wallSeconds() - band->started;
+      continue;
+    }
+
+    char reason[64];
+    char lastLine[512];
+    describe_status(status, reason, sizeof(reason));
+    last_log_line(band->logFile, lastLine, sizeof(lastLine));
+    printf("Band of rows %d to %d failed, %s: %s\n", band->firstRow, band->lastRow, reason, lastLine);
+
+    if (band->attempts >= BAND_ATTEMPTS) {
+      for (int otherI = 0; otherI < bandCount; otherI += 1) {
+        if (bands[otherI].pid > 0) {
+          kill(bands[otherI].pid, SIGTERM);
+          waitpid(bands[otherI].pid, NULL, 0);
+        }
+      }
+      printf("Error: rows %d to %d failed %d times, the tiles and worker logs are in %s.\n", band->firstRow,
+             band->lastRow, band->attempts, tileDir);
+      exit(1);
+    }
+    queue[queued] = bandI;
+    queued += 1;
+    retries += 1;
+  }
+  double renderSeconds = wallSeconds() - wallStart - estimateSeconds;
+
+  double mergeStart = wallSeconds();
+  char **tileFiles = (char **) malloc(bandCount * sizeof(char *));
+  for (int bandI = 0; bandI < bandCount; bandI += 1) {
+    tileFiles[bandI] = bands[bandI].tileFile;
+  }
+  char error[256];
+  if (merge_tiles(outputFile, tileFiles, bandCount, error, sizeof(error)) < 0) {
+    printf("Error: %s, the tiles are in %s.\n", error, tileDir);
+    exit(1);
+  }
+  double mergeSeconds = wallSeconds() - mergeStart;
+
+  double fastest = bands[0].seconds;
+  double slowest = bands[0].seconds;
+  for (int bandI = 0; bandI < bandCount; bandI += 1) {
+    remove(bands[bandI].tileFile);
+    remove(bands[bandI].logFile);
+    fastest = bands[bandI].seconds < fastest ? bands[bandI].seconds : fastest;
+    slowest = bands[bandI].seconds > slowest ? bands[bandI].seconds : slowest;
+  }
+  rmdir(tileDir);
+
+  printf("Rendered %dx%d in %d bands on %d processes of %d threads, %d bands retried\n", pixelWidth, pixelHeight,
+         bandCount, processes, threads, retries);
+  printf("Wall %.3f s: cost estimate %.3f s, render %.3f s with bands taking %.3f to %.3f s, merge %.3f s\n",
+         wallSeconds() - wallStart, estimateSeconds, renderSeconds, fastest, slowest, mergeSeconds);
+
+  free(tileFiles);
+  free(queue);
+  free(bands);
+}
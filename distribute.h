@@ -0,0 +1,24 @@
+#ifndef DISTRIBUTE_H
+#define DISTRIBUTE_H
+
+#include "Raycaster.h"
+
+// one frame split over several processes, or machines sharing a filesystem.
+// each process renders a region of the frame with --region into a tile file,
+// and merge_tiles puts the tiles back together. a region's pixels are exactly
+// the ones a render of the whole frame has, so the merged image is identical
+// to a single process render
+
+// assembles tile files into outputFile, whose extension picks the format. the
+// tiles have to come from the same frame and cover every pixel of it once.
+// returns 0 on success, or -1 with a message in error
+int merge_tiles(char *outputFile, char **tileFiles, int tileCount, char *error, int errorSize);
+
+// renders the image on processes worker processes running program, this
+// executable, with argv0 as the fallback when it can't be found. the frame is
+// cut into bands of rows of about even estimated cost, the most expensive
+// first, and a band whose worker fails is handed out again
+void render_distributed(int pixelWidth, int pixelHeight, char *fileName, char *outputFile, RenderOptions *options,
+                        int processes, char *argv0);
+
+#endif
@@ -0,0 +1,175 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "gbuffer.h"
+
+static const char gbufferMagic[8] = {'R', 'T', 'G', 'B', 'U', 'F', 'F', '\0'};
+
+typedef struct GBufferHeader {
+  char magic[8];
+  uint32_t version;
+  // catches files written on a machine with the other byte order
+  uint32_t byteOrder;
+  uint32_t hitSize;
+  int32_t width;
+  int32_t height;
+  int32_t maxDepth;
+  float roulette;
+  uint32_t pad;
+  uint64_t sceneHash;
+  // followed by width * height surface counts and then hitCount hits
+  uint64_t hitCount;
+} GBufferHeader;
+
+static uint64_t hash_bytes(uint64_t hash, void *data, size_t size) {
+  unsigned char *bytes = (unsigned char *) data;
+
+  for (size_t index = 0; index < size; index += 1) {
+    hash = (hash ^ bytes[index]) * 0x100000001b3ull;
+  }
+  return hash;
+}
+
+uint64_t gbuffer_scene_hash(Scene *scene) {
+  uint64_t hash = 0xcbf29ce484222325ull;
+
+  hash = hash_bytes(hash, scene->objects, (size_t) scene->objectCount * sizeof(Object));
+  hash = hash_bytes(hash, scene->materials, (size_t) scene->materialCount * sizeof(Material));
+  hash = hash_bytes(hash, scene->prototypeSpheres, (size_t) scene->prototypeSphereCount * sizeof(PrototypeSphere));
+  hash = hash_bytes(hash, scene->instances, (size_t) scene->instanceCount * sizeof(Instance));
+  hash = hash_bytes(hash, scene->meshes, (size_t) scene->meshCount * sizeof(Mesh));
+  hash = hash_bytes(hash, scene->vertices, (size_t) scene->vertexCount * sizeof(float[3]));
+  hash = hash_bytes(hash, scene->quantizedVertices, (size_t) scene->quantizedVertexCount * sizeof(uint16_t[3]));
+  hash = hash_bytes(hash, scene->triangles, (size_t) scene->triangleCount * sizeof(int[3]));
+  return hash;
+}
+
+GBuffer *gbuffer_create(int width, int height, int maxDepth, float roulette, uint64_t sceneHash) {
+  GBuffer *gbuffer = (GBuffer *) calloc(1, sizeof(GBuffer));
+  long pixels = (long) width * height;
+
+  gbuffer->width = width;
+  gbuffer->height = height;
+  gbuffer->maxDepth = maxDepth;
+  gbuffer->roulette = roulette;
+  gbuffer->sceneHash = sceneHash;
+  // every pixel gets maxDepth slots while recording, since threads finish
+  // pixels in any order
+  gbuffer->depth = (uint8_t *) calloc(pixels + 1, sizeof(uint8_t));
+  gbuffer->first = (long *) malloc((pixels + 1) * sizeof(long));
+  gbuffer->hitCount = pixels * maxDepth;
+  gbuffer->hits = (GBufferHit *) malloc((gbuffer->hitCount + 1) * sizeof(GBufferHit));
+  for (long pixel = 0; pixel < pixels; pixel += 1) {
+    gbuffer->first[pixel] = pixel * maxDepth;
+  }
+
+  return gbuffer;
+}
+
+int gbuffer_write(GBuffer *gbuffer, char *fileName, char *error, int errorSize) {
+  long pixels = (long) gbuffer->width * gbuffer->height;
+
+  GBufferHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, gbufferMagic, sizeof(gbufferMagic));
+  header.version = GBUFFER_VERSION;
+  header.byteOrder = 0x01020304;
+  header.hitSize = sizeof(GBufferHit);
+  header.width = gbuffer->width;
+  header.height = gbuffer->height;
+  header.maxDepth = gbuffer->maxDepth;
+  header.roulette = gbuffer->roulette;
+  header.sceneHash = gbuffer->sceneHash;
+  for (long pixel = 0; pixel < pixels; pixel += 1) {
+    header.hitCount += gbuffer->depth[pixel];
+  }
+
+  FILE *fh = fopen(fileName, "wb");
+  if (fh == NULL) {
+    snprintf(error, errorSize, "%s: cannot create the g-buffer", fileName);
+    return -1;
+  }
+
+  int ok = fwrite(&header, sizeof(header), 1, fh) == 1;
+  ok = ok && fwrite(gbuffer->depth, 1, pixels, fh) == (size_t) pixels;
+  for (long pixel = 0; pixel < pixels && ok; pixel += 1) {
+    int depth = gbuffer->depth[pixel];
+    ok = depth == 0 || fwrite(&gbuffer->hits[gbuffer->first[pixel]], sizeof(GBufferHit), depth, fh) == (size_t) depth;
+  }
+  ok = fclose(fh) == 0 && ok;
+
+  if (!ok) {
+    snprintf(error, errorSize, "%s: failed writing the g-buffer", fileName);
+    return -1;
+  }
+  return 0;
+}
+
+GBuffer *gbuffer_load(char *fileName, char *error, int errorSize) {
+  FILE *fh = fopen(fileName, "rb");
+  if (fh == NULL) {
+    snprintf(error, errorSize, "%s: cannot open the g-buffer", fileName);
+    return NULL;
+  }
+
+  GBufferHeader header;
+  const char *problem = NULL;
+  if (fread(&header, sizeof(header), 1, fh) != 1 || memcmp(header.magic, gbufferMagic, sizeof(gbufferMagic)) != 0) {
+    problem = "not a g-buffer";
+  }
+  else if (header.version != GBUFFER_VERSION) {
+    problem = "g-buffer version is not supported, record it again";
+  }
+  else if (header.byteOrder != 0x01020304 || header.hitSize != sizeof(GBufferHit)) {
+    problem = "g-buffer was written by a different build, record it again";
+  }
+  else if (header.width < 1 || header.height < 1 || header.maxDepth < 1 || header.maxDepth > MAX_DEPTH ||
+           header.hitCount > (uint64_t) header.width * header.height * header.maxDepth) {
+    problem = "g-buffer header is corrupt";
+  }
+  if (problem != NULL) {
+    fclose(fh);
+    snprintf(error, errorSize, "%s: %s", fileName, problem);
+    return NULL;
+  }
+
+  GBuffer *gbuffer = (GBuffer *) calloc(1, sizeof(GBuffer));
+  long pixels = (long) header.width * header.height;
+  gbuffer->width = header.width;
+  gbuffer->height = header.height;
+  gbuffer->maxDepth = header.maxDepth;
+  gbuffer->roulette = header.roulette;
+  gbuffer->sceneHash = header.sceneHash;
+  gbuffer->hitCount = (long) header.hitCount;
+  gbuffer->depth = (uint8_t *) malloc(pixels + 1);
+  gbuffer->first = (long *) malloc((pixels + 1) * sizeof(long));
+  gbuffer->hits = (GBufferHit *) malloc((gbuffer->hitCount + 1) * sizeof(GBufferHit));
+
+  int ok = fread(gbuffer->depth, 1, pixels, fh) == (size_t) pixels &&
+           fread(gbuffer->hits, sizeof(GBufferHit), gbuffer->hitCount, fh) == (size_t) gbuffer->hitCount;
+  fclose(fh);
+
+  long first = 0;
+  for (long pixel = 0; pixel < pixels && ok; pixel += 1) {
+    gbuffer->first[pixel] = first;
+    first += gbuffer->depth[pixel];
+    ok = gbuffer->depth[pixel] <= gbuffer->maxDepth;
+  }
+  if (!ok || first != gbuffer->hitCount) {
+    gbuffer_free(gbuffer);
+    snprintf(error, errorSize, "%s: g-buffer is truncated", fileName);
+    return NULL;
+  }
+
+  return gbuffer;
+}
+
+void gbuffer_free(GBuffer *gbuffer) {
+  if (gbuffer == NULL) {
+    return;
+  }
+  free(gbuffer->depth);
+  free(gbuffer->first);
+  free(gbuffer->hits);
+  free(gbuffer);
+}
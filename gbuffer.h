@@ -0,0 +1,49 @@
+#ifndef GBUFFER_H
+#define GBUFFER_H
+
+#include <stdint.h>
+#include "Raycaster.h"
+
+// g-buffer files (.gbuf) for relighting. a render with --gbuffer records every
+// surface each pixel's path went through: the primary hit and the hits of its
+// reflection chain, followed to the depth limit. a render with --relight
+// shades those surfaces again with the lights of an edited scene instead of
+// tracing the paths, so only shadow rays are traced. the geometry, materials
+// and camera have to stay the same, the file keeps a hash of the objects and
+// instances to check that
+
+#define GBUFFER_VERSION 1
+
+typedef struct GBuffer {
+  int width;
+  int height;
+  // the path settings the surfaces were recorded with
+  int maxDepth;
+  float roulette;
+  // fnv-1a hash of the scene's objects, camera included, its instancing and
+  // its meshes
+  uint64_t sceneHash;
+
+  // surfaces recorded for each pixel, row by row, and the index of its first
+  // one in hits. a pixel's surfaces are in path order, from the primary hit
+  uint8_t *depth;
+  long *first;
+  GBufferHit *hits;
+  long hitCount;
+} GBuffer;
+
+uint64_t gbuffer_scene_hash(Scene *scene);
+
+// an empty g-buffer with room for maxDepth surfaces per pixel, for recording
+GBuffer *gbuffer_create(int width, int height, int maxDepth, float roulette, uint64_t sceneHash);
+
+// writes the recorded surfaces, only as many per pixel as it has. returns 0 on
+// success, or -1 with a message in error
+int gbuffer_write(GBuffer *gbuffer, char *fileName, char *error, int errorSize);
+
+// reads a g-buffer file, NULL with a message in error when it can't
+GBuffer *gbuffer_load(char *fileName, char *error, int errorSize);
+
+void gbuffer_free(GBuffer *gbuffer);
+
+#endif
@@ -0,0 +1,778 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include "imagewriter.h"
+
+#define FORMAT_PPM 0
+#define FORMAT_QOI 1
+#define FORMAT_PNG 2
+// a ppm of one region of a bigger frame, with the region in a header comment
+#define FORMAT_TILE 3
+
+// deflate back references reach this far, and matches are this long at most
+#define DEFLATE_WINDOW 32768
+#define DEFLATE_MIN_MATCH 4
+#define DEFLATE_MAX_MATCH 258
+#define DEFLATE_HASH_BITS 15
+
+// compressed png data is written in idat chunks of about this size
+#define PNG_CHUNK_BYTES 65536
+// filtered rows are compressed in deflate blocks of this size, so the file
+// doesn't depend on how the rows were split up when they were handed over
+#define PNG_BLOCK_BYTES 131072
+
+// the fastest deflate there is short of storing: one greedy match attempt per
+// position against the last position with the same 4 bytes, coded with the
+// fixed huffman tables so no code tables have to be built or sent. this is
+// what zlib's level 1 amounts to for images, without the dependency
+typedef struct Deflate {
+  // filtered bytes, the last DEFLATE_WINDOW of history followed by new data.
+  // base is the stream position of buffer[0]
+  uint8_t *buffer;
+  long bufferUsed;
+  long bufferCapacity;
+  long base;
+
+  // stream position of the last place each hash of 4 bytes was seen, -1 for none
+  long *head;
+
+  // bits not yet making up a whole byte, and the finished bytes
+  uint64_t bits;
+  int bitCount;
+  uint8_t *out;
+  long outUsed;
+  long outCapacity;
+
+  uint32_t adlerA;
+  uint32_t adlerB;
+
+  // fixed huffman codes, bit reversed since deflate sends them msb first
+  uint16_t litCode[288];
+  uint8_t litLength[288];
+  uint8_t distCode[30];
+  // length and distance to their symbols
+  uint8_t lengthSymbol[DEFLATE_MAX_MATCH + 1];
+  uint8_t distSymbol[DEFLATE_WINDOW + 1];
+} Deflate;
+
+struct ImageWriter {
+  FILE *fh;
+  int format;
+  int width;
+  int height;
+  uint8_t *image;
+  int bufferRows;
+  // tiles only, the frame and the region's top left corner in it
+  int frameWidth;
+  int frameHeight;
+  int tileX;
+  int tileY;
+
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t ready;
+  pthread_cond_t written;
+  // rows handed over, and how many rows from the top are all handed over
+  bool *rowDone;
+  int readyRows;
+  // rows from the top that are written, only changed by the writer thread
+  int writtenRows;
+
+  // writer thread only
+  bool failed;
+  long bytes;
+  double encodeSeconds;
+
+  // qoi state carried from row to row, rgba like the decoder keeps it
+  uint8_t qoiIndex[64][4];
+  uint8_t qoiPrev[4];
+  int qoiRun;
+
+  // png filter scratch, filter byte plus row for each of the candidate filters,
+  // and a copy of the last row written since its slot may be reused by then
+  uint8_t *pngRows;
+  uint8_t *pngAbove;
+  // filtered rows waiting for a whole block
+  uint8_t *pending;
+  long pendingUsed;
+  Deflate *deflate;
+};
+
+static const uint16_t lengthBase[29] = {
+  3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+static const uint8_t lengthExtra[29] = {
+  0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+static const uint16_t distBase[30] = {
+  1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073,
+  4097, 6145, 8193, 12289, 16385, 24577
+};
+static const uint8_t distExtra[30] = {
+  0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+
+// cpu time of the calling thread, so render threads sharing the cores don't
+// count towards the encode time
+static double seconds_now(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static void emit(ImageWriter *writer, const void *data, long size) {
+  if (size > 0 && fwrite(data, 1, size, writer->fh) != (size_t) size) {
+    writer->failed = true;
+  }
+  writer->bytes += size;
+}
+
+static void put_be32(uint8_t *at, uint32_t value) {
+  at[0] = (uint8_t) (value >> 24);
+  at[1] = (uint8_t) (value >> 16);
+  at[2] = (uint8_t) (value >> 8);
+  at[3] = (uint8_t) value;
+}
+
+static uint8_t *image_row(ImageWriter *writer, int row) {
+  return writer->image + (long) (row % writer->bufferRows) * writer->width * 3;
+}
+
+// ppm
+
+static void ppm_rows(ImageWriter *writer, int firstRow, int lastRow) {
+  emit(writer, image_row(writer, firstRow), (long) (lastRow - firstRow) * writer->width * 3);
+}
+
+// qoi, see qoiformat.org
+
+static void qoi_rows(ImageWriter *writer, int firstRow, int lastRow) {
+  long pixelCount = (long) (lastRow - firstRow) * writer->width;
+  uint8_t *pixels = image_row(writer, firstRow);
+  // every pixel takes at most 4 bytes
+  uint8_t *out = (uint8_t *) malloc(pixelCount * 4 + 1);
+  long used = 0;
+
+  for (long pixel = 0; pixel < pixelCount; pixel += 1) {
+    uint8_t rgb[4] = {pixels[pixel * 3], pixels[pixel * 3 + 1], pixels[pixel * 3 + 2], 255};
+
+    if (memcmp(rgb, writer->qoiPrev, 4) == 0) {
+      writer->qoiRun += 1;
+      if (writer->qoiRun == 62) {
+        out[used++] = 0xc0 | (writer->qoiRun - 1);
+        writer->qoiRun = 0;
+      }
+      continue;
+    }
+    if (writer->qoiRun > 0) {
+      out[used++] = 0xc0 | (writer->qoiRun - 1);
+      writer->qoiRun = 0;
+    }
+
+    int slot = (rgb[0] * 3 + rgb[1] * 5 + rgb[2] * 7 + rgb[3] * 11) % 64;
+    if (memcmp(writer->qoiIndex[slot], rgb, 4) == 0) {
+      out[used++] = slot;
+    }
+    else {
+      memcpy(writer->qoiIndex[slot], rgb, 4);
+
+      signed char dr = (signed char) (rgb[0] - writer->qoiPrev[0]);
+      signed char dg = (signed char) (rgb[1] - writer->qoiPrev[1]);
+      signed char db = (signed char) (rgb[2] - writer->qoiPrev[2]);
+      signed char drg = (signed char) (dr - dg);
+      signed char dbg = (signed char) (db - dg);
+
+      if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1) {
+        out[used++] = 0x40 | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2);
+      }
+      else if (dg >= -32 && dg <= 31 && drg >= -8 && drg <= 7 && dbg >= -8 && dbg <= 7) {
+        out[used++] = 0x80 | (dg + 32);
+        out[used++] = (drg + 8) << 4 | (dbg + 8);
+      }
+      else {
+        out[used++] = 0xfe;
+        out[used++] = rgb[0];
+        out[used++] = rgb[1];
+        out[used++] = rgb[2];
+      }
+    }
+    memcpy(writer->qoiPrev, rgb, 4);
+  }
+
+  emit(writer, out, used);
+  free(out);
+}
+
+static void qoi_start(ImageWriter *writer) {
+  uint8_t header[14] = {'q', 'o', 'i', 'f'};
+  put_be32(header + 4, writer->width);
+  put_be32(header + 8, writer->height);
+  header[12] = 3;
+  header[13] = 0;
+  emit(writer, header, sizeof(header));
+
+  // the image is opaque, every pixel has an alpha of 255
+  memset(writer->qoiIndex, 0, sizeof(writer->qoiIndex));
+  memset(writer->qoiPrev, 0, sizeof(writer->qoiPrev));
+  writer->qoiPrev[3] = 255;
+  writer->qoiRun = 0;
+}
+
+static void qoi_finish(ImageWriter *writer) {
+  if (writer->qoiRun > 0) {
+    uint8_t run = 0xc0 | (writer->qoiRun - 1);
+    emit(writer, &run, 1);
+  }
+
+  static const uint8_t end[8] = {0, 0, 0, 0, 0, 0, 0, 1};
+  emit(writer, end, sizeof(end));
+}
+
+// deflate
+
+static uint32_t reverse_bits(uint32_t code, int length) {
+  uint32_t reversed = 0;
+  for (int bit = 0; bit < length; bit += 1) {
+    reversed = (reversed << 1) | ((code >> bit) & 1);
+  }
+  return reversed;
+}
+
+static Deflate *deflate_create(void) {
+  Deflate *deflate = (Deflate *) calloc(1, sizeof(Deflate));
+  deflate->head = (long *) malloc((1 << DEFLATE_HASH_BITS) * sizeof(long));
+  for (int hash = 0; hash < (1 << DEFLATE_HASH_BITS); hash += 1) {
+    deflate->head[hash] = -1;
+  }
+  deflate->adlerA = 1;
+
+  // the fixed literal/length code of rfc 1951 3.2.6
+  for (int symbol = 0; symbol < 288; symbol += 1) {
+    uint32_t code;
+    int length;
+    if (symbol < 144) {
+      code = 0x30 + symbol;
+      length = 8;
+    }
+    else if (symbol < 256) {
+      code = 0x190 + symbol - 144;
+      length = 9;
+    }
+    else if (symbol < 280) {
+      code = symbol - 256;
+      length = 7;
+    }
+    else {
+      code = 0xc0 + symbol - 280;
+      length = 8;
+    }
+    deflate->litCode[symbol] = (uint16_t) reverse_bits(code, length);
+    deflate->litLength[symbol] = (uint8_t) length;
+  }
+  for (int symbol = 0; symbol < 30; symbol += 1) {
+    deflate->distCode[symbol] = (uint8_t) reverse_bits(symbol, 5);
+  }
+
+  for (int symbol = 0; symbol < 29; symbol += 1) {
+    int last = symbol < 28 ? lengthBase[symbol + 1] : DEFLATE_MAX_MATCH + 1;
+    for (int length = lengthBase[symbol]; length < last; length += 1) {
+      deflate->lengthSymbol[length] = (uint8_t) symbol;
+    }
+  }
+  for (int symbol = 0; symbol < 30; symbol += 1) {
+    int last = symbol < 29 ? distBase[symbol + 1] : DEFLATE_WINDOW + 1;
+    for (int dist = distBase[symbol]; dist < last; dist += 1) {
+      deflate->distSymbol[dist] = (uint8_t) symbol;
+    }
+  }
+
+  return deflate;
+}
+
+static void deflate_free(Deflate *deflate) {
+  free(deflate->buffer);
+  free(deflate->head);
+  free(deflate->out);
+  free(deflate);
+}
+
+static inline void put_bits(Deflate *deflate, uint32_t value, int count) {
+  deflate->bits |= (uint64_t) value << deflate->bitCount;
+  deflate->bitCount += count;
+  while (deflate->bitCount >= 8) {
+    deflate->out[deflate->outUsed++] = (uint8_t) deflate->bits;
+    deflate->bits >>= 8;
+    deflate->bitCount -= 8;
+  }
+}
+
+static void reserve_out(Deflate *deflate, long extra) {
+  if (deflate->outUsed + extra > deflate->outCapacity) {
+    deflate->outCapacity = (deflate->outUsed + extra) * 2;
+    deflate->out = (uint8_t *) realloc(deflate->out, deflate->outCapacity);
+  }
+}
+
+static void adler_update(Deflate *deflate, uint8_t *data, long size) {
+  uint32_t a = deflate->adlerA;
+  uint32_t b = deflate->adlerB;
+
+  while (size > 0) {
+    // the sums can't overflow within this many bytes
+    long block = size < 5552 ? size : 5552;
+    for (long index = 0; index < block; index += 1) {
+      a += data[index];
+      b += a;
+    }
+    a %= 65521;
+    b %= 65521;
+    data += block;
+    size -= block;
+  }
+
+  deflate->adlerA = a;
+  deflate->adlerB = b;
+}
+
+// compresses size more bytes as one fixed huffman block
+static void deflate_block(Deflate *deflate, uint8_t *data, long size) {
+  adler_update(deflate, data, size);
+
+  // keep only the window of history in front of the new data
+  if (deflate->bufferUsed + size > deflate->bufferCapacity) {
+    long keep = deflate->bufferUsed < DEFLATE_WINDOW ? deflate->bufferUsed : DEFLATE_WINDOW;
+    memmove(deflate->buffer, deflate->buffer + deflate->bufferUsed - keep, keep);
+    deflate->base += deflate->bufferUsed - keep;
+    deflate->bufferUsed = keep;
+    if (keep + size > deflate->bufferCapacity) {
+      deflate->bufferCapacity = keep + size;
+      deflate->buffer = (uint8_t *) realloc(deflate->buffer, deflate->bufferCapacity);
+    }
+  }
+  memcpy(deflate->buffer + deflate->bufferUsed, data, size);
+  long pos = deflate->bufferUsed;
+  long end = deflate->bufferUsed + size;
+  deflate->bufferUsed = end;
+
+  // literals take at most 9 bits
+  reserve_out(deflate, size * 9 / 8 + 16);
+
+  uint8_t *buffer = deflate->buffer;
+  // not the last block, fixed huffman codes
+  put_bits(deflate, 0, 1);
+  put_bits(deflate, 1, 2);
+
+  while (pos < end) {
+    int best = 0;
+    long dist = 0;
+
+    if (end - pos >= DEFLATE_MIN_MATCH) {
+      uint32_t word;
+      memcpy(&word, buffer + pos, 4);
+      uint32_t hash = (word * 2654435761u) >> (32 - DEFLATE_HASH_BITS);
+      long candidate = deflate->head[hash] - deflate->base;
+      deflate->head[hash] = deflate->base + pos;
+
+      if (candidate >= 0 && pos - candidate <= DEFLATE_WINDOW) {
+        long limit = end - pos < DEFLATE_MAX_MATCH ? end - pos : DEFLATE_MAX_MATCH;
+        while (best < limit && buffer[candidate + best] == buffer[pos + best]) {
+          best += 1;
+        }
+        dist = pos - candidate;
+      }
+    }
+
+    if (best >= DEFLATE_MIN_MATCH) {
+      int symbol = deflate->lengthSymbol[best];
+      put_bits(deflate, deflate->litCode[257 + symbol], deflate->litLength[257 + symbol]);
+      put_bits(deflate, best - lengthBase[symbol], lengthExtra[symbol]);
+
+      int distSymbol = deflate->distSymbol[dist];
+      put_bits(deflate, deflate->distCode[distSymbol], 5);
+      put_bits(deflate, dist - distBase[distSymbol], distExtra[distSymbol]);
+      pos += best;
+    }
+    else {
+      put_bits(deflate, deflate->litCode[buffer[pos]], deflate->litLength[buffer[pos]]);
+      pos += 1;
+    }
+  }
+
+  put_bits(deflate, deflate->litCode[256], deflate->litLength[256]);
+}
+
+// an empty last block, then the adler-32 of everything
+static void deflate_finish(Deflate *deflate) {
+  reserve_out(deflate, 16);
+  put_bits(deflate, 1, 1);
+  put_bits(deflate, 1, 2);
+  put_bits(deflate, deflate->litCode[256], deflate->litLength[256]);
+  if (deflate->bitCount > 0) {
+    put_bits(deflate, 0, 8 - deflate->bitCount);
+  }
+
+  uint8_t adler[4];
+  put_be32(adler, deflate->adlerB << 16 | deflate->adlerA);
+  memcpy(deflate->out + deflate->outUsed, adler, 4);
+  deflate->outUsed += 4;
+}
+
+// png
+
+static uint32_t crcTable[256];
+static pthread_once_t crcOnce = PTHREAD_ONCE_INIT;
+
+static void crc_init(void) {
+  for (uint32_t byte = 0; byte < 256; byte += 1) {
+    uint32_t crc = byte;
+    for (int bit = 0; bit < 8; bit += 1) {
+      crc = crc & 1 ? 0xedb88320u ^ (crc >> 1) : crc >> 1;
+    }
+    crcTable[byte] = crc;
+  }
+}
+
+static uint32_t crc_update(uint32_t crc, const uint8_t *data, long size) {
+  for (long index = 0; index < size; index += 1) {
+    crc = crcTable[(crc ^ data[index]) & 0xff] ^ (crc >> 8);
+  }
+  return crc;
+}
+
+static void png_chunk(ImageWriter *writer, const char *type, const uint8_t *data, long size) {
+  uint8_t header[8];
+  put_be32(header, (uint32_t) size);
+  memcpy(header + 4, type, 4);
+
+  uint32_t crc = crc_update(0xffffffffu, header + 4, 4);
+  crc = crc_update(crc, data, size) ^ 0xffffffffu;
+  uint8_t trailer[4];
+  put_be32(trailer, crc);
+
+  emit(writer, header, 8);
+  emit(writer, data, size);
+  emit(writer, trailer, 4);
+}
+
+// writes the finished compressed bytes out as idat chunks
+static void png_flush(ImageWriter *writer, bool all) {
+  Deflate *deflate = writer->deflate;
+  long done = 0;
+
+  while (deflate->outUsed - done >= PNG_CHUNK_BYTES || (all && deflate->outUsed > done)) {
+    long size = deflate->outUsed - done < PNG_CHUNK_BYTES ? deflate->outUsed - done : PNG_CHUNK_BYTES;
+    png_chunk(writer, "IDAT", deflate->out + done, size);
+    done += size;
+  }
+
+  memmove(deflate->out, deflate->out + done, deflate->outUsed - done);
+  deflate->outUsed -= done;
+}
+
+static void png_start(ImageWriter *writer) {
+  static const uint8_t signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+  emit(writer, signature, 8);
+  pthread_once(&crcOnce, crc_init);
+
+  // 8 bit rgb, no interlacing
+  uint8_t header[13];
+  put_be32(header, writer->width);
+  put_be32(header + 4, writer->height);
+  header[8] = 8;
+  header[9] = 2;
+  header[10] = 0;
+  header[11] = 0;
+  header[12] = 0;
+  png_chunk(writer, "IHDR", header, sizeof(header));
+
+  writer->deflate = deflate_create();
+  reserve_out(writer->deflate, 2);
+  // zlib header, 32k window and the fastest level
+  writer->deflate->out[0] = 0x78;
+  writer->deflate->out[1] = 0x01;
+  writer->deflate->outUsed = 2;
+
+  long rowBytes = (long) writer->width * 3 + 1;
+  writer->pngRows = (uint8_t *) malloc(rowBytes * 3);
+  writer->pngAbove = (uint8_t *) malloc(rowBytes);
+}
+
+static int paeth(int left, int up, int upLeft) {
+  int estimate = left + up - upLeft;
+  int toLeft = abs(estimate - left);
+  int toUp = abs(estimate - up);
+  int toUpLeft = abs(estimate - upLeft);
+
+  if (toLeft <= toUp && toLeft <= toUpLeft) {
+    return left;
+  }
+  return toUp <= toUpLeft ? up : upLeft;
+}
+
+// filters each row with whichever of sub, up and paeth leaves the smallest
+// differences, the usual heuristic, and compresses every whole block of them
+static void png_rows(ImageWriter *writer, int firstRow, int lastRow) {
+  long stride = (long) writer->width * 3;
+  long rowBytes = stride + 1;
+  writer->pending = (uint8_t *) realloc(writer->pending, writer->pendingUsed + rowBytes * (lastRow - firstRow));
+
+  for (int row = firstRow; row < lastRow; row += 1) {
+    uint8_t *pixels = image_row(writer, row);
+    uint8_t *above = row > 0 ? writer->pngAbove : NULL;
+    long bestSum = -1;
+    uint8_t *best = NULL;
+
+    // sub, up and paeth are filter types 1, 2 and 4
+    uint8_t *sub = writer->pngRows;
+    uint8_t *up = writer->pngRows + rowBytes;
+    uint8_t *paethRow = writer->pngRows + 2 * rowBytes;
+    sub[0] = 1;
+    up[0] = 2;
+    paethRow[0] = 4;
+    for (long index = 0; index < stride; index += 1) {
+      sub[index + 1] = pixels[index] - (index >= 3 ? pixels[index - 3] : 0);
+    }
+    for (long index = 0; index < stride; index += 1) {
+      up[index + 1] = pixels[index] - (above != NULL ? above[index] : 0);
+    }
+    if (above == NULL) {
+      // with nothing above, paeth always predicts the left neighbor
+      memcpy(paethRow + 1, sub + 1, stride);
+    }
+    else {
+      for (long index = 0; index < 3 && index < stride; index += 1) {
+        paethRow[index + 1] = pixels[index] - above[index];
+      }
+      for (long index = 3; index < stride; index += 1) {
+        paethRow[index + 1] = pixels[index] - paeth(pixels[index - 3], above[index], above[index - 3]);
+      }
+    }
+
+    for (int candidate = 0; candidate < 3; candidate += 1) {
+      uint8_t *filtered = writer->pngRows + candidate * rowBytes;
+      long sum = 0;
+      for (long index = 1; index <= stride; index += 1) {
+        sum += filtered[index] < 128 ? filtered[index] : 256 - filtered[index];
+      }
+
+      if (bestSum < 0 || sum < bestSum) {
+        bestSum = sum;
+        best = filtered;
+      }
+    }
+
+    memcpy(writer->pending + writer->pendingUsed, best, rowBytes);
+    writer->pendingUsed += rowBytes;
+    memcpy(writer->pngAbove, pixels, stride);
+  }
+
+  long done = 0;
+  while (writer->pendingUsed - done >= PNG_BLOCK_BYTES) {
+    deflate_block(writer->deflate, writer->pending + done, PNG_BLOCK_BYTES);
+    done += PNG_BLOCK_BYTES;
+  }
+  memmove(writer->pending, writer->pending + done, writer->pendingUsed - done);
+  writer->pendingUsed -= done;
+  png_flush(writer, false);
+}
+
+static void png_finish(ImageWriter *writer) {
+  if (writer->pendingUsed > 0) {
+    deflate_block(writer->deflate, writer->pending, writer->pendingUsed);
+  }
+  deflate_finish(writer->deflate);
+  png_flush(writer, true);
+  png_chunk(writer, "IEND", NULL, 0);
+
+  deflate_free(writer->deflate);
+  free(writer->pngRows);
+  free(writer->pngAbove);
+  free(writer->pending);
+}
+
+// writer thread
+
+static void *writer_main(void *arg) {
+  ImageWriter *writer = (ImageWriter *) arg;
+  double start = seconds_now();
+
+  if (writer->format == FORMAT_PPM) {
+    char header[64];
+    int length = snprintf(header, sizeof(header), "P6 %d %d 255\n", writer->width, writer->height);
+    emit(writer, header, length);
+  }
+  else if (writer->format == FORMAT_TILE) {
+    char header[128];
+    int length = snprintf(header, sizeof(header), "P6\n# raytrace tile %d %d %d %d\n%d %d\n255\n", writer->frameWidth,
+                          writer->frameHeight, writer->tileX, writer->tileY, writer->width, writer->height);
+    emit(writer, header, length);
+  }
+  else if (writer->format == FORMAT_QOI) {
+    qoi_start(writer);
+  }
+  else {
+    png_start(writer);
+  }
+  writer->encodeSeconds += seconds_now() - start;
+
+  while (writer->writtenRows < writer->height) {
+    pthread_mutex_lock(&writer->lock);
+    while (writer->readyRows == writer->writtenRows) {
+      pthread_cond_wait(&writer->ready, &writer->lock);
+    }
+    int firstRow = writer->writtenRows;
+    int lastRow = writer->readyRows;
+    // stop at the end of the buffer, the rows after it wrap to the start
+    int wrapRow = (firstRow / writer->bufferRows + 1) * writer->bufferRows;
+    lastRow = lastRow < wrapRow ? lastRow : wrapRow;
+    pthread_mutex_unlock(&writer->lock);
+
+    start = seconds_now();
+    if (writer->format == FORMAT_PPM || writer->format == FORMAT_TILE) {
+      ppm_rows(writer, firstRow, lastRow);
+    }
+    else if (writer->format == FORMAT_QOI) {
+      qoi_rows(writer, firstRow, lastRow);
+    }
+    else {
+      png_rows(writer, firstRow, lastRow);
+    }
+    writer->encodeSeconds += seconds_now() - start;
+
+    pthread_mutex_lock(&writer->lock);
+    writer->writtenRows = lastRow;
+    pthread_cond_broadcast(&writer->written);
+    pthread_mutex_unlock(&writer->lock);
+  }
+
+  start = seconds_now();
+  if (writer->format == FORMAT_QOI) {
+    qoi_finish(writer);
+  }
+  else if (writer->format == FORMAT_PNG) {
+    png_finish(writer);
+  }
+  writer->encodeSeconds += seconds_now() - start;
+
+  return NULL;
+}
+
+static bool has_extension(char *fileName, const char *extension) {
+  size_t length = strlen(fileName);
+  size_t extensionLength = strlen(extension);
+
+  return length >= extensionLength && strcasecmp(fileName + length - extensionLength, extension) == 0;
+}
+
+static ImageWriter *writer_create(char *fileName, int format, int width, int height, uint8_t *image, int bufferRows,
+                                  char *error, int errorSize) {
+  // nothing would ever mark rows done, and the writer would wait for them
+  if (width < 1 || height < 1) {
+    snprintf(error, errorSize, "%s: a %dx%d image has no pixels to write", fileName, width, height);
+    return NULL;
+  }
+
+  FILE *fh = fopen(fileName, "wb");
+  if (fh == NULL) {
+    snprintf(error, errorSize, "cannot create %s", fileName);
+    return NULL;
+  }
+
+  ImageWriter *writer = (ImageWriter *) calloc(1, sizeof(ImageWriter));
+  writer->fh = fh;
+  writer->format = format;
+  writer->width = width;
+  writer->height = height;
+  writer->image = image;
+  writer->bufferRows = bufferRows;
+  writer->rowDone = (bool *) calloc(height + 1, sizeof(bool));
+
+  pthread_mutex_init(&writer->lock, NULL);
+  pthread_cond_init(&writer->ready, NULL);
+  pthread_cond_init(&writer->written, NULL);
+
+  return writer;
+}
+
+ImageWriter *writer_open(char *fileName, int width, int height, uint8_t *image, int bufferRows, char *error, int errorSize) {
+  int format = has_extension(fileName, ".png") ? FORMAT_PNG : has_extension(fileName, ".qoi") ? FORMAT_QOI : FORMAT_PPM;
+  ImageWriter *writer = writer_create(fileName, format, width, height, image, bufferRows, error, errorSize);
+
+  if (writer != NULL) {
+    pthread_create(&writer->thread, NULL, writer_main, writer);
+  }
+  return writer;
+}
+
+ImageWriter *writer_open_tile(char *fileName, int frameWidth, int frameHeight, int tileX, int tileY, int width,
+                              int height, uint8_t *image, int bufferRows, char *error, int errorSize) {
+  if (has_extension(fileName, ".png") || has_extension(fileName, ".qoi")) {
+    snprintf(error, errorSize, "%s: tiles are always written as ppm files", fileName);
+    return NULL;
+  }
+
+  ImageWriter *writer = writer_create(fileName, FORMAT_TILE, width, height, image, bufferRows, error, errorSize);
+  if (writer != NULL) {
+    writer->frameWidth = frameWidth;
+    writer->frameHeight = frameHeight;
+    writer->tileX = tileX;
+    writer->tileY = tileY;
+    pthread_create(&writer->thread, NULL, writer_main, writer);
+  }
+  return writer;
+}
+
+void writer_rows_done(ImageWriter *writer, int firstRow, int rowCount) {
+  pthread_mutex_lock(&writer->lock);
+  for (int row = firstRow; row < firstRow + rowCount; row += 1) {
+    writer->rowDone[row] = true;
+  }
+
+  int readyRows = writer->readyRows;
+  while (readyRows < writer->height && writer->rowDone[readyRows]) {
+    readyRows += 1;
+  }
+  if (readyRows > writer->readyRows) {
+    writer->readyRows = readyRows;
+    pthread_cond_signal(&writer->ready);
+  }
+  pthread_mutex_unlock(&writer->lock);
+}
+
+void writer_wait(ImageWriter *writer, int row) {
+  pthread_mutex_lock(&writer->lock);
+  while (writer->writtenRows < row) {
+    pthread_cond_wait(&writer->written, &writer->lock);
+  }
+  pthread_mutex_unlock(&writer->lock);
+}
+
+int writer_close(ImageWriter *writer, WriterResult *result, char *error, int errorSize) {
+  static const char *formats[] = {"ppm", "qoi", "png", "ppm tile"};
+
+  pthread_join(writer->thread, NULL);
+  bool failed = writer->failed;
+  if (fclose(writer->fh) != 0) {
+    failed = true;
+  }
+
+  result->format = formats[writer->format];
+  result->bytes = writer->bytes;
+  result->encodeSeconds = writer->encodeSeconds;
+
+  pthread_mutex_destroy(&writer->lock);
+  pthread_cond_destroy(&writer->ready);
+  pthread_cond_destroy(&writer->written);
+  free(writer->rowDone);
+  free(writer);
+
+  if (failed) {
+    snprintf(error, errorSize, "writing the image failed");
+    return -1;
+  }
+  return 0;
+}
@@ -0,0 +1,51 @@
+#ifndef IMAGEWRITER_H
+#define IMAGEWRITER_H
+
+#include <stdint.h>
+
+// writes an image on a background thread while it is still being rendered.
+// the renderer hands rows over as they are finished, in any order, and the
+// writer encodes them top to bottom as soon as every row above them is done.
+// the format comes from the file name: .png and .qoi are compressed, anything
+// else is written as a binary ppm
+
+typedef struct ImageWriter ImageWriter;
+
+typedef struct WriterResult {
+  const char *format;
+  long bytes;
+  // cpu time the writer thread spent encoding and writing
+  double encodeSeconds;
+} WriterResult;
+
+// image is the caller's rgb buffer of bufferRows rows, used as a ring: row r
+// of the image lives in row r % bufferRows. pass height for a buffer holding
+// the whole image. the writer thread only reads rows after they have been
+// handed over. returns NULL with a message in error if the file can't be created
+ImageWriter *writer_open(char *fileName, int width, int height, uint8_t *image, int bufferRows, char *error, int errorSize);
+
+// like writer_open for a width x height region of a frameWidth x frameHeight
+// frame with its top left corner at tileX, tileY. the file is a binary ppm of
+// the region with a header comment giving its place in the frame,
+//
+//   P6
+//   # raytrace tile FRAME_WIDTH FRAME_HEIGHT X Y
+//   WIDTH HEIGHT
+//   255
+//
+// which merge_tiles puts back together
+ImageWriter *writer_open_tile(char *fileName, int frameWidth, int frameHeight, int tileX, int tileY, int width,
+                              int height, uint8_t *image, int bufferRows, char *error, int errorSize);
+
+// rows [firstRow, firstRow + rowCount) of the image are final
+void writer_rows_done(ImageWriter *writer, int firstRow, int rowCount);
+
+// waits until every row above row is written, after which their part of the
+// buffer can be reused
+void writer_wait(ImageWriter *writer, int row);
+
+// waits until every row, all of which must have been handed over, is written
+// and closes the file. returns 0 on success, or -1 with a message in error
+int writer_close(ImageWriter *writer, WriterResult *result, char *error, int errorSize);
+
+#endif
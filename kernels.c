@@ -0,0 +1,591 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include "kernels.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define KERNELS_X86 1
+#include <immintrin.h>
+#endif
+
+sphere_kernel_fn nearest_sphere;
+plane_kernel_fn nearest_plane;
+triangle_kernel_fn nearest_triangle;
+
+static int kernelWidth = 1;
+
+// whether a hit at tVal on object index beats the closest one so far. only
+// t > 0 counts, the smaller t wins, and ties go to the lower index so every
+// kernel width picks the same object
+static inline int closer(float tVal, int index, float minIntersect, int minIndex) {
+  if (!(tVal > 0)) {
+    return 0;
+  }
+  return tVal < minIntersect || (tVal == minIntersect && minIndex >= 0 && index < minIndex);
+}
+
+static void nearest_sphere_scalar(SphereArrays *spheres, int first, int count, float *Rd, float *R0,
+                                  int skipObjIndex, float *minIntersect, int *minIndex) {
+  for (int slot = first; slot < first + count; slot += 1) {
+    int index = spheres->objIndex[slot];
+    if (index == skipObjIndex) {
+      continue;
+    }
+
+    float dx = R0[0] - spheres->cx[slot];
+    float dy = R0[1] - spheres->cy[slot];
+    float dz = R0[2] - spheres->cz[slot];
+    float B = 2 * ((Rd[0] * dx) + (Rd[1] * dy) + (Rd[2] * dz));
+    float C = ((dx * dx) + (dy * dy) + (dz * dz)) - spheres->r2[slot];
+    float discrim = (B * B) - (4 * C);
+
+    if (discrim < 0) {
+      continue;
+    }
+
+    float root = sqrtf(discrim);
+    float tVal = ((-1 * B) - root) / 2;
+    if (!(tVal >= 0)) {
+      tVal = ((-1 * B) + root) / 2;
+    }
+
+    if (closer(tVal, index, *minIntersect, *minIndex)) {
+      *minIntersect = tVal;
+      *minIndex = index;
+    }
+  }
+}
+
+static void nearest_plane_scalar(PlaneArrays *planes, int first, int count, float *Rd, float *R0,
+                                 int skipObjIndex, float *minIntersect, int *minIndex) {
+  for (int slot = first; slot < first + count; slot += 1) {
+    int index = planes->objIndex[slot];
+    if (index == skipObjIndex) {
+      continue;
+    }
+
+    float V0 = -(((planes->nx[slot] * R0[0]) + (planes->ny[slot] * R0[1]) + (planes->nz[slot] * R0[2])) + planes->d[slot]);
+    float Vd = (planes->nx[slot] * Rd[0]) + (planes->ny[slot] * Rd[1]) + (planes->nz[slot] * Rd[2]);
+
+    // ray is parallel to plane
+    if (Vd == 0) {
+      continue;
+    }
+
+    float tVal = V0 / Vd;
+    if (closer(tVal, index, *minIntersect, *minIndex)) {
+      *minIntersect = tVal;
+      *minIndex = index;
+    }
+  }
+}
+
+void triangle_ray_init(TriangleRay *ray, float *Rd, float *R0) {
+  int kz = fabsf(Rd[0]) > fabsf(Rd[1]) ? (fabsf(Rd[0]) > fabsf(Rd[2]) ? 0 : 2) : (fabsf(Rd[1]) > fabsf(Rd[2]) ? 1 : 2);
+  int kx = kz == 2 ? 0 : kz + 1;
+  int ky = kx == 2 ? 0 : kx + 1;
+
+  // swapping the other two axes keeps the triangles' winding
+  if (Rd[kz] < 0) {
+    int swap = kx;
+    kx = ky;
+    ky = swap;
+  }
+
+  ray->kx = kx;
+  ray->ky = ky;
+  ray->kz = kz;
+  ray->sx = Rd[kx] / Rd[kz];
+  ray->sy = Rd[ky] / Rd[kz];
+  ray->sz = 1.0f / Rd[kz];
+  memcpy(ray->R0, R0, sizeof(float[3]));
+}
+
+float triangle_intersect(TriangleRay *ray, float *a, float *b, float *c) {
+  int kx = ray->kx, ky = ray->ky, kz = ray->kz;
+
+  // corners relative to the origin, sheared so the ray runs along z
+  float Az = a[kz] - ray->R0[kz];
+  float Bz = b[kz] - ray->R0[kz];
+  float Cz = c[kz] - ray->R0[kz];
+  float Ax = (a[kx] - ray->R0[kx]) - (ray->sx * Az);
+  float Ay = (a[ky] - ray->R0[ky]) - (ray->sy * Az);
+  float Bx = (b[kx] - ray->R0[kx]) - (ray->sx * Bz);
+  float By = (b[ky] - ray->R0[ky]) - (ray->sy * Bz);
+  float Cx = (c[kx] - ray->R0[kx]) - (ray->sx * Cz);
+  float Cy = (c[ky] - ray->R0[ky]) - (ray->sy * Cz);
+
+  // scaled barycentric coordinates, the 2d edge functions at the origin
+  float U = (Cx * By) - (Cy * Bx);
+  float V = (Ax * Cy) - (Ay * Cx);
+  float W = (Bx * Ay) - (By * Ax);
+
+  // a ray right on an edge gets its side from exact products, so the two
+  // triangles sharing the edge can't both miss it
+  if (U == 0 || V == 0 || W == 0) {
+    U = (float) (((double) Cx * By) - ((double) Cy * Bx));
+    V = (float) (((double) Ax * Cy) - ((double) Ay * Cx));
+    W = (float) (((double) Bx * Ay) - ((double) By * Ax));
+  }
+
+  if ((U < 0 || V < 0 || W < 0) && (U > 0 || V > 0 || W > 0)) {
+    return -1;
+  }
+  float det = U + V + W;
+  if (det == 0) {
+    return -1;
+  }
+
+  float T = (U * (ray->sz * Az)) + (V * (ray->sz * Bz)) + (W * (ray->sz * Cz));
+  return T / det;
+}
+
+static void nearest_triangle_scalar(TriangleBatch *batch, TriangleRay *ray, int skipObjIndex, float *minIntersect,
+                                    int *minIndex) {
+  for (int slot = 0; slot < batch->count; slot += 1) {
+    int index = batch->objIndex[slot];
+    if (index == skipObjIndex) {
+      continue;
+    }
+
+    float a[3] = {batch->ax[slot], batch->ay[slot], batch->az[slot]};
+    float b[3] = {batch->bx[slot], batch->by[slot], batch->bz[slot]};
+    float c[3] = {batch->cx[slot], batch->cy[slot], batch->cz[slot]};
+    float tVal = triangle_intersect(ray, a, b, c);
+    if (closer(tVal, index, *minIntersect, *minIndex)) {
+      *minIntersect = tVal;
+      *minIndex = index;
+    }
+  }
+}
+
+// the vector kernels leave lanes whose edge functions came out exactly 0 to
+// this, lanes is a bit mask of them
+static void redo_triangle_lanes(TriangleBatch *batch, TriangleRay *ray, int lanes, float *minIntersect, int *minIndex) {
+  for (int slot = 0; lanes != 0; slot += 1, lanes >>= 1) {
+    if (lanes & 1) {
+      float a[3] = {batch->ax[slot], batch->ay[slot], batch->az[slot]};
+      float b[3] = {batch->bx[slot], batch->by[slot], batch->bz[slot]};
+      float c[3] = {batch->cx[slot], batch->cy[slot], batch->cz[slot]};
+      float tVal = triangle_intersect(ray, a, b, c);
+      if (closer(tVal, batch->objIndex[slot], *minIntersect, *minIndex)) {
+        *minIntersect = tVal;
+        *minIndex = batch->objIndex[slot];
+      }
+    }
+  }
+}
+
+// folds the per lane bests into the running closest hit
+static void reduce_lanes(float *laneT, int *laneIndex, int lanes, float *minIntersect, int *minIndex) {
+  for (int lane = 0; lane < lanes; lane += 1) {
+    if (laneIndex[lane] >= 0 && closer(laneT[lane], laneIndex[lane], *minIntersect, *minIndex)) {
+      *minIntersect = laneT[lane];
+      *minIndex = laneIndex[lane];
+    }
+  }
+}
+
+#ifdef KERNELS_X86
+
+// sse2 only, so any x86-64 cpu can run these
+static inline __m128 negate4(__m128 a) {
+  return _mm_xor_ps(a, _mm_set1_ps(-0.0f));
+}
+
+static inline __m128 select4(__m128 mask, __m128 a, __m128 b) {
+  return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+}
+
+static inline __m128i select4i(__m128i mask, __m128i a, __m128i b) {
+  return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+
+// lanes that hit at t > 0, beat the lane's best so far and are inside the range
+static inline __m128 better4(__m128 tVal, __m128i index, __m128 bestT, __m128i bestIndex, __m128i valid) {
+  __m128 positive = _mm_cmpgt_ps(tVal, _mm_setzero_ps());
+  // best index starts at -1 when there is no hit yet, and -1 > index never holds
+  __m128 tie = _mm_and_ps(_mm_cmpeq_ps(tVal, bestT), _mm_castsi128_ps(_mm_cmpgt_epi32(bestIndex, index)));
+  __m128 better = _mm_or_ps(_mm_cmplt_ps(tVal, bestT), tie);
+
+  return _mm_and_ps(_mm_and_ps(positive, better), _mm_castsi128_ps(valid));
+}
+
+static inline __m128i lanes_valid4(int slot, int end, __m128i index, int skipObjIndex) {
+  __m128i slots = _mm_add_epi32(_mm_set1_epi32(slot), _mm_setr_epi32(0, 1, 2, 3));
+  __m128i inRange = _mm_cmpgt_epi32(_mm_set1_epi32(end), slots);
+  __m128i skipped = _mm_cmpeq_epi32(index, _mm_set1_epi32(skipObjIndex));
+
+  return _mm_andnot_si128(skipped, inRange);
+}
+
+static void nearest_sphere_sse(SphereArrays *spheres, int first, int count, float *Rd, float *R0,
+                               int skipObjIndex, float *minIntersect, int *minIndex) {
+  __m128 rdx = _mm_set1_ps(Rd[0]), rdy = _mm_set1_ps(Rd[1]), rdz = _mm_set1_ps(Rd[2]);
+  __m128 r0x = _mm_set1_ps(R0[0]), r0y = _mm_set1_ps(R0[1]), r0z = _mm_set1_ps(R0[2]);
+  __m128 two = _mm_set1_ps(2), four = _mm_set1_ps(4), half = _mm_set1_ps(0.5f);
+  __m128 bestT = _mm_set1_ps(*minIntersect);
+  __m128i bestIndex = _mm_set1_epi32(*minIndex);
+  int end = first + count;
+
+  for (int slot = first; slot < end; slot += 4) {
+    __m128i index = _mm_loadu_si128((__m128i *) (spheres->objIndex + slot));
+    __m128 dx = _mm_sub_ps(r0x, _mm_loadu_ps(spheres->cx + slot));
+    __m128 dy = _mm_sub_ps(r0y, _mm_loadu_ps(spheres->cy + slot));
+    __m128 dz = _mm_sub_ps(r0z, _mm_loadu_ps(spheres->cz + slot));
+
+    __m128 B = _mm_mul_ps(two, _mm_add_ps(_mm_add_ps(_mm_mul_ps(rdx, dx), _mm_mul_ps(rdy, dy)), _mm_mul_ps(rdz, dz)));
+    __m128 C = _mm_sub_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz)),
+                          _mm_loadu_ps(spheres->r2 + slot));
+    __m128 discrim = _mm_sub_ps(_mm_mul_ps(B, B), _mm_mul_ps(four, C));
+
+    // a negative discriminant gives a NaN root, which fails every t test below
+    __m128 root = _mm_sqrt_ps(discrim);
+    __m128 negB = negate4(B);
+    __m128 t0 = _mm_mul_ps(_mm_sub_ps(negB, root), half);
+    __m128 t1 = _mm_mul_ps(_mm_add_ps(negB, root), half);
+    __m128 tVal = select4(_mm_cmpge_ps(t0, _mm_setzero_ps()), t0, t1);
+
+    __m128 better = better4(tVal, index, bestT, bestIndex, lanes_valid4(slot, end, index, skipObjIndex));
+    bestT = select4(better, tVal, bestT);
+    bestIndex = select4i(_mm_castps_si128(better), index, bestIndex);
+  }
+
+  float laneT[4];
+  int laneIndex[4];
+  _mm_storeu_ps(laneT, bestT);
+  _mm_storeu_si128((__m128i *) laneIndex, bestIndex);
+  reduce_lanes(laneT, laneIndex, 4, minIntersect, minIndex);
+}
+
+static void nearest_plane_sse(PlaneArrays *planes, int first, int count, float *Rd, float *R0,
+                              int skipObjIndex, float *minIntersect, int *minIndex) {
+  __m128 rdx = _mm_set1_ps(Rd[0]), rdy = _mm_set1_ps(Rd[1]), rdz = _mm_set1_ps(Rd[2]);
+  __m128 r0x = _mm_set1_ps(R0[0]), r0y = _mm_set1_ps(R0[1]), r0z = _mm_set1_ps(R0[2]);
+  __m128 bestT = _mm_set1_ps(*minIntersect);
+  __m128i bestIndex = _mm_set1_epi32(*minIndex);
+  int end = first + count;
+
+  for (int slot = first; slot < end; slot += 4) {
+    __m128i index = _mm_loadu_si128((__m128i *) (planes->objIndex + slot));
+    __m128 nx = _mm_loadu_ps(planes->nx + slot);
+    __m128 ny = _mm_loadu_ps(planes->ny + slot);
+    __m128 nz = _mm_loadu_ps(planes->nz + slot);
+
+    __m128 dotR0 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(nx, r0x), _mm_mul_ps(ny, r0y)), _mm_mul_ps(nz, r0z));
+    __m128 V0 = negate4(_mm_add_ps(dotR0, _mm_loadu_ps(planes->d + slot)));
+    __m128 Vd = _mm_add_ps(_mm_add_ps(_mm_mul_ps(nx, rdx), _mm_mul_ps(ny, rdy)), _mm_mul_ps(nz, rdz));
+    __m128 tVal = _mm_div_ps(V0, Vd);
+
+    // rays parallel to the plane never hit
+    __m128i valid = lanes_valid4(slot, end, index, skipObjIndex);
+    valid = _mm_andnot_si128(_mm_castps_si128(_mm_cmpeq_ps(Vd, _mm_setzero_ps())), valid);
+
+    __m128 better = better4(tVal, index, bestT, bestIndex, valid);
+    bestT = select4(better, tVal, bestT);
+    bestIndex = select4i(_mm_castps_si128(better), index, bestIndex);
+  }
+
+  float laneT[4];
+  int laneIndex[4];
+  _mm_storeu_ps(laneT, bestT);
+  _mm_storeu_si128((__m128i *) laneIndex, bestIndex);
+  reduce_lanes(laneT, laneIndex, 4, minIntersect, minIndex);
+}
+
+static void nearest_triangle_sse(TriangleBatch *batch, TriangleRay *ray, int skipObjIndex, float *minIntersect,
+                                 int *minIndex) {
+  float *as[3] = {batch->ax, batch->ay, batch->az};
+  float *bs[3] = {batch->bx, batch->by, batch->bz};
+  float *cs[3] = {batch->cx, batch->cy, batch->cz};
+  int kx = ray->kx, ky = ray->ky, kz = ray->kz;
+  __m128 r0x = _mm_set1_ps(ray->R0[kx]), r0y = _mm_set1_ps(ray->R0[ky]), r0z = _mm_set1_ps(ray->R0[kz]);
+  __m128 sx = _mm_set1_ps(ray->sx), sy = _mm_set1_ps(ray->sy), sz = _mm_set1_ps(ray->sz);
+  __m128 zero = _mm_setzero_ps();
+  __m128 bestT = _mm_set1_ps(*minIntersect);
+  __m128i bestIndex = _mm_set1_epi32(*minIndex);
+  int redo = 0;
+
+  for (int slot = 0; slot < batch->count; slot += 4) {
+    __m128i index = _mm_loadu_si128((__m128i *) (batch->objIndex + slot));
+    __m128 Az = _mm_sub_ps(_mm_loadu_ps(as[kz] + slot), r0z);
+    __m128 Bz = _mm_sub_ps(_mm_loadu_ps(bs[kz] + slot), r0z);
+    __m128 Cz = _mm_sub_ps(_mm_loadu_ps(cs[kz] + slot), r0z);
+    __m128 Ax = _mm_sub_ps(_mm_sub_ps(_mm_loadu_ps(as[kx] + slot), r0x), _mm_mul_ps(sx, Az));
+    __m128 Ay = _mm_sub_ps(_mm_sub_ps(_mm_loadu_ps(as[ky] + slot), r0y), _mm_mul_ps(sy, Az));
+    __m128 Bx = _mm_sub_ps(_mm_sub_ps(_mm_loadu_ps(bs[kx] + slot), r0x), _mm_mul_ps(sx, Bz));
+    __m128 By = _mm_sub_ps(_mm_sub_ps(_mm_loadu_ps(bs[ky] + slot), r0y), _mm_mul_ps(sy, Bz));
+    __m128 Cx = _mm_sub_ps(_mm_sub_ps(_mm_loadu_ps(cs[kx] + slot), r0x), _mm_mul_ps(sx, Cz));
+    __m128 Cy = _mm_sub_ps(_mm_sub_ps(_mm_loadu_ps(cs[ky] + slot), r0y), _mm_mul_ps(sy, Cz));
+
+    __m128 U = _mm_sub_ps(_mm_mul_ps(Cx, By), _mm_mul_ps(Cy, Bx));
+    __m128 V = _mm_sub_ps(_mm_mul_ps(Ax, Cy), _mm_mul_ps(Ay, Cx));
+    __m128 W = _mm_sub_ps(_mm_mul_ps(Bx, Ay), _mm_mul_ps(By, Ax));
+    __m128 negative = _mm_or_ps(_mm_or_ps(_mm_cmplt_ps(U, zero), _mm_cmplt_ps(V, zero)), _mm_cmplt_ps(W, zero));
+    __m128 positive = _mm_or_ps(_mm_or_ps(_mm_cmpgt_ps(U, zero), _mm_cmpgt_ps(V, zero)), _mm_cmpgt_ps(W, zero));
+    __m128 onEdge = _mm_or_ps(_mm_or_ps(_mm_cmpeq_ps(U, zero), _mm_cmpeq_ps(V, zero)), _mm_cmpeq_ps(W, zero));
+
+    __m128 det = _mm_add_ps(_mm_add_ps(U, V), W);
+    __m128 T = _mm_add_ps(_mm_add_ps(_mm_mul_ps(U, _mm_mul_ps(sz, Az)), _mm_mul_ps(V, _mm_mul_ps(sz, Bz))),
+                          _mm_mul_ps(W, _mm_mul_ps(sz, Cz)));
+    __m128 tVal = _mm_div_ps(T, det);
+
+    __m128i valid = lanes_valid4(slot, batch->count, index, skipObjIndex);
+    redo |= _mm_movemask_ps(_mm_and_ps(onEdge, _mm_castsi128_ps(valid))) << slot;
+    __m128 miss = _mm_or_ps(_mm_or_ps(_mm_and_ps(negative, positive), onEdge), _mm_cmpeq_ps(det, zero));
+    valid = _mm_andnot_si128(_mm_castps_si128(miss), valid);
+
+    __m128 better = better4(tVal, index, bestT, bestIndex, valid);
+    bestT = select4(better, tVal, bestT);
+    bestIndex = select4i(_mm_castps_si128(better), index, bestIndex);
+  }
+
+  float laneT[4];
+  int laneIndex[4];
+  _mm_storeu_ps(laneT, bestT);
+  _mm_storeu_si128((__m128i *) laneIndex, bestIndex);
+  reduce_lanes(laneT, laneIndex, 4, minIntersect, minIndex);
+  redo_triangle_lanes(batch, ray, redo, minIntersect, minIndex);
+}
+
+// avx2 without fma, so nothing gets contracted and the rounding matches the scalar code
+#define AVX2_TARGET __attribute__((target("avx2")))
+
+AVX2_TARGET static inline __m256 negate8(__m256 a) {
+  return _mm256_xor_ps(a, _mm256_set1_ps(-0.0f));
+}
+
+AVX2_TARGET static inline __m256 better8(__m256 tVal, __m256i index, __m256 bestT, __m256i bestIndex, __m256i valid) {
+  __m256 positive = _mm256_cmp_ps(tVal, _mm256_setzero_ps(), _CMP_GT_OQ);
+  __m256 tie = _mm256_and_ps(_mm256_cmp_ps(tVal, bestT, _CMP_EQ_OQ), _mm256_castsi256_ps(_mm256_cmpgt_epi32(bestIndex, index)));
+  __m256 better = _mm256_or_ps(_mm256_cmp_ps(tVal, bestT, _CMP_LT_OQ), tie);
+
+  return _mm256_and_ps(_mm256_and_ps(positive, better), _mm256_castsi256_ps(valid));
+}
+
+AVX2_TARGET static inline __m256i lanes_valid8(int slot, int end, __m256i index, int skipObjIndex) {
+  __m256i slots = _mm256_add_epi32(_mm256_set1_epi32(slot), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+  __m256i inRange = _mm256_cmpgt_epi32(_mm256_set1_epi32(end), slots);
+  __m256i skipped = _mm256_cmpeq_epi32(index, _mm256_set1_epi32(skipObjIndex));
+
+  return _mm256_andnot_si256(skipped, inRange);
+}
+
+AVX2_TARGET static void nearest_sphere_avx2(SphereArrays *spheres, int first, int count, float *Rd, float *R0,
+                                            int skipObjIndex, float *minIntersect, int *minIndex) {
+  __m256 rdx = _mm256_set1_ps(Rd[0]), rdy = _mm256_set1_ps(Rd[1]), rdz = _mm256_set1_ps(Rd[2]);
+  __m256 r0x = _mm256_set1_ps(R0[0]), r0y = _mm256_set1_ps(R0[1]), r0z = _mm256_set1_ps(R0[2]);
+  __m256 two = _mm256_set1_ps(2), four = _mm256_set1_ps(4), half = _mm256_set1_ps(0.5f);
+  __m256 bestT = _mm256_set1_ps(*minIntersect);
+  __m256i bestIndex = _mm256_set1_epi32(*minIndex);
+  int end = first + count;
+
+  for (int slot = first; slot < end; slot += 8) {
+    __m256i index = _mm256_loadu_si256((__m256i *) (spheres->objIndex + slot));
+    __m256 dx = _mm256_sub_ps(r0x, _mm256_loadu_ps(spheres->cx + slot));
+    __m256 dy = _mm256_sub_ps(r0y, _mm256_loadu_ps(spheres->cy + slot));
+    __m256 dz = _mm256_sub_ps(r0z, _mm256_loadu_ps(spheres->cz + slot));
+
+    __m256 B = _mm256_mul_ps(two, _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(rdx, dx), _mm256_mul_ps(rdy, dy)), _mm256_mul_ps(rdz, dz)));
+    __m256 C = _mm256_sub_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy)), _mm256_mul_ps(dz, dz)),
+                             _mm256_loadu_ps(spheres->r2 + slot));
+    __m256 discrim = _mm256_sub_ps(_mm256_mul_ps(B, B), _mm256_mul_ps(four, C));
+
+    __m256 root = _mm256_sqrt_ps(discrim);
+    __m256 negB = negate8(B);
+    __m256 t0 = _mm256_mul_ps(_mm256_sub_ps(negB, root), half);
+    __m256 t1 = _mm256_mul_ps(_mm256_add_ps(negB, root), half);
+    __m256 tVal = _mm256_blendv_ps(t1, t0, _mm256_cmp_ps(t0, _mm256_setzero_ps(), _CMP_GE_OQ));
+
+    __m256 better = better8(tVal, index, bestT, bestIndex, lanes_valid8(slot, end, index, skipObjIndex));
+    bestT = _mm256_blendv_ps(bestT, tVal, better);
+    bestIndex = _mm256_castps_si256(_mm256_blendv_ps(_mm256_castsi256_ps(bestIndex), _mm256_castsi256_ps(index), better));
+  }
+
+  float laneT[8];
+  int laneIndex[8];
+  _mm256_storeu_ps(laneT, bestT);
+  _mm256_storeu_si256((__m256i *) laneIndex, bestIndex);
+  reduce_lanes(laneT, laneIndex, 8, minIntersect, minIndex);
+}
+
+AVX2_TARGET static void nearest_plane_avx2(PlaneArrays *planes, int first, int count, float *Rd, float *R0,
+                                           int skipObjIndex, float *minIntersect, int *minIndex) {
+  __m256 rdx = _mm256_set1_ps(Rd[0]), rdy = _mm256_set1_ps(Rd[1]), rdz = _mm256_set1_ps(Rd[2]);
+  __m256 r0x = _mm256_set1_ps(R0[0]), r0y = _mm256_set1_ps(R0[1]), r0z = _mm256_set1_ps(R0[2]);
+  __m256 bestT = _mm256_set1_ps(*minIntersect);
+  __m256i bestIndex = _mm256_set1_epi32(*minIndex);
+  int end = first + count;
+
+  for (int slot = first; slot < end; slot += 8) {
+    __m256i index = _mm256_loadu_si256((__m256i *) (planes->objIndex + slot));
+    __m256 nx = _mm256_loadu_ps(planes->nx + slot);
+    __m256 ny = _mm256_loadu_ps(planes->ny + slot);
+    __m256 nz = _mm256_loadu_ps(planes->nz + slot);
+
+    __m256 dotR0 = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(nx, r0x), _mm256_mul_ps(ny, r0y)), _mm256_mul_ps(nz, r0z));
+    __m256 V0 = negate8(_mm256_add_ps(dotR0, _mm256_loadu_ps(planes->d + slot)));
+    __m256 Vd = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(nx, rdx), _mm256_mul_ps(ny, rdy)), _mm256_mul_ps(nz, rdz));
+    __m256 tVal = _mm256_div_ps(V0, Vd);
+
+    __m256i valid = lanes_valid8(slot, end, index, skipObjIndex);
+    valid = _mm256_andnot_si256(_mm256_castps_si256(_mm256_cmp_ps(Vd, _mm256_setzero_ps(), _CMP_EQ_OQ)), valid);
+
+    __m256 better = better8(tVal, index, bestT, bestIndex, valid);
+    bestT = _mm256_blendv_ps(bestT, tVal, better);
+    bestIndex = _mm256_castps_si256(_mm256_blendv_ps(_mm256_castsi256_ps(bestIndex), _mm256_castsi256_ps(index), better));
+  }
+
+  float laneT[8];
+  int laneIndex[8];
+  _mm256_storeu_ps(laneT, bestT);
+  _mm256_storeu_si256((__m256i *) laneIndex, bestIndex);
+  reduce_lanes(laneT, laneIndex, 8, minIntersect, minIndex);
+}
+
+AVX2_TARGET static void nearest_triangle_avx2(TriangleBatch *batch, TriangleRay *ray, int skipObjIndex,
+                                              float *minIntersect, int *minIndex) {
+  float *as[3] = {batch->ax, batch->ay, batch->az};
+  float *bs[3] = {batch->bx, batch->by, batch->bz};
+  float *cs[3] = {batch->cx, batch->cy, batch->cz};
+  int kx = ray->kx, ky = ray->ky, kz = ray->kz;
+  __m256 r0x = _mm256_set1_ps(ray->R0[kx]), r0y = _mm256_set1_ps(ray->R0[ky]), r0z = _mm256_set1_ps(ray->R0[kz]);
+  __m256 sx = _mm256_set1_ps(ray->sx), sy = _mm256_set1_ps(ray->sy), sz = _mm256_set1_ps(ray->sz);
+  __m256 zero = _mm256_setzero_ps();
+  __m256 bestT = _mm256_set1_ps(*minIntersect);
+  __m256i bestIndex = _mm256_set1_epi32(*minIndex);
+
+  // a batch is one register
+  __m256i index = _mm256_loadu_si256((__m256i *) batch->objIndex);
+  __m256 Az = _mm256_sub_ps(_mm256_loadu_ps(as[kz]), r0z);
+  __m256 Bz = _mm256_sub_ps(_mm256_loadu_ps(bs[kz]), r0z);
+  __m256 Cz = _mm256_sub_ps(_mm256_loadu_ps(cs[kz]), r0z);
+  __m256 Ax = _mm256_sub_ps(_mm256_sub_ps(_mm256_loadu_ps(as[kx]), r0x), _mm256_mul_ps(sx, Az));
+  __m256 Ay = _mm256_sub_ps(_mm256_sub_ps(_mm256_loadu_ps(as[ky]), r0y), _mm256_mul_ps(sy, Az));
+  __m256 Bx = _mm256_sub_ps(_mm256_sub_ps(_mm256_loadu_ps(bs[kx]), r0x), _mm256_mul_ps(sx, Bz));
+  __m256 By = _mm256_sub_ps(_mm256_sub_ps(_mm256_loadu_ps(bs[ky]), r0y), _mm256_mul_ps(sy, Bz));
+  __m256 Cx = _mm256_sub_ps(_mm256_sub_ps(_mm256_loadu_ps(cs[kx]), r0x), _mm256_mul_ps(sx, Cz));
+  __m256 Cy = _mm256_sub_ps(_mm256_sub_ps(_mm256_loadu_ps(cs[ky]), r0y), _mm256_mul_ps(sy, Cz));
+
+  __m256 U = _mm256_sub_ps(_mm256_mul_ps(Cx, By), _mm256_mul_ps(Cy, Bx));
+  __m256 V = _mm256_sub_ps(_mm256_mul_ps(Ax, Cy), _mm256_mul_ps(Ay, Cx));
+  __m256 W = _mm256_sub_ps(_mm256_mul_ps(Bx, Ay), _mm256_mul_ps(By, Ax));
+  __m256 negative = _mm256_or_ps(_mm256_or_ps(_mm256_cmp_ps(U, zero, _CMP_LT_OQ), _mm256_cmp_ps(V, zero, _CMP_LT_OQ)),
+                                 _mm256_cmp_ps(W, zero, _CMP_LT_OQ));
+  __m256 positive = _mm256_or_ps(_mm256_or_ps(_mm256_cmp_ps(U, zero, _CMP_GT_OQ), _mm256_cmp_ps(V, zero, _CMP_GT_OQ)),
+                                 _mm256_cmp_ps(W, zero, _CMP_GT_OQ));
+  __m256 onEdge = _mm256_or_ps(_mm256_or_ps(_mm256_cmp_ps(U, zero, _CMP_EQ_OQ), _mm256_cmp_ps(V, zero, _CMP_EQ_OQ)),
+                               _mm256_cmp_ps(W, zero, _CMP_EQ_OQ));
+
+  __m256 det = _mm256_add_ps(_mm256_add_ps(U, V), W);
+  __m256 T = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(U, _mm256_mul_ps(sz, Az)), _mm256_mul_ps(V, _mm256_mul_ps(sz, Bz))),
+                           _mm256_mul_ps(W, _mm256_mul_ps(sz, Cz)));
+  __m256 tVal = _mm256_div_ps(T, det);
+
+  __m256i valid = lanes_valid8(0, batch->count, index, skipObjIndex);
+  int redo = _mm256_movemask_ps(_mm256_and_ps(onEdge, _mm256_castsi256_ps(valid)));
+  __m256 miss = _mm256_or_ps(_mm256_or_ps(_mm256_and_ps(negative, positive), onEdge),
+                             _mm256_cmp_ps(det, zero, _CMP_EQ_OQ));
+  valid = _mm256_andnot_si256(_mm256_castps_si256(miss), valid);
+
+  __m256 better = better8(tVal, index, bestT, bestIndex, valid);
+  bestT = _mm256_blendv_ps(bestT, tVal, better);
+  bestIndex = _mm256_castps_si256(_mm256_blendv_ps(_mm256_castsi256_ps(bestIndex), _mm256_castsi256_ps(index), better));
+
+  float laneT[8];
+  int laneIndex[8];
+  _mm256_storeu_ps(laneT, bestT);
+  _mm256_storeu_si256((__m256i *) laneIndex, bestIndex);
+  reduce_lanes(laneT, laneIndex, 8, minIntersect, minIndex);
+  redo_triangle_lanes(batch, ray, redo, minIntersect, minIndex);
+}
+
+#endif
+
+const char *kernels_init(const char *name) {
+  int wantAuto = name == NULL || strcmp(name, "auto") == 0;
+
+#ifdef KERNELS_X86
+  __builtin_cpu_init();
+
+  if ((wantAuto || strcmp(name, "avx2") == 0) && __builtin_cpu_supports("avx2")) {
+    nearest_sphere = nearest_sphere_avx2;
+    nearest_plane = nearest_plane_avx2;
+    nearest_triangle = nearest_triangle_avx2;
+    kernelWidth = 8;
+    return "avx2";
+  }
+  if (wantAuto || strcmp(name, "sse") == 0) {
+    nearest_sphere = nearest_sphere_sse;
+    nearest_plane = nearest_plane_sse;
+    nearest_triangle = nearest_triangle_sse;
+    kernelWidth = 4;
+    return "sse";
+  }
+#endif
+
+  nearest_sphere = nearest_sphere_scalar;
+  nearest_plane = nearest_plane_scalar;
+  nearest_triangle = nearest_triangle_scalar;
+  kernelWidth = 1;
+  return "scalar";
+}
+
+int kernel_width(void) {
+  return kernelWidth;
+}
+
+// padding entries have NaN coordinates, so every test against them fails
+static float *padded_floats(int count) {
+  float *values = (float *) malloc((count + KERNEL_PADDING) * sizeof(float));
+
+  for (int index = count; index < count + KERNEL_PADDING; index += 1) {
+    values[index] = NAN;
+  }
+  return values;
+}
+
+static int *padded_ints(int count) {
+  int *values = (int *) malloc((count + KERNEL_PADDING) * sizeof(int));
+
+  for (int index = count; index < count + KERNEL_PADDING; index += 1) {
+    values[index] = -1;
+  }
+  return values;
+}
+
+void sphere_arrays_alloc(SphereArrays *spheres, int count) {
+  spheres->cx = padded_floats(count);
+  spheres->cy = padded_floats(count);
+  spheres->cz = padded_floats(count);
+  spheres->r2 = padded_floats(count);
+  spheres->objIndex = padded_ints(count);
+  spheres->count = count;
+}
+
+void plane_arrays_alloc(PlaneArrays *planes, int count) {
+  planes->nx = padded_floats(count);
+  planes->ny = padded_floats(count);
+  planes->nz = padded_floats(count);
+  planes->d = padded_floats(count);
+  planes->objIndex = padded_ints(count);
+  planes->count = count;
+}
+
+void sphere_arrays_free(SphereArrays *spheres) {
+  free(spheres->cx);
+  free(spheres->cy);
+  free(spheres->cz);
+  free(spheres->r2);
+  free(spheres->objIndex);
+  spheres->count = 0;
+}
+
+void plane_arrays_free(PlaneArrays *planes) {
+  free(planes->nx);
+  free(planes->ny);
+  free(planes->nz);
+  free(planes->d);
+  free(planes->objIndex);
+  planes->count = 0;
+}
@@ -0,0 +1,100 @@
+#ifndef KERNELS_H
+#define KERNELS_H
+
+// structure of arrays copies of the scene geometry, so one ray can be tested
+// against several spheres, planes or triangles at once. every array has KERNEL_PADDING
+// extra entries past count that never produce a hit, letting the vector
+// kernels read whole registers at the end of a range
+
+#define KERNEL_PADDING 8
+
+typedef struct SphereArrays {
+  float *cx;
+  float *cy;
+  float *cz;
+  // radius squared
+  float *r2;
+  // index of the sphere in the scene's object list
+  int *objIndex;
+  int count;
+} SphereArrays;
+
+typedef struct PlaneArrays {
+  float *nx;
+  float *ny;
+  float *nz;
+  // plane_intersect's distance term, length of the plane position
+  float *d;
+  int *objIndex;
+  int count;
+} PlaneArrays;
+
+// most triangles in a batch, which is one avx2 register or two sse ones
+#define TRIANGLE_BATCH 8
+
+// triangles with their corners a, b and c gathered from a mesh's shared
+// vertices. lanes past count are ignored
+typedef struct TriangleBatch {
+  float ax[TRIANGLE_BATCH];
+  float ay[TRIANGLE_BATCH];
+  float az[TRIANGLE_BATCH];
+  float bx[TRIANGLE_BATCH];
+  float by[TRIANGLE_BATCH];
+  float bz[TRIANGLE_BATCH];
+  float cx[TRIANGLE_BATCH];
+  float cy[TRIANGLE_BATCH];
+  float cz[TRIANGLE_BATCH];
+  int objIndex[TRIANGLE_BATCH];
+  int count;
+} TriangleBatch;
+
+// a ray set up for the watertight triangle test (woop, benthin and wald
+// 2013). kz is the axis the ray runs along most, and the shear sx, sy, sz
+// turns the ray into the +z axis, where the test is 2d
+typedef struct TriangleRay {
+  int kx;
+  int ky;
+  int kz;
+  float sx;
+  float sy;
+  float sz;
+  float R0[3];
+} TriangleRay;
+
+void triangle_ray_init(TriangleRay *ray, float *Rd, float *R0);
+
+// t value of the ray against one triangle, negative if it misses. a ray
+// through an edge or a vertex hits at least one of the triangles sharing it
+float triangle_intersect(TriangleRay *ray, float *a, float *b, float *c);
+
+// tests the ray against entries [first, first + count) and replaces
+// minIntersect / minIndex with any closer hit, using the same arithmetic as
+// sphere_intersect and plane_intersect so results match them bit for bit.
+// equal t values go to the lower object index, and skipObjIndex never hits
+typedef void (*sphere_kernel_fn)(SphereArrays *spheres, int first, int count, float *Rd, float *R0,
+                                 int skipObjIndex, float *minIntersect, int *minIndex);
+typedef void (*plane_kernel_fn)(PlaneArrays *planes, int first, int count, float *Rd, float *R0,
+                                int skipObjIndex, float *minIntersect, int *minIndex);
+
+// triangle kernels test a whole batch the same way, with triangle_intersect's arithmetic
+typedef void (*triangle_kernel_fn)(TriangleBatch *batch, TriangleRay *ray, int skipObjIndex, float *minIntersect,
+                                   int *minIndex);
+
+extern sphere_kernel_fn nearest_sphere;
+extern plane_kernel_fn nearest_plane;
+extern triangle_kernel_fn nearest_triangle;
+
+// picks the kernels, name is "auto", "scalar", "sse" or "avx2". auto takes
+// the widest one this cpu supports, and an unsupported request falls back to
+// scalar. returns the name of the kernels in use
+const char *kernels_init(const char *name);
+
+// lanes per kernel call, 1 for scalar
+int kernel_width(void);
+
+void sphere_arrays_alloc(SphereArrays *spheres, int count);
+void plane_arrays_alloc(PlaneArrays *planes, int count);
+void sphere_arrays_free(SphereArrays *spheres);
+void plane_arrays_free(PlaneArrays *planes);
+
+#endif
@@ -0,0 +1,173 @@
+#include <math.h>
+#include <stdbool.h>
+#include "packet.h"
+
+// range of the packet's inverse directions per axis. only valid when every
+// ray points the same way along every axis, which keeps the near and far
+// slab of a box the same for the whole packet
+typedef struct PacketBounds {
+  bool valid;
+  float invMin[3];
+  float invMax[3];
+} PacketBounds;
+
+static void packet_bounds(RayPacket *packet, PacketBounds *bounds) {
+  bounds->valid = true;
+
+  for (int axis = 0; axis < 3; axis += 1) {
+    bounds->invMin[axis] = INFINITY;
+    bounds->invMax[axis] = -INFINITY;
+    for (int ray = 0; ray < packet->count; ray += 1) {
+      float inv = packet->invRd[axis][ray];
+      bounds->invMin[axis] = fminf(bounds->invMin[axis], inv);
+      bounds->invMax[axis] = fmaxf(bounds->invMax[axis], inv);
+    }
+
+    bool sameSign = bounds->invMin[axis] > 0 || bounds->invMax[axis] < 0;
+    if (!sameSign || isinf(bounds->invMin[axis]) || isinf(bounds->invMax[axis])) {
+      bounds->valid = false;
+    }
+  }
+}
+
+// interval version of the slab test over every direction in the packet.
+// x * inv is monotonic in inv, so these bounds also hold for the rounded
+// per ray values. returns false only when no ray can enter the box before maxT
+static bool packet_may_hit(BVHNode *node, float *R0, PacketBounds *bounds, float maxT, float margin) {
+  float tNear = 0;
+  float tFar = maxT;
+
+  for (int axis = 0; axis < 3; axis += 1) {
+    float low = node->min[axis] - margin - R0[axis];
+    float high = node->max[axis] + margin - R0[axis];
+    float nearSlab = bounds->invMin[axis] > 0 ? low : high;
+    float farSlab = bounds->invMin[axis] > 0 ? high : low;
+
+    float nearest = nearSlab >= 0 ? nearSlab * bounds->invMin[axis] : nearSlab * bounds->invMax[axis];
+    float farthest = farSlab >= 0 ? farSlab * bounds->invMax[axis] : farSlab * bounds->invMin[axis];
+
+    tNear = fmaxf(tNear, nearest);
+    tFar = fminf(tFar, farthest);
+  }
+
+  return tNear <= tFar;
+}
+
+// same slab test as bvh_ray_box for one ray of the packet
+static inline bool ray_hits_box(BVHNode *node, RayPacket *packet, int ray, float maxT, float margin) {
+  float tNear = 0;
+  float tFar = maxT;
+
+  for (int axis = 0; axis < 3; axis += 1) {
+    float t0 = (node->min[axis] - margin - packet->R0[axis]) * packet->invRd[axis][ray];
+    float t1 = (node->max[axis] + margin - packet->R0[axis]) * packet->invRd[axis][ray];
+
+    tNear = fmaxf(tNear, fminf(t0, t1));
+    tFar = fminf(tFar, fmaxf(t0, t1));
+  }
+
+  return tNear <= tFar;
+}
+
+void shoot_packet(RayPacket *packet, Scene *scene, RayStats *stats) {
+  for (int ray = 0; ray < packet->count; ray += 1) {
+    packet->tVal[ray] = 10000000;
+    packet->objIndex[ray] = -1;
+
+    for (int axis = 0; axis < 3; axis += 1) {
+      packet->invRd[axis][ray] = 1.0f / packet->Rd[ray][axis];
+    }
+
+    // planes are unbounded, so they are always tested
+    nearest_plane(&scene->planes, 0, scene->planes.count, packet->Rd[ray], packet->R0, -1,
+                  &packet->tVal[ray], &packet->objIndex[ray]);
+  }
+  STAT_ADD(stats, planeTests, (long) packet->count * scene->planes.count);
+
+  BVH *bvh = &scene->bvh;
+  if (bvh->nodeCount > 0) {
+    PacketBounds bounds;
+    packet_bounds(packet, &bounds);
+    float margin = origin_margin(scene, packet->R0);
+
+    int stack[BVH_STACK_SIZE];
+    int stackSize = 1;
+    stack[0] = 0;
+
+    while (stackSize > 0) {
+      stackSize -= 1;
+      int nodeIndex = stack[stackSize];
+      BVHNode *node = &bvh->nodes[nodeIndex];
+
+      // skip the node for the whole packet when no ray can reach it before
+      // the farthest closest hit found so far
+      float maxT = 0;
+      for (int ray = 0; ray < packet->count; ray += 1) {
+        maxT = fmaxf(maxT, packet->tVal[ray]);
+      }
+      if (bounds.valid && !packet_may_hit(node, packet->R0, &bounds, maxT, margin)) {
+        continue;
+      }
+
+      STAT_ADD(stats, nodeTests, packet->count);
+      int active[PACKET_MAX_RAYS];
+      int activeCount = 0;
+      for (int ray = 0; ray < packet->count; ray += 1) {
+        if (ray_hits_box(node, packet, ray, packet->tVal[ray], margin)) {
+          active[activeCount] = ray;
+          activeCount += 1;
+        }
+      }
+      if (activeCount == 0) {
+        continue;
+      }
+
+      if (node->count > 0) {
+        for (int activeI = 0; activeI < activeCount; activeI += 1) {
+          int ray = active[activeI];
+          nearest_sphere(&scene->spheres, node->first, node->count, packet->Rd[ray], packet->R0, -1,
+                         &packet->tVal[ray], &packet->objIndex[ray]);
+        }
+        STAT_ADD(stats, sphereTests, (long) activeCount * node->count);
+        continue;
+      }
+
+      // visit the child on the side the first active ray comes from first,
+      // judged along the axis the two children are most apart on
+      BVHNode *left = &bvh->nodes[nodeIndex + 1];
+      BVHNode *right = &bvh->nodes[node->first];
+      int axis = 0;
+      float widest = -1;
+      for (int candidate = 0; candidate < 3; candidate += 1) {
+        float apart = fabsf((left->min[candidate] + left->max[candidate]) - (right->min[candidate] + right->max[candidate]));
+        if (apart > widest) {
+          widest = apart;
+          axis = candidate;
+        }
+      }
+
+      bool leftFirst = (left->min[axis] + left->max[axis] <= right->min[axis] + right->max[axis]) ==
+                       (packet->Rd[active[0]][axis] >= 0);
+      stack[stackSize] = leftFirst ? node->first : nodeIndex + 1;
+      stack[stackSize + 1] = leftFirst ? nodeIndex + 1 : node->first;
+      stackSize += 2;
+    }
+  }
+
+  // instances and meshes are traced ray by ray, starting from the packet's hits
+  if (scene->instanceBvh.nodeCount > 0 || scene->meshCount > 0) {
+    for (int ray = 0; ray < packet->count; ray += 1) {
+      nearest_instance(scene, packet->Rd[ray], packet->R0, -1, &packet->tVal[ray], &packet->objIndex[ray], false, stats);
+      nearest_mesh(scene, packet->Rd[ray], packet->R0, -1, &packet->tVal[ray], &packet->objIndex[ray], false, stats);
+    }
+  }
+
+  for (int ray = 0; ray < packet->count; ray += 1) {
+    if (packet->objIndex[ray] < 0) {
+      packet->tVal[ray] = -1;
+    }
+    else {
+      STAT_ADD(stats, hits, 1);
+    }
+  }
+}
@@ -0,0 +1,27 @@
+#ifndef PACKET_H
+#define PACKET_H
+
+#include "Raycaster.h"
+
+// up to an 8x8 block of primary rays sharing the camera origin
+#define PACKET_MAX_RAYS 64
+
+typedef struct RayPacket {
+  int count;
+  float R0[3];
+  float Rd[PACKET_MAX_RAYS][3];
+
+  // per axis inverse directions, laid out by axis for the box tests
+  float invRd[3][PACKET_MAX_RAYS];
+
+  // results, same as shoot() would give for each ray on its own
+  float tVal[PACKET_MAX_RAYS];
+  int objIndex[PACKET_MAX_RAYS];
+} RayPacket;
+
+// finds the closest hit of every ray in the packet. bvh nodes are visited
+// once for the whole packet, and a node is skipped for every ray at once when
+// the box can't be reached by any direction inside the packet
+void shoot_packet(RayPacket *packet, Scene *scene, RayStats *stats);
+
+#endif
@@ -0,0 +1,1309 @@
+#include <fcntl.h>
+#include <math.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "parser.h"
+#include "vec3.h"
+
+// files bigger than this are parsed in chunks of about this size
+#define PARSE_CHUNK_BYTES (4 << 20)
+
+// a mesh line. its obj file is read once the whole scene file is parsed
+typedef struct MeshLine {
+  char file[256];
+  Material material;
+  float position[3];
+  float scale;
+  int quantize;
+} MeshLine;
+
+typedef struct Chunk {
+  const char *begin;
+  const char *end;
+
+  Object *objects;
+  int objectCount;
+  int objectCapacity;
+  Light *lights;
+  int lightCount;
+  int lightCapacity;
+  Material *materials;
+  int materialCount;
+  int materialCapacity;
+  PrototypeSphere *prototypeSpheres;
+  int prototypeSphereCount;
+  int prototypeSphereCapacity;
+  Instance *instances;
+  int instanceCount;
+  int instanceCapacity;
+  MeshLine *meshes;
+  int meshCount;
+  int meshCapacity;
+
+  // newlines in the chunk, used to number the lines of later chunks
+  int lines;
+
+  // chunk relative line (from 0) and column (from 1) of the first error
+  int errorLine;
+  int errorColumn;
+  char error[128];
+} Chunk;
+
+// a material, prototype sphere, instance or grid of instances being read
+typedef struct Instancing {
+  // 0 material, 1 prototype sphere, 2 instance, 3 instance grid
+  int kind;
+  Material material;
+  PrototypeSphere sphere;
+  Instance instance;
+  // instances along each axis of a grid and the distance between them
+  int count[3];
+  float spacing[3];
+} Instancing;
+
+// an obj file's vertices and triangles, vertices numbered from 0
+typedef struct ObjData {
+  float (*vertices)[3];
+  int vertexCount;
+  int vertexCapacity;
+  int (*triangles)[3];
+  int triangleCount;
+  int triangleCapacity;
+} ObjData;
+
+typedef struct Cursor {
+  const char *pos;
+  const char *end;
+  const char *lineStart;
+  int line;
+  Chunk *chunk;
+} Cursor;
+
+// every power of ten up to 1e10 is exact in a float
+static const float powersOfTen[] = {
+  1e0f, 1e1f, 1e2f, 1e3f, 1e4f, 1e5f, 1e6f, 1e7f, 1e8f, 1e9f, 1e10f
+};
+
+static bool is_digit(char c) {
+  return c >= '0' && c <= '9';
+}
+
+static bool is_blank(char c) {
+  return c == ' ' || c == '\t' || c == '\r';
+}
+
+// strtof needs a terminated string, so the slow path works on a copy
+static int parse_float_slow(const char *begin, const char *end, float *value) {
+  char buffer[64];
+  int length = end - begin < 63 ? (int) (end - begin) : 63;
+
+  memcpy(buffer, begin, length);
+  buffer[length] = '\0';
+
+  char *stop;
+  *value = strtof(buffer, &stop);
+  return (int) (stop - buffer);
+}
+
+int parse_float(const char *begin, const char *end, float *value) {
+  const char *pos = begin;
+  bool negative = false;
+
+  if (pos < end && (*pos == '-' || *pos == '+')) {
+    negative = *pos == '-';
+    pos += 1;
+  }
+
+  // inf, nan and hex floats are rare enough to leave to strtof
+  if (pos >= end || !(is_digit(*pos) || *pos == '.') ||
+      (*pos == '0' && pos + 1 < end && (pos[1] == 'x' || pos[1] == 'X'))) {
+    return parse_float_slow(begin, end, value);
+  }
+
+  uint64_t mantissa = 0;
+  int significant = 0;
+  int exponent = 0;
+  bool sawDigit = false;
+
+  for (; pos < end && is_digit(*pos); pos += 1) {
+    sawDigit = true;
+    if (mantissa > 0 || *pos != '0') {
+      significant += 1;
+    }
+    mantissa = mantissa * 10 + (*pos - '0');
+  }
+  if (pos < end && *pos == '.') {
+    pos += 1;
+    for (; pos < end && is_digit(*pos); pos += 1) {
+      sawDigit = true;
+      if (mantissa > 0 || *pos != '0') {
+        significant += 1;
+      }
+      mantissa = mantissa * 10 + (*pos - '0');
+      exponent -= 1;
+    }
+  }
+  if (!sawDigit) {
+    return 0;
+  }
+
+  // an exponent only counts if it has digits, like strtof
+  if (pos < end && (*pos == 'e' || *pos == 'E')) {
+    const char *exponentPos = pos + 1;
+    bool exponentNegative = false;
+    if (exponentPos < end && (*exponentPos == '-' || *exponentPos == '+')) {
+      exponentNegative = *exponentPos == '-';
+      exponentPos += 1;
+    }
+    if (exponentPos < end && is_digit(*exponentPos)) {
+      int written = 0;
+      for (; exponentPos < end && is_digit(*exponentPos); exponentPos += 1) {
+        written = written < 10000 ? written * 10 + (*exponentPos - '0') : written;
+      }
+      exponent += exponentNegative ? -written : written;
+      pos = exponentPos;
+    }
+  }
+
+  // with the mantissa and the power of ten both exact in a float, one float
+  // multiply or divide is correctly rounded, so it matches strtof exactly
+  if (mantissa == 0) {
+    *value = negative ? -0.0f : 0.0f;
+  }
+  else if (significant <= 19 && mantissa <= (1 << 24) && exponent >= -10 && exponent <= 10) {
+    float result = (float) mantissa;
+    result = exponent < 0 ? result / powersOfTen[-exponent] : result * powersOfTen[exponent];
+    *value = negative ? -result : result;
+  }
+  else {
+    return parse_float_slow(begin, pos, value) == pos - begin ? (int) (pos - begin) : 0;
+  }
+
+  return (int) (pos - begin);
+}
+
+static int fail(Cursor *cursor, const char *at, const char *format, ...) {
+  Chunk *chunk = cursor->chunk;
+
+  chunk->errorLine = cursor->line;
+  chunk->errorColumn = (int) (at - cursor->lineStart) + 1;
+
+  va_list args;
+  va_start(args, format);
+  vsnprintf(chunk->error, sizeof(chunk->error), format, args);
+  va_end(args);
+
+  return -1;
+}
+
+static void skip_blanks(Cursor *cursor) {
+  while (cursor->pos < cursor->end && is_blank(*cursor->pos)) {
+    cursor->pos += 1;
+  }
+}
+
+static bool at_line_end(Cursor *cursor) {
+  return cursor->pos >= cursor->end || *cursor->pos == '\n';
+}
+
+// moves past the end of the current line
+static void next_line(Cursor *cursor) {
+  while (cursor->pos < cursor->end && *cursor->pos != '\n') {
+    cursor->pos += 1;
+  }
+  if (cursor->pos < cursor->end) {
+    cursor->pos += 1;
+    cursor->line += 1;
+    cursor->chunk->lines += 1;
+  }
+  cursor->lineStart = cursor->pos;
+}
+
+// the next whitespace separated word on the line, without copying it
+static int read_word(Cursor *cursor, const char **word) {
+  skip_blanks(cursor);
+  *word = cursor->pos;
+  while (cursor->pos < cursor->end && !is_blank(*cursor->pos) && *cursor->pos != '\n') {
+    cursor->pos += 1;
+  }
+  return (int) (cursor->pos - *word);
+}
+
+static bool word_is(const char *word, int length, const char *name) {
+  return (int) strlen(name) == length && memcmp(word, name, length) == 0;
+}
+
+static int read_number(Cursor *cursor, float *value) {
+  skip_blanks(cursor);
+
+  int used = parse_float(cursor->pos, cursor->end, value);
+  const char *after = cursor->pos + used;
+  if (used == 0 || (after < cursor->end && !is_blank(*after) && *after != '\n' && *after != ',' && *after != ']')) {
+    return fail(cursor, cursor->pos, "expected a number");
+  }
+
+  cursor->pos = after;
+  return 0;
+}
+
+static int expect(Cursor *cursor, char c) {
+  skip_blanks(cursor);
+  if (cursor->pos >= cursor->end || *cursor->pos != c) {
+    return fail(cursor, cursor->pos, "expected '%c'", c);
+  }
+  cursor->pos += 1;
+  return 0;
+}
+
+// [x, y, z]
+static int read_vector(Cursor *cursor, float *vector) {
+  if (expect(cursor, '[') < 0) {
+    return -1;
+  }
+  for (int axis = 0; axis < 3; axis += 1) {
+    if (read_number(cursor, &vector[axis]) < 0 || expect(cursor, axis < 2 ? ',' : ']') < 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+static int read_object_property(Cursor *cursor, Object *obj, const char *key, int length) {
+  if (word_is(key, length, "diffuse_color:")) {
+    return read_vector(cursor, obj->diffuse);
+  }
+  if (word_is(key, length, "specular_color:")) {
+    return read_vector(cursor, obj->specular);
+  }
+  if (word_is(key, length, "position:")) {
+    return read_vector(cursor, obj->position);
+  }
+  if (word_is(key, length, "reflectivity:")) {
+    return read_number(cursor, &obj->reflectivity);
+  }
+  if (word_is(key, length, "ns:")) {
+    return read_number(cursor, &obj->ns);
+  }
+  if (obj->kind == 1 && word_is(key, length, "width:")) {
+    return read_number(cursor, &obj->width);
+  }
+  if (obj->kind == 1 && word_is(key, length, "height:")) {
+    return read_number(cursor, &obj->height);
+  }
+  if (obj->kind == 2 && word_is(key, length, "radius:")) {
+    return read_number(cursor, &obj->radius);
+  }
+  if (obj->kind == 3 && word_is(key, length, "normal:")) {
+    if (read_vector(cursor, obj->normal) < 0) {
+      return -1;
+    }
+    // normalize normal vector
+    vec3_store(obj->normal, vec3_normalize(vec3_load(obj->normal)));
+    return 0;
+  }
+
+  return fail(cursor, key, "unknown property '%.*s'", length, key);
+}
+
+static int read_light_property(Cursor *cursor, Light *light, const char *key, int length) {
+  if (word_is(key, length, "color:")) {
+    return read_vector(cursor, light->color);
+  }
+  if (word_is(key, length, "position:")) {
+    return read_vector(cursor, light->position);
+  }
+  if (word_is(key, length, "direction:")) {
+    if (read_vector(cursor, light->direction) < 0) {
+      return -1;
+    }
+    // normalize direction vector
+    vec3_store(light->direction, vec3_normalize(vec3_load(light->direction)));
+    return 0;
+  }
+  if (word_is(key, length, "radial-a0:")) {
+    return read_number(cursor, &light->radial_a0);
+  }
+  if (word_is(key, length, "radial-a1:")) {
+    return read_number(cursor, &light->radial_a1);
+  }
+  if (word_is(key, length, "radial-a2:")) {
+    return read_number(cursor, &light->radial_a2);
+  }
+  if (word_is(key, length, "angular-a0:")) {
+    return read_number(cursor, &light->angular_a0);
+  }
+  if (word_is(key, length, "theta:")) {
+    if (read_number(cursor, &light->theta) < 0) {
+      return -1;
+    }
+    // calculate acos for future use
+    float PI = 3.14159265359;
+    light->spotlightDotProd = acosf((light->theta * PI) / 180);
+    return 0;
+  }
+
+  return fail(cursor, key, "unknown property '%.*s'", length, key);
+}
+
+// frame and index numbers, whole and not negative
+static int read_count(Cursor *cursor, int *value) {
+  const char *at = cursor->pos;
+  float number;
+
+  if (read_number(cursor, &number) < 0) {
+    return -1;
+  }
+  if (number < 0 || number != floorf(number) || number > 1e9f) {
+    return fail(cursor, at, "expected a whole number of 0 or more");
+  }
+  *value = (int) number;
+  return 0;
+}
+
+// [x, y, z] of whole numbers
+static int read_counts(Cursor *cursor, int *counts) {
+  if (expect(cursor, '[') < 0) {
+    return -1;
+  }
+  for (int axis = 0; axis < 3; axis += 1) {
+    if (read_count(cursor, &counts[axis]) < 0 || expect(cursor, axis < 2 ? ',' : ']') < 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+// boxes and rays are moved into a prototype's coordinates by dividing by the
+// scale, and a mesh turned inside out by a negative one would face the wrong way
+static int read_scale(Cursor *cursor, float *scale) {
+  const char *at = cursor->pos;
+  if (read_number(cursor, scale) < 0) {
+    return -1;
+  }
+  if (!(*scale > 0) || isinf(*scale)) {
+    return fail(cursor, at, "scale has to be more than 0");
+  }
+  return 0;
+}
+
+static int read_instancing_property(Cursor *cursor, Instancing *item, const char *key, int length) {
+  if (item->kind == 0) {
+    Material *material = &item->material;
+    if (word_is(key, length, "diffuse_color:")) {
+      return read_vector(cursor, material->diffuse);
+    }
+    if (word_is(key, length, "specular_color:")) {
+      return read_vector(cursor, material->specular);
+    }
+    if (word_is(key, length, "reflectivity:")) {
+      return read_number(cursor, &material->reflectivity);
+    }
+    if (word_is(key, length, "ns:")) {
+      return read_number(cursor, &material->ns);
+    }
+  }
+  else if (item->kind == 1) {
+    PrototypeSphere *sphere = &item->sphere;
+    if (word_is(key, length, "prototype:")) {
+      return read_count(cursor, &sphere->prototype);
+    }
+    if (word_is(key, length, "material:")) {
+      return read_count(cursor, &sphere->material);
+    }
+    if (word_is(key, length, "radius:")) {
+      return read_number(cursor, &sphere->radius);
+    }
+    if (word_is(key, length, "position:")) {
+      return read_vector(cursor, sphere->position);
+    }
+  }
+  else {
+    Instance *instance = &item->instance;
+    if (word_is(key, length, "prototype:")) {
+      return read_count(cursor, &instance->prototype);
+    }
+    if (word_is(key, length, "position:")) {
+      return read_vector(cursor, instance->position);
+    }
+    if (word_is(key, length, "scale:")) {
+      return read_scale(cursor, &instance->scale);
+    }
+    if (item->kind == 3 && word_is(key, length, "count:")) {
+      return read_counts(cursor, item->count);
+    }
+    if (item->kind == 3 && word_is(key, length, "spacing:")) {
+      return read_vector(cursor, item->spacing);
+    }
+  }
+
+  return fail(cursor, key, "unknown property '%.*s'", length, key);
+}
+
+static int read_mesh_property(Cursor *cursor, MeshLine *mesh, const char *key, int length) {
+  if (word_is(key, length, "file:")) {
+    skip_blanks(cursor);
+    const char *path = cursor->pos;
+    while (cursor->pos < cursor->end && !is_blank(*cursor->pos) && *cursor->pos != '\n' && *cursor->pos != ',') {
+      cursor->pos += 1;
+    }
+    int pathLength = (int) (cursor->pos - path);
+    if (pathLength == 0 || pathLength >= (int) sizeof(mesh->file)) {
+      return fail(cursor, path, "expected an obj file name of up to %d characters", (int) sizeof(mesh->file) - 1);
+    }
+    memcpy(mesh->file, path, pathLength);
+    mesh->file[pathLength] = '\0';
+    return 0;
+  }
+  if (word_is(key, length, "diffuse_color:")) {
+    return read_vector(cursor, mesh->material.diffuse);
+  }
+  if (word_is(key, length, "specular_color:")) {
+    return read_vector(cursor, mesh->material.specular);
+  }
+  if (word_is(key, length, "reflectivity:")) {
+    return read_number(cursor, &mesh->material.reflectivity);
+  }
+  if (word_is(key, length, "ns:")) {
+    return read_number(cursor, &mesh->material.ns);
+  }
+  if (word_is(key, length, "position:")) {
+    return read_vector(cursor, mesh->position);
+  }
+  if (word_is(key, length, "scale:")) {
+    return read_scale(cursor, &mesh->scale);
+  }
+  if (word_is(key, length, "quantize:")) {
+    const char *at = cursor->pos;
+    if (read_count(cursor, &mesh->quantize) < 0) {
+      return -1;
+    }
+    if (mesh->quantize > 1) {
+      return fail(cursor, at, "quantize is 0 or 1");
+    }
+    return 0;
+  }
+
+  return fail(cursor, key, "unknown property '%.*s'", length, key);
+}
+
+static int read_keyframe_property(Cursor *cursor, Keyframe *key, const char *at, int length) {
+  if (word_is(at, length, "frame:")) {
+    return read_count(cursor, &key->frame);
+  }
+  if (key->target != 0 && word_is(at, length, "index:")) {
+    return read_count(cursor, &key->index);
+  }
+  if (word_is(at, length, "position:")) {
+    return read_vector(cursor, key->position);
+  }
+
+  return fail(cursor, at, "unknown property '%.*s'", length, at);
+}
+
+// reads "key: value," pairs until the end of the line, into whichever of
+// obj, light, item, mesh and key isn't NULL
+static int read_properties(Cursor *cursor, Object *obj, Light *light, Instancing *item, MeshLine *mesh, Keyframe *key) {
+  while (1) {
+    skip_blanks(cursor);
+    if (at_line_end(cursor)) {
+      return 0;
+    }
+
+    const char *name;
+    int length = read_word(cursor, &name);
+    if (name[length - 1] != ':') {
+      return fail(cursor, name, "expected a property name ending in ':'");
+    }
+
+    int status;
+    if (obj != NULL) {
+      status = read_object_property(cursor, obj, name, length);
+    }
+    else if (light != NULL) {
+      status = read_light_property(cursor, light, name, length);
+    }
+    else if (item != NULL) {
+      status = read_instancing_property(cursor, item, name, length);
+    }
+    else if (mesh != NULL) {
+      status = read_mesh_property(cursor, mesh, name, length);
+    }
+    else {
+      status = read_keyframe_property(cursor, key, name, length);
+    }
+    if (status < 0) {
+      return -1;
+    }
+
+    // values are separated by commas
+    skip_blanks(cursor);
+    if (cursor->pos < cursor->end && *cursor->pos == ',') {
+      cursor->pos += 1;
+    }
+    else if (!at_line_end(cursor)) {
+      return fail(cursor, cursor->pos, "expected ',' or the end of the line");
+    }
+  }
+}
+
+// room for needed entries of size bytes, growing the array by at least double
+static void *grow_array(void *array, int *capacity, int needed, size_t size) {
+  if (needed > *capacity) {
+    *capacity = *capacity * 2 > needed ? *capacity * 2 : (needed > 16 ? needed : 16);
+    array = realloc(array, (size_t) *capacity * size);
+  }
+  return array;
+}
+
+static void add_object(Chunk *chunk, Object *obj) {
+  chunk->objects = (Object *) grow_array(chunk->objects, &chunk->objectCapacity, chunk->objectCount + 1, sizeof(Object));
+  chunk->objects[chunk->objectCount] = *obj;
+  chunk->objectCount += 1;
+}
+
+static void add_light(Chunk *chunk, Light *light) {
+  chunk->lights = (Light *) grow_array(chunk->lights, &chunk->lightCapacity, chunk->lightCount + 1, sizeof(Light));
+  chunk->lights[chunk->lightCount] = *light;
+  chunk->lightCount += 1;
+}
+
+// a material, a prototype sphere, or the instances of an instance or a grid
+static int add_instancing(Cursor *cursor, Instancing *item, const char *kind) {
+  Chunk *chunk = cursor->chunk;
+
+  if (item->kind == 0) {
+    chunk->materials = (Material *) grow_array(chunk->materials, &chunk->materialCapacity, chunk->materialCount + 1,
+                                               sizeof(Material));
+    chunk->materials[chunk->materialCount] = item->material;
+    chunk->materialCount += 1;
+    return 0;
+  }
+  if (item->kind == 1) {
+    chunk->prototypeSpheres = (PrototypeSphere *) grow_array(chunk->prototypeSpheres, &chunk->prototypeSphereCapacity,
+                                                             chunk->prototypeSphereCount + 1, sizeof(PrototypeSphere));
+    chunk->prototypeSpheres[chunk->prototypeSphereCount] = item->sphere;
+    chunk->prototypeSphereCount += 1;
+    return 0;
+  }
+
+  int *count = item->count;
+  double total = (double) count[0] * count[1] * count[2];
+  if (total == 0) {
+    return fail(cursor, kind, "instance grid needs a count of 1 or more along every axis");
+  }
+  if (total > INT32_MAX - chunk->instanceCount) {
+    return fail(cursor, kind, "too many instances");
+  }
+
+  chunk->instances = (Instance *) grow_array(chunk->instances, &chunk->instanceCapacity,
+                                             chunk->instanceCount + (int) total, sizeof(Instance));
+  Instance *instance = &chunk->instances[chunk->instanceCount];
+  for (int z = 0; z < count[2]; z += 1) {
+    for (int y = 0; y < count[1]; y += 1) {
+      for (int x = 0; x < count[0]; x += 1) {
+        *instance = item->instance;
+        instance->position[0] += x * item->spacing[0];
+        instance->position[1] += y * item->spacing[1];
+        instance->position[2] += z * item->spacing[2];
+        instance += 1;
+      }
+    }
+  }
+  chunk->instanceCount += (int) total;
+  return 0;
+}
+
+static void add_mesh(Chunk *chunk, MeshLine *mesh) {
+  chunk->meshes = (MeshLine *) grow_array(chunk->meshes, &chunk->meshCapacity, chunk->meshCount + 1, sizeof(MeshLine));
+  chunk->meshes[chunk->meshCount] = *mesh;
+  chunk->meshCount += 1;
+}
+
+// one object, light, material, prototype sphere, instance or mesh per line
+static int parse_line(Cursor *cursor) {
+  const char *kind;
+  int length = read_word(cursor, &kind);
+
+  // blank lines are fine
+  if (length == 0) {
+    return 0;
+  }
+
+  if (word_is(kind, length, "light,")) {
+    Light light;
+    memset(&light, 0, sizeof(light));
+
+    if (read_properties(cursor, NULL, &light, NULL, NULL, NULL) < 0) {
+      return -1;
+    }
+
+    // assign kind based on theta
+    light.kind = light.theta == 0 ? 1 : 2;
+    add_light(cursor->chunk, &light);
+    return 0;
+  }
+
+  if (word_is(kind, length, "mesh,")) {
+    MeshLine mesh;
+    memset(&mesh, 0, sizeof(mesh));
+    mesh.material.ns = 20;
+    mesh.scale = 1;
+
+    if (read_properties(cursor, NULL, NULL, NULL, &mesh, NULL) < 0) {
+      return -1;
+    }
+    if (mesh.file[0] == '\0') {
+      return fail(cursor, kind, "mesh needs a file");
+    }
+    add_mesh(cursor->chunk, &mesh);
+    return 0;
+  }
+
+  Instancing item;
+  memset(&item, 0, sizeof(item));
+  item.kind = -1;
+  if (word_is(kind, length, "material,")) {
+    item.kind = 0;
+    item.material.ns = 20;
+  }
+  else if (word_is(kind, length, "prototype-sphere,")) {
+    item.kind = 1;
+  }
+  else if (word_is(kind, length, "instance,")) {
+    item.kind = 2;
+  }
+  else if (word_is(kind, length, "instance-grid,")) {
+    item.kind = 3;
+  }
+  if (item.kind >= 0) {
+    item.instance.scale = 1;
+    for (int axis = 0; axis < 3; axis += 1) {
+      item.count[axis] = 1;
+    }
+    if (read_properties(cursor, NULL, NULL, &item, NULL, NULL) < 0) {
+      return -1;
+    }
+    return add_instancing(cursor, &item, kind);
+  }
+
+  Object obj;
+  memset(&obj, 0, sizeof(obj));
+  obj.ns = 20;
+
+  if (word_is(kind, length, "camera,")) {
+    obj.kind = 1;
+  }
+  else if (word_is(kind, length, "sphere,")) {
+    obj.kind = 2;
+  }
+  else if (word_is(kind, length, "plane,")) {
+    obj.kind = 3;
+  }
+  else {
+    return fail(cursor, kind, "unknown object '%.*s'", length, kind);
+  }
+
+  if (read_properties(cursor, &obj, NULL, NULL, NULL, NULL) < 0) {
+    return -1;
+  }
+  add_object(cursor->chunk, &obj);
+  return 0;
+}
+
+static void parse_chunk(Chunk *chunk) {
+  Cursor cursor;
+  cursor.pos = chunk->begin;
+  cursor.end = chunk->end;
+  cursor.lineStart = chunk->begin;
+  cursor.line = 0;
+  cursor.chunk = chunk;
+
+  while (cursor.pos < cursor.end) {
+    if (parse_line(&cursor) < 0) {
+      return;
+    }
+    next_line(&cursor);
+  }
+}
+
+static void parse_chunk_task(void *ctx, int taskIndex, int workerIndex) {
+  (void) workerIndex;
+  Chunk *chunks = (Chunk *) ctx;
+  parse_chunk(&chunks[taskIndex]);
+}
+
+// maps a whole file for reading, returns NULL with a message in error when it
+// can't. empty files give an empty string that must not be unmapped
+static const char *map_file(char *fileName, const char *description, size_t *size, char *error, int errorSize) {
+  int fd = open(fileName, O_RDONLY);
+  if (fd < 0) {
+    snprintf(error, errorSize, "%s: cannot open the %s", fileName, description);
+    return NULL;
+  }
+
+  struct stat info;
+  fstat(fd, &info);
+  *size = (size_t) info.st_size;
+
+  const char *data = "";
+  if (*size > 0) {
+    data = (const char *) mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+      close(fd);
+      snprintf(error, errorSize, "%s: cannot map the %s", fileName, description);
+      return NULL;
+    }
+    madvise((void *) data, *size, MADV_SEQUENTIAL);
+  }
+  close(fd);
+
+  return data;
+}
+
+// checks what the materials, prototype spheres and instances refer to, which
+// can only be done once every chunk is in, and sorts the prototype spheres by
+// prototype, keeping them in file order within each
+static int check_instancing(char *fileName, Scene *scene, char *error, int errorSize) {
+  int prototypeCount = 0;
+  for (int sphereI = 0; sphereI < scene->prototypeSphereCount; sphereI += 1) {
+    PrototypeSphere *sphere = &scene->prototypeSpheres[sphereI];
+    if (sphere->material >= scene->materialCount) {
+      snprintf(error, errorSize, "%s: prototype sphere %d uses material %d, but there are %d materials", fileName,
+               sphereI, sphere->material, scene->materialCount);
+      return -1;
+    }
+    prototypeCount = sphere->prototype + 1 > prototypeCount ? sphere->prototype + 1 : prototypeCount;
+  }
+
+  // every prototype from 0 up has spheres, so there are no more prototypes than spheres
+  int *firsts = (int *) calloc(prototypeCount + 1, sizeof(int));
+  int missing = prototypeCount > scene->prototypeSphereCount ? 0 : -1;
+  for (int sphereI = 0; missing < 0 && sphereI < scene->prototypeSphereCount; sphereI += 1) {
+    firsts[scene->prototypeSpheres[sphereI].prototype + 1] += 1;
+  }
+  for (int prototypeI = 0; missing < 0 && prototypeI < prototypeCount; prototypeI += 1) {
+    missing = firsts[prototypeI + 1] == 0 ? prototypeI : -1;
+  }
+  if (missing >= 0) {
+    free(firsts);
+    snprintf(error, errorSize, "%s: prototype %d has no spheres, prototypes are numbered from 0 without gaps",
+             fileName, missing);
+    return -1;
+  }
+
+  int stride = 0;
+  for (int prototypeI = 0; prototypeI < prototypeCount; prototypeI += 1) {
+    stride = firsts[prototypeI + 1] > stride ? firsts[prototypeI + 1] : stride;
+    firsts[prototypeI + 1] += firsts[prototypeI];
+  }
+  PrototypeSphere *sorted = (PrototypeSphere *) malloc((scene->prototypeSphereCount + 1) * sizeof(PrototypeSphere));
+  for (int sphereI = 0; sphereI < scene->prototypeSphereCount; sphereI += 1) {
+    PrototypeSphere *sphere = &scene->prototypeSpheres[sphereI];
+    sorted[firsts[sphere->prototype]] = *sphere;
+    firsts[sphere->prototype] += 1;
+  }
+  free(firsts);
+  free(scene->prototypeSpheres);
+  scene->prototypeSpheres = sorted;
+  scene->prototypeCount = prototypeCount;
+  scene->instanceStride = stride;
+
+  for (int instanceI = 0; instanceI < scene->instanceCount; instanceI += 1) {
+    if (scene->instances[instanceI].prototype >= prototypeCount) {
+      snprintf(error, errorSize, "%s: instance %d uses prototype %d, but there are %d prototypes", fileName,
+               instanceI, scene->instances[instanceI].prototype, prototypeCount);
+      return -1;
+    }
+  }
+
+  // instance spheres are numbered after the objects, and the numbers have to fit an int
+  if ((long) scene->instanceCount * stride > INT32_MAX - 1 - scene->objectCount) {
+    snprintf(error, errorSize, "%s: %d instances of up to %d spheres are too many to number", fileName,
+             scene->instanceCount, stride);
+    return -1;
+  }
+  return 0;
+}
+
+// one corner of a face, "v", "v/vt", "v//vn" or "v/vt/vn" with v counted
+// from 1, or from the end when negative. only the vertex is kept, from 0
+static int read_face_corner(Cursor *cursor, int vertexCount, int *vertex) {
+  skip_blanks(cursor);
+  const char *at = cursor->pos;
+  bool negative = cursor->pos < cursor->end && *cursor->pos == '-';
+  if (negative) {
+    cursor->pos += 1;
+  }
+
+  long number = 0;
+  const char *digits = cursor->pos;
+  while (cursor->pos < cursor->end && is_digit(*cursor->pos)) {
+    number = number < INT32_MAX ? number * 10 + (*cursor->pos - '0') : number;
+    cursor->pos += 1;
+  }
+  if (cursor->pos == digits) {
+    return fail(cursor, at, "expected a vertex number");
+  }
+  // texture coordinate and normal numbers
+  while (cursor->pos < cursor->end && !is_blank(*cursor->pos) && *cursor->pos != '\n') {
+    if (*cursor->pos != '/' && *cursor->pos != '-' && !is_digit(*cursor->pos)) {
+      return fail(cursor, cursor->pos, "expected a vertex number");
+    }
+    cursor->pos += 1;
+  }
+
+  long index = negative ? vertexCount - number : number - 1;
+  if (number == 0 || index < 0 || index >= vertexCount) {
+    return fail(cursor, at, "vertex %s%ld is not defined before this face", negative ? "-" : "", number);
+  }
+  *vertex = (int) index;
+  return 0;
+}
+
+// a face, split into a fan of triangles around its first corner
+static int read_face(Cursor *cursor, ObjData *obj) {
+  const char *at = cursor->pos;
+  int corners = 0;
+  int first = 0;
+  int previous = 0;
+
+  skip_blanks(cursor);
+  while (!at_line_end(cursor)) {
+    int vertex = 0;
+    if (read_face_corner(cursor, obj->vertexCount, &vertex) < 0) {
+      return -1;
+    }
+    if (corners >= 2) {
+      obj->triangles = (int (*)[3]) grow_array(obj->triangles, &obj->triangleCapacity, obj->triangleCount + 1,
+                                               sizeof(int[3]));
+      obj->triangles[obj->triangleCount][0] = first;
+      obj->triangles[obj->triangleCount][1] = previous;
+      obj->triangles[obj->triangleCount][2] = vertex;
+      obj->triangleCount += 1;
+    }
+    first = corners == 0 ? vertex : first;
+    previous = vertex;
+    corners += 1;
+    skip_blanks(cursor);
+  }
+
+  if (corners < 3) {
+    return fail(cursor, at, "face needs 3 or more vertices");
+  }
+  return 0;
+}
+
+// reads the vertices and faces of an obj file. normals, texture coordinates,
+// groups, materials and everything else in it are skipped
+static int read_obj(char *fileName, ObjData *obj, char *error, int errorSize) {
+  memset(obj, 0, sizeof(ObjData));
+
+  size_t size;
+  const char *data = map_file(fileName, "obj file", &size, error, errorSize);
+  if (data == NULL) {
+    return -1;
+  }
+
+  Chunk chunk;
+  memset(&chunk, 0, sizeof(chunk));
+  Cursor cursor;
+  cursor.pos = data;
+  cursor.end = data + size;
+  cursor.lineStart = data;
+  cursor.line = 0;
+  cursor.chunk = &chunk;
+
+  int status = 0;
+  while (cursor.pos < cursor.end && status == 0) {
+    const char *kind;
+    int length = read_word(&cursor, &kind);
+
+    if (word_is(kind, length, "v")) {
+      obj->vertices = (float (*)[3]) grow_array(obj->vertices, &obj->vertexCapacity, obj->vertexCount + 1,
+                                                sizeof(float[3]));
+      float *vertex = obj->vertices[obj->vertexCount];
+      status = read_number(&cursor, &vertex[0]) < 0 || read_number(&cursor, &vertex[1]) < 0 ||
+               read_number(&cursor, &vertex[2]) < 0 ? -1 : 0;
+      obj->vertexCount += 1;
+    }
+    else if (word_is(kind, length, "f")) {
+      status = read_face(&cursor, obj);
+    }
+    if (status == 0) {
+      next_line(&cursor);
+    }
+  }
+  if (size > 0) {
+    munmap((void *) data, size);
+  }
+
+  if (status == 0 && obj->triangleCount == 0) {
+    snprintf(error, errorSize, "%s: no faces", fileName);
+    status = -1;
+  }
+  else if (status < 0) {
+    snprintf(error, errorSize, "%s:%d:%d: %s", fileName, chunk.errorLine + 1, chunk.errorColumn, chunk.error);
+  }
+  if (status < 0) {
+    free(obj->vertices);
+    free(obj->triangles);
+  }
+  return status;
+}
+
+// obj files are found next to the scene file unless their path is absolute
+static void obj_path(char *sceneFile, char *objFile, char *path, int pathSize) {
+  const char *slash = strrchr(sceneFile, '/');
+  int directoryLength = objFile[0] == '/' || slash == NULL ? 0 : (int) (slash - sceneFile) + 1;
+
+  snprintf(path, pathSize, "%.*s%s", directoryLength, sceneFile, objFile);
+}
+
+// reads every mesh's obj file and moves the mesh into place, quantizing its
+// vertices when it asks for that. triangles whose corners end up on one line
+// can never be hit and are dropped
+static int load_meshes(char *fileName, Scene *scene, MeshLine *lines, int lineCount, char *error, int errorSize) {
+  int vertexCapacity = 0;
+  int quantizedCapacity = 0;
+  int triangleCapacity = 0;
+  scene->meshes = (Mesh *) calloc(lineCount + 1, sizeof(Mesh));
+  scene->meshCount = lineCount;
+
+  for (int meshI = 0; meshI < lineCount; meshI += 1) {
+    MeshLine *line = &lines[meshI];
+    Mesh *mesh = &scene->meshes[meshI];
+    char path[512];
+    ObjData obj;
+    obj_path(fileName, line->file, path, sizeof(path));
+    if (read_obj(path, &obj, error, errorSize) < 0) {
+      return -1;
+    }
+
+    mesh->material = line->material;
+    mesh->quantized = line->quantize;
+    for (int axis = 0; axis < 3; axis += 1) {
+      mesh->min[axis] = INFINITY;
+      mesh->max[axis] = -INFINITY;
+    }
+    for (int vertexI = 0; vertexI < obj.vertexCount; vertexI += 1) {
+      for (int axis = 0; axis < 3; axis += 1) {
+        float value = line->position[axis] + line->scale * obj.vertices[vertexI][axis];
+        obj.vertices[vertexI][axis] = value;
+        mesh->min[axis] = fminf(mesh->min[axis], value);
+        mesh->max[axis] = fmaxf(mesh->max[axis], value);
+      }
+    }
+
+    // vertices go where they are traced, which for a quantized mesh is the
+    // nearest step, so the bounds and the dropped triangles are for those
+    int vertexBase = mesh->quantized ? scene->quantizedVertexCount : scene->vertexCount;
+    if (mesh->quantized) {
+      scene->quantizedVertices = (uint16_t (*)[3]) grow_array(scene->quantizedVertices, &quantizedCapacity,
+                                                              vertexBase + obj.vertexCount, sizeof(uint16_t[3]));
+      for (int axis = 0; axis < 3; axis += 1) {
+        mesh->origin[axis] = mesh->min[axis];
+        mesh->step[axis] = (mesh->max[axis] - mesh->min[axis]) / 65535;
+        mesh->min[axis] = INFINITY;
+        mesh->max[axis] = -INFINITY;
+      }
+      for (int vertexI = 0; vertexI < obj.vertexCount; vertexI += 1) {
+        uint16_t *steps = scene->quantizedVertices[vertexBase + vertexI];
+        for (int axis = 0; axis < 3; axis += 1) {
+          float step = mesh->step[axis];
+          float count = step > 0 ? rintf((obj.vertices[vertexI][axis] - mesh->origin[axis]) / step) : 0;
+          steps[axis] = (uint16_t) fminf(fmaxf(count, 0), 65535);
+          float value = mesh->origin[axis] + step * steps[axis];
+          obj.vertices[vertexI][axis] = value;
+          mesh->min[axis] = fminf(mesh->min[axis], value);
+          mesh->max[axis] = fmaxf(mesh->max[axis], value);
+        }
+      }
+      scene->quantizedVertexCount += obj.vertexCount;
+    }
+    else {
+      scene->vertices = (float (*)[3]) grow_array(scene->vertices, &vertexCapacity, vertexBase + obj.vertexCount,
+                                                  sizeof(float[3]));
+      memcpy(scene->vertices + vertexBase, obj.vertices, (size_t) obj.vertexCount * sizeof(float[3]));
+      scene->vertexCount += obj.vertexCount;
+    }
+
+    mesh->firstTriangle = scene->triangleCount;
+    scene->triangles = (int (*)[3]) grow_array(scene->triangles, &triangleCapacity,
+                                               scene->triangleCount + obj.triangleCount, sizeof(int[3]));
+    for (int triangleI = 0; triangleI < obj.triangleCount; triangleI += 1) {
+      int *corners = obj.triangles[triangleI];
+      vec3 a = vec3_load(obj.vertices[corners[0]]);
+      vec3 normal = vec3_cross(vec3_from_points(a, vec3_load(obj.vertices[corners[1]])),
+                               vec3_from_points(a, vec3_load(obj.vertices[corners[2]])));
+      if (vec3_dot(normal, normal) == 0) {
+        continue;
+      }
+      int *triangle = scene->triangles[scene->triangleCount];
+      for (int corner = 0; corner < 3; corner += 1) {
+        triangle[corner] = vertexBase + corners[corner];
+      }
+      scene->triangleCount += 1;
+    }
+    mesh->triangleCount = scene->triangleCount - mesh->firstTriangle;
+    free(obj.vertices);
+    free(obj.triangles);
+
+    if (mesh->triangleCount == 0) {
+      snprintf(error, errorSize, "%s: every triangle has no area", path);
+      return -1;
+    }
+  }
+
+  // triangles are numbered after the instance spheres, and the numbers have to fit an int
+  scene->triangleBase = scene->objectCount + scene->instanceCount * scene->instanceStride;
+  if (scene->triangleCount > INT32_MAX - 1 - scene->triangleBase) {
+    snprintf(error, errorSize, "%s: %d triangles are too many to number", fileName, scene->triangleCount);
+    return -1;
+  }
+  return 0;
+}
+
+int read_objects(char *fileName, Scene *scene, ThreadPool *pool, char *error, int errorSize) {
+  memset(scene, 0, sizeof(Scene));
+
+  size_t size;
+  const char *data = map_file(fileName, "scene file", &size, error, errorSize);
+  if (data == NULL) {
+    return -1;
+  }
+
+  // cut the file into chunks that each end on a line boundary
+  int chunkCount = pool != NULL && size > PARSE_CHUNK_BYTES ? (int) (size / PARSE_CHUNK_BYTES) : 1;
+  Chunk *chunks = (Chunk *) calloc(chunkCount, sizeof(Chunk));
+  const char *begin = data;
+  const char *fileEnd = data + size;
+  for (int chunkI = 0; chunkI < chunkCount; chunkI += 1) {
+    const char *end = chunkI == chunkCount - 1 ? fileEnd : data + (size / chunkCount) * (chunkI + 1);
+    end = end < begin ? begin : end;
+    while (end < fileEnd && end > data && end[-1] != '\n') {
+      end += 1;
+    }
+
+    chunks[chunkI].begin = begin;
+    chunks[chunkI].end = end;
+    chunks[chunkI].errorLine = -1;
+    begin = end;
+  }
+
+  if (chunkCount > 1) {
+    pool_run(pool, chunkCount, parse_chunk_task, chunks);
+  }
+  else {
+    parse_chunk(&chunks[0]);
+  }
+
+  // stitch the chunks back together in file order, the first error wins
+  int status = 0;
+  int lineOffset = 0;
+  int meshCount = 0;
+  for (int chunkI = 0; chunkI < chunkCount; chunkI += 1) {
+    Chunk *chunk = &chunks[chunkI];
+
+    if (status == 0 && chunk->errorLine >= 0) {
+      snprintf(error, errorSize, "%s:%d:%d: %s", fileName, lineOffset + chunk->errorLine + 1, chunk->errorColumn, chunk->error);
+      status = -1;
+    }
+    lineOffset += chunk->lines;
+
+    scene->objectCount += chunk->objectCount;
+    scene->lightCount += chunk->lightCount;
+    scene->materialCount += chunk->materialCount;
+    scene->prototypeSphereCount += chunk->prototypeSphereCount;
+    scene->instanceCount += chunk->instanceCount;
+    meshCount += chunk->meshCount;
+  }
+
+  scene->objects = (Object *) malloc((scene->objectCount + 1) * sizeof(Object));
+  scene->objectCapacity = scene->objectCount;
+  scene->lights = (Light *) malloc((scene->lightCount + 1) * sizeof(Light));
+  scene->materials = (Material *) malloc((scene->materialCount + 1) * sizeof(Material));
+  scene->prototypeSpheres = (PrototypeSphere *) malloc((scene->prototypeSphereCount + 1) * sizeof(PrototypeSphere));
+  // a grid puts all its instances in one chunk, which keeps its array when
+  // it holds every instance instead of it being copied
+  bool instancesCopied = chunkCount > 1;
+  scene->instances = chunkCount > 1 ? (Instance *) malloc(((size_t) scene->instanceCount + 1) * sizeof(Instance)) : NULL;
+  int objectIndex = 0;
+  int lightIndex = 0;
+  int materialIndex = 0;
+  int sphereIndex = 0;
+  int instanceIndex = 0;
+  MeshLine *meshes = (MeshLine *) malloc((meshCount + 1) * sizeof(MeshLine));
+  int meshIndex = 0;
+  for (int chunkI = 0; chunkI < chunkCount; chunkI += 1) {
+    Chunk *chunk = &chunks[chunkI];
+
+    memcpy(scene->objects + objectIndex, chunk->objects, chunk->objectCount * sizeof(Object));
+    memcpy(scene->lights + lightIndex, chunk->lights, chunk->lightCount * sizeof(Light));
+    memcpy(scene->materials + materialIndex, chunk->materials, chunk->materialCount * sizeof(Material));
+    memcpy(scene->prototypeSpheres + sphereIndex, chunk->prototypeSpheres, chunk->prototypeSphereCount * sizeof(PrototypeSphere));
+    objectIndex += chunk->objectCount;
+    lightIndex += chunk->lightCount;
+    materialIndex += chunk->materialCount;
+    memcpy(meshes + meshIndex, chunk->meshes, chunk->meshCount * sizeof(MeshLine));
+    sphereIndex += chunk->prototypeSphereCount;
+    meshIndex += chunk->meshCount;
+    if (instancesCopied) {
+      memcpy(scene->instances + instanceIndex, chunk->instances, (size_t) chunk->instanceCount * sizeof(Instance));
+      instanceIndex += chunk->instanceCount;
+      free(chunk->instances);
+    }
+    else {
+      scene->instances = chunk->instances;
+    }
+
+    free(chunk->objects);
+    free(chunk->lights);
+    free(chunk->materials);
+    free(chunk->prototypeSpheres);
+    free(chunk->meshes);
+  }
+
+  free(chunks);
+  if (size > 0) {
+    munmap((void *) data, size);
+  }
+
+  if (status == 0) {
+    status = check_instancing(fileName, scene, error, errorSize);
+  }
+  if (status == 0) {
+    status = load_meshes(fileName, scene, meshes, meshCount, error, errorSize);
+  }
+  free(meshes);
+  return status;
+}
+
+static int compare_keyframes(const void *a, const void *b) {
+  const Keyframe *left = (const Keyframe *) a;
+  const Keyframe *right = (const Keyframe *) b;
+
+  if (left->target != right->target) {
+    return left->target - right->target;
+  }
+  if (left->index != right->index) {
+    return left->index - right->index;
+  }
+  return left->frame - right->frame;
+}
+
+// one keyframe per line
+static int parse_keyframe_line(Cursor *cursor, Animation *animation, int *capacity) {
+  const char *kind;
+  int length = read_word(cursor, &kind);
+
+  if (length == 0) {
+    return 0;
+  }
+
+  Keyframe key;
+  key.frame = -1;
+  key.index = -1;
+  key.position[0] = NAN;
+
+  if (word_is(kind, length, "camera,")) {
+    key.target = 0;
+    key.index = 0;
+  }
+  else if (word_is(kind, length, "object,")) {
+    key.target = 1;
+  }
+  else if (word_is(kind, length, "light,")) {
+    key.target = 2;
+  }
+  else {
+    return fail(cursor, kind, "unknown keyframe target '%.*s'", length, kind);
+  }
+
+  if (read_properties(cursor, NULL, NULL, NULL, NULL, &key) < 0) {
+    return -1;
+  }
+  if (key.frame < 0) {
+    return fail(cursor, kind, "keyframe needs a frame");
+  }
+  if (key.index < 0) {
+    return fail(cursor, kind, "keyframe needs an index");
+  }
+  if (isnan(key.position[0])) {
+    return fail(cursor, kind, "keyframe needs a position");
+  }
+
+  if (animation->keyCount == *capacity) {
+    *capacity = *capacity > 0 ? *capacity * 2 : 16;
+    animation->keys = (Keyframe *) realloc(animation->keys, *capacity * sizeof(Keyframe));
+  }
+  animation->keys[animation->keyCount] = key;
+  animation->keyCount += 1;
+  return 0;
+}
+
+int read_keyframes(char *fileName, Animation *animation, char *error, int errorSize) {
+  memset(animation, 0, sizeof(Animation));
+
+  size_t size;
+  const char *data = map_file(fileName, "keyframe file", &size, error, errorSize);
+  if (data == NULL) {
+    return -1;
+  }
+
+  Chunk chunk;
+  memset(&chunk, 0, sizeof(chunk));
+  Cursor cursor;
+  cursor.pos = data;
+  cursor.end = data + size;
+  cursor.lineStart = data;
+  cursor.line = 0;
+  cursor.chunk = &chunk;
+
+  int status = 0;
+  int capacity = 0;
+  while (cursor.pos < cursor.end) {
+    if (parse_keyframe_line(&cursor, animation, &capacity) < 0) {
+      snprintf(error, errorSize, "%s:%d:%d: %s", fileName, chunk.errorLine + 1, chunk.errorColumn, chunk.error);
+      status = -1;
+      break;
+    }
+    next_line(&cursor);
+  }
+  if (size > 0) {
+    munmap((void *) data, size);
+  }
+
+  if (status == 0 && animation->keyCount == 0) {
+    snprintf(error, errorSize, "%s: no keyframes", fileName);
+    status = -1;
+  }
+
+  qsort(animation->keys, animation->keyCount, sizeof(Keyframe), compare_keyframes);
+  for (int keyI = 0; status == 0 && keyI < animation->keyCount; keyI += 1) {
+    Keyframe *key = &animation->keys[keyI];
+    if (keyI > 0 && compare_keyframes(key - 1, key) == 0) {
+      if (key->target == 0) {
+        snprintf(error, errorSize, "%s: the camera has two keyframes at frame %d", fileName, key->frame);
+      }
+      else {
+        snprintf(error, errorSize, "%s: %s %d has two keyframes at frame %d", fileName,
+                 key->target == 1 ? "object" : "light", key->index, key->frame);
+      }
+      status = -1;
+    }
+    animation->frameCount = key->frame + 1 > animation->frameCount ? key->frame + 1 : animation->frameCount;
+  }
+
+  if (status < 0) {
+    free(animation->keys);
+    animation->keys = NULL;
+  }
+  return status;
+}
@@ -0,0 +1,28 @@
+#ifndef PARSER_H
+#define PARSER_H
+
+#include "Raycaster.h"
+#include "threadpool.h"
+
+// reads a .scene file into the scene's object, light and instancing lists,
+// and the obj files its meshes name into its meshes. the file is memory
+// mapped and tokenized in place; big files are cut into chunks at line
+// boundaries and parsed on the pool (which may be NULL). returns 0 on
+// success, or -1 with a "file:line:column: message" (or for instancing that
+// refers to something missing, a "file: message") description written to
+// error, the file being the obj file for mistakes in one
+int read_objects(char *fileName, Scene *scene, ThreadPool *pool, char *error, int errorSize);
+
+// reads an animation's keyframes, one per line:
+//   camera, frame: 0, position: [0, 0, 0]
+//   object, index: 2, frame: 30, position: [1, 0, -12]
+//   light, index: 0, frame: 30, position: [5, 5, -5]
+// returns 0 on success, or -1 with a "file:line:column: message" description
+// written to error
+int read_keyframes(char *fileName, Animation *animation, char *error, int errorSize);
+
+// parses one float from [begin, end), with the same result as strtof.
+// returns the number of characters used, 0 if there is no number there
+int parse_float(const char *begin, const char *end, float *value);
+
+#endif
@@ -0,0 +1,164 @@
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "progressive.h"
+#include "threadpool.h"
+#include "vec3.h"
+
+// thread pool task, traces the pixels of the current pass in one tile: those
+// on its grid that a coarser pass hasn't traced. the first pass always runs
+// to the end, so there is always a grid to fill the gaps from
+void render_pass_tile(void *ctx, int taskIndex, int workerIndex) {
+  RenderJob *job = (RenderJob *) ctx;
+  TraceContext *trace = &job->contexts[workerIndex];
+  RayStats *rayStats = &trace->stats;
+  int stride = job->passStride;
+  bool firstPass = stride == PROGRESSIVE_STRIDE;
+
+  int tileIndex = (int) ((long) taskIndex * job->passStep % (job->tilesX * job->tilesY));
+  int rowStart = (tileIndex / job->tilesX) * TILE_SIZE;
+  int colStart = (tileIndex % job->tilesX) * TILE_SIZE;
+  int rowEnd = rowStart + TILE_SIZE < job->pixelHeight ? rowStart + TILE_SIZE : job->pixelHeight;
+  int colEnd = colStart + TILE_SIZE < job->pixelWidth ? colStart + TILE_SIZE : job->pixelWidth;
+
+  long traced = 0;
+  for (int row = rowStart; row < rowEnd; row += stride) {
+    if (!firstPass && wallSeconds() >= job->deadline) {
+      atomic_store(&job->passCut, true);
+      break;
+    }
+    bool coarseRow = row % (2 * stride) == 0;
+
+    for (int col = colStart; col < colEnd; col += stride) {
+      if (!firstPass && coarseRow && col % (2 * stride) == 0) {
+        continue;
+      }
+      long pixel = (long) row * job->pixelWidth + col;
+      long work = stats_work(rayStats);
+
+      float Rd[3];
+      int objIndex;
+      double start = wallSeconds();
+      pixel_ray(Rd, job, row, col);
+      float tVal = shoot(&objIndex, job->scene, Rd, job->camPosition, -1, rayStats);
+      job->workers[workerIndex].primarySeconds += wallSeconds() - start;
+
+      trace->pathSeed = path_seed(job, row, col, 0);
+      vec3 color = shade_primary(job->scene, trace, Rd, tVal, objIndex, job->camPosition);
+      stats_depth(rayStats, trace->pathDepth);
+      if (job->cost != NULL) {
+        job->cost[pixel] = stats_work(rayStats) - work;
+      }
+
+      job->rgbFile[pixel * 3 + 0] = (uint8_t)(color[0] * 255);
+      job->rgbFile[pixel * 3 + 1] = (uint8_t)(color[1] * 255);
+      job->rgbFile[pixel * 3 + 2] = (uint8_t)(color[2] * 255);
+      job->traced[pixel] = stride;
+      traced += 1;
+    }
+  }
+
+  STAT_ADD(rayStats, primaryRays, traced);
+  atomic_fetch_add(&job->tracedCount, traced);
+}
+
+static int gcd(int a, int b) {
+  while (b != 0) {
+    int rest = a % b;
+    a = b;
+    b = rest;
+  }
+  return a;
+}
+
+// thread pool task, fills the pixels of one row that the deadline left
+// untraced from the grid of the finest pass that ran to the end: the nearest
+// grid pixel, or the four at the corners of the grid cell blended
+// bilinearly. pixels past the grid's last row or column take that one
+void fill_row(void *ctx, int row, int workerIndex) {
+  (void) workerIndex;
+  RenderJob *job = (RenderJob *) ctx;
+  int stride = job->completeStride;
+  int row0 = row / stride * stride;
+  int row1 = row0 + stride < job->pixelHeight ? row0 + stride : row0;
+  float rowWeight = (float) (row - row0) / stride;
+  uint8_t *top = &job->rgbFile[(long) row0 * job->pixelWidth * 3];
+  uint8_t *bottom = &job->rgbFile[(long) row1 * job->pixelWidth * 3];
+  uint8_t *rgb = &job->rgbFile[(long) row * job->pixelWidth * 3];
+  uint8_t *traced = &job->traced[(long) row * job->pixelWidth];
+
+  for (int col = 0; col < job->pixelWidth; col += 1) {
+    if (traced[col] != 0) {
+      continue;
+    }
+    int col0 = col / stride * stride;
+    int col1 = col0 + stride < job->pixelWidth ? col0 + stride : col0;
+
+    if (job->fillNearest) {
+      uint8_t *nearRow = row - row0 < stride / 2 ? top : bottom;
+      memcpy(&rgb[col * 3], &nearRow[(col - col0 < stride / 2 ? col0 : col1) * 3], 3);
+      continue;
+    }
+
+    float colWeight = (float) (col - col0) / stride;
+    for (int channel = 0; channel < 3; channel += 1) {
+      float upper = top[col0 * 3 + channel] + (top[col1 * 3 + channel] - top[col0 * 3 + channel]) * colWeight;
+      float lower = bottom[col0 * 3 + channel] + (bottom[col1 * 3 + channel] - bottom[col0 * 3 + channel]) * colWeight;
+      rgb[col * 3 + channel] = (uint8_t) (upper + (lower - upper) * rowWeight + 0.5f);
+    }
+  }
+}
+
+// renders with a deadline: passes from a grid of PROGRESSIVE_STRIDE pixels
+// apart down to every pixel, until the deadline passes, then fills the gaps.
+// every traced pixel has the color a full render gives it
+void render_progressive(RenderJob *job, ThreadPool *pool, PhaseTimes *phases) {
+  double phaseStart = wallSeconds();
+  int tileCount = job->tilesX * job->tilesY;
+  // about the golden ratio of the tile count apart, and coprime to it so every
+  // tile is visited once
+  job->passStep = (int) (tileCount * 0.618) | 1;
+  while (tileCount > 1 && gcd(job->passStep, tileCount) != 1) {
+    job->passStep += 2;
+  }
+
+  for (int stride = PROGRESSIVE_STRIDE; stride >= 1; stride /= 2) {
+    if (stride < PROGRESSIVE_STRIDE && wallSeconds() >= job->deadline) {
+      break;
+    }
+    job->passStride = stride;
+    atomic_store(&job->passCut, false);
+    pool_run(pool, tileCount, render_pass_tile, job);
+    if (atomic_load(&job->passCut)) {
+      break;
+    }
+    job->completeStride = stride;
+  }
+  phases->render += wallSeconds() - phaseStart;
+
+  phaseStart = wallSeconds();
+  if (job->completeStride > 1) {
+    pool_run(pool, job->pixelHeight, fill_row, job);
+  }
+  phases->refine += wallSeconds() - phaseStart;
+}
+
+// sets the job up for --deadline-ms, counted from start. pixels are traced one
+// by one, since the passes' pixels are too far apart for packets
+void attach_deadline(RenderJob *job, RenderOptions *options, double start) {
+  if (options->deadlineMs <= 0) {
+    return;
+  }
+  job->deadline = start + options->deadlineMs / 1000.0;
+  job->fillNearest = strcmp(options->fill, "nearest") == 0;
+  job->traced = (uint8_t *) calloc((long) job->pixelWidth * job->pixelHeight + 1, sizeof(uint8_t));
+  if (job->traced == NULL) {
+    printf("Error: out of memory for the --deadline-ms pass map.\n");
+    exit(1);
+  }
+  job->packetSize = 0;
+  job->wavefront = 0;
+}
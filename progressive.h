@@ -0,0 +1,17 @@
+#ifndef PROGRESSIVE_H
+#define PROGRESSIVE_H
+
+#include "Raycaster.h"
+#include "render.h"
+
+// renders with a deadline for --deadline-ms. pixels are traced in passes from
+// a grid of PROGRESSIVE_STRIDE pixels apart down to every pixel, until the
+// deadline passes, and the pixels left are filled in from the finest grid
+// that was completed. every traced pixel has the color a full render gives it
+
+// sets the job up for --deadline-ms, counted from start
+void attach_deadline(RenderJob *job, RenderOptions *options, double start);
+
+void render_progressive(RenderJob *job, ThreadPool *pool, PhaseTimes *phases);
+
+#endif
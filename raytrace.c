@@ -2,16 +2,359 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <string.h>
 #include "Raycaster.h"
+#include "distribute.h"
+#include "sequence.h"
+#include "server.h"
+#include "threadpool.h"
+
+void usage(void) {
+  printf("Usage: raytrace [--threads N] [--simd auto|scalar|sse|avx2] [--packet 0|4|8] [--wavefront]\n"
+         "                [--stats FILE.json] [--heatmap FILE.ppm] [--mem-budget MB] [--light-cutoff C]\n"
+         "                [--aa THRESHOLD] [--aa-samples 4|9|16|...] [--aa-budget SAMPLES_PER_PIXEL]\n"
+         "                [--max-depth N] [--roulette THROUGHPUT]\n"
+         "                [--deadline-ms MS] [--fill bilinear|nearest]\n"
+         "                [--gbuffer FILE.gbuf | --relight FILE.gbuf]\n"
+         "                [--update BEFORE.scene BEFORE.ppm]\n"
+         "                [--region X0,Y0,X1,Y1 | --processes N] width height input.scene output.ppm\n");
+  printf("       raytrace [options] [--frames N] [--rebuild] sequence width height input.scene input.keys output%%04d.ppm\n");
+  printf("       raytrace [options] --serve socket\n");
+  printf("       raytrace compile input.scene output.bscene\n");
+  printf("       raytrace merge output.ppm tile.ppm...\n");
+}
+
+// an image side from the command line, which has to be at least a pixel
+static int image_size(char *text, const char *side) {
+  int size = atoi(text);
+  if (size < 1) {
+    printf("Error: the image %s has to be a positive number of pixels, not %s.\n", side, text);
+    exit(1);
+  }
+  return size;
+}
 
 int main(int argc, char **argv)
 {
-  if (argc != 5) {
+  RenderOptions options;
+  options.threads = default_thread_count();
+  options.simd = "auto";
+  options.packetSize = 8;
+  options.wavefront = 0;
+  options.statsFile = NULL;
+  options.heatmapFile = NULL;
+  options.aaThreshold = 0;
+  options.aaGrid = 4;
+  options.aaBudget = 4;
+  options.frames = 0;
+  options.rebuild = 0;
+  options.memBudget = 0;
+  options.lightCutoff = 0;
+  memset(options.region, 0, sizeof(options.region));
+  options.maxDepth = DEFAULT_MAX_DEPTH;
+  options.roulette = 0;
+  options.gbufferFile = NULL;
+  options.relightFile = NULL;
+  options.updateScene = NULL;
+  options.updateImage = NULL;
+  options.deadlineMs = 0;
+  options.fill = "bilinear";
+  char *serveSocket = NULL;
+  int processes = 0;
+
+  // tiles can be any number of files, so merge takes the whole command line
+  if (argc >= 2 && strcmp(argv[1], "merge") == 0) {
+    if (argc < 4) {
+      printf("Error: merge needs an output file and at least one tile.\n");
+      usage();
+      exit(1);
+    }
+    char error[256];
+    if (merge_tiles(argv[2], argv + 3, argc - 3, error, sizeof(error)) < 0) {
+      printf("Error: %s.\n", error);
+      exit(1);
+    }
+    printf("Merged %d tiles into %s\n", argc - 3, argv[2]);
+    return 0;
+  }
+
+  // pull out options, everything else is positional
+  char *positional[6];
+  int positionalCount = 0;
+
+  for (int index = 1; index < argc; index += 1) {
+    if (strcmp(argv[index], "--threads") == 0) {
+      if (index + 1 >= argc || atoi(argv[index + 1]) < 1) {
+        printf("Error: --threads needs a positive number.\n");
+        exit(1);
+      }
+      options.threads = atoi(argv[index + 1]);
+      index += 1;
+    }
+    else if (strcmp(argv[index], "--simd") == 0) {
+      if (index + 1 >= argc) {
+        printf("Error: --simd needs auto, scalar, sse or avx2.\n");
+        exit(1);
+      }
+      options.simd = argv[index + 1];
+      index += 1;
+    }
+    else if (strcmp(argv[index], "--packet") == 0) {
+      if (index + 1 >= argc || (atoi(argv[index + 1]) != 0 && atoi(argv[index + 1]) != 4 && atoi(argv[index + 1]) != 8)) {
+        printf("Error: --packet needs 0, 4 or 8.\n");
+        exit(1);
+      }
+      options.packetSize = atoi(argv[index + 1]);
+      index += 1;
+    }
+    else if (strcmp(argv[index], "--wavefront") == 0) {
+      options.wavefront = 1;
+    }
+    else if (strcmp(argv[index], "--stats") == 0) {
+      if (index + 1 >= argc) {
+        printf("Error: --stats needs a file name.\n");
+        exit(1);
+      }
+      options.statsFile = argv[index + 1];
+      index += 1;
+    }
+    else if (strcmp(argv[index], "--heatmap") == 0) {
+      if (index + 1 >= argc) {
+        printf("Error: --heatmap needs a file name.\n");
+        exit(1);
+      }
+      options.heatmapFile = argv[index + 1];
+      index += 1;
+    }
+    else if (strcmp(argv[index], "--aa") == 0) {
+      if (index + 1 >= argc || atof(argv[index + 1]) < 0) {
+        printf("Error: --aa needs a contrast threshold, like 0.1.\n");
+        exit(1);
+      }
+      options.aaThreshold = atof(argv[index + 1]);
+      index += 1;
+    }
+    else if (strcmp(argv[index], "--aa-samples") == 0) {
+      int samples = index + 1 < argc ? atoi(argv[index + 1]) : 0;
+      int grid = (int) sqrt(samples);
+      while (grid * grid < samples) {
+        grid += 1;
+      }
+      if (grid < 2 || grid > 8 || grid * grid != samples) {
+        printf("Error: --aa-samples needs a square number from 4 to 64.\n");
+        exit(1);
+      }
+      options.aaGrid = grid;
+      index += 1;
+    }
+    else if (strcmp(argv[index], "--aa-budget") == 0) {
+      if (index + 1 >= argc || atof(argv[index + 1]) < 1) {
+        printf("Error: --aa-budget needs an average number of samples per pixel of at least 1.\n");
+        exit(1);
+      }
+      options.aaBudget = atof(argv[index + 1]);
+      index += 1;
+    }
+    else if (strcmp(argv[index], "--frames") == 0) {
+      if (index + 1 >= argc || atoi(argv[index + 1]) < 1) {
+        printf("Error: --frames needs a positive number.\n");
+        exit(1);
+      }
+      options.frames = atoi(argv[index + 1]);
+      index += 1;
+    }
+    else if (strcmp(argv[index], "--rebuild") == 0) {
+      options.rebuild = 1;
+    }
+    else if (strcmp(argv[index], "--mem-budget") == 0) {
+      if (index + 1 >= argc || atof(argv[index + 1]) <= 0) {
+        printf("Error: --mem-budget needs a size in megabytes.\n");
+        exit(1);
+      }
+      options.memBudget = (long) (atof(argv[index + 1]) * 1e6);
+      index += 1;
+    }
+    else if (strcmp(argv[index], "--light-cutoff") == 0) {
+      if (index + 1 >= argc || atof(argv[index + 1]) < 0) {
+        printf("Error: --light-cutoff needs a brightness, like 0.002.\n");
+        exit(1);
+      }
+      options.lightCutoff = atof(argv[index + 1]);
+      index += 1;
+    }
+    else if (strcmp(argv[index], "--max-depth") == 0) {
+      if (index + 1 >= argc || atoi(argv[index + 1]) < 1 || atoi(argv[index + 1]) > MAX_DEPTH) {
+        printf("Error: --max-depth needs a number of surfaces from 1 to %d.\n", MAX_DEPTH);
+        exit(1);
+      }
+      options.maxDepth = atoi(argv[index + 1]);
+      index += 1;
+    }
+    else if (strcmp(argv[index], "--roulette") == 0) {
+      if (index + 1 >= argc || atof(argv[index + 1]) < 0) {
+        printf("Error: --roulette needs a throughput, like 0.1.\n");
+        exit(1);
+      }
+      options.roulette = atof(argv[index + 1]);
+      index += 1;
+    }
+    else if (strcmp(argv[index], "--deadline-ms") == 0) {
+      if (index + 1 >= argc || atoi(argv[index + 1]) < 1) {
+        printf("Error: --deadline-ms needs a positive number of milliseconds.\n");
+        exit(1);
+      }
+      options.deadlineMs = atoi(argv[index + 1]);
+      index += 1;
+    }
+    else if (strcmp(argv[index], "--fill") == 0) {
+      if (index + 1 >= argc || (strcmp(argv[index + 1], "bilinear") != 0 && strcmp(argv[index + 1], "nearest") != 0)) {
+        printf("Error: --fill needs bilinear or nearest.\n");
+        exit(1);
+      }
+      options.fill = argv[index + 1];
+      index += 1;
+    }
+    else if (strcmp(argv[index], "--gbuffer") == 0) {
+      if (index + 1 >= argc) {
+        printf("Error: --gbuffer needs a file name.\n");
+        exit(1);
+      }
+      options.gbufferFile = argv[index + 1];
+      index += 1;
+    }
+    else if (strcmp(argv[index], "--relight") == 0) {
+      if (index + 1 >= argc) {
+        printf("Error: --relight needs a g-buffer file recorded with --gbuffer.\n");
+        exit(1);
+      }
+      options.relightFile = argv[index + 1];
+      index += 1;
+    }
+    else if (strcmp(argv[index], "--update") == 0) {
+      if (index + 2 >= argc) {
+        printf("Error: --update needs the scene before the edit and the image rendered from it.\n");
+        exit(1);
+      }
+      options.updateScene = argv[index + 1];
+      options.updateImage = argv[index + 2];
+      index += 2;
+    }
+    else if (strcmp(argv[index], "--region") == 0) {
+      int *region = options.region;
+      char extra;
+      if (index + 1 >= argc ||
+          sscanf(argv[index + 1], "%d,%d,%d,%d%c", &region[0], &region[1], &region[2], &region[3], &extra) != 4 ||
+          region[0] < 0 || region[1] < 0 || region[2] <= region[0] || region[3] <= region[1]) {
+        printf("Error: --region needs X0,Y0,X1,Y1 with X0 < X1 and Y0 < Y1.\n");
+        exit(1);
+      }
+      index += 1;
+    }
+    else if (strcmp(argv[index], "--processes") == 0) {
+      if (index + 1 >= argc || atoi(argv[index + 1]) < 1) {
+        printf("Error: --processes needs a positive number.\n");
+        exit(1);
+      }
+      processes = atoi(argv[index + 1]);
+      index += 1;
+    }
+    else if (strcmp(argv[index], "--serve") == 0) {
+      if (index + 1 >= argc) {
+        printf("Error: --serve needs a socket path.\n");
+        exit(1);
+      }
+      serveSocket = argv[index + 1];
+      index += 1;
+    }
+    else if (positionalCount < 6) {
+      positional[positionalCount] = argv[index];
+      positionalCount += 1;
+    }
+    else {
+      printf("Error: too many arguments.\n");
+      usage();
+      exit(1);
+    }
+  }
+
+  // both keep a value for every pixel of the image
+  if (options.memBudget > 0 && (options.aaThreshold > 0 || options.heatmapFile != NULL)) {
+    printf("Error: --mem-budget can't be combined with --aa or --heatmap, they need the whole image in memory.\n");
+    exit(1);
+  }
+
+  // anti-aliasing picks the pixels to refine from the whole frame
+  if ((options.region[2] > 0 || processes > 0) && options.aaThreshold > 0) {
+    printf("Error: --region and --processes can't be combined with --aa.\n");
+    exit(1);
+  }
+  if (processes > 0 && (options.region[2] > 0 || options.heatmapFile != NULL || options.statsFile != NULL ||
+                        serveSocket != NULL || positionalCount != 4)) {
+    printf("Error: --processes renders one whole image, it can't be combined with --region, --heatmap, --stats or --serve.\n");
+    exit(1);
+  }
+  // a g-buffer holds one path per pixel of one whole frame
+  if ((options.gbufferFile != NULL || options.relightFile != NULL) &&
+      ((options.gbufferFile != NULL && options.relightFile != NULL) || options.aaThreshold > 0 ||
+       options.region[2] > 0 || processes > 0 || serveSocket != NULL || positionalCount != 4)) {
+    printf("Error: --gbuffer and --relight render one whole image, they can't be combined with each other, --aa, --region, --processes or --serve.\n");
+    exit(1);
+  }
+  // the previous image covers the whole frame, and anti-aliasing could
+  // refine different pixels
+  if (options.updateScene != NULL && (options.gbufferFile != NULL || options.relightFile != NULL ||
+                                      options.aaThreshold > 0 || options.region[2] > 0 || processes > 0 ||
+                                      serveSocket != NULL || positionalCount != 4)) {
+    printf("Error: --update renders one whole image, it can't be combined with --gbuffer, --relight, --aa, --region, --processes or --serve.\n");
+    exit(1);
+  }
+  // the passes cover the whole image in memory, and the deadline is one run's
+  if (options.deadlineMs > 0 && (options.aaThreshold > 0 || options.memBudget > 0 || options.gbufferFile != NULL ||
+                                 options.relightFile != NULL || options.updateScene != NULL || processes > 0 ||
+                                 serveSocket != NULL || positionalCount != 4)) {
+    printf("Error: --deadline-ms renders one image in memory, it can't be combined with --aa, --mem-budget, --gbuffer, --relight, --update, --processes or --serve.\n");
+    exit(1);
+  }
+  if (options.region[2] > 0 && serveSocket != NULL) {
+    printf("Error: --serve can't be combined with --region.\n");
+    exit(1);
+  }
+
+  if (serveSocket != NULL) {
+    // every request keeps its whole image in memory and nothing is written
+    // besides the images
+    if (positionalCount > 0 || options.memBudget > 0 || options.heatmapFile != NULL || options.statsFile != NULL) {
+      printf("Error: --serve takes no other arguments and can't be combined with --mem-budget, --heatmap or --stats.\n");
+      exit(1);
+    }
+    serve(serveSocket, &options);
+    return 0;
+  }
+
+  if (positionalCount == 3 && strcmp(positional[0], "compile") == 0) {
+    compile_scene(positional[1], positional[2], &options);
+    return 0;
+  }
+
+  if (positionalCount == 6 && strcmp(positional[0], "sequence") == 0) {
+    generate_sequence(image_size(positional[1], "width"), image_size(positional[2], "height"), positional[3], positional[4], positional[5], &options);
+    return 0;
+  }
+
+  if (positionalCount != 4) {
     printf("Error: not enough arguments.\n");
+    usage();
     exit(1);
   }
 
-  generate_image(atoi(argv[1]), atoi(argv[2]), argv[3], argv[4]);
+  int width = image_size(positional[0], "width");
+  int height = image_size(positional[1], "height");
+  if (processes > 0) {
+    render_distributed(width, height, positional[2], positional[3], &options, processes, argv[0]);
+    return 0;
+  }
+
+  generate_image(width, height, positional[2], positional[3], &options);
 
   return 0;
 }
@@ -0,0 +1,76 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "gbuffer.h"
+#include "relight.h"
+
+// whether shoot can report objIndex for the scene
+static bool object_exists(Scene *scene, int objIndex) {
+  if (objIndex < 0) {
+    return false;
+  }
+  if (objIndex < scene->objectCount) {
+    return true;
+  }
+  if (objIndex >= scene->triangleBase) {
+    return (long) objIndex - scene->triangleBase < scene->triangleCount;
+  }
+
+  long instanceSlot = (long) objIndex - scene->objectCount;
+  if (scene->instanceStride == 0 || instanceSlot / scene->instanceStride >= scene->instanceCount) {
+    return false;
+  }
+  Instance *instance = &scene->instances[instanceSlot / scene->instanceStride];
+  return instanceSlot % scene->instanceStride < scene->prototypes[instance->prototype].count;
+}
+
+// gives the job a g-buffer to record into for --gbuffer, or the one --relight
+// names to shade from. both shade paths one by one with the recursive engine
+void attach_gbuffer(RenderJob *job, Scene *scene, RenderOptions *options) {
+  char error[256];
+
+  if (options->relightFile != NULL) {
+    GBuffer *gbuffer = gbuffer_load(options->relightFile, error, sizeof(error));
+    if (gbuffer == NULL) {
+      printf("Error: %s.\n", error);
+      exit(1);
+    }
+    if (gbuffer->width != job->pixelWidth || gbuffer->height != job->pixelHeight) {
+      printf("Error: %s was recorded at %dx%d, not %dx%d.\n", options->relightFile, gbuffer->width, gbuffer->height,
+             job->pixelWidth, job->pixelHeight);
+      exit(1);
+    }
+    if (gbuffer->sceneHash != gbuffer_scene_hash(scene)) {
+      printf("Error: %s was recorded with different objects, instances, meshes or camera, only lights can change for a relight.\n",
+             options->relightFile);
+      exit(1);
+    }
+    for (long hitI = 0; hitI < gbuffer->hitCount; hitI += 1) {
+      if (!object_exists(scene, gbuffer->hits[hitI].objIndex)) {
+        printf("Error: %s is corrupt.\n", options->relightFile);
+        exit(1);
+      }
+    }
+
+    // the paths end where they ended when recorded
+    for (int index = 0; index < options->threads; index += 1) {
+      job->contexts[index].maxDepth = gbuffer->maxDepth;
+      job->contexts[index].roulette = gbuffer->roulette;
+    }
+    job->gbuffer = gbuffer;
+    job->relight = true;
+  }
+  else if (options->gbufferFile != NULL) {
+    // paths are followed all the way, without the early end that depends on
+    // the lights, so the surfaces are there whatever the lights become
+    for (int index = 0; index < options->threads; index += 1) {
+      job->contexts[index].cutoff = false;
+    }
+    job->gbuffer = gbuffer_create(job->pixelWidth, job->pixelHeight, options->maxDepth, options->roulette,
+                                  gbuffer_scene_hash(scene));
+  }
+  else {
+    return;
+  }
+  job->wavefront = 0;
+}
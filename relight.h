@@ -0,0 +1,12 @@
+#ifndef RELIGHT_H
+#define RELIGHT_H
+
+#include "Raycaster.h"
+#include "render.h"
+
+// gives the job a g-buffer to record into for --gbuffer, or loads and checks
+// the one --relight names to shade from. prints the error and exits when the
+// g-buffer doesn't belong to the scene
+void attach_gbuffer(RenderJob *job, Scene *scene, RenderOptions *options);
+
+#endif
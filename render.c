@@ -0,0 +1,865 @@
+#include <math.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include "Raycaster.h"
+#include "gbuffer.h"
+#include "imagewriter.h"
+#include "packet.h"
+#include "progressive.h"
+#include "relight.h"
+#include "render.h"
+#include "threadpool.h"
+#include "update.h"
+#include "vec3.h"
+#include "wavefront.h"
+
+// the load estimate for multi process renders comes from a preview this many
+// times smaller on each side
+#define COST_PREVIEW_SCALE 4
+
+// a pixel's center and up to 64 anti-aliasing samples each get a path seed
+#define PATH_SEEDS_PER_PIXEL 65
+
+// pixels refined per thread pool task during anti-aliasing
+#define REFINE_BATCH 64
+
+// direction of the ray through a point of one pixel, offsets are 0 to 1
+// from the pixel's top left corner
+void subpixel_ray(float *Rd, RenderJob *job, int row, int col, double rowOffset, double colOffset) {
+  float pixel_height = job->height / job->frameHeight;
+  float pixel_width = job->width / job->frameWidth;
+
+  // the viewport sits one unit in front of the camera, whose rays start at camPosition
+  vec3 pixelPoint = vec3_make(-job->width / 2 + pixel_width * (col + job->regionX + colOffset),
+                              job->height / 2 - pixel_height * (row + job->regionY + rowOffset), -1);
+
+  vec3_store(Rd, vec3_normalize(pixelPoint));
+}
+
+// direction of the ray through the center of one pixel
+void pixel_ray(float *Rd, RenderJob *job, int row, int col) {
+  subpixel_ray(Rd, job, row, col, 0.5, 0.5);
+}
+
+// seed of the roulette draws of a path through a pixel, sample 0 for the
+// pixel's center and 1 on for its anti-aliasing samples. numbered over the
+// whole frame, so a region gets the same draws as the full render
+unsigned int path_seed(RenderJob *job, int row, int col, int sample) {
+  unsigned int pixel = (unsigned int) (row + job->regionY) * job->frameWidth + col + job->regionX;
+  return pixel * PATH_SEEDS_PER_PIXEL + sample;
+}
+
+// thread pool task, renders one tile of the image
+// all primary rays of the tile are shot first, as packets when enabled,
+// then every pixel is shaded on its own since the rays diverge after the first hit
+void render_tile(void *ctx, int tileIndex, int workerIndex) {
+  RenderJob *job = (RenderJob *) ctx;
+  WorkerStats *stats = &job->workers[workerIndex];
+  RayStats *rayStats = &job->contexts[workerIndex].stats;
+
+  tileIndex += job->tileOffset;
+  int rowStart = (tileIndex / job->tilesX) * TILE_SIZE;
+  int colStart = (tileIndex % job->tilesX) * TILE_SIZE;
+  int rowEnd = rowStart + TILE_SIZE < job->pixelHeight ? rowStart + TILE_SIZE : job->pixelHeight;
+  int colEnd = colStart + TILE_SIZE < job->pixelWidth ? colStart + TILE_SIZE : job->pixelWidth;
+
+  // primary hits for the tile, indexed by (row - rowStart) * TILE_SIZE + (col - colStart)
+  float Rd[TILE_SIZE * TILE_SIZE][3];
+  float tVal[TILE_SIZE * TILE_SIZE];
+  int objIndex[TILE_SIZE * TILE_SIZE];
+
+  // partial tiles leave gaps in the arrays, the wavefront engine sees them as misses
+  if (job->wavefront) {
+    for (int pixel = 0; pixel < TILE_SIZE * TILE_SIZE; pixel += 1) {
+      tVal[pixel] = -1;
+    }
+  }
+
+  double start = wallSeconds();
+  // a relight takes the primary hits from the g-buffer instead of tracing them
+  if (!job->relight && job->packetSize > 0) {
+    RayPacket packet;
+    memcpy(packet.R0, job->camPosition, sizeof(float[3]));
+
+    for (int blockRow = rowStart; blockRow < rowEnd; blockRow += job->packetSize) {
+      for (int blockCol = colStart; blockCol < colEnd; blockCol += job->packetSize) {
+        int blockRowEnd = blockRow + job->packetSize < rowEnd ? blockRow + job->packetSize : rowEnd;
+        int blockColEnd = blockCol + job->packetSize < colEnd ? blockCol + job->packetSize : colEnd;
+
+        packet.count = 0;
+        for (int row = blockRow; row < blockRowEnd; row += 1) {
+          for (int col = blockCol; col < blockColEnd; col += 1) {
+            pixel_ray(packet.Rd[packet.count], job, row, col);
+            packet.count += 1;
+          }
+        }
+
+        long work = stats_work(rayStats);
+        shoot_packet(&packet, job->scene, rayStats);
+        // the packet's work is shared evenly by its pixels
+        long rayWork = (stats_work(rayStats) - work) / packet.count;
+
+        int ray = 0;
+        for (int row = blockRow; row < blockRowEnd; row += 1) {
+          for (int col = blockCol; col < blockColEnd; col += 1) {
+            int pixel = (row - rowStart) * TILE_SIZE + (col - colStart);
+            memcpy(Rd[pixel], packet.Rd[ray], sizeof(float[3]));
+            tVal[pixel] = packet.tVal[ray];
+            objIndex[pixel] = packet.objIndex[ray];
+            if (job->cost != NULL) {
+              job->cost[(long) row * job->pixelWidth + col] = rayWork;
+            }
+            ray += 1;
+          }
+        }
+      }
+    }
+  }
+  else if (!job->relight) {
+    for (int row = rowStart; row < rowEnd; row += 1) {
+      for (int col = colStart; col < colEnd; col += 1) {
+        int pixel = (row - rowStart) * TILE_SIZE + (col - colStart);
+        long work = stats_work(rayStats);
+        pixel_ray(Rd[pixel], job, row, col);
+        tVal[pixel] = shoot(&objIndex[pixel], job->scene, Rd[pixel], job->camPosition, -1, rayStats);
+        if (job->cost != NULL) {
+          job->cost[(long) row * job->pixelWidth + col] = stats_work(rayStats) - work;
+        }
+      }
+    }
+  }
+  stats->primarySeconds += wallSeconds() - start;
+  if (!job->relight) {
+    STAT_ADD(rayStats, primaryRays, (rowEnd - rowStart) * (colEnd - colStart));
+  }
+
+  // pixels an edit can't reach keep the previous image's color, the
+  // wavefront engine sees them as misses
+  bool reused[TILE_SIZE * TILE_SIZE];
+  memset(reused, 0, sizeof(reused));
+  if (job->update != NULL) {
+    long reusedCount = 0;
+    for (int row = rowStart; row < rowEnd; row += 1) {
+      for (int col = colStart; col < colEnd; col += 1) {
+        int pixel = (row - rowStart) * TILE_SIZE + (col - colStart);
+        reused[pixel] = !path_affected(job->scene, job->update, &job->contexts[workerIndex], Rd[pixel], tVal[pixel],
+                                       objIndex[pixel], job->camPosition);
+        if (reused[pixel]) {
+          tVal[pixel] = -1;
+          reusedCount += 1;
+        }
+      }
+    }
+    atomic_fetch_add(&job->update->reused, reusedCount);
+  }
+
+  float colors[TILE_SIZE * TILE_SIZE][3];
+  if (job->wavefront) {
+    unsigned int seeds[TILE_SIZE * TILE_SIZE];
+    for (int row = rowStart; row < rowEnd; row += 1) {
+      for (int col = colStart; col < colEnd; col += 1) {
+        seeds[(row - rowStart) * TILE_SIZE + (col - colStart)] = path_seed(job, row, col, 0);
+      }
+    }
+
+    long work = stats_work(rayStats);
+    shade_wavefront(&job->contexts[workerIndex], job->scene, job->camPosition, Rd, tVal, objIndex, seeds,
+                    TILE_SIZE * TILE_SIZE, colors);
+    work = stats_work(rayStats) - work;
+
+    // the stages mix every path's rays, so the heatmap splits the tile's
+    // shading work by how many bounces each path took
+    int *levelCount = job->contexts[workerIndex].wavefront->levelCount;
+    long bounces = 0;
+    for (int row = rowStart; row < rowEnd; row += 1) {
+      for (int col = colStart; col < colEnd; col += 1) {
+        int pixel = (row - rowStart) * TILE_SIZE + (col - colStart);
+        stats_depth(rayStats, levelCount[pixel]);
+        bounces += levelCount[pixel];
+      }
+    }
+    if (job->cost != NULL && bounces > 0) {
+      for (int row = rowStart; row < rowEnd; row += 1) {
+        for (int col = colStart; col < colEnd; col += 1) {
+          int pixel = (row - rowStart) * TILE_SIZE + (col - colStart);
+          job->cost[(long) row * job->pixelWidth + col] += work * levelCount[pixel] / bounces;
+        }
+      }
+    }
+  }
+
+  for (int row = rowStart; row < rowEnd; row += 1) {
+    for (int col = colStart; col < colEnd; col += 1) {
+      int pixel = (row - rowStart) * TILE_SIZE + (col - colStart);
+      float *currColor = colors[pixel];
+      long rgbIndex = ((long) (row % job->bufferRows) * job->pixelWidth + col) * 3;
+
+      if (reused[pixel]) {
+        memcpy(&job->rgbFile[rgbIndex], &job->update->previous[((long) row * job->pixelWidth + col) * 3], 3);
+        continue;
+      }
+      if (!job->wavefront) {
+        TraceContext *trace = &job->contexts[workerIndex];
+        long work = stats_work(rayStats);
+        trace->pathSeed = path_seed(job, row, col, 0);
+        long framePixel = (long) row * job->pixelWidth + col;
+        if (job->relight) {
+          GBuffer *gbuffer = job->gbuffer;
+          vec3_store(currColor, shade_recorded(job->scene, trace, &gbuffer->hits[gbuffer->first[framePixel]],
+                                               gbuffer->depth[framePixel], job->camPosition));
+        }
+        else {
+          trace->pathHits = job->gbuffer != NULL ? &job->gbuffer->hits[job->gbuffer->first[framePixel]] : NULL;
+          vec3_store(currColor, shade_primary(job->scene, trace, Rd[pixel], tVal[pixel], objIndex[pixel], job->camPosition));
+          if (job->gbuffer != NULL) {
+            job->gbuffer->depth[framePixel] = trace->pathDepth;
+            trace->pathHits = NULL;
+          }
+        }
+        stats_depth(rayStats, trace->pathDepth);
+        if (job->cost != NULL) {
+          job->cost[(long) row * job->pixelWidth + col] += stats_work(rayStats) - work;
+        }
+      }
+      if (job->colors != NULL) {
+        memcpy(&job->colors[((long) row * job->pixelWidth + col) * 3], currColor, sizeof(float[3]));
+      }
+
+      // add color to uint8_t data thing (uint8_t)
+      job->rgbFile[rgbIndex + 0] = (uint8_t)(currColor[0] * 255);
+      job->rgbFile[rgbIndex + 1] = (uint8_t)(currColor[1] * 255);
+      job->rgbFile[rgbIndex + 2] = (uint8_t)(currColor[2] * 255);
+    }
+  }
+
+  if (job->writer != NULL && atomic_fetch_add(&job->tilesDone[tileIndex / job->tilesX], 1) + 1 == job->tilesX) {
+    writer_rows_done(job->writer, rowStart, rowEnd - rowStart);
+  }
+}
+
+// thread pool task, supersamples one batch of the pixels picked for refinement.
+// the pixel's center sample is averaged in with one jittered sample per
+// stratum of an aaGrid x aaGrid split of the pixel
+void refine_pixels(void *ctx, int taskIndex, int workerIndex) {
+  RenderJob *job = (RenderJob *) ctx;
+  int first = taskIndex * REFINE_BATCH;
+  int last = first + REFINE_BATCH < job->refineCount ? first + REFINE_BATCH : job->refineCount;
+
+  for (int refineI = first; refineI < last; refineI += 1) {
+    int pixel = job->refinePixels[refineI];
+    int row = pixel / job->pixelWidth;
+    int col = pixel % job->pixelWidth;
+    vec3 sum = vec3_load(&job->colors[pixel * 3]);
+    long work = stats_work(&job->contexts[workerIndex].stats);
+
+    for (int stratum = 0; stratum < job->aaGrid * job->aaGrid; stratum += 1) {
+      double rowOffset = (stratum / job->aaGrid + hashed_random(pixel, stratum * 2)) / job->aaGrid;
+      double colOffset = (stratum % job->aaGrid + hashed_random(pixel, stratum * 2 + 1)) / job->aaGrid;
+      float Rd[3];
+
+      subpixel_ray(Rd, job, row, col, rowOffset, colOffset);
+      job->contexts[workerIndex].pathSeed = path_seed(job, row, col, stratum + 1);
+      sum += intersect(job->scene, &job->contexts[workerIndex], Rd, job->camPosition, job->camPosition);
+    }
+
+    if (job->cost != NULL) {
+      job->cost[pixel] += stats_work(&job->contexts[workerIndex].stats) - work;
+    }
+
+    sum *= 1.0f / (job->aaGrid * job->aaGrid + 1);
+    job->rgbFile[(long) pixel * 3 + 0] = (uint8_t)(sum[0] * 255);
+    job->rgbFile[(long) pixel * 3 + 1] = (uint8_t)(sum[1] * 255);
+    job->rgbFile[(long) pixel * 3 + 2] = (uint8_t)(sum[2] * 255);
+  }
+}
+
+// highest contrast first, ties in image order
+static int compare_candidates(const void *a, const void *b) {
+  const Candidate *left = (const Candidate *) a;
+  const Candidate *right = (const Candidate *) b;
+
+  if (left->contrast != right->contrast) {
+    return left->contrast > right->contrast ? -1 : 1;
+  }
+  return left->pixel - right->pixel;
+}
+
+// picks the pixels whose largest color difference to any of their 8 neighbors
+// is over the threshold. when the budget can't cover all of them the highest
+// contrast pixels win. returns how many were picked into job->refinePixels
+static int pick_refine_pixels(RenderJob *job, float threshold, long maxPixels) {
+  Candidate *candidates = job->candidates;
+  long candidateCount = 0;
+
+  for (int row = 0; row < job->pixelHeight; row += 1) {
+    for (int col = 0; col < job->pixelWidth; col += 1) {
+      float *center = &job->colors[((long) row * job->pixelWidth + col) * 3];
+      float contrast = 0;
+
+      for (int neighborRow = row - 1; neighborRow <= row + 1; neighborRow += 1) {
+        for (int neighborCol = col - 1; neighborCol <= col + 1; neighborCol += 1) {
+          if (neighborRow < 0 || neighborRow >= job->pixelHeight || neighborCol < 0 || neighborCol >= job->pixelWidth) {
+            continue;
+          }
+          float *neighbor = &job->colors[((long) neighborRow * job->pixelWidth + neighborCol) * 3];
+          for (int channel = 0; channel < 3; channel += 1) {
+            contrast = fmaxf(contrast, fabsf(neighbor[channel] - center[channel]));
+          }
+        }
+      }
+
+      if (contrast > threshold) {
+        candidates[candidateCount].contrast = contrast;
+        candidates[candidateCount].pixel = row * job->pixelWidth + col;
+        candidateCount += 1;
+      }
+    }
+  }
+
+  if (candidateCount > maxPixels) {
+    qsort(candidates, candidateCount, sizeof(Candidate), compare_candidates);
+    candidateCount = maxPixels;
+  }
+
+  for (long index = 0; index < candidateCount; index += 1) {
+    job->refinePixels[index] = candidates[index].pixel;
+  }
+
+  return (int) candidateCount;
+}
+
+// camera viewport and position from the scene's camera
+// default values of 1 if no camera provided
+void find_camera(RenderJob *job, Scene *scene) {
+  job->width = 1;
+  job->height = 1;
+  job->camPosition[0] = 0;
+  job->camPosition[1] = 0;
+  job->camPosition[2] = 0;
+  for (int index = 0; index < scene->objectCount; index += 1) {
+    Object *obj = &scene->objects[index];
+    if (obj->kind == 1) {
+      job->width = obj->width;
+      job->height = obj->height;
+      job->camPosition[0] = obj->position[0];
+      job->camPosition[1] = obj->position[1];
+      job->camPosition[2] = obj->position[2];
+    }
+  }
+}
+
+static bool material_bounded(float *diffuse, float *specular, float reflectivity, float ns) {
+  bool positive = reflectivity >= 0 && reflectivity <= 1 && ns >= 0 && isfinite(ns);
+  for (int channel = 0; channel < 3; channel += 1) {
+    positive = positive && diffuse[channel] >= 0 && isfinite(diffuse[channel]) &&
+               specular[channel] >= 0 && isfinite(specular[channel]);
+  }
+  return positive;
+}
+
+// whether every color a surface can give is between 0 and 1, which the early
+// end of paths relies on. clamping keeps colors from going over 1, and the
+// scene has to keep them from going under 0: no negative light or material
+// colors, attenuation that stays positive, reflectivities between 0 and 1
+static bool colors_bounded(Scene *scene) {
+  for (int lightI = 0; lightI < scene->lightCount; lightI += 1) {
+    Light *light = &scene->lights[lightI];
+    bool positive = light->radial_a0 > 0 && light->radial_a1 >= 0 && light->radial_a2 >= 0 &&
+                    isfinite(light->radial_a1) && isfinite(light->radial_a2);
+    for (int channel = 0; channel < 3; channel += 1) {
+      positive = positive && light->color[channel] >= 0 && isfinite(light->color[channel]);
+    }
+    // outside of a cone that opens past 90 degrees, powf gets negative bases
+    if (!positive || (light->kind == 2 && !(light->spotlightDotProd >= 0))) {
+      return false;
+    }
+  }
+
+  for (int objI = 0; objI < scene->objectCount; objI += 1) {
+    Object *obj = &scene->objects[objI];
+    if (!material_bounded(obj->diffuse, obj->specular, obj->reflectivity, obj->ns)) {
+      return false;
+    }
+  }
+  for (int materialI = 0; materialI < scene->materialCount; materialI += 1) {
+    Material *material = &scene->materials[materialI];
+    if (!material_bounded(material->diffuse, material->specular, material->reflectivity, material->ns)) {
+      return false;
+    }
+  }
+  for (int meshI = 0; meshI < scene->meshCount; meshI += 1) {
+    Material *material = &scene->meshes[meshI].material;
+    if (!material_bounded(material->diffuse, material->specular, material->reflectivity, material->ns)) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+void job_free(RenderJob *job, int threads) {
+  for (int index = 0; job->contexts != NULL && index < threads; index += 1) {
+    free_context(&job->contexts[index]);
+  }
+  free(job->contexts);
+  free(job->workers);
+  free(job->rgbFile);
+  free(job->colors);
+  free(job->cost);
+  free(job->refinePixels);
+  free(job->candidates);
+  free(job->tilesDone);
+  free(job->traced);
+  gbuffer_free(job->gbuffer);
+  update_free(job->update);
+}
+
+// sets up the image buffers and per thread state for rendering the scene.
+// returns -1 with the reason in error when the options don't fit the image or
+// memory runs out, with nothing left to free
+int job_init(RenderJob *job, Scene *scene, int pixelWidth, int pixelHeight, RenderOptions *options,
+             char *error, int errorSize) {
+  memset(job, 0, sizeof(RenderJob));
+  job->scene = scene;
+  find_camera(job, scene);
+
+  // shoot ray through each pixel
+  // for each ray, go through list of objects and check for intersections
+  // smallest intersection (where t > 0) gets the color
+  // tiles are spread over the thread pool, each pixel is traced independently
+  // so the image is the same no matter how many threads run. a region's pixels
+  // come out the same as in a render of the whole frame
+  job->frameWidth = pixelWidth;
+  job->frameHeight = pixelHeight;
+  job->regionX = 0;
+  job->regionY = 0;
+  job->tile = options->region[2] > 0;
+  if (job->tile) {
+    int *region = options->region;
+    if (region[2] > pixelWidth || region[3] > pixelHeight) {
+      snprintf(error, errorSize, "the region %d,%d,%d,%d is outside the %dx%d frame", region[0], region[1], region[2],
+               region[3], pixelWidth, pixelHeight);
+      return -1;
+    }
+    job->regionX = region[0];
+    job->regionY = region[1];
+    pixelWidth = region[2] - region[0];
+    pixelHeight = region[3] - region[1];
+  }
+  job->pixelWidth = pixelWidth;
+  job->pixelHeight = pixelHeight;
+  job->tilesX = (pixelWidth + TILE_SIZE - 1) / TILE_SIZE;
+  job->tilesY = (pixelHeight + TILE_SIZE - 1) / TILE_SIZE;
+  job->bufferRows = pixelHeight;
+  job->bandTiles = job->tilesY;
+  if (options->memBudget > 0) {
+    // a band is the smallest unit rendered at once, a row of tiles
+    long tileRowBytes = (long) pixelWidth * TILE_SIZE * 3;
+    long bandTiles = options->memBudget / (2 * tileRowBytes);
+    if (bandTiles < 1) {
+      snprintf(error, errorSize, "--mem-budget of %.1f MB is too small for a %d pixel wide image, it needs at least %.1f MB",
+               options->memBudget / 1e6, pixelWidth, 2 * tileRowBytes / 1e6);
+      return -1;
+    }
+    if (2 * bandTiles < job->tilesY) {
+      job->bandTiles = (int) bandTiles;
+      job->bufferRows = 2 * job->bandTiles * TILE_SIZE;
+    }
+  }
+  job->rgbFile = (uint8_t *) malloc(((long) pixelWidth * job->bufferRows * 3 + 1) * sizeof(uint8_t));
+  job->packetSize = options->packetSize;
+  job->wavefront = options->wavefront;
+  job->workers = (WorkerStats *) calloc(options->threads, sizeof(WorkerStats));
+  job->contexts = (TraceContext *) calloc(options->threads, sizeof(TraceContext));
+  // anti-aliasing works with the float colors, so only an exact cutoff keeps
+  // them the same
+  bool bounded = colors_bounded(scene);
+  for (int index = 0; job->contexts != NULL && index < options->threads; index += 1) {
+    init_context(&job->contexts[index], scene);
+    job->contexts[index].maxDepth = options->maxDepth;
+    job->contexts[index].roulette = options->roulette;
+    job->contexts[index].cutoff = bounded;
+    job->contexts[index].quantizedCutoff = options->aaThreshold == 0;
+  }
+  long pixelCount = (long) pixelWidth * pixelHeight;
+  job->aaGrid = options->aaGrid;
+  if (options->aaThreshold > 0) {
+    job->colors = (float *) malloc((pixelCount * 3 + 1) * sizeof(float));
+    job->candidates = (Candidate *) malloc((pixelCount + 1) * sizeof(Candidate));
+    job->refinePixels = (int *) malloc((pixelCount + 1) * sizeof(int));
+  }
+  if (options->heatmapFile != NULL) {
+    job->cost = (uint32_t *) calloc(pixelCount + 1, sizeof(uint32_t));
+  }
+  job->tilesDone = (_Atomic int *) malloc((job->tilesY + 1) * sizeof(_Atomic int));
+  atomic_init(&job->tracedCount, 0);
+  atomic_init(&job->passCut, false);
+  job->completeStride = PROGRESSIVE_STRIDE;
+
+  bool allocated = job->rgbFile != NULL && job->workers != NULL && job->contexts != NULL &&
+                   job->tilesDone != NULL && (options->aaThreshold == 0 ||
+                   (job->colors != NULL && job->candidates != NULL && job->refinePixels != NULL)) &&
+                   (options->heatmapFile == NULL || job->cost != NULL);
+  for (int index = 0; allocated && index < options->threads; index += 1) {
+    allocated = job->contexts[index].lastOccluder != NULL && job->contexts[index].nearLights != NULL;
+  }
+  if (!allocated) {
+    snprintf(error, errorSize, "out of memory for a %dx%d image", pixelWidth, pixelHeight);
+    job_free(job, options->threads);
+    return -1;
+  }
+
+  return 0;
+}
+
+ImageWriter *open_output(char *outputFile, RenderJob *job) {
+  char error[256];
+  ImageWriter *writer;
+  if (job->tile) {
+    writer = writer_open_tile(outputFile, job->frameWidth, job->frameHeight, job->regionX, job->regionY,
+                              job->pixelWidth, job->pixelHeight, job->rgbFile, job->bufferRows, error, sizeof(error));
+  }
+  else {
+    writer = writer_open(outputFile, job->pixelWidth, job->pixelHeight, job->rgbFile, job->bufferRows, error,
+                         sizeof(error));
+  }
+
+  if (writer == NULL) {
+    printf("Error: %s.\n", error);
+    exit(1);
+  }
+  return writer;
+}
+
+void close_output(ImageWriter *writer, WriterResult *result) {
+  char error[256];
+
+  if (writer_close(writer, result, error, sizeof(error)) < 0) {
+    printf("Error: %s.\n", error);
+    exit(1);
+  }
+}
+
+// renders the image into job->rgbFile and hands every row to writer as it is
+// finished, adding the time spent to phases
+void render_image(RenderJob *job, ThreadPool *pool, RenderOptions *options, PhaseTimes *phases, ImageWriter *writer) {
+  if (job->deadline > 0) {
+    render_progressive(job, pool, phases);
+    writer_rows_done(writer, 0, job->pixelHeight);
+    return;
+  }
+
+  // anti-aliasing changes pixels after the first pass, so then rows are only
+  // final once it is done
+  job->writer = options->aaThreshold > 0 ? NULL : writer;
+  for (int tileRow = 0; tileRow < job->tilesY; tileRow += 1) {
+    atomic_init(&job->tilesDone[tileRow], 0);
+  }
+
+  double phaseStart = wallSeconds();
+  for (int firstTileRow = 0; firstTileRow < job->tilesY; firstTileRow += job->bandTiles) {
+    int bandTiles = job->tilesY - firstTileRow < job->bandTiles ? job->tilesY - firstTileRow : job->bandTiles;
+    // the band two back used the same part of the buffer, it has to be
+    // written before its pixels are overwritten
+    if (job->bufferRows < job->pixelHeight) {
+      writer_wait(writer, (firstTileRow - job->bandTiles) * TILE_SIZE);
+    }
+    job->tileOffset = firstTileRow * job->tilesX;
+    pool_run(pool, bandTiles * job->tilesX, render_tile, job);
+  }
+  phases->render += wallSeconds() - phaseStart;
+
+  // second pass, extra samples only where the first pass found edges
+  if (options->aaThreshold > 0) {
+    phaseStart = wallSeconds();
+    long pixelCount = (long) job->pixelWidth * job->pixelHeight;
+    long budgetPixels = (long) ((options->aaBudget - 1) * pixelCount) / (job->aaGrid * job->aaGrid);
+    job->refineCount = pick_refine_pixels(job, options->aaThreshold, budgetPixels);
+    pool_run(pool, (job->refineCount + REFINE_BATCH - 1) / REFINE_BATCH, refine_pixels, job);
+    phases->refine += wallSeconds() - phaseStart;
+    if (writer != NULL) {
+      writer_rows_done(writer, 0, job->pixelHeight);
+    }
+  }
+}
+
+void job_totals(RenderJob *job, int threads, RayStats *totals, double *primarySeconds) {
+  memset(totals, 0, sizeof(RayStats));
+  *primarySeconds = 0;
+  for (int index = 0; index < threads; index += 1) {
+    stats_merge(totals, &job->contexts[index].stats);
+    *primarySeconds += job->workers[index].primarySeconds;
+  }
+}
+
+void write_stats_file(RenderJob *job, RenderOptions *options, RayStats *totals, PhaseTimes *phases) {
+  FILE *fh = fopen(options->statsFile, "w");
+  if (fh == NULL) {
+    printf("Error: cannot create %s.\n", options->statsFile);
+    exit(1);
+  }
+  stats_write_json(fh, totals, &job->contexts[0].stats, sizeof(TraceContext), options->threads, phases,
+                   job->pixelWidth, job->pixelHeight, job->wavefront ? "wavefront" : "recursive");
+  fclose(fh);
+}
+
+void print_ray_summary(RenderJob *job, RayStats *totals, double primarySeconds, double wall) {
+  // primary ray time is summed over the workers, so this is per thread throughput
+  if (job->relight) {
+    printf("Primary rays: none, the paths' surfaces come from the g-buffer\n");
+  }
+  else if (job->packetSize > 0) {
+    printf("Primary rays: %ld in %dx%d packets, %.3f s, %.2f Mrays/s per thread\n", totals->primaryRays,
+           job->packetSize, job->packetSize, primarySeconds, primarySeconds > 0 ? totals->primaryRays / primarySeconds / 1e6 : 0);
+  }
+  else {
+    printf("Primary rays: %ld traced one by one, %.3f s, %.2f Mrays/s per thread\n", totals->primaryRays,
+           primarySeconds, primarySeconds > 0 ? totals->primaryRays / primarySeconds / 1e6 : 0);
+  }
+
+  // the benchmark harness reads this line
+  printf("Rays: %ld primary, %ld shadow, %ld reflection, %.2f Mrays/s overall with %s shading\n",
+         totals->primaryRays, totals->shadowRays, totals->reflectionRays,
+         (totals->primaryRays + totals->shadowRays + totals->reflectionRays) / wall / 1e6,
+         job->relight ? "g-buffer" : job->wavefront ? "wavefront" : "recursive");
+}
+
+void generate_image(int pixelWidth, int pixelHeight, char *fileName, char *outputFile, RenderOptions *options) {
+  // time measurement
+  double wallStart = wallSeconds();
+  clock_t time = clock();
+
+  ThreadPool *pool = pool_create(options->threads);
+
+  // Read in the scene
+  Scene scene;
+  char error[256];
+
+  PhaseTimes phases;
+  memset(&phases, 0, sizeof(phases));
+
+  const char *kernels = kernels_init(options->simd);
+  if (load_scene(fileName, &scene, pool, &phases, error, sizeof(error)) < 0) {
+    printf("Error: %s\n", error);
+    exit(1);
+  }
+  double cullStart = wallSeconds();
+  cull_lights(&scene, options->lightCutoff);
+  phases.build += wallSeconds() - cullStart;
+
+  RenderJob job;
+  if (job_init(&job, &scene, pixelWidth, pixelHeight, options, error, sizeof(error)) < 0) {
+    printf("Error: %s.\n", error);
+    exit(1);
+  }
+  attach_gbuffer(&job, &scene, options);
+  const char *updateReason;
+  attach_update(&job, &scene, options, pool, &updateReason);
+  attach_deadline(&job, options, wallStart);
+  ImageWriter *writer = open_output(outputFile, &job);
+  render_image(&job, pool, options, &phases, writer);
+  double renderEnd = wallSeconds();
+
+  int steals = 0;
+  for (int index = 0; index < pool_size(pool); index += 1) {
+    steals += pool_steals(pool, index);
+  }
+  pool_destroy(pool);
+  RayStats totals;
+  double primarySeconds;
+  job_totals(&job, options->threads, &totals, &primarySeconds);
+
+  // most of the image was written while it rendered, this waits for the rest
+  double phaseStart = wallSeconds();
+  WriterResult written;
+  close_output(writer, &written);
+  if (job.cost != NULL) {
+    write_heatmap(options->heatmapFile, job.pixelWidth, job.pixelHeight, job.cost);
+  }
+  if (job.gbuffer != NULL && !job.relight && gbuffer_write(job.gbuffer, options->gbufferFile, error, sizeof(error)) < 0) {
+    printf("Error: %s.\n", error);
+    exit(1);
+  }
+  phases.write = wallSeconds() - phaseStart;
+
+  int sceneObjects = scene.objectCount;
+  int sceneLights = scene.lightCount;
+  bool sceneCompiled = scene.mapping != NULL;
+  int sceneInstances = scene.instanceCount;
+  int scenePrototypes = scene.prototypeCount;
+  long instanceSpheres = 0;
+  for (int instanceI = 0; instanceI < scene.instanceCount; instanceI += 1) {
+    instanceSpheres += scene.prototypes[scene.instances[instanceI].prototype].count;
+  }
+  double instanceBytes = (double) scene.instanceCount * (sizeof(Instance) + sizeof(int)) +
+                         (double) scene.instanceBvh.nodeCount * sizeof(BVHNode);
+  int sceneMeshes = scene.meshCount;
+  int sceneTriangles = scene.triangleCount;
+  int sceneVertices = scene.vertexCount + scene.quantizedVertexCount;
+  double meshBytes = (double) scene.meshCount * sizeof(Mesh) + (double) scene.vertexCount * sizeof(float[3]) +
+                     (double) scene.quantizedVertexCount * sizeof(uint16_t[3]) +
+                     (double) scene.triangleCount * sizeof(int[3]) + (double) scene.meshBvh.nodeCount * sizeof(BVHNode);
+  free_scene(&scene);
+
+  // final time measurement
+  time = clock() - time;
+  double wall = wallSeconds() - wallStart;
+  phases.total = wall;
+  if (options->statsFile != NULL) {
+    write_stats_file(&job, options, &totals, &phases);
+  }
+
+  displayTime(wall, time, options->threads);
+  printf("%d tiles of %dx%d pixels, %d steals, %s intersection kernels\n", job.tilesX * job.tilesY, TILE_SIZE, TILE_SIZE, steals, kernels);
+  printf("Scene: %d objects, %d lights, %s in %.3f s\n", sceneObjects, sceneLights,
+         sceneCompiled ? "mapped" : "parsed and built", phases.parse + phases.build);
+  if (sceneInstances > 0) {
+    printf("Instances: %d of %d prototypes, %ld spheres, %.1f MB with their bvh\n", sceneInstances, scenePrototypes,
+           instanceSpheres, instanceBytes / 1e6);
+  }
+  if (sceneMeshes > 0) {
+    printf("Meshes: %d with %d triangles and %d vertices, %.1f bytes per triangle with their bvh\n", sceneMeshes,
+           sceneTriangles, sceneVertices, meshBytes / sceneTriangles);
+  }
+  printf("Image: %s, %.2f MB, encoded in %.3f s of writer cpu, %.3f s spent waiting after the render\n",
+         written.format, written.bytes / 1e6, written.encodeSeconds, phases.write);
+  if (job.tile) {
+    printf("Tile: pixels %d,%d to %d,%d of a %dx%d frame\n", job.regionX, job.regionY, job.regionX + job.pixelWidth,
+           job.regionY + job.pixelHeight, job.frameWidth, job.frameHeight);
+  }
+  print_ray_summary(&job, &totals, primarySeconds, wall);
+  if (job.gbuffer != NULL) {
+    long surfaces = 0;
+    for (long pixel = 0; pixel < (long) job.pixelWidth * job.pixelHeight; pixel += 1) {
+      surfaces += job.gbuffer->depth[pixel];
+    }
+    printf("G-buffer: %ld surfaces %s %s, %.2f per pixel\n", surfaces, job.relight ? "relit from" : "recorded into",
+           job.relight ? options->relightFile : options->gbufferFile, (double) surfaces / job.pixelWidth / job.pixelHeight);
+  }
+  if (job.update != NULL) {
+    long pixelCount = (long) job.pixelWidth * job.pixelHeight;
+    long reused = atomic_load(&job.update->reused);
+    printf("Update: %ld of %ld pixels rendered again, %.1f%%, for %d changed sphere bounds\n", pixelCount - reused,
+           pixelCount, 100.0 * (pixelCount - reused) / pixelCount, job.update->changedCount);
+  }
+  else if (updateReason != NULL) {
+    printf("Update: every pixel rendered again, %s\n", updateReason);
+  }
+
+  if (job.deadline > 0) {
+    long pixelCount = (long) job.pixelWidth * job.pixelHeight;
+    long traced = atomic_load(&job.tracedCount);
+    if (traced == pixelCount) {
+      printf("Deadline: every pixel traced in %.0f of %d ms\n", (renderEnd - wallStart) * 1000, options->deadlineMs);
+    }
+    else {
+      printf("Deadline: %ld of %ld pixels traced, %.1f%%, in %.0f of %d ms. the grid of every %d pixels is complete, "
+             "the rest was filled %s\n", traced, pixelCount, 100.0 * traced / pixelCount, (renderEnd - wallStart) * 1000,
+             options->deadlineMs, job.completeStride, job.fillNearest ? "from the nearest traced pixels" : "bilinearly");
+    }
+  }
+
+  if (options->aaThreshold > 0) {
+    long pixelCount = (long) job.pixelWidth * job.pixelHeight;
+    long samples = pixelCount + (long) job.refineCount * job.aaGrid * job.aaGrid;
+    printf("Anti-aliasing: %d of %ld pixels refined with %dx%d samples, %ld samples total, %.2f per pixel (budget %.2f)\n",
+           job.refineCount, pixelCount, job.aaGrid, job.aaGrid, samples, (double) samples / pixelCount, options->aaBudget);
+  }
+  job_free(&job, options->threads);
+}
+
+void estimate_row_costs(int pixelWidth, int pixelHeight, char *fileName, RenderOptions *options, double *rowCosts) {
+  ThreadPool *pool = pool_create(options->threads);
+  Scene scene;
+  char error[256];
+  PhaseTimes phases;
+  memset(&phases, 0, sizeof(phases));
+
+  kernels_init(options->simd);
+  if (load_scene(fileName, &scene, pool, &phases, error, sizeof(error)) < 0) {
+    printf("Error: %s\n", error);
+    exit(1);
+  }
+  cull_lights(&scene, options->lightCutoff);
+
+  // the preview covers the same view, each of its rows stands for a few rows of the frame
+  RenderOptions previewOptions = *options;
+  previewOptions.aaThreshold = 0;
+  previewOptions.memBudget = 0;
+  memset(previewOptions.region, 0, sizeof(previewOptions.region));
+  int previewWidth = (pixelWidth + COST_PREVIEW_SCALE - 1) / COST_PREVIEW_SCALE;
+  int previewHeight = (pixelHeight + COST_PREVIEW_SCALE - 1) / COST_PREVIEW_SCALE;
+
+  RenderJob job;
+  if (job_init(&job, &scene, previewWidth, previewHeight, &previewOptions, error, sizeof(error)) < 0) {
+    printf("Error: %s.\n", error);
+    exit(1);
+  }
+  // the estimate is made from the preview's work per pixel
+  if (job.cost == NULL) {
+    job.cost = (uint32_t *) calloc((long) previewWidth * previewHeight + 1, sizeof(uint32_t));
+  }
+  if (job.cost == NULL) {
+    printf("Error: out of memory for the cost preview.\n");
+    exit(1);
+  }
+  render_image(&job, pool, &previewOptions, &phases, NULL);
+
+  // every pixel costs something even when nothing is hit, and without stats
+  // compiled in the preview counts nothing at all
+  for (int row = 0; row < pixelHeight; row += 1) {
+    int previewRow = (int) ((long) row * previewHeight / pixelHeight);
+    double cost = 0;
+    for (int col = 0; col < previewWidth; col += 1) {
+      cost += job.cost[(long) previewRow * previewWidth + col] + 1;
+    }
+    rowCosts[row] = cost;
+  }
+
+  job_free(&job, options->threads);
+  pool_destroy(pool);
+  free_scene(&scene);
+}
+
+int render_request(Scene *scene, ThreadPool *pool, int pixelWidth, int pixelHeight, float *camPosition,
+                   char *outputFile, uint8_t **pixels, RenderOptions *options, char *error, int errorSize) {
+  RenderJob job;
+  if (job_init(&job, scene, pixelWidth, pixelHeight, options, error, errorSize) < 0) {
+    return -1;
+  }
+  if (camPosition != NULL) {
+    memcpy(job.camPosition, camPosition, sizeof(float[3]));
+  }
+
+  ImageWriter *writer = NULL;
+  if (outputFile != NULL) {
+    writer = writer_open(outputFile, pixelWidth, pixelHeight, job.rgbFile, job.bufferRows, error, errorSize);
+    if (writer == NULL) {
+      job_free(&job, options->threads);
+      return -1;
+    }
+  }
+
+  PhaseTimes phases;
+  memset(&phases, 0, sizeof(phases));
+  render_image(&job, pool, options, &phases, writer);
+
+  int result = 0;
+  if (writer != NULL) {
+    WriterResult written;
+    result = writer_close(writer, &written, error, errorSize);
+  }
+  else {
+    // the caller takes the image over
+    *pixels = job.rgbFile;
+    job.rgbFile = NULL;
+  }
+  job_free(&job, options->threads);
+
+  return result;
+}
@@ -0,0 +1,148 @@
+#ifndef RENDER_H
+#define RENDER_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include "Raycaster.h"
+#include "gbuffer.h"
+#include "imagewriter.h"
+
+// a render job holds what rendering one image of a scene needs: the camera,
+// the image buffers and the per thread state. the image is cut into tiles
+// that are spread over the thread pool, and when a memory budget is set they
+// render in bands of rows of tiles that are written out as they finish.
+// updates, relighting and deadlines are attached to the job by their own
+// modules before it renders
+
+// pixels per side of a render tile
+#define TILE_SIZE 32
+
+// a render with a deadline traces pixels in passes, the first one on a grid
+// of this many pixels per side and each next one on a grid twice as fine. it
+// has to divide TILE_SIZE
+#define PROGRESSIVE_STRIDE 16
+
+// per worker timing, padded so workers don't share cache lines
+typedef struct WorkerStats {
+  double primarySeconds;
+  char pad[56];
+} WorkerStats;
+
+typedef struct Candidate {
+  float contrast;
+  int pixel;
+} Candidate;
+
+typedef struct RenderJob {
+  Scene *scene;
+
+  // camera viewport
+  float camPosition[3];
+  float width;
+  float height;
+
+  // pixels rendered. with a region these are the region's, the camera still
+  // spans all of frameWidth x frameHeight and the region starts at regionX, regionY
+  int pixelWidth;
+  int pixelHeight;
+  int frameWidth;
+  int frameHeight;
+  int regionX;
+  int regionY;
+  // the output is a tile file, which merge_tiles can put together with others
+  bool tile;
+  int tilesX;
+  int tilesY;
+  // rgbFile holds bufferRows rows. when that is less than the whole image it
+  // is a ring of two bands of bandTiles rows of tiles each, so one band can
+  // render while the writer works through the other
+  uint8_t *rgbFile;
+  int bufferRows;
+  int bandTiles;
+  // render_tile's task indices start at this tile, the first of the band
+  int tileOffset;
+
+  // side of the square primary ray packets, 0 traces rays one by one
+  int packetSize;
+  // shade tiles with the wavefront engine
+  int wavefront;
+  WorkerStats *workers;
+  TraceContext *contexts;
+
+  // unquantized pixel colors, only kept when anti-aliasing needs them
+  float *colors;
+  // intersection work per pixel, only kept for the heatmap
+  uint32_t *cost;
+
+  // surfaces of every pixel's path, recorded into when relight is false and
+  // shaded from instead of tracing when it is true. NULL for neither
+  GBuffer *gbuffer;
+  bool relight;
+
+  // pixels are only rendered where an edit can reach them when set
+  struct SceneUpdate *update;
+
+  // pixels getting an aaGrid x aaGrid block of extra samples, picked out of
+  // candidates. both are sized for every pixel up front
+  int *refinePixels;
+  Candidate *candidates;
+  int refineCount;
+  int aaGrid;
+
+  // rows go to the writer as soon as every tile across them is done, when
+  // writer is set. tilesDone counts the finished tiles of each row of tiles
+  ImageWriter *writer;
+  _Atomic int *tilesDone;
+
+  // with a deadline (wall clock seconds, 0 for none) pixels are traced coarse
+  // to fine, one pass of passStride pixels apart at a time, and tracing stops
+  // when it passes. traced holds the stride of the pass that traced each
+  // pixel, 0 for the gaps left to fill from the grid of completeStride, the
+  // finest pass that wasn't cut. tiles of a pass are visited passStep apart,
+  // so a pass cut short still covers the whole frame
+  double deadline;
+  bool fillNearest;
+  uint8_t *traced;
+  _Atomic long tracedCount;
+  int passStride;
+  int passStep;
+  _Atomic bool passCut;
+  int completeStride;
+} RenderJob;
+
+// sets up the image buffers and per thread state for rendering the scene.
+// returns -1 with the reason in error when the options don't fit the image or
+// memory runs out, with nothing left to free
+int job_init(RenderJob *job, Scene *scene, int pixelWidth, int pixelHeight, RenderOptions *options, char *error,
+             int errorSize);
+void job_free(RenderJob *job, int threads);
+
+// camera viewport and position from the scene's camera
+void find_camera(RenderJob *job, Scene *scene);
+
+// direction of the ray through a point of one pixel, offsets are 0 to 1 from
+// the pixel's top left corner, or through its center
+void subpixel_ray(float *Rd, RenderJob *job, int row, int col, double rowOffset, double colOffset);
+void pixel_ray(float *Rd, RenderJob *job, int row, int col);
+// seed of the roulette draws of a path through a pixel, sample 0 for the
+// pixel's center and 1 on for its anti-aliasing samples
+unsigned int path_seed(RenderJob *job, int row, int col, int sample);
+
+// thread pool task, renders one tile of the image
+void render_tile(void *ctx, int tileIndex, int workerIndex);
+
+// renders the image into job->rgbFile and hands every row to writer as it is
+// finished, adding the time spent to phases
+void render_image(RenderJob *job, ThreadPool *pool, RenderOptions *options, PhaseTimes *phases, ImageWriter *writer);
+
+// the image writer for the job's output file, a tile file for a region. these
+// print the error and exit when the file can't be written
+ImageWriter *open_output(char *outputFile, RenderJob *job);
+void close_output(ImageWriter *writer, WriterResult *result);
+
+// the ray counters and primary ray seconds of every worker added up
+void job_totals(RenderJob *job, int threads, RayStats *totals, double *primarySeconds);
+void write_stats_file(RenderJob *job, RenderOptions *options, RayStats *totals, PhaseTimes *phases);
+void print_ray_summary(RenderJob *job, RayStats *totals, double primarySeconds, double wall);
+
+#endif
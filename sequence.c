@@ -0,0 +1,228 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "Raycaster.h"
+#include "bvh.h"
+#include "imagewriter.h"
+#include "parser.h"
+#include "render.h"
+#include "sequence.h"
+#include "threadpool.h"
+
+// sequences rebuild the bvh once refitting has made it this many times as
+// expensive to trace as when it was built
+#define REFIT_COST_LIMIT 1.1f
+
+// moves everything keyed in the animation to where it is at frame, linearly
+// between keyframes and holding still before the first and after the last.
+// returns whether the camera is keyed, with its position in camPosition
+static bool apply_keyframes(Scene *scene, Animation *animation, int frame, float *camPosition) {
+  bool cameraKeyed = false;
+
+  // keys are sorted, so each target's keys are one run in frame order
+  int first = 0;
+  while (first < animation->keyCount) {
+    Keyframe *keys = &animation->keys[first];
+    int count = 1;
+    while (first + count < animation->keyCount && keys[count].target == keys[0].target && keys[count].index == keys[0].index) {
+      count += 1;
+    }
+    first += count;
+
+    float *position;
+    if (keys[0].target == 0) {
+      position = camPosition;
+      cameraKeyed = true;
+    }
+    else if (keys[0].target == 1) {
+      position = scene->objects[keys[0].index].position;
+    }
+    else {
+      position = scene->lights[keys[0].index].position;
+    }
+
+    int next = 0;
+    while (next < count && keys[next].frame <= frame) {
+      next += 1;
+    }
+    if (next == 0 || next == count) {
+      memcpy(position, keys[next == 0 ? 0 : count - 1].position, sizeof(float[3]));
+      continue;
+    }
+
+    Keyframe *from = &keys[next - 1];
+    Keyframe *to = &keys[next];
+    float blend = (float) (frame - from->frame) / (to->frame - from->frame);
+    for (int axis = 0; axis < 3; axis += 1) {
+      position[axis] = from->position[axis] + (to->position[axis] - from->position[axis]) * blend;
+    }
+  }
+
+  return cameraKeyed;
+}
+
+// the output pattern needs exactly one integer conversion for the frame number
+static bool frame_pattern_valid(char *pattern) {
+  int conversions = 0;
+
+  for (char *pos = pattern; *pos != '\0'; pos += 1) {
+    if (*pos != '%') {
+      continue;
+    }
+    pos += 1;
+    if (*pos == '%') {
+      continue;
+    }
+    while (*pos >= '0' && *pos <= '9') {
+      pos += 1;
+    }
+    if (*pos != 'd') {
+      return false;
+    }
+    conversions += 1;
+  }
+
+  return conversions == 1;
+}
+
+void generate_sequence(int pixelWidth, int pixelHeight, char *fileName, char *keysFile, char *outputPattern,
+                       RenderOptions *options) {
+  double wallStart = wallSeconds();
+  clock_t time = clock();
+  char error[256];
+
+  if (!frame_pattern_valid(outputPattern)) {
+    printf("Error: the output name needs one frame number conversion like %%04d, got %s.\n", outputPattern);
+    exit(1);
+  }
+
+  Animation animation;
+  if (read_keyframes(keysFile, &animation, error, sizeof(error)) < 0) {
+    printf("Error: %s\n", error);
+    exit(1);
+  }
+  int frameCount = options->frames > 0 ? options->frames : animation.frameCount;
+
+  ThreadPool *pool = pool_create(options->threads);
+  Scene scene;
+  PhaseTimes phases;
+  memset(&phases, 0, sizeof(phases));
+
+  const char *kernels = kernels_init(options->simd);
+  if (load_scene(fileName, &scene, pool, &phases, error, sizeof(error)) < 0) {
+    printf("Error: %s\n", error);
+    exit(1);
+  }
+  double cullStart = wallSeconds();
+  cull_lights(&scene, options->lightCutoff);
+  phases.build += wallSeconds() - cullStart;
+  double loadSeconds = phases.parse + phases.build;
+
+  for (int keyI = 0; keyI < animation.keyCount; keyI += 1) {
+    Keyframe *key = &animation.keys[keyI];
+    if (key->target == 1 && key->index >= scene.objectCount) {
+      printf("Error: %s: object %d is keyed, but the scene has %d objects.\n", keysFile, key->index, scene.objectCount);
+      exit(1);
+    }
+    if (key->target == 2 && key->index >= scene.lightCount) {
+      printf("Error: %s: light %d is keyed, but the scene has %d lights.\n", keysFile, key->index, scene.lightCount);
+      exit(1);
+    }
+  }
+
+  // the pool, image buffers and per thread state are set up once and reused
+  // by every frame
+  RenderJob job;
+  if (job_init(&job, &scene, pixelWidth, pixelHeight, options, error, sizeof(error)) < 0) {
+    printf("Error: %s.\n", error);
+    exit(1);
+  }
+
+  float builtCost = bvh_cost(&scene.bvh);
+  int rebuilds = 0;
+  double firstFrame = 0;
+  double updateSeconds = 0;
+  char frameFile[4096];
+
+  for (int frame = 0; frame < frameCount; frame += 1) {
+    double frameStart = wallSeconds();
+
+    float camPosition[3];
+    bool cameraKeyed = apply_keyframes(&scene, &animation, frame, camPosition);
+    find_camera(&job, &scene);
+    if (cameraKeyed) {
+      memcpy(job.camPosition, camPosition, sizeof(float[3]));
+    }
+
+    // the moved objects keep the tree they were built into. once refitting has
+    // made it too slow to trace, a fresh one is built for where they are now
+    double phaseStart = wallSeconds();
+    if (options->rebuild) {
+      rebuild_scene(&scene);
+      rebuilds += 1;
+    }
+    else {
+      refit_scene(&scene);
+      if (bvh_cost(&scene.bvh) > REFIT_COST_LIMIT * builtCost) {
+        rebuild_scene(&scene);
+        builtCost = bvh_cost(&scene.bvh);
+        rebuilds += 1;
+      }
+    }
+    updateSeconds += wallSeconds() - phaseStart;
+
+    snprintf(frameFile, sizeof(frameFile), outputPattern, frame);
+    ImageWriter *writer = open_output(frameFile, &job);
+    render_image(&job, pool, options, &phases, writer);
+
+    phaseStart = wallSeconds();
+    WriterResult written;
+    close_output(writer, &written);
+    phases.write += wallSeconds() - phaseStart;
+
+    double frameSeconds = wallSeconds() - frameStart;
+    if (frame == 0) {
+      firstFrame = frameSeconds;
+    }
+    printf("Frame %d of %d: %s in %.3f s\n", frame + 1, frameCount, frameFile, frameSeconds);
+  }
+  phases.build += updateSeconds;
+
+  int steals = 0;
+  for (int index = 0; index < pool_size(pool); index += 1) {
+    steals += pool_steals(pool, index);
+  }
+  pool_destroy(pool);
+  RayStats totals;
+  double primarySeconds;
+  job_totals(&job, options->threads, &totals, &primarySeconds);
+
+  // the heatmap shows the last frame
+  if (job.cost != NULL) {
+    write_heatmap(options->heatmapFile, job.pixelWidth, job.pixelHeight, job.cost);
+  }
+
+  int sceneObjects = scene.objectCount;
+  int sceneLights = scene.lightCount;
+  free_scene(&scene);
+  free(animation.keys);
+
+  time = clock() - time;
+  double wall = wallSeconds() - wallStart;
+  phases.total = wall;
+  if (options->statsFile != NULL) {
+    write_stats_file(&job, options, &totals, &phases);
+  }
+
+  displayTime(wall, time, options->threads);
+  printf("%d tiles of %dx%d pixels per frame, %d steals, %s intersection kernels\n", job.tilesX * job.tilesY, TILE_SIZE, TILE_SIZE, steals, kernels);
+  printf("Scene: %d objects, %d lights, loaded in %.3f s\n", sceneObjects, sceneLights, loadSeconds);
+  double rest = wall - loadSeconds - firstFrame;
+  printf("Sequence: %d frames, first %.3f s, then %.3f s per frame, bvh %s %.2f ms per frame, %d rebuilds\n",
+         frameCount, firstFrame, frameCount > 1 ? rest / (frameCount - 1) : 0, options->rebuild ? "rebuild" : "refit",
+         updateSeconds / frameCount * 1000, rebuilds);
+  print_ray_summary(&job, &totals, primarySeconds, wall);
+  job_free(&job, options->threads);
+}
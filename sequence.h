@@ -0,0 +1,16 @@
+#ifndef SEQUENCE_H
+#define SEQUENCE_H
+
+#include "Raycaster.h"
+
+// keyframe animations. the scene is loaded once, and for every frame the
+// keyed camera, objects and lights are moved into place, the bvh is refit
+// around them and the frame renders with the buffers and per thread state of
+// the one before
+
+// renders every frame of a keyframe animation of the scene in one go, to files
+// named by outputPattern with the frame number filled in (like "frame%04d.ppm")
+void generate_sequence(int pixelWidth, int pixelHeight, char *fileName, char *keysFile, char *outputPattern,
+                       RenderOptions *options);
+
+#endif
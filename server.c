@@ -0,0 +1,382 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "kernels.h"
+#include "server.h"
+
+// scenes kept loaded at once, the least recently used one makes room
+#define CACHE_SCENES 8
+#define REQUEST_LINE_MAX 4096
+#define REQUEST_WORDS 10
+// largest image a request can ask for, so a typo can't take the daemon's
+// memory. 8k is just under the pixel limit
+#define REQUEST_MAX_SIDE 16384
+#define REQUEST_MAX_PIXELS (1L << 25)
+
+typedef struct CachedScene {
+  bool used;
+  Scene scene;
+  // fnv-1a hash of the scene file's contents
+  uint64_t hash;
+  unsigned long lastUsed;
+
+  // the file it was last loaded or hashed from. while that file is unchanged
+  // it isn't hashed again
+  char path[PATH_MAX];
+  dev_t device;
+  ino_t inode;
+  off_t size;
+  struct timespec modified;
+} CachedScene;
+
+typedef struct Server {
+  int listenFd;
+  ThreadPool *pool;
+  RenderOptions *options;
+
+  // held for a whole request, so requests take turns on the pool and nothing
+  // in the cache is freed while it renders
+  pthread_mutex_t lock;
+  CachedScene cache[CACHE_SCENES];
+  unsigned long useClock;
+  bool stopping;
+  long requests;
+} Server;
+
+typedef struct Connection {
+  Server *server;
+  int fd;
+} Connection;
+
+static bool same_file(CachedScene *entry, char *path, struct stat *info) {
+  return strcmp(entry->path, path) == 0 && entry->device == info->st_dev && entry->inode == info->st_ino &&
+         entry->size == info->st_size && entry->modified.tv_sec == info->st_mtim.tv_sec &&
+         entry->modified.tv_nsec == info->st_mtim.tv_nsec;
+}
+
+static void remember_file(CachedScene *entry, char *path, struct stat *info) {
+  snprintf(entry->path, sizeof(entry->path), "%s", path);
+  entry->device = info->st_dev;
+  entry->inode = info->st_ino;
+  entry->size = info->st_size;
+  entry->modified = info->st_mtim;
+}
+
+static int hash_file(char *path, uint64_t *hash, struct stat *info, char *error, int errorSize) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0 || fstat(fd, info) < 0) {
+    snprintf(error, errorSize, "%s: cannot open the scene file", path);
+    if (fd >= 0) {
+      close(fd);
+    }
+    return -1;
+  }
+
+  *hash = 0xcbf29ce484222325ull;
+  if (info->st_size > 0) {
+    const uint8_t *data = (const uint8_t *) mmap(NULL, info->st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+      close(fd);
+      snprintf(error, errorSize, "%s: cannot map the scene file", path);
+      return -1;
+    }
+    for (off_t index = 0; index < info->st_size; index += 1) {
+      *hash = (*hash ^ data[index]) * 0x100000001b3ull;
+    }
+    munmap((void *) data, info->st_size);
+  }
+  close(fd);
+
+  return 0;
+}
+
+// finds the scene in the cache, loading it when it isn't there. returns NULL
+// with a message in error if it can't be loaded
+static Scene *find_scene(Server *server, char *path, bool *cached, char *error, int errorSize) {
+  struct stat info;
+  if (stat(path, &info) < 0) {
+    snprintf(error, errorSize, "%s: cannot open the scene file", path);
+    return NULL;
+  }
+
+  server->useClock += 1;
+  *cached = true;
+  for (int slot = 0; slot < CACHE_SCENES; slot += 1) {
+    CachedScene *entry = &server->cache[slot];
+    if (entry->used && same_file(entry, path, &info)) {
+      entry->lastUsed = server->useClock;
+      return &entry->scene;
+    }
+  }
+
+  // a new or changed file, it may still have the same contents as a cached one
+  uint64_t hash;
+  if (hash_file(path, &hash, &info, error, errorSize) < 0) {
+    return NULL;
+  }
+  for (int slot = 0; slot < CACHE_SCENES; slot += 1) {
+    CachedScene *entry = &server->cache[slot];
+    if (entry->used && entry->hash == hash) {
+      remember_file(entry, path, &info);
+      entry->lastUsed = server->useClock;
+      return &entry->scene;
+    }
+  }
+
+  CachedScene *victim = &server->cache[0];
+  for (int slot = 1; slot < CACHE_SCENES && victim->used; slot += 1) {
+    if (!server->cache[slot].used || server->cache[slot].lastUsed < victim->lastUsed) {
+      victim = &server->cache[slot];
+    }
+  }
+  if (victim->used) {
+    free_scene(&victim->scene);
+    victim->used = false;
+  }
+
+  *cached = false;
+  PhaseTimes phases;
+  if (load_scene(path, &victim->scene, server->pool, &phases, error, errorSize) < 0) {
+    return NULL;
+  }
+  cull_lights(&victim->scene, server->options->lightCutoff);
+  victim->used = true;
+  victim->hash = hash;
+  victim->lastUsed = server->useClock;
+  remember_file(victim, path, &info);
+
+  return &victim->scene;
+}
+
+static int send_all(int fd, const void *data, long size) {
+  const char *pos = (const char *) data;
+
+  while (size > 0) {
+    ssize_t sent = send(fd, pos, size, MSG_NOSIGNAL);
+    if (sent < 0 && errno == EINTR) {
+      continue;
+    }
+    if (sent <= 0) {
+      return -1;
+    }
+    pos += sent;
+    size -= sent;
+  }
+  return 0;
+}
+
+static int send_error(int fd, char *message) {
+  char reply[512];
+  int length = snprintf(reply, sizeof(reply), "error %s\n", message);
+  return send_all(fd, reply, length < (int) sizeof(reply) ? length : (int) sizeof(reply) - 1);
+}
+
+static bool parse_int(char *word, int *value) {
+  char *end;
+  long parsed = strtol(word, &end, 10);
+  *value = (int) parsed;
+  return *word != '\0' && *end == '\0' && parsed > 0 && parsed <= INT_MAX;
+}
+
+static bool parse_float(char *word, float *value) {
+  char *end;
+  *value = strtof(word, &end);
+  return *word != '\0' && *end == '\0';
+}
+
+// handles one request line. returns whether to keep reading from the client
+static bool handle_request(Server *server, int fd, char *line) {
+  char *words[REQUEST_WORDS];
+  int wordCount = 0;
+  char *save;
+
+  for (char *word = strtok_r(line, " \t\r\n", &save); word != NULL; word = strtok_r(NULL, " \t\r\n", &save)) {
+    if (wordCount == REQUEST_WORDS) {
+      return send_error(fd, "too many words in the request") == 0;
+    }
+    words[wordCount] = word;
+    wordCount += 1;
+  }
+  if (wordCount == 0) {
+    return true;
+  }
+
+  if (strcmp(words[0], "shutdown") == 0 && wordCount == 1) {
+    pthread_mutex_lock(&server->lock);
+    server->stopping = true;
+    // wakes the accept loop up
+    shutdown(server->listenFd, SHUT_RDWR);
+    pthread_mutex_unlock(&server->lock);
+    send_all(fd, "ok\n", 3);
+    return false;
+  }
+
+  if (strcmp(words[0], "render") != 0) {
+    return send_error(fd, "unknown request, expected render or shutdown") == 0;
+  }
+
+  int width;
+  int height;
+  float camPosition[3];
+  bool moveCamera = wordCount == 9 && strcmp(words[5], "camera") == 0;
+  if ((wordCount != 5 && !moveCamera) || !parse_int(words[1], &width) || !parse_int(words[2], &height)) {
+    return send_error(fd, "expected render WIDTH HEIGHT SCENE OUTPUT [camera X Y Z]") == 0;
+  }
+  if (width > REQUEST_MAX_SIDE || height > REQUEST_MAX_SIDE || (long) width * height > REQUEST_MAX_PIXELS) {
+    char message[128];
+    snprintf(message, sizeof(message), "the image can be at most %d pixels on a side and %ld pixels in all",
+             REQUEST_MAX_SIDE, REQUEST_MAX_PIXELS);
+    return send_error(fd, message) == 0;
+  }
+  if (moveCamera && (!parse_float(words[6], &camPosition[0]) || !parse_float(words[7], &camPosition[1]) ||
+                     !parse_float(words[8], &camPosition[2]))) {
+    return send_error(fd, "the camera position needs three numbers") == 0;
+  }
+  char *outputFile = strcmp(words[4], "-") == 0 ? NULL : words[4];
+
+  double start = wallSeconds();
+  char error[256];
+  bool cached = false;
+  uint8_t *pixels = NULL;
+  double traceSeconds = 0;
+  int result = -1;
+
+  // requests are served one at a time: the render runs under the lock, since
+  // the pool runs one job at a time and the scene must stay in the cache
+  // until it is done. other connections wait here for their turn
+  pthread_mutex_lock(&server->lock);
+  if (server->stopping) {
+    snprintf(error, sizeof(error), "the server is shutting down");
+  }
+  else {
+    Scene *scene = find_scene(server, words[3], &cached, error, sizeof(error));
+    if (scene != NULL) {
+      double traceStart = wallSeconds();
+      result = render_request(scene, server->pool, width, height, moveCamera ? camPosition : NULL, outputFile,
+                              &pixels, server->options, error, sizeof(error));
+      traceSeconds = wallSeconds() - traceStart;
+      server->requests += 1;
+    }
+  }
+  pthread_mutex_unlock(&server->lock);
+
+  if (result < 0) {
+    return send_error(fd, error) == 0;
+  }
+
+  long bytes = outputFile == NULL ? (long) width * height * 3 : 0;
+  char reply[256];
+  int length = snprintf(reply, sizeof(reply), "ok bytes=%ld scene=%s trace=%.6f total=%.6f\n", bytes,
+                        cached ? "cached" : "loaded", traceSeconds, wallSeconds() - start);
+  bool sent = send_all(fd, reply, length) == 0 && send_all(fd, pixels, bytes) == 0;
+  free(pixels);
+
+  return sent;
+}
+
+static void *serve_connection(void *arg) {
+  Connection *connection = (Connection *) arg;
+  FILE *in = fdopen(connection->fd, "r");
+  char line[REQUEST_LINE_MAX];
+
+  while (fgets(line, sizeof(line), in) != NULL) {
+    if (strchr(line, '\n') == NULL && !feof(in)) {
+      send_error(connection->fd, "request line too long");
+      break;
+    }
+    if (!handle_request(connection->server, connection->fd, line)) {
+      break;
+    }
+  }
+
+  fclose(in);
+  free(connection);
+  return NULL;
+}
+
+void serve(char *socketPath, RenderOptions *options) {
+  struct sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (strlen(socketPath) >= sizeof(address.sun_path)) {
+    printf("Error: the socket path %s is too long.\n", socketPath);
+    exit(1);
+  }
+  strcpy(address.sun_path, socketPath);
+
+  // a socket left behind by a daemon that didn't shut down cleanly
+  struct stat info;
+  if (stat(socketPath, &info) == 0 && S_ISSOCK(info.st_mode)) {
+    unlink(socketPath);
+  }
+
+  Server *server = (Server *) calloc(1, sizeof(Server));
+  server->options = options;
+  server->listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (server->listenFd < 0 || bind(server->listenFd, (struct sockaddr *) &address, sizeof(address)) < 0 ||
+      listen(server->listenFd, 64) < 0) {
+    printf("Error: cannot listen on %s.\n", socketPath);
+    exit(1);
+  }
+  pthread_mutex_init(&server->lock, NULL);
+
+  const char *kernels = kernels_init(options->simd);
+  server->pool = pool_create(options->threads);
+  printf("Serving on %s with %d threads, %s intersection kernels\n", socketPath, options->threads, kernels);
+  fflush(stdout);
+
+  // one thread per client reads its requests, the renders take turns on the pool
+  while (1) {
+    int fd = accept(server->listenFd, NULL, NULL);
+    if (fd < 0) {
+      pthread_mutex_lock(&server->lock);
+      bool stopping = server->stopping;
+      pthread_mutex_unlock(&server->lock);
+      if (stopping || (errno != EINTR && errno != ECONNABORTED)) {
+        break;
+      }
+      continue;
+    }
+
+    Connection *connection = (Connection *) malloc(sizeof(Connection));
+    connection->server = server;
+    connection->fd = fd;
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, serve_connection, connection) != 0) {
+      close(fd);
+      free(connection);
+      continue;
+    }
+    pthread_detach(thread);
+  }
+
+  // clients still connected get an error for anything else they send
+  pthread_mutex_lock(&server->lock);
+  server->stopping = true;
+  int scenes = 0;
+  for (int slot = 0; slot < CACHE_SCENES; slot += 1) {
+    if (server->cache[slot].used) {
+      free_scene(&server->cache[slot].scene);
+      server->cache[slot].used = false;
+      scenes += 1;
+    }
+  }
+  pool_destroy(server->pool);
+  printf("Served %ld requests, %d scenes were cached\n", server->requests, scenes);
+  pthread_mutex_unlock(&server->lock);
+
+  // server itself stays allocated for client threads that may still be
+  // reading, the process exits right after this
+  close(server->listenFd);
+  unlink(socketPath);
+}
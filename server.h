@@ -0,0 +1,22 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include "Raycaster.h"
+
+// a render daemon listening on a unix domain socket. scenes are loaded once
+// and kept, keyed by a hash of the file contents, and every request renders
+// on one shared thread pool. clients send one request per line:
+//
+//   render WIDTH HEIGHT SCENE OUTPUT [camera X Y Z]
+//   shutdown
+//
+// OUTPUT is a file name, whose extension picks the format like on the command
+// line, or - to get the pixels back on the socket. the reply is one line,
+//
+//   ok bytes=N scene=cached|loaded trace=SECONDS total=SECONDS
+//   error MESSAGE
+//
+// and after an ok line, N bytes of width x height rgb pixels (0 for files)
+void serve(char *socketPath, RenderOptions *options);
+
+#endif
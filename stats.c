@@ -0,0 +1,118 @@
+#include <stdlib.h>
+#include <string.h>
+#include "stats.h"
+
+void stats_merge(RayStats *total, RayStats *part) {
+  total->primaryRays += part->primaryRays;
+  total->shadowRays += part->shadowRays;
+  total->reflectionRays += part->reflectionRays;
+  total->nodeTests += part->nodeTests;
+  total->sphereTests += part->sphereTests;
+  total->planeTests += part->planeTests;
+  total->triangleTests += part->triangleTests;
+  total->hits += part->hits;
+  total->shadowBlocked += part->shadowBlocked;
+  total->lightsCulled += part->lightsCulled;
+  for (int depth = 0; depth <= STATS_MAX_DEPTH; depth += 1) {
+    total->depthHistogram[depth] += part->depthHistogram[depth];
+  }
+}
+
+static void write_counters(FILE *fh, RayStats *stats, const char *indent) {
+  fprintf(fh, "%s\"primary_rays\": %ld,\n", indent, stats->primaryRays);
+  fprintf(fh, "%s\"shadow_rays\": %ld,\n", indent, stats->shadowRays);
+  fprintf(fh, "%s\"reflection_rays\": %ld,\n", indent, stats->reflectionRays);
+  fprintf(fh, "%s\"hits\": %ld,\n", indent, stats->hits);
+  fprintf(fh, "%s\"shadow_blocked\": %ld,\n", indent, stats->shadowBlocked);
+  fprintf(fh, "%s\"lights_culled\": %ld,\n", indent, stats->lightsCulled);
+  fprintf(fh, "%s\"bvh_node_tests\": %ld,\n", indent, stats->nodeTests);
+  fprintf(fh, "%s\"sphere_tests\": %ld,\n", indent, stats->sphereTests);
+  fprintf(fh, "%s\"plane_tests\": %ld,\n", indent, stats->planeTests);
+  fprintf(fh, "%s\"triangle_tests\": %ld", indent, stats->triangleTests);
+}
+
+void stats_write_json(FILE *fh, RayStats *total, void *threadStats, int stride, int threads, PhaseTimes *phases,
+                      int pixelWidth, int pixelHeight, const char *shading) {
+  fprintf(fh, "{\n");
+  fprintf(fh, "  \"width\": %d,\n  \"height\": %d,\n  \"threads\": %d,\n  \"shading\": \"%s\",\n",
+          pixelWidth, pixelHeight, threads, shading);
+
+  fprintf(fh, "  \"phases\": {\n");
+  fprintf(fh, "    \"parse_seconds\": %.6f,\n", phases->parse);
+  fprintf(fh, "    \"build_seconds\": %.6f,\n", phases->build);
+  fprintf(fh, "    \"render_seconds\": %.6f,\n", phases->render);
+  fprintf(fh, "    \"refine_seconds\": %.6f,\n", phases->refine);
+  fprintf(fh, "    \"write_seconds\": %.6f,\n", phases->write);
+  fprintf(fh, "    \"total_seconds\": %.6f\n", phases->total);
+  fprintf(fh, "  },\n");
+
+  fprintf(fh, "  \"totals\": {\n");
+  write_counters(fh, total, "    ");
+  fprintf(fh, "\n  },\n");
+
+  // trailing empty buckets are left off
+  int lastDepth = 0;
+  for (int depth = 0; depth <= STATS_MAX_DEPTH; depth += 1) {
+    if (total->depthHistogram[depth] > 0) {
+      lastDepth = depth;
+    }
+  }
+  fprintf(fh, "  \"depth_histogram\": [");
+  for (int depth = 0; depth <= lastDepth; depth += 1) {
+    fprintf(fh, "%s%ld", depth > 0 ? ", " : "", total->depthHistogram[depth]);
+  }
+  fprintf(fh, "],\n");
+
+  fprintf(fh, "  \"per_thread\": [\n");
+  for (int thread = 0; thread < threads; thread += 1) {
+    RayStats *stats = (RayStats *) ((char *) threadStats + (long) thread * stride);
+    fprintf(fh, "    {\n");
+    write_counters(fh, stats, "      ");
+    fprintf(fh, "\n    }%s\n", thread + 1 < threads ? "," : "");
+  }
+  fprintf(fh, "  ]\n}\n");
+}
+
+static int compare_costs(const void *a, const void *b) {
+  uint32_t left = *(const uint32_t *) a;
+  uint32_t right = *(const uint32_t *) b;
+
+  return left < right ? -1 : left > right;
+}
+
+// black, blue, red, yellow, white
+static void heat_color(float heat, uint8_t *rgb) {
+  static const float ramp[5][3] = {{0, 0, 0}, {0, 0, 1}, {1, 0, 0}, {1, 1, 0}, {1, 1, 1}};
+  float scaled = (heat < 0 ? 0 : heat > 1 ? 1 : heat) * 4;
+  int segment = scaled >= 4 ? 3 : (int) scaled;
+  float blend = scaled - segment;
+
+  for (int channel = 0; channel < 3; channel += 1) {
+    float value = ramp[segment][channel] + (ramp[segment + 1][channel] - ramp[segment][channel]) * blend;
+    rgb[channel] = (uint8_t) (value * 255);
+  }
+}
+
+void write_heatmap(char *fileName, int pixelWidth, int pixelHeight, uint32_t *cost) {
+  long pixelCount = (long) pixelWidth * pixelHeight;
+  uint32_t *sorted = (uint32_t *) malloc((pixelCount + 1) * sizeof(uint32_t));
+  memcpy(sorted, cost, pixelCount * sizeof(uint32_t));
+  qsort(sorted, pixelCount, sizeof(uint32_t), compare_costs);
+  uint32_t hottest = pixelCount > 0 ? sorted[(pixelCount - 1) * 99 / 100] : 0;
+  free(sorted);
+
+  uint8_t *rgb = (uint8_t *) malloc((pixelCount * 3 + 1) * sizeof(uint8_t));
+  for (long pixel = 0; pixel < pixelCount; pixel += 1) {
+    heat_color(hottest > 0 ? (float) cost[pixel] / hottest : 0, &rgb[pixel * 3]);
+  }
+
+  FILE *fh = fopen(fileName, "wb");
+  if (fh == NULL) {
+    printf("Error: cannot create %s.\n", fileName);
+    exit(1);
+  }
+  fprintf(fh, "P6 %d %d 255\n", pixelWidth, pixelHeight);
+  fwrite(rgb, sizeof(uint8_t), pixelCount * 3, fh);
+  fclose(fh);
+  free(rgb);
+}
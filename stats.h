@@ -0,0 +1,71 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+// render counters. every thread counts into its own RayStats and the totals
+// are merged after the render, so counting needs no atomics or locks.
+// building with -DRAYTRACE_NO_STATS compiles the counting out of the hot paths
+
+#ifdef RAYTRACE_NO_STATS
+#define STAT_ADD(stats, field, amount) ((void) 0)
+#else
+#define STAT_ADD(stats, field, amount) ((stats)->field += (amount))
+#endif
+
+// bounces beyond this land in the last histogram bucket
+#define STATS_MAX_DEPTH 16
+
+typedef struct RayStats {
+  long primaryRays;
+  long shadowRays;
+  long reflectionRays;
+
+  // bounding box tests and primitive intersection tests
+  long nodeTests;
+  long sphereTests;
+  long planeTests;
+  long triangleTests;
+
+  // closest hit queries that found something, and shadow rays that were blocked
+  long hits;
+  long shadowBlocked;
+  // lights skipped at a shading point without a shadow ray, because they
+  // can't add anything there
+  long lightsCulled;
+
+  // primary rays by how many surfaces were shaded along them, 0 for a miss
+  long depthHistogram[STATS_MAX_DEPTH + 1];
+} RayStats;
+
+// wall clock seconds of each step of a render
+typedef struct PhaseTimes {
+  double parse;
+  double build;
+  double render;
+  double refine;
+  double write;
+  double total;
+} PhaseTimes;
+
+// intersection work done so far, what the heatmap measures
+static inline long stats_work(RayStats *stats) {
+  return stats->nodeTests + stats->sphereTests + stats->planeTests + stats->triangleTests;
+}
+
+static inline void stats_depth(RayStats *stats, int depth) {
+  STAT_ADD(stats, depthHistogram[depth < STATS_MAX_DEPTH ? depth : STATS_MAX_DEPTH], 1);
+}
+
+void stats_merge(RayStats *total, RayStats *part);
+
+// threadStats holds one entry per thread, stride bytes apart
+void stats_write_json(FILE *fh, RayStats *total, void *threadStats, int stride, int threads, PhaseTimes *phases,
+                      int pixelWidth, int pixelHeight, const char *shading);
+
+// false color image of the work spent on each pixel, scaled so the 99th
+// percentile is the hottest color
+void write_heatmap(char *fileName, int pixelWidth, int pixelHeight, uint32_t *cost);
+
+#endif
@@ -0,0 +1,219 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "threadpool.h"
+
+// each worker's remaining tasks are packed as (begin << 32 | end) so the owner
+// popping from the front and thieves taking from the back race on one word
+typedef struct WorkerSlot {
+  _Atomic uint64_t range;
+  int steals;
+  ThreadPool *pool;
+  int index;
+  pthread_t thread;
+  char pad[64];
+} WorkerSlot;
+
+struct ThreadPool {
+  int threadCount;
+  WorkerSlot *workers;
+
+  // serializes pool_run callers
+  pthread_mutex_t runLock;
+
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  pthread_cond_t done;
+  unsigned long generation;
+  int running;
+  int shutdown;
+
+  pool_task_fn fn;
+  void *ctx;
+};
+
+static uint64_t pack_range(uint32_t begin, uint32_t end) {
+  return ((uint64_t) begin << 32) | end;
+}
+
+// take the next task from the front of our own slice
+static int pop_front(WorkerSlot *slot, int *taskIndex) {
+  uint64_t range = atomic_load(&slot->range);
+
+  while (1) {
+    uint32_t begin = (uint32_t) (range >> 32);
+    uint32_t end = (uint32_t) range;
+
+    if (begin >= end) {
+      return 0;
+    }
+    if (atomic_compare_exchange_weak(&slot->range, &range, pack_range(begin + 1, end))) {
+      *taskIndex = (int) begin;
+      return 1;
+    }
+  }
+}
+
+// move the back half of the victim's slice into our own (empty) slice
+static int steal_half(WorkerSlot *thief, WorkerSlot *victim) {
+  uint64_t range = atomic_load(&victim->range);
+
+  while (1) {
+    uint32_t begin = (uint32_t) (range >> 32);
+    uint32_t end = (uint32_t) range;
+
+    if (begin >= end) {
+      return 0;
+    }
+
+    uint32_t count = (end - begin + 1) / 2;
+    if (atomic_compare_exchange_weak(&victim->range, &range, pack_range(begin, end - count))) {
+      atomic_store(&thief->range, pack_range(end - count, end));
+      return 1;
+    }
+  }
+}
+
+static void work(ThreadPool *pool, WorkerSlot *slot) {
+  int taskIndex;
+
+  while (1) {
+    while (pop_front(slot, &taskIndex)) {
+      pool->fn(pool->ctx, taskIndex, slot->index);
+    }
+
+    // out of work, look for the next victim that still has some
+    int stolen = 0;
+    for (int offset = 1; offset < pool->threadCount && !stolen; offset += 1) {
+      WorkerSlot *victim = &pool->workers[(slot->index + offset) % pool->threadCount];
+      stolen = steal_half(slot, victim);
+    }
+
+    if (!stolen) {
+      return;
+    }
+    slot->steals += 1;
+  }
+}
+
+static void *worker_main(void *arg) {
+  WorkerSlot *slot = (WorkerSlot *) arg;
+  ThreadPool *pool = slot->pool;
+  unsigned long seen = 0;
+
+  while (1) {
+    pthread_mutex_lock(&pool->lock);
+    while (pool->generation == seen && !pool->shutdown) {
+      pthread_cond_wait(&pool->wake, &pool->lock);
+    }
+    if (pool->shutdown) {
+      pthread_mutex_unlock(&pool->lock);
+      return NULL;
+    }
+    seen = pool->generation;
+    pthread_mutex_unlock(&pool->lock);
+
+    work(pool, slot);
+
+    pthread_mutex_lock(&pool->lock);
+    pool->running -= 1;
+    if (pool->running == 0) {
+      pthread_cond_signal(&pool->done);
+    }
+    pthread_mutex_unlock(&pool->lock);
+  }
+}
+
+ThreadPool *pool_create(int threadCount) {
+  if (threadCount < 1) {
+    threadCount = 1;
+  }
+
+  ThreadPool *pool = (ThreadPool *) calloc(1, sizeof(ThreadPool));
+  pool->threadCount = threadCount;
+  pool->workers = (WorkerSlot *) calloc(threadCount, sizeof(WorkerSlot));
+
+  pthread_mutex_init(&pool->runLock, NULL);
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->wake, NULL);
+  pthread_cond_init(&pool->done, NULL);
+
+  // worker 0 is whoever calls pool_run
+  for (int index = 0; index < threadCount; index += 1) {
+    pool->workers[index].pool = pool;
+    pool->workers[index].index = index;
+    atomic_init(&pool->workers[index].range, 0);
+    if (index > 0) {
+      pthread_create(&pool->workers[index].thread, NULL, worker_main, &pool->workers[index]);
+    }
+  }
+
+  return pool;
+}
+
+void pool_destroy(ThreadPool *pool) {
+  pthread_mutex_lock(&pool->lock);
+  pool->shutdown = 1;
+  pthread_cond_broadcast(&pool->wake);
+  pthread_mutex_unlock(&pool->lock);
+
+  for (int index = 1; index < pool->threadCount; index += 1) {
+    pthread_join(pool->workers[index].thread, NULL);
+  }
+
+  pthread_cond_destroy(&pool->done);
+  pthread_cond_destroy(&pool->wake);
+  pthread_mutex_destroy(&pool->lock);
+  pthread_mutex_destroy(&pool->runLock);
+  free(pool->workers);
+  free(pool);
+}
+
+int pool_size(ThreadPool *pool) {
+  return pool->threadCount;
+}
+
+int pool_steals(ThreadPool *pool, int workerIndex) {
+  return pool->workers[workerIndex].steals;
+}
+
+void pool_run(ThreadPool *pool, int taskCount, pool_task_fn fn, void *ctx) {
+  pthread_mutex_lock(&pool->runLock);
+
+  // hand out contiguous slices up front, stealing evens things out later
+  for (int index = 0; index < pool->threadCount; index += 1) {
+    uint32_t begin = (uint32_t) ((int64_t) taskCount * index / pool->threadCount);
+    uint32_t end = (uint32_t) ((int64_t) taskCount * (index + 1) / pool->threadCount);
+    atomic_store(&pool->workers[index].range, pack_range(begin, end));
+    pool->workers[index].steals = 0;
+  }
+
+  pthread_mutex_lock(&pool->lock);
+  pool->fn = fn;
+  pool->ctx = ctx;
+  pool->running = pool->threadCount - 1;
+  pool->generation += 1;
+  pthread_cond_broadcast(&pool->wake);
+  pthread_mutex_unlock(&pool->lock);
+
+  work(pool, &pool->workers[0]);
+
+  pthread_mutex_lock(&pool->lock);
+  while (pool->running > 0) {
+    pthread_cond_wait(&pool->done, &pool->lock);
+  }
+  pthread_mutex_unlock(&pool->lock);
+
+  pthread_mutex_unlock(&pool->runLock);
+}
+
+int default_thread_count(void) {
+  long count = sysconf(_SC_NPROCESSORS_ONLN);
+
+  if (count < 1) {
+    return 1;
+  }
+  return (int) count;
+}
@@ -0,0 +1,27 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+// runs a batch of independent tasks, numbered 0 to taskCount - 1, across a
+// fixed set of worker threads. each worker starts with a contiguous slice of
+// the tasks and steals half of another worker's remaining slice once its own
+// runs dry, so a few expensive tasks don't leave the other workers idle
+
+typedef void (*pool_task_fn)(void *ctx, int taskIndex, int workerIndex);
+
+typedef struct ThreadPool ThreadPool;
+
+// threadCount includes the calling thread, which works alongside the pool
+ThreadPool *pool_create(int threadCount);
+void pool_destroy(ThreadPool *pool);
+
+int pool_size(ThreadPool *pool);
+
+// blocks until every task has run
+void pool_run(ThreadPool *pool, int taskCount, pool_task_fn fn, void *ctx);
+
+// number of successful steals by each worker during the last pool_run
+int pool_steals(ThreadPool *pool, int workerIndex);
+
+int default_thread_count(void);
+
+#endif
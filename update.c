@@ -0,0 +1,229 @@
+#include <math.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "update.h"
+#include "vec3.h"
+
+// whether the part of a ray from origin up to reach passes through any of
+// the changed spheres, or only the ones that can block light
+static bool ray_touches_change(SceneUpdate *update, vec3 origin, vec3 dir, float reach, bool blockersOnly) {
+  for (int changedI = 0; changedI < update->changedCount; changedI += 1) {
+    if (blockersOnly && !update->blocks[changedI]) {
+      continue;
+    }
+    // closest point of the segment to the center
+    vec3 toCenter = vec3_load(update->center[changedI]) - origin;
+    double along = fmin(fmax(vec3_dot(toCenter, dir), 0), reach);
+    double dx = toCenter[0] - dir[0] * along;
+    double dy = toCenter[1] - dir[1] * along;
+    double dz = toCenter[2] - dir[2] * along;
+    double radius = update->radius[changedI];
+    if (dx * dx + dy * dy + dz * dz <= radius * radius) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// whether an edit can have changed the color of the path of a primary ray,
+// given what the ray hits in the edited scene. the path is followed through
+// its reflections, and it is affected when one of its rays, or a shadow ray
+// toward a light near one of its surfaces, comes near a changed sphere.
+// otherwise every ray of the path finds the same thing in both scenes, so
+// the pixel comes out the same. the reflections are followed to the depth
+// limit even where shading would end the path earlier
+bool path_affected(Scene *scene, SceneUpdate *update, TraceContext *ctx, float *Rd, float tVal, int objIndex,
+                   float *cam) {
+  vec3 rayInit = vec3_load(cam);
+  vec3 dir = vec3_load(Rd);
+  float hitT = tVal >= 0 ? tVal : -1;
+
+  for (int level = 0; level < ctx->maxDepth; level += 1) {
+    if (ray_touches_change(update, rayInit, dir, hitT >= 0 ? hitT : INFINITY, false)) {
+      return true;
+    }
+    if (hitT < 0) {
+      return false;
+    }
+
+    vec3 point = dir * hitT + rayInit;
+    int nearCount = lights_near(scene, point, ctx->nearLights);
+    for (int nearI = 0; nearI < nearCount; nearI += 1) {
+      float dist;
+      vec3 pToL = light_direction(&dist, &scene->lights[ctx->nearLights[nearI]], point);
+      if (ray_touches_change(update, point, pToL, dist, true)) {
+        return true;
+      }
+    }
+
+    Object scratch;
+    Object *surfaceObj = scene_object(scene, objIndex, &scratch);
+    if (surfaceObj->reflectivity == 0) {
+      return false;
+    }
+    vec3 reflectedRay = reflect_direction(surfaceObj, point, rayInit);
+    float reflectRd[3];
+    float R0[3];
+    vec3_store(reflectRd, reflectedRay);
+    vec3_store(R0, point);
+    int hitIndex = -1;
+    hitT = shoot(&hitIndex, scene, reflectRd, R0, objIndex, &ctx->stats);
+    if (hitT <= 0) {
+      hitT = -1;
+    }
+
+    rayInit = point;
+    dir = reflectedRay;
+    objIndex = hitIndex;
+  }
+  return false;
+}
+
+// adds a bounding sphere for a sphere's shape to the changed list. the
+// padding covers rounding in the intersection tests
+static void add_changed(SceneUpdate *update, Object *sphere, float extent, bool blocks) {
+  int slot = update->changedCount;
+  memcpy(update->center[slot], sphere->position, sizeof(float[3]));
+  update->radius[slot] = sphere->radius + 1e-3f * (sphere->radius + extent);
+  update->blocks[slot] = blocks;
+  update->changedCount += 1;
+}
+
+// lists what changed from the scene before to the scene after. returns NULL
+// when only spheres changed, or why every pixel has to be rendered again.
+// objects are matched up from the start and from the end of the scene, so
+// everything between the first and the last difference counts as changed
+static const char *diff_scenes(Scene *before, Scene *after, SceneUpdate *update) {
+  if (before->lightCount != after->lightCount ||
+      memcmp(before->lights, after->lights, before->lightCount * sizeof(Light)) != 0) {
+    return "the lights changed";
+  }
+  if (before->materialCount != after->materialCount || before->prototypeSphereCount != after->prototypeSphereCount ||
+      before->instanceCount != after->instanceCount ||
+      memcmp(before->materials, after->materials, before->materialCount * sizeof(Material)) != 0 ||
+      memcmp(before->prototypeSpheres, after->prototypeSpheres, before->prototypeSphereCount * sizeof(PrototypeSphere)) != 0 ||
+      memcmp(before->instances, after->instances, (size_t) before->instanceCount * sizeof(Instance)) != 0) {
+    return "the instances changed";
+  }
+  if (before->meshCount != after->meshCount || before->vertexCount != after->vertexCount ||
+      before->quantizedVertexCount != after->quantizedVertexCount || before->triangleCount != after->triangleCount ||
+      memcmp(before->meshes, after->meshes, before->meshCount * sizeof(Mesh)) != 0 ||
+      memcmp(before->vertices, after->vertices, (size_t) before->vertexCount * sizeof(float[3])) != 0 ||
+      memcmp(before->quantizedVertices, after->quantizedVertices,
+             (size_t) before->quantizedVertexCount * sizeof(uint16_t[3])) != 0 ||
+      memcmp(before->triangles, after->triangles, (size_t) before->triangleCount * sizeof(int[3])) != 0) {
+    return "the meshes changed";
+  }
+
+  int shorter = before->objectCount < after->objectCount ? before->objectCount : after->objectCount;
+  int prefix = 0;
+  while (prefix < shorter && memcmp(&before->objects[prefix], &after->objects[prefix], sizeof(Object)) == 0) {
+    prefix += 1;
+  }
+  int suffix = 0;
+  while (suffix < shorter - prefix && memcmp(&before->objects[before->objectCount - 1 - suffix],
+                                             &after->objects[after->objectCount - 1 - suffix], sizeof(Object)) == 0) {
+    suffix += 1;
+  }
+  int oldCount = before->objectCount - prefix - suffix;
+  int newCount = after->objectCount - prefix - suffix;
+
+  update->center = (float (*)[3]) malloc((oldCount + newCount + 1) * sizeof(float[3]));
+  update->radius = (float *) malloc((oldCount + newCount + 1) * sizeof(float));
+  update->blocks = (bool *) malloc((oldCount + newCount + 1) * sizeof(bool));
+  float extent = fmaxf(before->extent, after->extent);
+
+  for (int changedI = 0; changedI < oldCount || changedI < newCount; changedI += 1) {
+    Object *oldObj = changedI < oldCount ? &before->objects[prefix + changedI] : NULL;
+    Object *newObj = changedI < newCount ? &after->objects[prefix + changedI] : NULL;
+    if ((oldObj != NULL && oldObj->kind != 2) || (newObj != NULL && newObj->kind != 2)) {
+      return "the camera or a plane changed";
+    }
+
+    // when the same sphere only changed its material, only its own pixels
+    // and reflections change, not its shadow
+    bool sameShape = oldCount == newCount &&
+                     memcmp(oldObj->position, newObj->position, sizeof(float[3])) == 0 && oldObj->radius == newObj->radius;
+    if (oldObj != NULL) {
+      add_changed(update, oldObj, extent, !sameShape);
+    }
+    if (newObj != NULL && !sameShape) {
+      add_changed(update, newObj, extent, true);
+    }
+  }
+  return NULL;
+}
+
+// reads a previous image, which has to be a ppm of the same size
+static uint8_t *read_previous_image(char *fileName, int pixelWidth, int pixelHeight) {
+  FILE *fh = fopen(fileName, "rb");
+  if (fh == NULL) {
+    printf("Error: cannot open %s.\n", fileName);
+    exit(1);
+  }
+
+  int width = 0;
+  int height = 0;
+  int headerLength = 0;
+  long size = (long) pixelWidth * pixelHeight * 3;
+  uint8_t *pixels = (uint8_t *) malloc(size + 1);
+  if (fscanf(fh, "P6 %d %d 255%n", &width, &height, &headerLength) != 2 || headerLength == 0 || fgetc(fh) == EOF) {
+    printf("Error: %s is not a ppm image, --update needs the previous image as a .ppm.\n", fileName);
+    exit(1);
+  }
+  if (width != pixelWidth || height != pixelHeight) {
+    printf("Error: %s is %dx%d, not %dx%d.\n", fileName, width, height, pixelWidth, pixelHeight);
+    exit(1);
+  }
+  if (fread(pixels, 1, size, fh) != (size_t) size) {
+    printf("Error: %s is truncated.\n", fileName);
+    exit(1);
+  }
+  fclose(fh);
+
+  return pixels;
+}
+
+// sets the job up to render only what changed since the previous image, for
+// --update. when that isn't possible every pixel is rendered, and reason says why
+void attach_update(RenderJob *job, Scene *scene, RenderOptions *options, ThreadPool *pool, const char **reason) {
+  *reason = NULL;
+  if (options->updateScene == NULL) {
+    return;
+  }
+
+  Scene before;
+  char error[256];
+  PhaseTimes phases;
+  if (load_scene(options->updateScene, &before, pool, &phases, error, sizeof(error)) < 0) {
+    printf("Error: %s\n", error);
+    exit(1);
+  }
+
+  SceneUpdate *update = (SceneUpdate *) calloc(1, sizeof(SceneUpdate));
+  atomic_init(&update->reused, 0);
+  *reason = diff_scenes(&before, scene, update);
+  free_scene(&before);
+  if (*reason != NULL) {
+    update_free(update);
+    return;
+  }
+
+  update->previous = read_previous_image(options->updateImage, job->pixelWidth, job->pixelHeight);
+  job->update = update;
+}
+
+void update_free(SceneUpdate *update) {
+  if (update == NULL) {
+    return;
+  }
+  free(update->previous);
+  free(update->center);
+  free(update->radius);
+  free(update->blocks);
+  free(update);
+}
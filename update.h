@@ -0,0 +1,42 @@
+#ifndef UPDATE_H
+#define UPDATE_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include "Raycaster.h"
+#include "render.h"
+
+// incremental renders for --update. the scene the previous image was rendered
+// from is diffed against the edited one, and only the pixels whose paths can
+// come near what changed are rendered again, the rest are copied from the
+// previous image
+
+// what an edit changed, for rendering only the pixels it can reach. every
+// sphere that differs between the scene the previous image was rendered from
+// and the edited one gets a bounding sphere around its old and one around
+// its new shape
+typedef struct SceneUpdate {
+  // the previous image, whose pixels are kept where the edit can't reach
+  uint8_t *previous;
+  int changedCount;
+  float (*center)[3];
+  float *radius;
+  // whether the sphere can cast a different shadow, which changing only its
+  // material doesn't
+  bool *blocks;
+  _Atomic long reused;
+} SceneUpdate;
+
+// sets the job up to render only what changed since the previous image, for
+// --update. when that isn't possible every pixel is rendered, and reason says why
+void attach_update(RenderJob *job, Scene *scene, RenderOptions *options, ThreadPool *pool, const char **reason);
+
+// whether an edit can have changed the color of the path of a primary ray,
+// given what the ray hits in the edited scene
+bool path_affected(Scene *scene, SceneUpdate *update, TraceContext *ctx, float *Rd, float tVal, int objIndex,
+                   float *cam);
+
+void update_free(SceneUpdate *update);
+
+#endif
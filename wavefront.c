@@ -0,0 +1,286 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include "vec3.h"
+#include "wavefront.h"
+
+// sort keys are below this
+#define SORT_BUCKETS 512
+
+static void release_buffers(Wavefront *wavefront) {
+  free(wavefront->point);
+  free(wavefront->rayInit);
+  free(wavefront->objIndex);
+  free(wavefront->active);
+  free(wavefront->lightsColor);
+  free(wavefront->base);
+  free(wavefront->weight);
+  free(wavefront->throughput);
+  free(wavefront->seed);
+  free(wavefront->addReflection);
+  free(wavefront->levelCount);
+  free(wavefront->shadowPath);
+  free(wavefront->shadowLight);
+  free(wavefront->shadowRd);
+  free(wavefront->shadowDist);
+  free(wavefront->blocked);
+  free(wavefront->reflectRd);
+  free(wavefront->keys);
+  free(wavefront->order);
+}
+
+// makes room for count paths of levels bounces each
+static Wavefront *wavefront_reserve(Wavefront *wavefront, int count, int levels) {
+  if (wavefront == NULL) {
+    wavefront = (Wavefront *) calloc(1, sizeof(Wavefront));
+  }
+  if (wavefront->capacity >= count && wavefront->levels >= levels) {
+    return wavefront;
+  }
+
+  release_buffers(wavefront);
+  int capacity = count > wavefront->capacity ? count : wavefront->capacity;
+  levels = levels > wavefront->levels ? levels : wavefront->levels;
+  // one more than needed so nothing is ever allocated with size 0
+  int paths = capacity + 1;
+  int queue = capacity * WAVEFRONT_LIGHT_CHUNK + 1;
+
+  wavefront->capacity = capacity;
+  wavefront->levels = levels;
+  wavefront->point = (float (*)[3]) malloc(paths * sizeof(float[3]));
+  wavefront->rayInit = (float (*)[3]) malloc(paths * sizeof(float[3]));
+  wavefront->objIndex = (int *) malloc(paths * sizeof(int));
+  wavefront->active = (int *) malloc(paths * sizeof(int));
+  wavefront->lightsColor = (vec3 *) malloc(paths * sizeof(vec3));
+  wavefront->base = (vec3 *) malloc(paths * levels * sizeof(vec3));
+  wavefront->weight = (float *) malloc(paths * levels * sizeof(float));
+  wavefront->throughput = (float *) malloc(paths * sizeof(float));
+  wavefront->seed = (unsigned int *) malloc(paths * sizeof(unsigned int));
+  wavefront->addReflection = (bool *) malloc(paths * levels * sizeof(bool));
+  wavefront->levelCount = (int *) malloc(paths * sizeof(int));
+  wavefront->shadowPath = (int *) malloc(queue * sizeof(int));
+  wavefront->shadowLight = (int *) malloc(queue * sizeof(int));
+  wavefront->shadowRd = (float (*)[3]) malloc(queue * sizeof(float[3]));
+  wavefront->shadowDist = (float *) malloc(queue * sizeof(float));
+  wavefront->blocked = (bool *) malloc(queue * sizeof(bool));
+  wavefront->reflectRd = (float (*)[3]) malloc(paths * sizeof(float[3]));
+  wavefront->keys = (unsigned short *) malloc(queue * sizeof(unsigned short));
+  wavefront->order = (int *) malloc(queue * sizeof(int));
+
+  return wavefront;
+}
+
+void wavefront_free(Wavefront *wavefront) {
+  if (wavefront == NULL) {
+    return;
+  }
+  release_buffers(wavefront);
+  free(wavefront);
+}
+
+// stable counting sort, order gets the queue entries grouped by key
+static void sort_queue(unsigned short *keys, int count, int *order) {
+  int bucketStart[SORT_BUCKETS + 1];
+  memset(bucketStart, 0, sizeof(bucketStart));
+
+  for (int entry = 0; entry < count; entry += 1) {
+    bucketStart[keys[entry] + 1] += 1;
+  }
+  for (int bucket = 0; bucket < SORT_BUCKETS; bucket += 1) {
+    bucketStart[bucket + 1] += bucketStart[bucket];
+  }
+  for (int entry = 0; entry < count; entry += 1) {
+    order[bucketStart[keys[entry]]] = entry;
+    bucketStart[keys[entry]] += 1;
+  }
+}
+
+// 3 bits per axis of the direction, so rays in the same octant and roughly
+// the same direction share a key
+static unsigned short direction_key(float *Rd) {
+  unsigned short key = 0;
+
+  for (int axis = 0; axis < 3; axis += 1) {
+    float scaled = (Rd[axis] + 1) * 4;
+    int bin = scaled >= 7 ? 7 : scaled > 0 ? (int) scaled : 0;
+    key = key * 8 + bin;
+  }
+
+  return key;
+}
+
+// traces the queued shadow rays, then adds the lights that reach each path
+// to its lightsColor
+static void flush_shadows(Wavefront *wf, TraceContext *ctx, Scene *scene, int queued) {
+  sort_queue(wf->keys, queued, wf->order);
+  for (int sortedI = 0; sortedI < queued; sortedI += 1) {
+    int entry = wf->order[sortedI];
+    int path = wf->shadowPath[entry];
+    int lightI = wf->shadowLight[entry];
+
+    wf->blocked[entry] = occluded(scene, wf->shadowRd[entry], wf->point[path], wf->shadowDist[entry],
+                                  wf->objIndex[path], &ctx->lastOccluder[lightI], &ctx->stats);
+  }
+  STAT_ADD(&ctx->stats, shadowRays, queued);
+
+  // each path adds its lights in light order, rounding the sum like illuminate
+  for (int entry = 0; entry < queued; entry += 1) {
+    if (!wf->blocked[entry]) {
+      int path = wf->shadowPath[entry];
+      wf->lightsColor[path] = add_light_color(wf->lightsColor[path], scene, wf->objIndex[path],
+                                              &scene->lights[wf->shadowLight[entry]], vec3_load(wf->point[path]),
+                                              vec3_load(wf->rayInit[path]), vec3_load(wf->shadowRd[entry]),
+                                              wf->shadowDist[entry]);
+    }
+  }
+}
+
+// queues and traces the shadow rays of every active path, adding the lights
+// that reach each path to its lightsColor. lights that can't reach a path are
+// culled the same way illuminate culls them
+static void trace_shadows(Wavefront *wf, TraceContext *ctx, Scene *scene, int activeCount) {
+  int queueSize = wf->capacity * WAVEFRONT_LIGHT_CHUNK;
+  int queued = 0;
+
+  for (int activeI = 0; activeI < activeCount; activeI += 1) {
+    int path = wf->active[activeI];
+    wf->lightsColor[path] = vec3_make(0, 0, 0);
+
+    vec3 point = vec3_load(wf->point[path]);
+    Object scratch;
+    vec3 surfaceNorm = surface_normal(scene_object(scene, wf->objIndex[path], &scratch), point);
+    int nearCount = lights_near(scene, point, ctx->nearLights);
+    STAT_ADD(&ctx->stats, lightsCulled, scene->lightCount - nearCount);
+
+    for (int nearI = 0; nearI < nearCount; nearI += 1) {
+      int lightI = ctx->nearLights[nearI];
+      vec3 pToL = light_direction(&wf->shadowDist[queued], &scene->lights[lightI], point);
+      if (!light_reaches(&scene->lights[lightI], surfaceNorm, pToL)) {
+        STAT_ADD(&ctx->stats, lightsCulled, 1);
+        continue;
+      }
+      vec3_store(wf->shadowRd[queued], pToL);
+
+      wf->shadowPath[queued] = path;
+      wf->shadowLight[queued] = lightI;
+      // group by light, then by direction octant
+      wf->keys[queued] = (unsigned short) (((lightI % 64) << 3) | (direction_key(wf->shadowRd[queued]) >> 6));
+      queued += 1;
+
+      if (queued == queueSize) {
+        flush_shadows(wf, ctx, scene, queued);
+        queued = 0;
+      }
+    }
+  }
+
+  flush_shadows(wf, ctx, scene, queued);
+}
+
+void shade_wavefront(TraceContext *ctx, Scene *scene, float *cam, float (*Rd)[3], float *tVal, int *objIndex,
+                     unsigned int *seeds, int count, float (*colors)[3]) {
+  Wavefront *wf = wavefront_reserve(ctx->wavefront, count, ctx->maxDepth);
+  ctx->wavefront = wf;
+  int levels = wf->levels;
+
+  int activeCount = 0;
+  for (int path = 0; path < count; path += 1) {
+    wf->levelCount[path] = 0;
+    if (tVal[path] >= 0) {
+      vec3_store(wf->point[path], vec3_load(Rd[path]) * tVal[path] + vec3_load(cam));
+      memcpy(wf->rayInit[path], cam, sizeof(float[3]));
+      wf->objIndex[path] = objIndex[path];
+      wf->throughput[path] = 1;
+      wf->seed[path] = seeds[path];
+      wf->active[activeCount] = path;
+      activeCount += 1;
+    }
+  }
+
+  for (int level = 0; level < ctx->maxDepth && activeCount > 0; level += 1) {
+    trace_shadows(wf, ctx, scene, activeCount);
+
+    // color of the bounce before its reflection, as illuminate computes it.
+    // paths that reflect stay in the active list and queue a reflection ray,
+    // unless illuminate would stop the path here
+    int reflecting = 0;
+    for (int activeI = 0; activeI < activeCount; activeI += 1) {
+      int path = wf->active[activeI];
+      int slot = path * levels + level;
+      Object scratch;
+      Object *surfaceObj = scene_object(scene, wf->objIndex[path], &scratch);
+
+      vec3 ambient = vec3_make(0.01, 0.01, 0.01);
+      float reflectAmount = 1 - surfaceObj->reflectivity;
+      wf->base[slot] = wf->lightsColor[path] * reflectAmount + ambient;
+
+      wf->weight[slot] = 0;
+      wf->addReflection[slot] = false;
+      wf->levelCount[path] = level + 1;
+
+      if (surfaceObj->reflectivity == 0 || level + 1 >= ctx->maxDepth) {
+        continue;
+      }
+      wf->throughput[path] *= surfaceObj->reflectivity;
+      wf->weight[slot] = reflection_weight(ctx, surfaceObj->reflectivity, wf->throughput[path], wf->seed[path], level);
+
+      if (wf->weight[slot] != 0 &&
+          reflection_matters(ctx, &wf->base[path * levels], &wf->weight[path * levels], level)) {
+        vec3_store(wf->reflectRd[reflecting],
+                   reflect_direction(surfaceObj, vec3_load(wf->point[path]), vec3_load(wf->rayInit[path])));
+        wf->keys[reflecting] = direction_key(wf->reflectRd[reflecting]);
+        wf->active[reflecting] = path;
+        reflecting += 1;
+      }
+    }
+
+    sort_queue(wf->keys, reflecting, wf->order);
+    for (int sortedI = 0; sortedI < reflecting; sortedI += 1) {
+      int entry = wf->order[sortedI];
+      int path = wf->active[entry];
+      int newClosestObjIndex = -1;
+      float hitT = shoot(&newClosestObjIndex, scene, wf->reflectRd[entry], wf->point[path], wf->objIndex[path],
+                         &ctx->stats);
+
+      if (hitT > 0) {
+        wf->addReflection[path * levels + level] = true;
+
+        vec3 point = vec3_load(wf->point[path]);
+        memcpy(wf->rayInit[path], wf->point[path], sizeof(float[3]));
+        vec3_store(wf->point[path], vec3_load(wf->reflectRd[entry]) * hitT + point);
+        wf->objIndex[path] = newClosestObjIndex;
+      }
+      else {
+        wf->objIndex[path] = -1;
+      }
+    }
+    STAT_ADD(&ctx->stats, reflectionRays, reflecting);
+
+    activeCount = 0;
+    for (int reflectI = 0; reflectI < reflecting; reflectI += 1) {
+      int path = wf->active[reflectI];
+      if (wf->objIndex[path] >= 0) {
+        wf->active[activeCount] = path;
+        activeCount += 1;
+      }
+    }
+  }
+
+  // fold the bounces back up. a path that stopped, or whose reflection
+  // missed, ends with the bounce's own color like in illuminate
+  for (int path = 0; path < count; path += 1) {
+    vec3 next = vec3_make(0, 0, 0);
+
+    for (int level = wf->levelCount[path] - 1; level >= 0; level -= 1) {
+      int slot = path * levels + level;
+      vec3 finalColor = wf->base[slot];
+
+      if (wf->addReflection[slot]) {
+        finalColor = next * wf->weight[slot] + finalColor;
+      }
+      next = clamp_color(finalColor);
+    }
+
+    vec3_store(colors[path], next);
+  }
+}
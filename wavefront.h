@@ -0,0 +1,67 @@
+#ifndef WAVEFRONT_H
+#define WAVEFRONT_H
+
+#include "Raycaster.h"
+
+// breadth first shading. instead of following each pixel's reflections depth
+// first through illuminate(), a batch of paths is advanced one bounce at a
+// time: the shadow rays of every path are queued and traced together, then
+// every reflection ray. queues are sorted by light and direction before
+// tracing so rays next to each other in a queue take similar routes through
+// the bvh. each bounce keeps the color illuminate() would have computed
+// before recursing, and the bounces are folded back together from the last
+// one up, giving exactly the colors of the recursive path
+
+// the shadow ray queue has room for this many lights per path, and is traced
+// whenever it fills up
+#define WAVEFRONT_LIGHT_CHUNK 16
+
+typedef struct Wavefront {
+  // paths the buffers have room for, and bounces per path
+  int capacity;
+  int levels;
+
+  // current bounce of each path. rays stay float[3] for the intersection
+  // kernels, colors are kept as vectors
+  float (*point)[3];
+  float (*rayInit)[3];
+  int *objIndex;
+  int *active;
+  vec3 *lightsColor;
+
+  // per path and bounce, the color before adding the reflection, the
+  // weight the reflection is added with, and whether one gets added
+  vec3 *base;
+  float *weight;
+  bool *addReflection;
+  int *levelCount;
+
+  // per path, the product of its reflectivities so far and its roulette seed
+  float *throughput;
+  unsigned int *seed;
+
+  // shadow ray queue, WAVEFRONT_LIGHT_CHUNK entries per path. entries are in
+  // path order, and each path's lights in light order
+  int *shadowPath;
+  int *shadowLight;
+  float (*shadowRd)[3];
+  float *shadowDist;
+  bool *blocked;
+
+  // reflection ray queue, one entry per active path
+  float (*reflectRd)[3];
+
+  // sort scratch
+  unsigned short *keys;
+  int *order;
+} Wavefront;
+
+// shades count primary hits (tVal < 0 for a miss) into colors, the same
+// colors shade_primary gives with the same path seeds, ctx->maxDepth bounces
+// deep at most
+void shade_wavefront(TraceContext *ctx, Scene *scene, float *cam, float (*Rd)[3], float *tVal, int *objIndex,
+                     unsigned int *seeds, int count, float (*colors)[3]);
+
+void wavefront_free(Wavefront *wavefront);
+
+#endif